@@ -27,6 +27,7 @@
 #include "llimits.h"
 #include "lobject.h"
 #include "lstate.h"
+#include "lserialise.hpp"
 
 #include "vendor/Soup/soup/version_compare.hpp"
 
@@ -355,7 +356,8 @@ static int luaB_pairs (lua_State *L) {
 /*
 ** Traversal function for 'ipairs'
 */
-static int ipairsaux (lua_State *L) {
+LUAI_FUNC int luaB_ipairsaux (lua_State *L);
+int luaB_ipairsaux (lua_State *L) {
   lua_Integer i = luaL_checkinteger(L, 2);
   i = luaL_intop(+, i, 1);
   lua_pushinteger(L, i);
@@ -364,12 +366,12 @@ static int ipairsaux (lua_State *L) {
 
 
 /*
-** 'ipairs' function. Returns 'ipairsaux', given "table", 0.
+** 'ipairs' function. Returns 'luaB_ipairsaux', given "table", 0.
 ** (The given "table" may not be a table.)
 */
 static int luaB_ipairs (lua_State *L) {
   luaL_checkany(L, 1);
-  lua_pushcfunction(L, ipairsaux);  /* iteration function */
+  lua_pushcfunction(L, luaB_ipairsaux);  /* iteration function */
   lua_pushvalue(L, 1);  /* state */
   lua_pushinteger(L, 0);  /* initial value */
   return 3;
@@ -782,6 +784,31 @@ static int luaB_exportvar (lua_State *L) {
 }
 
 
+static int luaB_serialise (lua_State *L) {
+  luaL_checkany(L, 1);
+  lua_settop(L, 1);
+  std::string& out = *pluto_newclassinst(L, std::string);
+  Serialiser& ser = *pluto_newclassinst(L, Serialiser, out);
+  out.push_back(PLUTO_SERIALISE_VERSION);
+  ser.encode(L, 1);
+  pluto_pushstring(L, out);
+  return 1;
+}
+
+static int luaB_deserialise (lua_State *L) {
+  size_t size;
+  const char *data = luaL_checklstring(L, 1, &size);
+  if (l_unlikely(size == 0 || data[0] != PLUTO_SERIALISE_VERSION))
+    luaL_error(L, "unsupported serialisation format");
+  Deserialiser des{ data, size };
+  des.i = 1;
+  des.decodevalues(L, 1);
+  if (l_unlikely(des.i != size))
+    Deserialiser::malformed(L);
+  return 1;
+}
+
+
 static int luaB_compareversions (lua_State *L) {
   lua_pushinteger(L, SOUP_STRONG_ORDERING_TO_INT(soup::version_compare(luaL_checkstring(L, 1), luaL_checkstring(L, 2))));
   return 1;
@@ -877,6 +904,8 @@ static const luaL_Reg base_funcs[] = {
   {"compareversions", luaB_compareversions},
   {"exportvar", luaB_exportvar},
   {"dumpvar", luaB_dumpvar},
+  {"serialise", luaB_serialise},
+  {"deserialise", luaB_deserialise},
   {"newuserdata", luaB_newuserdata},
   {"assert", luaB_assert},
   {"collectgarbage", luaB_collectgarbage},
@@ -1,89 +1,801 @@
 #define LUA_LIB
 #include "lualib.h"
 #include "llimits.h" // l_unlikely
+#include "lctype.h"
+
+#include <algorithm> // copy, fill, min, swap
+#include <string>
+#include <vector>
 
 #include "vendor/Soup/soup/Bigint.hpp"
 
 void pushbigint (lua_State *L, soup::Bigint x);
 
+/*
+** Soup's division, base conversion and modular exponentiation work a bit at a time. The routines
+** below work on whole chunks instead and only use Soup for storage, addition and shifts.
+*/
+using chunk_t = soup::Bigint::chunk_t;
+using wide_t = size_t; /* twice as wide as a chunk, as in Soup */
+using Words = std::vector<chunk_t>; /* magnitude, least significant chunk first, no leading zeros */
+
+static constexpr unsigned CHUNK_BITS = soup::Bigint::getBitsPerChunk();
+
+static Words towords (const soup::Bigint& x) {
+  Words w(x.getNumChunks());
+  for (size_t i = 0; i != w.size(); ++i)
+    w[i] = x.getChunkInbounds(i);
+  return w;
+}
+
+static void trim (Words& w) {
+  while (!w.empty() && w.back() == 0)
+    w.pop_back();
+}
+
+static soup::Bigint fromwords (const Words& w, bool negative = false) {
+  soup::Bigint x;
+  size_t n = w.size();
+  while (n != 0 && w[n - 1] == 0)
+    --n;
+  for (size_t i = 0; i != n; ++i)
+    x.addChunk(w[i]);
+  x.negative = (negative && n != 0);
+  return x;
+}
+
+static soup::Bigint frominteger (lua_Integer i) {
+  soup::Bigint x;
+  lua_Unsigned mag = (i < 0) ? 0u - (lua_Unsigned)i : (lua_Unsigned)i;
+  for (; mag != 0; mag >>= CHUNK_BITS)
+    x.addChunk((chunk_t)mag);
+  x.negative = (i < 0);
+  return x;
+}
+
+/* w = w * m + a */
+static void muladdsmall (Words& w, chunk_t m, chunk_t a) {
+  wide_t c = a;
+  for (auto& d : w) {
+    c += (wide_t)d * m;
+    d = (chunk_t)c;
+    c >>= CHUNK_BITS;
+  }
+  if (c != 0)
+    w.push_back((chunk_t)c);
+}
+
+/* w = w / d, returns w % d */
+static chunk_t divsmall (Words& w, chunk_t d) {
+  wide_t r = 0;
+  for (size_t i = w.size(); i-- != 0; ) {
+    r = (r << CHUNK_BITS) | w[i];
+    w[i] = (chunk_t)(r / d);
+    r %= d;
+  }
+  trim(w);
+  return (chunk_t)r;
+}
+
+static int cmpwords (const chunk_t *a, const chunk_t *b, size_t n) {
+  while (n-- != 0) {
+    if (a[n] != b[n])
+      return a[n] < b[n] ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Knuth's algorithm D: q = u / v and r = u % v. 'v' must not be zero. */
+static void divwords (const Words& u, const Words& v, Words& q, Words& r) {
+  const size_t n = v.size();
+  const size_t m = u.size();
+  if (m < n || (m == n && cmpwords(u.data(), v.data(), n) < 0)) {
+    q.clear();
+    r = u;
+    return;
+  }
+  if (n == 1) {
+    q = u;
+    const chunk_t rem = divsmall(q, v[0]);
+    r.assign(rem != 0, rem);
+    return;
+  }
+  /* normalise so the divisor's top bit is set, which keeps the estimate for each quotient chunk within 2 */
+  unsigned s = 0;
+  while (!((v[n - 1] << s) & ((chunk_t)1 << (CHUNK_BITS - 1))))
+    ++s;
+  Words vn(n), un(m + 1);
+  for (size_t i = n - 1; i != 0; --i)
+    vn[i] = (chunk_t)((v[i] << s) | (s ? ((wide_t)v[i - 1] >> (CHUNK_BITS - s)) : 0));
+  vn[0] = (chunk_t)(v[0] << s);
+  un[m] = (chunk_t)(s ? ((wide_t)u[m - 1] >> (CHUNK_BITS - s)) : 0);
+  for (size_t i = m - 1; i != 0; --i)
+    un[i] = (chunk_t)((u[i] << s) | (s ? ((wide_t)u[i - 1] >> (CHUNK_BITS - s)) : 0));
+  un[0] = (chunk_t)(u[0] << s);
+  q.assign(m - n + 1, 0);
+  const wide_t base = (wide_t)1 << CHUNK_BITS;
+  for (size_t j = m - n + 1; j-- != 0; ) {
+    const wide_t num = ((wide_t)un[j + n] << CHUNK_BITS) | un[j + n - 1];
+    wide_t qhat = num / vn[n - 1];
+    wide_t rhat = num % vn[n - 1];
+    while (qhat >= base || qhat * vn[n - 2] > ((rhat << CHUNK_BITS) | un[j + n - 2])) {
+      --qhat;
+      rhat += vn[n - 1];
+      if (rhat >= base)
+        break;
+    }
+    /* multiply and subtract */
+    wide_t borrow = 0, carry = 0;
+    for (size_t i = 0; i != n; ++i) {
+      const wide_t p = qhat * vn[i] + carry;
+      carry = p >> CHUNK_BITS;
+      const wide_t sub = (wide_t)un[i + j] - (chunk_t)p - borrow;
+      un[i + j] = (chunk_t)sub;
+      borrow = (sub >> CHUNK_BITS) ? 1 : 0;
+    }
+    const wide_t top = (wide_t)un[j + n] - carry - borrow;
+    un[j + n] = (chunk_t)top;
+    if (top >> CHUNK_BITS) {  /* subtracted too much; add back once */
+      --qhat;
+      wide_t c = 0;
+      for (size_t i = 0; i != n; ++i) {
+        c += (wide_t)un[i + j] + vn[i];
+        un[i + j] = (chunk_t)c;
+        c >>= CHUNK_BITS;
+      }
+      un[j + n] = (chunk_t)(un[j + n] + c);
+    }
+    q[j] = (chunk_t)qhat;
+  }
+  trim(q);
+  r.resize(n);
+  for (size_t i = 0; i != n; ++i)
+    r[i] = (chunk_t)((un[i] >> s) | (s ? ((wide_t)un[i + 1] << (CHUNK_BITS - s)) : 0));
+  trim(r);
+}
+
+/* Euclidean division (0 <= r < |d|), which is also what Soup's 'divide' computes. 'd' must not be zero. */
+static void divmod (const soup::Bigint& x, const soup::Bigint& d, soup::Bigint& q, soup::Bigint& r) {
+  Words qw, rw;
+  divwords(towords(x), towords(d), qw, rw);
+  const bool adjust = (x.negative && !rw.empty());
+  q = fromwords(qw);
+  r = fromwords(rw);
+  if (adjust) {
+    q += soup::Bigint((chunk_t)1u);
+    r = d.abs() - r;
+  }
+  q.negative = (x.negative != d.negative && !q.isZero());
+}
+
+/* r += x << (offset chunks); 'r' must be large enough to hold the result */
+static void addat (Words& r, const chunk_t *x, size_t n, size_t offset) {
+  wide_t c = 0;
+  size_t i = 0;
+  for (; i != n; ++i) {
+    c += (wide_t)r[offset + i] + x[i];
+    r[offset + i] = (chunk_t)c;
+    c >>= CHUNK_BITS;
+  }
+  for (; c != 0; ++i) {
+    c += r[offset + i];
+    r[offset + i] = (chunk_t)c;
+    c >>= CHUNK_BITS;
+  }
+}
+
+/* r -= x for r >= x */
+static void subwords (Words& r, const Words& x) {
+  wide_t borrow = 0;
+  for (size_t i = 0; i != r.size(); ++i) {
+    const wide_t sub = (wide_t)r[i] - (i < x.size() ? x[i] : 0) - borrow;
+    r[i] = (chunk_t)sub;
+    borrow = (sub >> CHUNK_BITS) ? 1 : 0;
+    if (i >= x.size() && borrow == 0)
+      break;
+  }
+}
+
+static Words addwords (const chunk_t *a, size_t na, const chunk_t *b, size_t nb) {
+  if (na < nb) {
+    std::swap(a, b);
+    std::swap(na, nb);
+  }
+  Words r(a, a + na);
+  r.push_back(0);
+  addat(r, b, nb, 0);
+  return r;
+}
+
+static constexpr size_t KARATSUBA_THRESHOLD = 40; /* chunks */
+
+/* Schoolbook multiplication below the threshold, Karatsuba above it. Soup's own multiplication has
+** the same structure, but goes through bounds-checked chunk accessors and only switches at 128 chunks. */
+static Words mulwords (const chunk_t *a, size_t na, const chunk_t *b, size_t nb) {
+  if (na < nb) {
+    std::swap(a, b);
+    std::swap(na, nb);
+  }
+  Words r(na + nb, 0);
+  if (nb == 0)
+    return r;
+  if (nb < KARATSUBA_THRESHOLD) {
+    for (size_t i = 0; i != nb; ++i) {
+      const wide_t y = b[i];
+      wide_t c = 0;
+      for (size_t j = 0; j != na; ++j) {
+        c += (wide_t)r[i + j] + a[j] * y;
+        r[i + j] = (chunk_t)c;
+        c >>= CHUNK_BITS;
+      }
+      r[i + na] = (chunk_t)c;
+    }
+  }
+  else if (na >= 2 * nb) {  /* unbalanced: multiply 'b' by slices of 'a' */
+    for (size_t off = 0; off < na; off += nb) {
+      const size_t n = std::min(nb, na - off);
+      const Words part = mulwords(a + off, n, b, nb);
+      addat(r, part.data(), part.size(), off);
+    }
+  }
+  else {
+    const size_t h = na / 2;
+    const Words z0 = mulwords(a, h, b, h);
+    const Words z2 = mulwords(a + h, na - h, b + h, nb - h);
+    const Words sa = addwords(a, h, a + h, na - h);
+    const Words sb = addwords(b, h, b + h, nb - h);
+    Words z1 = mulwords(sa.data(), sa.size(), sb.data(), sb.size());
+    subwords(z1, z0);
+    subwords(z1, z2);
+    trim(z1);
+    addat(r, z0.data(), z0.size(), 0);
+    addat(r, z1.data(), z1.size(), h);
+    addat(r, z2.data(), z2.size(), 2 * h);
+  }
+  return r;
+}
+
+static soup::Bigint mul (const soup::Bigint& a, const soup::Bigint& b) {
+  const Words aw = towords(a), bw = towords(b);
+  return fromwords(mulwords(aw.data(), aw.size(), bw.data(), bw.size()), a.negative != b.negative);
+}
+
+static soup::Bigint modunsigned (const soup::Bigint& x, const Words& m) {
+  Words q, r;
+  divwords(towords(x), m, q, r);
+  return fromwords(r);
+}
+
+/* Montgomery multiplication (CIOS) for odd moduli. */
+struct Montgomery {
+  const Words m;
+  chunk_t minv; /* -m^-1 mod 2^CHUNK_BITS */
+  Words t;
+
+  explicit Montgomery (Words mod) : m(std::move(mod)), t(m.size() + 2) {
+    wide_t inv = m[0];  /* correct to 3 bits for any odd number, and every step doubles that */
+    for (int i = 0; i != 5; ++i)
+      inv = (chunk_t)(inv * (2 - (wide_t)m[0] * inv));
+    minv = (chunk_t)(0 - inv);
+  }
+
+  /* out = a * b / R mod m, where all operands have exactly m.size() chunks */
+  void mul (const chunk_t *a, const chunk_t *b, chunk_t *out) {
+    const size_t n = m.size();
+    std::fill(t.begin(), t.end(), 0);
+    for (size_t i = 0; i != n; ++i) {
+      wide_t c = 0;
+      for (size_t j = 0; j != n; ++j) {
+        c += (wide_t)t[j] + (wide_t)a[j] * b[i];
+        t[j] = (chunk_t)c;
+        c >>= CHUNK_BITS;
+      }
+      c += t[n];
+      t[n] = (chunk_t)c;
+      t[n + 1] = (chunk_t)(c >> CHUNK_BITS);
+      const chunk_t u = (chunk_t)((wide_t)t[0] * minv);
+      c = ((wide_t)t[0] + (wide_t)u * m[0]) >> CHUNK_BITS;
+      for (size_t j = 1; j != n; ++j) {
+        c += (wide_t)t[j] + (wide_t)u * m[j];
+        t[j - 1] = (chunk_t)c;
+        c >>= CHUNK_BITS;
+      }
+      c += t[n];
+      t[n - 1] = (chunk_t)c;
+      t[n] = (chunk_t)(t[n + 1] + (c >> CHUNK_BITS));
+    }
+    if (t[n] != 0 || cmpwords(t.data(), m.data(), n) >= 0) {
+      wide_t borrow = 0;
+      for (size_t j = 0; j != n; ++j) {
+        const wide_t sub = (wide_t)t[j] - m[j] - borrow;
+        t[j] = (chunk_t)sub;
+        borrow = (sub >> CHUNK_BITS) ? 1 : 0;
+      }
+    }
+    std::copy(t.begin(), t.begin() + n, out);
+  }
+
+  /* x * 2^(shift * CHUNK_BITS) mod m, padded to m.size() chunks */
+  Words enter (const soup::Bigint& x, size_t shift) const {
+    Words w(shift, 0), q, r;
+    const Words xw = towords(x);
+    w.insert(w.end(), xw.begin(), xw.end());
+    trim(w);
+    divwords(w, m, q, r);
+    r.resize(m.size(), 0);
+    return r;
+  }
+};
+
+static unsigned window (const soup::Bigint& e, size_t bit) {
+  unsigned w = 0;
+  for (size_t i = bit + 4; i-- != bit; ) {
+    const size_t c = i / CHUNK_BITS;
+    w = (w << 1) | ((c < e.getNumChunks()) ? ((e.getChunkInbounds(c) >> (i % CHUNK_BITS)) & 1) : 0);
+  }
+  return w;
+}
+
+/* base ^ e mod m for 0 <= base < m, e > 0, m > 1 */
+static soup::Bigint modpow (const soup::Bigint& base, const soup::Bigint& e, const soup::Bigint& m) {
+  const size_t bits = e.getBitLength();
+  if (!m.isOdd()) {
+    const Words mw = towords(m);
+    soup::Bigint res((chunk_t)1u), b = base;
+    for (size_t i = 0; i != bits; ++i) {
+      if (e.getBit(i))
+        res = modunsigned(mul(res, b), mw);
+      if (i + 1 != bits)
+        b = modunsigned(mul(b, b), mw);
+    }
+    return res;
+  }
+  Montgomery mont(towords(m));
+  const size_t n = mont.m.size();
+  const Words r2 = mont.enter(soup::Bigint((chunk_t)1u), 2 * n);  /* R^2 mod m */
+  Words table[16];  /* base^i in Montgomery form; the top window is never 0 */
+  table[1].resize(n);
+  Words b = towords(base);
+  b.resize(n, 0);
+  mont.mul(b.data(), r2.data(), table[1].data());
+  for (int i = 2; i != 16; ++i) {
+    table[i].resize(n);
+    mont.mul(table[i - 1].data(), table[1].data(), table[i].data());
+  }
+  /* fixed 4-bit windows, most significant first */
+  size_t pos = (bits + 3) & ~(size_t)3;
+  pos -= 4;
+  Words acc = table[window(e, pos)];
+  while (pos != 0) {
+    pos -= 4;
+    for (int i = 0; i != 4; ++i)
+      mont.mul(acc.data(), acc.data(), acc.data());
+    if (const unsigned w = window(e, pos))
+      mont.mul(acc.data(), table[w].data(), acc.data());
+  }
+  Words one(n, 0);
+  one[0] = 1;
+  mont.mul(acc.data(), one.data(), acc.data());
+  return fromwords(acc);
+}
+
+/*
+** Base conversion. Small values go a chunk's worth of decimal digits at a time. Larger values are
+** split in halves by powers DEC_BASE^(2^k), so the cost follows that of multiplication (see
+** 'mulwords') instead of growing quadratically. Division by those powers uses Barrett reduction with
+** reciprocals that are derived from the previous level's with a Newton step.
+*/
+static constexpr chunk_t DEC_BASE = (sizeof(chunk_t) == 4) ? 1000000000u : 10000u;
+static constexpr size_t DEC_DIGITS = (sizeof(chunk_t) == 4) ? 9 : 4;
+static constexpr size_t DC_THRESHOLD = 64; /* chunks */
+
+struct DecimalPowers {
+  std::vector<soup::Bigint> pow; /* DEC_BASE^(2^k), which has DEC_DIGITS << k digits */
+  std::vector<soup::Bigint> inv; /* floor(2^shift[k] / pow[k]) */
+  std::vector<size_t> shift;
+
+  const soup::Bigint& get (size_t k) {
+    if (pow.empty())
+      pow.emplace_back(DEC_BASE);
+    while (pow.size() <= k) {
+      soup::Bigint next = mul(pow.back(), pow.back());
+      pow.emplace_back(std::move(next));
+    }
+    return pow[k];
+  }
+
+  void reciprocal (size_t k) {
+    while (inv.size() <= k) {
+      const size_t i = inv.size();
+      const soup::Bigint& p = get(i);
+      const size_t s = 2 * p.getBitLength();
+      const soup::Bigint one = soup::Bigint((chunk_t)1u) << s;
+      soup::Bigint y;
+      if (p.getNumChunks() < DC_THRESHOLD) {
+        Words q, r;
+        divwords(towords(one), towords(p), q, r);
+        y = fromwords(q);
+      }
+      else {
+        /* pow[i] = pow[i - 1]^2, so the square of the previous reciprocal is already half right, and one Newton step doubles that */
+        y = mul(inv[i - 1], inv[i - 1]) >> (2 * shift[i - 1] - s);
+        const soup::Bigint err = one - mul(p, y);
+        soup::Bigint corr = mul(y, err.abs());
+        corr >>= s;
+        if (err.negative)
+          y -= corr;
+        else
+          y += corr;
+      }
+      /* make it exact: p * y <= 2^s < p * (y + 1) */
+      soup::Bigint rem = one - mul(p, y);
+      while (rem.negative && !rem.isZero()) {
+        y -= soup::Bigint((chunk_t)1u);
+        rem += p;
+      }
+      while (rem >= p) {
+        y += soup::Bigint((chunk_t)1u);
+        rem -= p;
+      }
+      inv.emplace_back(std::move(y));
+      shift.emplace_back(s);
+    }
+  }
+
+  /* q = x / pow[k] and r = x % pow[k] for 0 <= x < pow[k]^2 */
+  void divide (const soup::Bigint& x, size_t k, soup::Bigint& q, soup::Bigint& r) {
+    reciprocal(k);
+    const soup::Bigint& p = pow[k];
+    /* shift[k] is twice the bit length of p; dropping the low bits of x first keeps both products balanced */
+    const size_t half = shift[k] / 2;
+    q = mul(x >> (half - 1), inv[k]) >> (half + 1);
+    r = x - mul(q, p);
+    while (r >= p) {
+      r -= p;
+      q += soup::Bigint((chunk_t)1u);
+    }
+  }
+};
+
+/* Appends |x| in decimal, zero-padded to 'width' digits unless that is 0. */
+static void todecimal (std::string& out, const soup::Bigint& x, size_t width) {
+  Words w = towords(x);
+  std::string digits;
+  while (!w.empty()) {
+    chunk_t group = divsmall(w, DEC_BASE);
+    for (size_t i = 0; i != DEC_DIGITS; ++i) {
+      digits.push_back((char)('0' + group % 10));
+      group /= 10;
+    }
+  }
+  while (!digits.empty() && digits.back() == '0')
+    digits.pop_back();
+  if (width == 0 && digits.empty())
+    digits.push_back('0');
+  if (digits.size() < width)
+    digits.append(width - digits.size(), '0');
+  out.append(digits.rbegin(), digits.rend());
+}
+
+/* Same as above for 0 <= x < pow[k]. */
+static void todecimal (std::string& out, const soup::Bigint& x, size_t k, size_t width, DecimalPowers& powers) {
+  if (k == 0 || x.getNumChunks() < DC_THRESHOLD) {
+    todecimal(out, x, width);
+    return;
+  }
+  soup::Bigint q, r;
+  powers.divide(x, k - 1, q, r);
+  const size_t lowwidth = DEC_DIGITS << (k - 1);
+  if (width != 0)
+    todecimal(out, q, k - 1, width - lowwidth, powers);
+  else if (!q.isZero())
+    todecimal(out, q, k - 1, 0, powers);
+  todecimal(out, r, k - 1, (width != 0 || !q.isZero()) ? lowwidth : 0, powers);
+}
+
+static std::string tostring (const soup::Bigint& x) {
+  std::string out;
+  if (x.negative && !x.isZero())
+    out.push_back('-');
+  if (x.getNumChunks() < DC_THRESHOLD)
+    todecimal(out, x, 0);
+  else {
+    /* find the smallest k with |x| < pow[k] = pow[k - 1]^2 */
+    DecimalPowers powers;
+    size_t k = 1;
+    while (x.getBitLength() > 2 * (powers.get(k - 1).getBitLength() - 1))
+      ++k;
+    todecimal(out, x.abs(), k, 0, powers);
+  }
+  return out;
+}
+
+static soup::Bigint fromdecimal (const char *str, size_t len, DecimalPowers& powers) {
+  if (len <= DEC_DIGITS * DC_THRESHOLD) {
+    Words w;
+    size_t i = 0;
+    while (i != len) {
+      const size_t n = (i == 0 && len % DEC_DIGITS) ? len % DEC_DIGITS : DEC_DIGITS;
+      chunk_t scale = 1, group = 0;
+      for (size_t j = 0; j != n; ++j) {
+        scale *= 10;
+        group = (chunk_t)(group * 10 + (str[i++] - '0'));
+      }
+      muladdsmall(w, scale, group);
+    }
+    return fromwords(w);
+  }
+  size_t k = 0;
+  while ((DEC_DIGITS << (k + 1)) < len)
+    ++k;
+  const size_t lowlen = DEC_DIGITS << k;
+  soup::Bigint high = fromdecimal(str, len - lowlen, powers);
+  soup::Bigint x = mul(high, powers.get(k));
+  x += fromdecimal(str + len - lowlen, lowlen, powers);
+  return x;
+}
+
+/* Same as Soup's 'fromString', but rejects malformed input. Hex and binary literals are left to Soup. */
+static bool fromstring (const char *str, size_t len, soup::Bigint& res) {
+  const bool neg = (len != 0 && str[0] == '-');
+  const char *digits = str + neg;
+  const size_t n = len - neg;
+  if (n > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X' || digits[1] == 'b' || digits[1] == 'B')) {
+    const bool hex = (digits[1] == 'x' || digits[1] == 'X');
+    for (size_t i = 2; i != n; ++i) {
+      const char c = digits[i];
+      if (hex ? !lisxdigit((unsigned char)c) : (c != '0' && c != '1'))
+        return false;
+    }
+    res = soup::Bigint::fromString(str, len);
+    return true;
+  }
+  for (size_t i = 0; i != n; ++i) {
+    if (!lisdigit((unsigned char)digits[i]))
+      return false;
+  }
+  DecimalPowers powers;
+  res = fromdecimal(digits, n, powers);
+  res.negative = (neg && !res.isZero());
+  return true;
+}
+
 soup::Bigint* checkbigint (lua_State *L, int i) {
   if (lua_type(L, i) == LUA_TNUMBER) {
-    lua_pushinteger(L, luaL_checkinteger(L, i));
-    size_t len;
-    const char *str = lua_tolstring(L, -1, &len);
-    pushbigint(L, soup::Bigint::fromString(str, len));
-    lua_replace(L, -2);
+    i = lua_absindex(L, i);
+    pushbigint(L, frominteger(luaL_checkinteger(L, i)));
     lua_replace(L, i);
   }
   return (soup::Bigint*)luaL_checkudata(L, i, "pluto:bigint");
 }
 
+/* Like 'checkbigint', but integers are converted into 'tmp' instead of a new userdata. */
+static const soup::Bigint& tobigint (lua_State *L, int i, soup::Bigint& tmp) {
+  if (lua_type(L, i) == LUA_TNUMBER) {
+    tmp = frominteger(luaL_checkinteger(L, i));
+    return tmp;
+  }
+  return *(soup::Bigint*)luaL_checkudata(L, i, "pluto:bigint");
+}
+
+static const soup::Bigint& checkdivisor (lua_State *L, int i, soup::Bigint& tmp) {
+  const soup::Bigint& d = tobigint(L, i, tmp);
+  if (l_unlikely(d.isZero()))
+    luaL_error(L, "attempt to divide by zero");
+  return d;
+}
+
 static int bigint_new (lua_State *L) {
-  int i = 1;
   if (lua_type(L, 1) == LUA_TNUMBER) {
-    lua_pushinteger(L, luaL_checkinteger(L, 1));
-    i = -1;
+    pushbigint(L, frominteger(luaL_checkinteger(L, 1)));
+    return 1;
+  }
+  if (lua_type(L, 1) == LUA_TUSERDATA) {
+    pushbigint(L, *checkbigint(L, 1));
+    return 1;
   }
   size_t len;
-  const char *str = lua_tolstring(L, i, &len);
-  pushbigint(L, soup::Bigint::fromString(str, len));
+  const char *str = luaL_checklstring(L, 1, &len);
+  soup::Bigint x;
+  if (l_unlikely(!fromstring(str, len, x)))
+    luaL_argerror(L, 1, "malformed number");
+  pushbigint(L, std::move(x));
   return 1;
 }
 
 static int bigint_add (lua_State *L) {
-  pushbigint(L, *checkbigint(L, 1) + *checkbigint(L, 2));
+  soup::Bigint t1, t2;
+  pushbigint(L, tobigint(L, 1, t1) + tobigint(L, 2, t2));
   return 1;
 }
 
 static int bigint_sub (lua_State *L) {
-  pushbigint(L, *checkbigint(L, 1) - *checkbigint(L, 2));
+  soup::Bigint t1, t2;
+  pushbigint(L, tobigint(L, 1, t1) - tobigint(L, 2, t2));
   return 1;
 }
 
 static int bigint_mul (lua_State *L) {
-  pushbigint(L, *checkbigint(L, 1) * *checkbigint(L, 2));
+  soup::Bigint t1, t2;
+  pushbigint(L, mul(tobigint(L, 1, t1), tobigint(L, 2, t2)));
   return 1;
 }
 
 static int bigint_div (lua_State *L) {
-  auto [q, r] = checkbigint(L, 1)->divide(*checkbigint(L, 2));
+  soup::Bigint t1, t2, q, r;
+  const auto& x = tobigint(L, 1, t1);
+  divmod(x, checkdivisor(L, 2, t2), q, r);
   pushbigint(L, std::move(q));
   pushbigint(L, std::move(r));
   return 2;
 }
 
 static int bigint_div_mm (lua_State *L) {
-  pushbigint(L, *checkbigint(L, 1) / *checkbigint(L, 2));
+  soup::Bigint t1, t2, q, r;
+  const auto& x = tobigint(L, 1, t1);
+  divmod(x, checkdivisor(L, 2, t2), q, r);
+  pushbigint(L, std::move(q));
+  return 1;
+}
+
+/* Floor division like the '//' operator on integers, which differs from 'divmod' for negative divisors. */
+static int bigint_idiv (lua_State *L) {
+  soup::Bigint t1, t2, q, r;
+  const auto& x = tobigint(L, 1, t1);
+  const auto& d = checkdivisor(L, 2, t2);
+  divmod(x, d, q, r);
+  if (d.negative && !r.isZero())
+    q -= soup::Bigint((chunk_t)1u);
+  pushbigint(L, std::move(q));
   return 1;
 }
 
 static int bigint_mod (lua_State *L) {
-  pushbigint(L, *checkbigint(L, 1) % *checkbigint(L, 2));
+  soup::Bigint t1, t2, q, r;
+  const auto& x = tobigint(L, 1, t1);
+  divmod(x, checkdivisor(L, 2, t2), q, r);
+  pushbigint(L, std::move(r));
   return 1;
 }
 
 static int bigint_pow (lua_State *L) {
-  pushbigint(L, checkbigint(L, 1)->pow(*checkbigint(L, 2)));
+  soup::Bigint t1, t2;
+  pushbigint(L, tobigint(L, 1, t1).pow(tobigint(L, 2, t2)));
+  return 1;
+}
+
+static int bigint_modpow (lua_State *L) {
+  soup::Bigint t1, t2, t3;
+  const auto& base = tobigint(L, 1, t1);
+  const auto& e = tobigint(L, 2, t2);
+  const auto& m = tobigint(L, 3, t3);
+  luaL_argcheck(L, !e.negative || e.isZero(), 2, "exponent must not be negative");
+  luaL_argcheck(L, !m.negative && !m.isZero(), 3, "modulus must be positive");
+  if (m == (chunk_t)1u)
+    pushbigint(L, soup::Bigint());
+  else if (e.isZero())
+    pushbigint(L, soup::Bigint((chunk_t)1u));
+  else {
+    soup::Bigint q, b;
+    if (base.negative || base.cmpUnsigned(m) >= 0)
+      divmod(base, m, q, b);
+    else
+      b = base;
+    pushbigint(L, modpow(b, e, m));
+  }
+  return 1;
+}
+
+static int bigint_modinv (lua_State *L) {
+  soup::Bigint t1, t2;
+  const auto& a = tobigint(L, 1, t1);
+  const auto& m = tobigint(L, 2, t2);
+  luaL_argcheck(L, !m.negative && !m.isZero(), 2, "modulus must be positive");
+  /* extended Euclid, only tracking the coefficient of 'a' */
+  soup::Bigint q, r, oldr, s, olds((chunk_t)1u), tmp;
+  divmod(a, m, q, oldr);
+  r = m;
+  while (!r.isZero()) {
+    divmod(oldr, r, q, tmp);
+    oldr = std::move(r);
+    r = std::move(tmp);
+    tmp = olds - mul(q, s);
+    olds = std::move(s);
+    s = std::move(tmp);
+  }
+  if (l_unlikely(oldr != (chunk_t)1u))
+    luaL_error(L, "no modular inverse exists as the numbers are not coprime");
+  divmod(olds, m, q, r);
+  pushbigint(L, std::move(r));
+  return 1;
+}
+
+/* In-place variants modify their first operand, which must be a bigint, and return it. */
+static int bigint_addinplace (lua_State *L) {
+  soup::Bigint t;
+  const auto self = (soup::Bigint*)luaL_checkudata(L, 1, "pluto:bigint");
+  *self += tobigint(L, 2, t);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int bigint_subinplace (lua_State *L) {
+  soup::Bigint t;
+  const auto self = (soup::Bigint*)luaL_checkudata(L, 1, "pluto:bigint");
+  *self -= tobigint(L, 2, t);
+  if (self->isZero())
+    self->negative = false;
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int bigint_mulinplace (lua_State *L) {
+  soup::Bigint t;
+  const auto self = (soup::Bigint*)luaL_checkudata(L, 1, "pluto:bigint");
+  *self = mul(*self, tobigint(L, 2, t));
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int bigint_modinplace (lua_State *L) {
+  soup::Bigint t, q, r;
+  const auto self = (soup::Bigint*)luaL_checkudata(L, 1, "pluto:bigint");
+  divmod(*self, checkdivisor(L, 2, t), q, r);
+  *self = std::move(r);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* Shifts act on the magnitude; the sign is kept. */
+static int bigint_shl (lua_State *L) {
+  soup::Bigint t;
+  const auto& x = tobigint(L, 1, t);
+  const auto n = luaL_checkinteger(L, 2);
+  if (n >= 0)
+    pushbigint(L, x << (size_t)n);
+  else
+    pushbigint(L, x >> (size_t)(0u - (lua_Unsigned)n));
+  return 1;
+}
+
+static int bigint_shr (lua_State *L) {
+  soup::Bigint t;
+  const auto& x = tobigint(L, 1, t);
+  const auto n = luaL_checkinteger(L, 2);
+  if (n >= 0)
+    pushbigint(L, x >> (size_t)n);
+  else
+    pushbigint(L, x << (size_t)(0u - (lua_Unsigned)n));
+  return 1;
+}
+
+static int bigint_concat (lua_State *L) {
+  luaL_tolstring(L, 1, nullptr);
+  luaL_tolstring(L, 2, nullptr);
+  lua_concat(L, 2);
   return 1;
 }
 
 static int bigint_tostring (lua_State *L) {
-  pluto_pushstring(L, checkbigint(L, 1)->toString());
+  pluto_pushstring(L, tostring(*checkbigint(L, 1)));
   return 1;
 }
 
 static int bigint_eq (lua_State *L) {
-  lua_pushboolean(L, *checkbigint(L, 1) == *checkbigint(L, 2));
+  soup::Bigint t1, t2;
+  lua_pushboolean(L, tobigint(L, 1, t1) == tobigint(L, 2, t2));
   return 1;
 }
 
 static int bigint_lt (lua_State *L) {
-  lua_pushboolean(L, *checkbigint(L, 1) < *checkbigint(L, 2));
+  soup::Bigint t1, t2;
+  lua_pushboolean(L, tobigint(L, 1, t1) < tobigint(L, 2, t2));
   return 1;
 }
 
 static int bigint_le (lua_State *L) {
-  lua_pushboolean(L, *checkbigint(L, 1) <= *checkbigint(L, 2));
+  soup::Bigint t1, t2;
+  lua_pushboolean(L, tobigint(L, 1, t1) <= tobigint(L, 2, t2));
   return 1;
 }
 
@@ -115,7 +827,14 @@ static int bigint_abs (lua_State *L) {
 }
 
 static int bigint_gcd (lua_State *L) {
-  pushbigint(L, checkbigint(L, 1)->gcd(*checkbigint(L, 2)));
+  soup::Bigint t1, t2, q, r;
+  soup::Bigint a = tobigint(L, 1, t1).abs(), b = tobigint(L, 2, t2).abs();
+  while (!b.isZero()) {
+    divmod(a, b, q, r);
+    a = std::move(b);
+    b = std::move(r);
+  }
+  pushbigint(L, std::move(a));
   return 1;
 }
 
@@ -146,6 +865,8 @@ static int bigint_import (lua_State *L) {
 }
 
 void pushbigint (lua_State *L, soup::Bigint x) {
+  if (x.isZero())
+    x.negative = false;
   new (lua_newuserdata(L, sizeof(soup::Bigint))) soup::Bigint(std::move(x));
   if (l_unlikely(luaL_newmetatable(L, "pluto:bigint"))) {
     lua_pushliteral(L, "__gc");
@@ -167,12 +888,24 @@ void pushbigint (lua_State *L, soup::Bigint x) {
     lua_pushliteral(L, "__div");
     lua_pushcfunction(L, bigint_div_mm);
     lua_settable(L, -3);
+    lua_pushliteral(L, "__idiv");
+    lua_pushcfunction(L, bigint_idiv);
+    lua_settable(L, -3);
     lua_pushliteral(L, "__mod");
     lua_pushcfunction(L, bigint_mod);
     lua_settable(L, -3);
     lua_pushliteral(L, "__pow");
     lua_pushcfunction(L, bigint_pow);
     lua_settable(L, -3);
+    lua_pushliteral(L, "__shl");
+    lua_pushcfunction(L, bigint_shl);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__shr");
+    lua_pushcfunction(L, bigint_shr);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__concat");
+    lua_pushcfunction(L, bigint_concat);
+    lua_settable(L, -3);
     lua_pushliteral(L, "__tostring");
     lua_pushcfunction(L, bigint_tostring);
     lua_settable(L, -3);
@@ -204,6 +937,12 @@ static const luaL_Reg funcs_bigint[] = {
   {"div", bigint_div},
   {"mod", bigint_mod},
   {"pow", bigint_pow},
+  {"modpow", bigint_modpow},
+  {"modinv", bigint_modinv},
+  {"addinplace", bigint_addinplace},
+  {"subinplace", bigint_subinplace},
+  {"mulinplace", bigint_mulinplace},
+  {"modinplace", bigint_modinplace},
   {"tostring", bigint_tostring},
   {"eq", bigint_eq},
   {"lt", bigint_lt},
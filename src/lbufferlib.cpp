@@ -1,82 +1,17 @@
 #define LUA_LIB
 #include "lualib.h"
 
-#include <cstdlib> // malloc, realloc, free
+#include <cstring> // memcpy, memmove
 #include <memory> // destroy_at
-#include <new> // bad_alloc
+#include <string_view>
 
-#include "vendor/Soup/soup/Buffer.hpp"
+#include "lbufferlib.hpp"
 
 #include "ldo.h"
-#include "lmem.h"
+#include "lpack.hpp"
 
-#ifdef PLUTO_MEMORY_LIMIT
-struct PlutoSingleBlockAllocator : public soup::memAllocator
-{
-    lua_State* L;
-    size_t size = 0;
-
-    PlutoSingleBlockAllocator()
-        : memAllocator(&allocateImpl, &reallocateImpl, &deallocateImpl)
-    {
-    }
-
-    static void* allocateImpl(memAllocator* inst, size_t size) /* SOUP_EXCAL */
-    {
-        //printf("allocate %zu\n", size);
-        void* ptr = luaM_realloc_(static_cast<PlutoSingleBlockAllocator*>(inst)->L, nullptr, 0, size);
-        SOUP_IF_LIKELY (ptr)
-        {
-            static_cast<PlutoSingleBlockAllocator*>(inst)->size = size;
-            return ptr;
-        }
-        throw std::bad_alloc{};
-    }
-
-    static void* reallocateImpl(memAllocator* inst, void* addr, size_t new_size) /* SOUP_EXCAL */
-    {
-        //printf("resize %zu to %zu\n", static_cast<PlutoSingleBlockAllocator*>(inst)->size, new_size);
-        addr = luaM_realloc_(static_cast<PlutoSingleBlockAllocator*>(inst)->L, addr, static_cast<PlutoSingleBlockAllocator*>(inst)->size, new_size);
-        SOUP_IF_LIKELY (addr)
-        {
-            static_cast<PlutoSingleBlockAllocator*>(inst)->size = new_size;
-            return addr;
-        }
-        throw std::bad_alloc{};
-    }
-
-    static void deallocateImpl(memAllocator* inst, void* addr) noexcept
-    {
-        luaM_free_(static_cast<PlutoSingleBlockAllocator*>(inst)->L, addr, static_cast<PlutoSingleBlockAllocator*>(inst)->size);
-    }
-};
-#endif
-
-struct PlutoBuffer
-{
-#ifdef PLUTO_MEMORY_LIMIT
-    PlutoSingleBlockAllocator allocator;
-#endif
-    soup::Buffer<> buffer;
-
-    PlutoBuffer()
-#ifdef PLUTO_MEMORY_LIMIT
-        : buffer(allocator)
-#endif
-    {
-    }
-};
-
-[[nodiscard]] static PlutoBuffer* checkbuffer (lua_State *L, int i) {
-  const auto buf = (PlutoBuffer*)luaL_checkudata(L, i, "pluto:buffer");
-#ifdef PLUTO_MEMORY_LIMIT
-  buf->allocator.L = L;
-#endif
-  return buf;
-}
-
-static int buffer_new (lua_State *L) {
-  new (lua_newuserdata(L, sizeof(PlutoBuffer))) PlutoBuffer{};
+PlutoBuffer* pushbuffer (lua_State *L) {
+  auto buf = new (lua_newuserdatauv(L, sizeof(PlutoBuffer), 1)) PlutoBuffer{};
   if (luaL_newmetatable(L, "pluto:buffer")) {
     lua_pushliteral(L, "__index");
     luaL_loadbuffer(L, "return require\"pluto:buffer\"", 28, 0);
@@ -93,17 +28,185 @@ static int buffer_new (lua_State *L) {
 	luaL_loadbuffer(L, "return require\"pluto:buffer\".tostring", 37, 0);
 	lua_call(L, 0, 1);
 	lua_settable(L, -3);
+    lua_pushliteral(L, "__len");
+    lua_pushcfunction(L, [](lua_State *L) {
+      lua_pushinteger(L, (lua_Integer)checkbuffer(L, 1)->size());
+      return 1;
+    });
+    lua_settable(L, -3);
   }
   lua_setmetatable(L, -2);
+#ifdef PLUTO_MEMORY_LIMIT
+  buf->allocator.L = L;
+#endif
+  return buf;
+}
+
+/* Views share the memory of their parent, so anything that may reallocate has to go through the parent. */
+static soup::Buffer<>& checkowner (lua_State *L, PlutoBuffer *buf) {
+  if (l_unlikely(buf->parent))
+    luaL_error(L, "cannot resize a view");
+  return buf->buffer;
+}
+
+/* Translates a 1-based, possibly negative position into an offset that is at most 'len'. */
+static size_t checkpos (lua_State *L, int arg, lua_Integer pos, size_t len) {
+  if (pos < 0)
+    pos += (lua_Integer)len + 1;
+  luaL_argcheck(L, pos >= 1 && (lua_Unsigned)pos - 1 <= len, arg, "position out of bounds");
+  return (size_t)pos - 1;
+}
+
+/* Copies 'len' bytes to 'pos', growing the buffer if needed. 'src' may point into the buffer itself. */
+static void writebytes (lua_State *L, PlutoBuffer *buf, size_t pos, const char *src, size_t len) {
+  if (pos + len > buf->size()) {
+    soup::Buffer<>& b = checkowner(L, buf);
+    const auto base = (const char*)b.data();
+    const bool aliased = (base && src >= base && src < base + b.capacity());
+    const size_t srcoff = aliased ? (size_t)(src - base) : 0;
+    bool fail = false;
+    try {
+      b.resize(pos + len);
+    }
+    catch (const std::bad_alloc&) {
+      fail = true;
+    }
+    if (l_unlikely(fail))
+      luaD_throw(L, LUA_ERRMEM);
+    if (aliased)
+      src = (const char*)b.data() + srcoff;
+  }
+  if (len != 0)
+    memmove(buf->data() + pos, src, len);
+}
+
+static int buffer_new (lua_State *L) {
+  auto buf = pushbuffer(L);
+  if (lua_type(L, 1) == LUA_TNUMBER) {
+    const auto capacity = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, capacity >= 0, 1, "capacity must not be negative");
+    bool fail = false;
+    try {
+      buf->buffer.reserve((size_t)capacity);
+    }
+    catch (const std::bad_alloc&) {
+      fail = true;
+    }
+    if (l_unlikely(fail))
+      luaD_throw(L, LUA_ERRMEM);
+  }
+  else if (!lua_isnoneornil(L, 1)) {
+    size_t size;
+    const char *data = checkbytes(L, 1, &size);
+    writebytes(L, buf, 0, data, size);
+  }
   return 1;
 }
 
 static int buffer_append (lua_State *L) {
+  const auto buf = checkbuffer(L, 1);
   size_t size;
+  const char *data = checkbytes(L, 2, &size);
+  writebytes(L, buf, buf->size(), data, size);
+  return 0;
+}
+
+static int buffer_size (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)checkbuffer(L, 1)->size());
+  return 1;
+}
+
+static int buffer_reserve (lua_State *L) {
+  soup::Buffer<>& b = checkowner(L, checkbuffer(L, 1));
+  const auto capacity = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, capacity >= 0, 2, "capacity must not be negative");
+  bool fail = false;
+  try {
+    b.reserve((size_t)capacity);
+  }
+  catch (const std::bad_alloc&) {
+    fail = true;
+  }
+  if (l_unlikely(fail))
+    luaD_throw(L, LUA_ERRMEM);
+  return 0;
+}
+
+static int buffer_clear (lua_State *L) {
+  checkowner(L, checkbuffer(L, 1)).clear();
+  return 0;
+}
+
+/* Appends to the end of a buffer. Growth is geometric, and if packing fails halfway, the partial record is removed again. */
+struct BufferAppendSink : PackSink {
+  soup::Buffer<>& b;
+  const size_t start;
+  bool done = false;
+
+  explicit BufferAppendSink (soup::Buffer<>& b) : b(b), start(b.size()) {}
+
+  ~BufferAppendSink () {
+    if (!done)
+      b.resize(start);
+  }
+
+  char *prep (size_t n) final {
+    if (b.capacity() - b.size() < n) {
+      const size_t grown = b.capacity() + (b.capacity() >> 1);
+      b.reserve(std::max(b.size() + n, grown));
+    }
+    return (char*)b.data() + b.size();
+  }
+
+  void add (size_t n) final {
+    b.resize(b.size() + n);
+  }
+};
+
+/* Overwrites bytes starting at a given offset, growing the buffer when writing past its end. */
+struct BufferWriteSink : PackSink {
+  lua_State *L;
+  PlutoBuffer *buf;
+  size_t pos;
+
+  BufferWriteSink (lua_State *L, PlutoBuffer *buf, size_t pos) : L(L), buf(buf), pos(pos) {}
+
+  char *prep (size_t n) final {
+    if (pos + n > buf->size()) {
+      soup::Buffer<>& b = checkowner(L, buf);
+      b.resize(pos + n);
+    }
+    return (char*)buf->data() + pos;
+  }
+
+  void add (size_t n) final {
+    pos += n;
+  }
+};
+
+static int buffer_pack (lua_State *L) {
+  soup::Buffer<>& b = checkowner(L, checkbuffer(L, 1));
+  bool fail = false;
+  try {
+    BufferAppendSink sink(b);
+    pluto_pack(L, 2, b.size(), sink);
+    sink.done = true;
+  }
+  catch (const std::bad_alloc&) {
+    fail = true;
+  }
+  if (l_unlikely(fail))
+    luaD_throw(L, LUA_ERRMEM);
+  return 0;
+}
+
+static int buffer_packat (lua_State *L) {
+  const auto buf = checkbuffer(L, 1);
+  const size_t pos = checkpos(L, 2, luaL_checkinteger(L, 2), buf->size());
   bool fail = false;
-  const char* data = luaL_checklstring(L, 2, &size);
   try {
-    checkbuffer(L, 1)->buffer.append(data, size);
+    BufferWriteSink sink(L, buf, pos);
+    pluto_pack(L, 3, pos, sink);
   }
   catch (const std::bad_alloc&) {
     fail = true;
@@ -113,11 +216,88 @@ static int buffer_append (lua_State *L) {
   return 0;
 }
 
+static int buffer_unpack (lua_State *L) {
+  const auto buf = checkbuffer(L, 1);
+  const char *fmt = luaL_checkstring(L, 2);
+  const size_t size = buf->size();
+  const size_t pos = checkpos(L, 3, luaL_optinteger(L, 3, 1), size);
+  return pluto_unpack(L, fmt, size ? (const char*)buf->data() : "", size, pos, 1);
+}
+
+static int buffer_read (lua_State *L) {
+  const auto buf = checkbuffer(L, 1);
+  const size_t size = buf->size();
+  const size_t pos = checkpos(L, 2, luaL_checkinteger(L, 2), size);
+  const auto len = luaL_optinteger(L, 3, (lua_Integer)(size - pos));
+  luaL_argcheck(L, len >= 0 && (lua_Unsigned)len <= size - pos, 3, "length out of bounds");
+  lua_pushlstring(L, len ? (const char*)buf->data() + pos : "", (size_t)len);
+  return 1;
+}
+
+static int buffer_write (lua_State *L) {
+  const auto buf = checkbuffer(L, 1);
+  const size_t pos = checkpos(L, 2, luaL_checkinteger(L, 2), buf->size());
+  size_t len;
+  const char *data = checkbytes(L, 3, &len);
+  writebytes(L, buf, pos, data, len);
+  return 0;
+}
+
+static int buffer_slice (lua_State *L) {
+  auto buf = checkbuffer(L, 1);
+  const size_t size = buf->size();
+  lua_Integer i = luaL_checkinteger(L, 2);
+  lua_Integer j = luaL_optinteger(L, 3, -1);
+  /* same rules as string.sub */
+  if (i < 0)
+    i = std::max<lua_Integer>((lua_Integer)size + i + 1, 1);
+  else if (i == 0)
+    i = 1;
+  if (j < 0)
+    j += (lua_Integer)size + 1;
+  else if (j > (lua_Integer)size)
+    j = (lua_Integer)size;
+  const size_t offset = (size_t)i - 1;
+  const size_t length = (i <= j) ? (size_t)(j - i + 1) : 0;
+  auto view = pushbuffer(L);
+  if (buf->parent) {  /* flatten views of views */
+    view->offset = buf->offset + std::min(offset, size);
+    buf = buf->parent;
+  }
+  else
+    view->offset = offset;
+  view->parent = buf;
+  view->length = length;
+  /* keep the owning buffer alive for as long as the view is */
+  if (lua_getiuservalue(L, 1, 1) != LUA_TUSERDATA) {
+    lua_pop(L, 1);
+    lua_pushvalue(L, 1);
+  }
+  lua_setiuservalue(L, -2, 1);
+  return 1;
+}
+
+static int buffer_find (lua_State *L) {
+  const auto buf = checkbuffer(L, 1);
+  size_t nlen;
+  const char *needle = checkbytes(L, 2, &nlen);
+  const size_t size = buf->size();
+  const size_t init = checkpos(L, 3, luaL_optinteger(L, 3, 1), size);
+  const std::string_view hay(size ? (const char*)buf->data() : "", size);
+  const size_t at = hay.find(std::string_view(needle, nlen), init);
+  if (at == std::string_view::npos)
+    luaL_pushfail(L);
+  else
+    lua_pushinteger(L, (lua_Integer)at + 1);
+  return 1;
+}
+
 static int buffer_tostring (lua_State *L) {
-  soup::Buffer<>& buf = checkbuffer(L, 1)->buffer;
+  const auto buf = checkbuffer(L, 1);
+  const size_t size = buf->size();
   bool fail = false;
   try {
-    lua_pushlstring(L, (const char*)buf.data(), buf.size());
+    lua_pushlstring(L, size ? (const char*)buf->data() : "", size);
   }
   catch (const std::bad_alloc&) {
     fail = true;
@@ -130,6 +310,16 @@ static int buffer_tostring (lua_State *L) {
 static const luaL_Reg funcs_buffer[] = {
   {"new", buffer_new},
   {"append", buffer_append},
+  {"size", buffer_size},
+  {"reserve", buffer_reserve},
+  {"clear", buffer_clear},
+  {"pack", buffer_pack},
+  {"packat", buffer_packat},
+  {"unpack", buffer_unpack},
+  {"read", buffer_read},
+  {"write", buffer_write},
+  {"slice", buffer_slice},
+  {"find", buffer_find},
   {"tostring", buffer_tostring},
   {nullptr, nullptr}
 };
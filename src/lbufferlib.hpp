@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm> // min
+#include <new> // bad_alloc
+
+#include "vendor/Soup/soup/Buffer.hpp"
+
+#include "lauxlib.h"
+#include "lmem.h"
+
+#ifdef PLUTO_MEMORY_LIMIT
+struct PlutoSingleBlockAllocator : public soup::memAllocator
+{
+    lua_State* L;
+    size_t size = 0;
+
+    PlutoSingleBlockAllocator()
+        : memAllocator(&allocateImpl, &reallocateImpl, &deallocateImpl)
+    {
+    }
+
+    static void* allocateImpl(memAllocator* inst, size_t size) /* SOUP_EXCAL */
+    {
+        //printf("allocate %zu\n", size);
+        void* ptr = luaM_realloc_(static_cast<PlutoSingleBlockAllocator*>(inst)->L, nullptr, 0, size);
+        SOUP_IF_LIKELY (ptr)
+        {
+            static_cast<PlutoSingleBlockAllocator*>(inst)->size = size;
+            return ptr;
+        }
+        throw std::bad_alloc{};
+    }
+
+    static void* reallocateImpl(memAllocator* inst, void* addr, size_t new_size) /* SOUP_EXCAL */
+    {
+        //printf("resize %zu to %zu\n", static_cast<PlutoSingleBlockAllocator*>(inst)->size, new_size);
+        addr = luaM_realloc_(static_cast<PlutoSingleBlockAllocator*>(inst)->L, addr, static_cast<PlutoSingleBlockAllocator*>(inst)->size, new_size);
+        SOUP_IF_LIKELY (addr)
+        {
+            static_cast<PlutoSingleBlockAllocator*>(inst)->size = new_size;
+            return addr;
+        }
+        throw std::bad_alloc{};
+    }
+
+    static void deallocateImpl(memAllocator* inst, void* addr) noexcept
+    {
+        luaM_free_(static_cast<PlutoSingleBlockAllocator*>(inst)->L, addr, static_cast<PlutoSingleBlockAllocator*>(inst)->size);
+    }
+};
+#endif
+
+struct PlutoBuffer
+{
+#ifdef PLUTO_MEMORY_LIMIT
+    PlutoSingleBlockAllocator allocator;
+#endif
+    soup::Buffer<> buffer;
+
+    /* Set for views created by buffer:slice, which own no memory and instead refer to 'length' bytes of 'parent' at 'offset'. */
+    PlutoBuffer* parent = nullptr;
+    size_t offset = 0;
+    size_t length = 0;
+
+    PlutoBuffer()
+#ifdef PLUTO_MEMORY_LIMIT
+        : buffer(allocator)
+#endif
+    {
+    }
+
+    [[nodiscard]] uint8_t* data() noexcept
+    {
+        return parent ? parent->buffer.data() + offset : buffer.data();
+    }
+
+    /* A view is clamped to what is left of its parent, which may have shrunk since the view was created. */
+    [[nodiscard]] size_t size() const noexcept
+    {
+        if (parent)
+        {
+            const size_t avail = parent->buffer.size();
+            return offset >= avail ? 0 : std::min(length, avail - offset);
+        }
+        return buffer.size();
+    }
+};
+
+[[nodiscard]] inline PlutoBuffer* checkbuffer (lua_State *L, int i) {
+  const auto buf = (PlutoBuffer*)luaL_checkudata(L, i, "pluto:buffer");
+#ifdef PLUTO_MEMORY_LIMIT
+  buf->allocator.L = L;
+#endif
+  return buf;
+}
+
+[[nodiscard]] inline PlutoBuffer* testbuffer (lua_State *L, int i) {
+  const auto buf = (PlutoBuffer*)luaL_testudata(L, i, "pluto:buffer");
+#ifdef PLUTO_MEMORY_LIMIT
+  if (buf)
+    buf->allocator.L = L;
+#endif
+  return buf;
+}
+
+/* Gets the bytes of a string or buffer at index i, or nullptr if it is neither. */
+[[nodiscard]] inline const char* tobytes (lua_State *L, int i, size_t *len) {
+  if (const auto buf = testbuffer(L, i)) {
+    *len = buf->size();
+    return buf->data() ? (const char*)buf->data() : "";
+  }
+  return lua_type(L, i) == LUA_TSTRING ? lua_tolstring(L, i, len) : nullptr;
+}
+
+/* Like tobytes, but raises an error if the value is neither a string nor a buffer. Numbers are converted like luaL_checklstring does. */
+[[nodiscard]] inline const char* checkbytes (lua_State *L, int i, size_t *len) {
+  if (const auto buf = testbuffer(L, i)) {
+    *len = buf->size();
+    return buf->data() ? (const char*)buf->data() : "";
+  }
+  return luaL_checklstring(L, i, len);
+}
+
+/* Pushes a new, empty buffer onto the stack. Defined in lbufferlib.cpp. */
+PlutoBuffer* pushbuffer (lua_State *L);
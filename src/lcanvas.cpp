@@ -2,7 +2,19 @@
 #include "lualib.h"
 #include "llimits.h" // l_unlikely
 
+#include <algorithm> // min, max
+#include <cmath> // round
+#include <cstdlib> // abs
+#include <cstring> // memcmp, memcpy
+#include <string>
+#include <vector>
+
+#include "lbufferlib.hpp"
+#include "ldeflate.hpp"
+
 #include "vendor/Soup/soup/Canvas.hpp"
+#include "vendor/Soup/soup/crc32.hpp"
+#include "vendor/Soup/soup/deflate.hpp"
 #include "vendor/Soup/soup/MemoryRefReader.hpp"
 #include "vendor/Soup/soup/QrCode.hpp"
 
@@ -28,6 +40,220 @@ static void pushcanvas (lua_State *L, soup::Canvas&& canvas) {
   lua_setmetatable(L, -2);
 }
 
+/*
+** PNG. Canvases are written as 8-bit RGB with a filter chosen per scanline and real DEFLATE compression.
+** Reading accepts every standard colour type and bit depth, interlaced or not; alpha is dropped.
+*/
+
+static_assert(sizeof(soup::Rgb) == 3);
+
+static const char png_signature[8] = { '\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n' };
+
+enum PngFilter { PNG_NONE, PNG_SUB, PNG_UP, PNG_AVERAGE, PNG_PAETH, PNG_ADAPTIVE };
+
+static uint8_t paeth (int a, int b, int c) {
+  const int p = a + b - c;
+  const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return (uint8_t)a;
+  return (uint8_t)(pb <= pc ? b : c);
+}
+
+/* Filters a scanline; 'prior' is the unfiltered previous scanline (all zeros for the first). */
+static void filterrow (int filter, const uint8_t *row, const uint8_t *prior, size_t len, size_t bpp, uint8_t *out) {
+  for (size_t i = 0; i != len; ++i) {
+    const int a = i >= bpp ? row[i - bpp] : 0;
+    const int b = prior[i];
+    const int c = i >= bpp ? prior[i - bpp] : 0;
+    switch (filter) {
+      case PNG_NONE: out[i] = row[i]; break;
+      case PNG_SUB: out[i] = (uint8_t)(row[i] - a); break;
+      case PNG_UP: out[i] = (uint8_t)(row[i] - b); break;
+      case PNG_AVERAGE: out[i] = (uint8_t)(row[i] - ((a + b) >> 1)); break;
+      default: out[i] = (uint8_t)(row[i] - paeth(a, b, c)); break;
+    }
+  }
+}
+
+/* Reverses filterrow in place. */
+static bool unfilterrow (int filter, uint8_t *row, const uint8_t *prior, size_t len, size_t bpp) {
+  for (size_t i = 0; i != len; ++i) {
+    const int a = i >= bpp ? row[i - bpp] : 0;
+    const int b = prior[i];
+    const int c = i >= bpp ? prior[i - bpp] : 0;
+    switch (filter) {
+      case PNG_NONE: break;
+      case PNG_SUB: row[i] = (uint8_t)(row[i] + a); break;
+      case PNG_UP: row[i] = (uint8_t)(row[i] + b); break;
+      case PNG_AVERAGE: row[i] = (uint8_t)(row[i] + ((a + b) >> 1)); break;
+      case PNG_PAETH: row[i] = (uint8_t)(row[i] + paeth(a, b, c)); break;
+      default: return false;
+    }
+  }
+  return true;
+}
+
+static void appendbe32 (std::string& out, uint32_t v) {
+  for (int shift = 24; shift >= 0; shift -= 8)
+    out.push_back((char)((v >> shift) & 0xff));
+}
+
+[[nodiscard]] static uint32_t readbe32 (const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void appendpngchunk (std::string& out, const char *type, const std::string& data) {
+  appendbe32(out, (uint32_t)data.size());
+  const size_t start = out.size();
+  out.append(type, 4);
+  out.append(data);
+  appendbe32(out, soup::crc32::hash((const uint8_t*)out.data() + start, out.size() - start));
+}
+
+static std::string topng (const soup::Canvas& c, int level, int filter) {
+  const size_t stride = (size_t)c.width * 3;
+  std::string raw((stride + 1) * c.height, '\0');
+  std::vector<uint8_t> zeros(stride, 0), trial(stride);
+  for (size_t y = 0; y != c.height; ++y) {
+    const uint8_t *row = (const uint8_t*)c.pixels.data() + y * stride;
+    const uint8_t *prior = (y == 0 ? zeros.data() : row - stride);
+    auto dst = (uint8_t*)raw.data() + y * (stride + 1);
+    if (filter != PNG_ADAPTIVE) {
+      dst[0] = (uint8_t)filter;
+      filterrow(filter, row, prior, stride, 3, dst + 1);
+      continue;
+    }
+    /* minimum sum of absolute differences: the usual heuristic for picking a filter per scanline */
+    uint64_t best = UINT64_MAX;
+    for (int f = PNG_NONE; f != PNG_ADAPTIVE; ++f) {
+      filterrow(f, row, prior, stride, 3, trial.data());
+      uint64_t score = 0;
+      for (uint8_t b : trial)
+        score += (uint64_t)abs((int8_t)b);
+      if (score < best) {
+        best = score;
+        dst[0] = (uint8_t)f;
+        memcpy(dst + 1, trial.data(), stride);
+      }
+    }
+  }
+  std::string ihdr;
+  appendbe32(ihdr, c.width);
+  appendbe32(ihdr, c.height);
+  ihdr.append("\x08\x02\x00\x00\x00", 5);  /* 8-bit RGB, deflate, adaptive filtering, not interlaced */
+  std::string idat;
+  DeflateEncoder(idat).zlib((const uint8_t*)raw.data(), raw.size(), level);
+  std::string out(png_signature, sizeof(png_signature));
+  appendpngchunk(out, "IHDR", ihdr);
+  appendpngchunk(out, "IDAT", idat);
+  appendpngchunk(out, "IEND", {});
+  return out;
+}
+
+static bool frompng (const uint8_t *p, size_t size, soup::Canvas& c) {
+  if (size < sizeof(png_signature) || memcmp(p, png_signature, sizeof(png_signature)) != 0)
+    return false;
+  uint32_t width = 0, height = 0;
+  uint8_t depth = 0, colour = 0, interlace = 0;
+  std::string palette, compressed;
+  bool ended = false;
+  for (size_t i = sizeof(png_signature); !ended; ) {
+    if (size - i < 12)
+      return false;
+    const uint32_t len = readbe32(p + i);
+    if (len > size - i - 12)
+      return false;
+    const uint8_t *type = p + i + 4, *data = p + i + 8;
+    if (soup::crc32::hash(type, len + 4) != readbe32(data + len))
+      return false;
+    if (memcmp(type, "IHDR", 4) == 0) {
+      if (len != 13 || data[10] != 0 || data[11] != 0 || data[12] > 1)
+        return false;
+      width = readbe32(data);
+      height = readbe32(data + 4);
+      depth = data[8];
+      colour = data[9];
+      interlace = data[12];
+    }
+    else if (memcmp(type, "PLTE", 4) == 0)
+      palette.assign((const char*)data, len);
+    else if (memcmp(type, "IDAT", 4) == 0)
+      compressed.append((const char*)data, len);
+    else if (memcmp(type, "IEND", 4) == 0)
+      ended = true;
+    i += 12 + (size_t)len;
+  }
+  int channels;
+  switch (colour) {
+    case 0: channels = 1; if (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16) return false; break;
+    case 2: channels = 3; if (depth != 8 && depth != 16) return false; break;
+    case 3: channels = 1; if (depth != 1 && depth != 2 && depth != 4 && depth != 8) return false; break;
+    case 4: channels = 2; if (depth != 8 && depth != 16) return false; break;
+    case 6: channels = 4; if (depth != 8 && depth != 16) return false; break;
+    default: return false;
+  }
+  if (width == 0 || height == 0 || (uint64_t)width * height > 0x10000000 || (colour == 3 && palette.empty()))
+    return false;
+  static constexpr uint8_t adam7[7][4] = {  /* x start, y start, x step, y step */
+    { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 }, { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 }
+  };
+  static constexpr uint8_t whole[1][4] = { { 0, 0, 1, 1 } };
+  const auto passes = interlace ? adam7 : whole;
+  const int npasses = interlace ? 7 : 1;
+  const size_t pixelbits = (size_t)channels * depth;
+  const size_t bpp = pixelbits < 8 ? 1 : pixelbits / 8;
+  auto passwidth = [&](int k) { return width > passes[k][0] ? (width - passes[k][0] + passes[k][2] - 1) / passes[k][2] : 0; };
+  auto passheight = [&](int k) { return height > passes[k][1] ? (height - passes[k][1] + passes[k][3] - 1) / passes[k][3] : 0; };
+  size_t expected = 0;
+  for (int k = 0; k != npasses; ++k)
+    if (passwidth(k) != 0)
+      expected += (size_t)passheight(k) * (1 + (passwidth(k) * pixelbits + 7) / 8);
+  auto inflated = soup::deflate::decompress(compressed.data(), compressed.size(), expected);
+  if (inflated.decompressed.size() < expected || inflated.checksum_mismatch)
+    return false;
+  c = soup::Canvas(width, height);
+  const uint32_t maxsample = (1u << std::min<int>(depth, 8)) - 1;
+  auto raw = (uint8_t*)inflated.decompressed.data();
+  for (int k = 0; k != npasses; ++k) {
+    const uint32_t pw = passwidth(k), ph = passheight(k);
+    if (pw == 0)
+      continue;
+    const size_t stride = (pw * pixelbits + 7) / 8;
+    std::vector<uint8_t> zeros(stride, 0);
+    const uint8_t *prior = zeros.data();
+    for (uint32_t y = 0; y != ph; ++y, raw += stride + 1) {
+      uint8_t *row = raw + 1;
+      if (!unfilterrow(raw[0], row, prior, stride, bpp))
+        return false;
+      prior = row;
+      for (uint32_t x = 0; x != pw; ++x) {
+        /* first byte of each sample; for 16-bit samples, that is the most significant one */
+        auto sample = [&](int ch) -> uint32_t {
+          if (depth >= 8)
+            return row[(x * channels + ch) * (depth / 8)];
+          const size_t bit = (size_t)x * depth;
+          return (row[bit / 8] >> (8 - depth - bit % 8)) & maxsample;
+        };
+        soup::Rgb px;
+        if (colour == 3) {
+          const size_t idx = sample(0);
+          if (idx * 3 + 3 > palette.size())
+            return false;
+          px = soup::Rgb((uint8_t)palette[idx * 3], (uint8_t)palette[idx * 3 + 1], (uint8_t)palette[idx * 3 + 2]);
+        }
+        else if (colour == 0 || colour == 4) {
+          const auto v = (uint8_t)(sample(0) * 255 / maxsample);
+          px = soup::Rgb(v, v, v);
+        }
+        else
+          px = soup::Rgb((uint8_t)sample(0), (uint8_t)sample(1), (uint8_t)sample(2));
+        c.set(passes[k][0] + x * passes[k][2], passes[k][1] + y * passes[k][3], px);
+      }
+    }
+  }
+  return true;
+}
+
 static int canvas_new (lua_State* L) {
   const auto width = luaL_checkinteger(L, 1);
   const auto height = luaL_checkinteger(L, 2);
@@ -43,6 +269,16 @@ static int canvas_bmp (lua_State *L) {
   return 1;
 }
 
+static int canvas_png (lua_State *L) {
+  size_t size;
+  const char *data = luaL_checklstring(L, 1, &size);
+  soup::Canvas c;
+  if (l_unlikely(!frompng((const uint8_t*)data, size, c)))
+    luaL_error(L, "invalid or unsupported png");
+  pushcanvas(L, std::move(c));
+  return 1;
+}
+
 static int canvas_qrcode (lua_State *L) {
   size_t size;
   const char *data = luaL_checklstring(L, 1, &size);
@@ -131,13 +367,353 @@ static int canvas_mulsize (lua_State *L) {
   return 0;
 }
 
+/*
+** Bulk operations. Pixels are stored as contiguous RGB bytes, so these work on whole rows of bytes
+** in plain loops that the compiler vectorises, instead of going through get/set per pixel.
+*/
+
+[[nodiscard]] static uint8_t *pixelptr (soup::Canvas& c, size_t x, size_t y) {
+  return (uint8_t*)c.pixels.data() + (y * c.width + x) * 3;
+}
+
+[[nodiscard]] static unsigned checkalpha (lua_State *L, lua_Integer alpha) {
+  if (l_unlikely(alpha < 0 || alpha > 255))
+    luaL_error(L, "alpha must be between 0 and 255");
+  return (unsigned)alpha;
+}
+
+/* Fills n pixels with a colour by doubling the filled part. */
+static void fillpixels (uint8_t *dst, size_t n, soup::Rgb colour) {
+  if (n == 0)
+    return;
+  memcpy(dst, colour.arr, 3);
+  for (size_t done = 1; done != n; ) {
+    const size_t k = std::min(done, n - done);
+    memcpy(dst + done * 3, dst, k * 3);
+    done += k;
+  }
+}
+
+/* dst = (src * alpha + dst * (255 - alpha)) / 255, rounded. */
+static void blendbytes (uint8_t *dst, const uint8_t *src, size_t n, unsigned alpha) {
+  const uint16_t a = (uint16_t)alpha, inv = (uint16_t)(255 - alpha);
+  for (size_t i = 0; i != n; ++i) {
+    const uint16_t t = (uint16_t)(src[i] * a + dst[i] * inv + 128);
+    dst[i] = (uint8_t)((t + (t >> 8)) >> 8);
+  }
+}
+
+/* Clips the span [pos, pos + len) to [0, limit). Returns false if nothing is left. */
+[[nodiscard]] static bool clipspan (lua_Integer& pos, lua_Integer& len, lua_Integer limit, lua_Integer *skipped = nullptr) {
+  if (len <= 0 || pos >= limit || pos <= -len)  /* empty, or entirely outside? */
+    return false;
+  lua_Integer skip = 0;
+  if (pos < 0) {
+    skip = -pos;  /* less than 'len', so this cannot overflow */
+    len -= skip;
+    pos = 0;
+  }
+  if (len > limit - pos)
+    len = limit - pos;
+  if (skipped)
+    *skipped = skip;
+  return true;
+}
+
+/*
+** Clips the segment from (x0, y0) to (x1, y1) to [0, w) x [0, h) using Liang-Barsky, rounding the new endpoints to
+** pixels. Returns false if the segment misses the canvas.
+*/
+[[nodiscard]] static bool clipline (lua_Integer& x0, lua_Integer& y0, lua_Integer& x1, lua_Integer& y1, size_t w, size_t h) {
+  if (w == 0 || h == 0)
+    return false;
+  const double fx0 = (double)x0, fy0 = (double)y0;
+  const double dx = (double)x1 - fx0, dy = (double)y1 - fy0;
+  const double p[4] = { -dx, dx, -dy, dy };
+  const double q[4] = { fx0, (double)(w - 1) - fx0, fy0, (double)(h - 1) - fy0 };
+  double t0 = 0.0, t1 = 1.0;
+  for (int i = 0; i != 4; ++i) {
+    if (p[i] == 0.0) {  /* parallel to this edge */
+      if (q[i] < 0.0)
+        return false;
+    }
+    else {
+      const double r = q[i] / p[i];
+      if (p[i] < 0.0)
+        t0 = std::max(t0, r);
+      else
+        t1 = std::min(t1, r);
+    }
+  }
+  if (t0 > t1)
+    return false;
+  const auto topixel = [](double v, size_t limit) {
+    return (lua_Integer)std::clamp(std::round(v), 0.0, (double)(limit - 1));
+  };
+  const lua_Integer nx0 = topixel(fx0 + t0 * dx, w), ny0 = topixel(fy0 + t0 * dy, h);
+  x1 = topixel(fx0 + t1 * dx, w);
+  y1 = topixel(fy0 + t1 * dy, h);
+  x0 = nx0;
+  y0 = ny0;
+  return true;
+}
+
+/* canvas:getrow(y, [x, [width]]): the pixels as a string of RGB bytes. */
+static int canvas_getrow (lua_State *L) {
+  const auto c = checkcanvas(L, 1);
+  const auto y = luaL_checkinteger(L, 2);
+  const auto x = luaL_optinteger(L, 3, 0);
+  const auto n = luaL_optinteger(L, 4, (lua_Integer)c->width - x);
+  if (l_unlikely(y < 0 || (lua_Unsigned)y >= c->height || x < 0 || n < 0 || (lua_Unsigned)x + (lua_Unsigned)n > c->width))
+    luaL_error(L, "out of bounds");
+  lua_pushlstring(L, (const char*)pixelptr(*c, (size_t)x, (size_t)y), (size_t)n * 3);
+  return 1;
+}
+
+/* canvas:setrow(y, data, [x]): sets pixels from a string or buffer of RGB bytes. */
+static int canvas_setrow (lua_State *L) {
+  const auto c = checkcanvas(L, 1);
+  const auto y = luaL_checkinteger(L, 2);
+  const char *data;
+  size_t size;
+  if (const auto buf = testbuffer(L, 3)) {
+    data = (const char*)buf->data();
+    size = buf->size();
+  }
+  else
+    data = luaL_checklstring(L, 3, &size);
+  const auto x = luaL_optinteger(L, 4, 0);
+  luaL_argcheck(L, size % 3 == 0, 3, "length must be a multiple of 3");
+  if (l_unlikely(y < 0 || (lua_Unsigned)y >= c->height || x < 0 || (lua_Unsigned)x + size / 3 > c->width))
+    luaL_error(L, "out of bounds");
+  memcpy(pixelptr(*c, (size_t)x, (size_t)y), data, size);
+  return 0;
+}
+
+static void fillrect (soup::Canvas& c, lua_Integer x, lua_Integer y, lua_Integer w, lua_Integer h, soup::Rgb colour, unsigned alpha) {
+  if (alpha == 0 || !clipspan(x, w, c.width) || !clipspan(y, h, c.height))
+    return;
+  const size_t bytes = (size_t)w * 3;
+  if (alpha == 255) {
+    uint8_t *first = pixelptr(c, (size_t)x, (size_t)y);
+    fillpixels(first, (size_t)w, colour);
+    for (lua_Integer row = 1; row != h; ++row)
+      memcpy(pixelptr(c, (size_t)x, (size_t)(y + row)), first, bytes);
+  }
+  else {
+    std::vector<uint8_t> solid(bytes);
+    fillpixels(solid.data(), (size_t)w, colour);
+    for (lua_Integer row = 0; row != h; ++row)
+      blendbytes(pixelptr(c, (size_t)x, (size_t)(y + row)), solid.data(), bytes, alpha);
+  }
+}
+
+/* canvas:rect(x, y, width, height, colour, [alpha]): a filled rectangle, clipped to the canvas. */
+static int canvas_rect (lua_State *L) {
+  const auto c = checkcanvas(L, 1);
+  const auto x = luaL_checkinteger(L, 2);
+  const auto y = luaL_checkinteger(L, 3);
+  const auto w = luaL_checkinteger(L, 4);
+  const auto h = luaL_checkinteger(L, 5);
+  const auto colour = soup::Rgb(static_cast<uint32_t>(luaL_checkinteger(L, 6)));
+  fillrect(*c, x, y, w, h, colour, checkalpha(L, luaL_optinteger(L, 7, 255)));
+  return 0;
+}
+
+/* canvas:line(x0, y0, x1, y1, colour, [alpha]): a line between two points, clipped to the canvas. */
+static int canvas_line (lua_State *L) {
+  const auto c = checkcanvas(L, 1);
+  auto x0 = luaL_checkinteger(L, 2);
+  auto y0 = luaL_checkinteger(L, 3);
+  auto x1 = luaL_checkinteger(L, 4);
+  auto y1 = luaL_checkinteger(L, 5);
+  const auto colour = soup::Rgb(static_cast<uint32_t>(luaL_checkinteger(L, 6)));
+  const unsigned alpha = checkalpha(L, luaL_optinteger(L, 7, 255));
+  if (y0 == y1 || x0 == x1) {  /* axis-aligned lines are rectangles */
+    /* only the part within one pixel of the canvas matters, which keeps the lengths from overflowing */
+    const auto clamp = [](lua_Integer v, size_t limit) { return std::clamp<lua_Integer>(v, -1, (lua_Integer)limit); };
+    const lua_Integer xa = clamp(std::min(x0, x1), c->width), xb = clamp(std::max(x0, x1), c->width);
+    const lua_Integer ya = clamp(std::min(y0, y1), c->height), yb = clamp(std::max(y0, y1), c->height);
+    fillrect(*c, xa, ya, xb - xa + 1, yb - ya + 1, colour, alpha);
+    return 0;
+  }
+  if (alpha == 0)
+    return 0;
+  if ((x0 < 0 || y0 < 0 || (lua_Unsigned)x0 >= c->width || (lua_Unsigned)y0 >= c->height ||
+       x1 < 0 || y1 < 0 || (lua_Unsigned)x1 >= c->width || (lua_Unsigned)y1 >= c->height) &&
+      !clipline(x0, y0, x1, y1, c->width, c->height))
+    return 0;
+  /* both endpoints are now on the canvas, so nothing below can overflow */
+  /* Bresenham */
+  const lua_Integer dx = x1 > x0 ? x1 - x0 : x0 - x1, sx = x0 < x1 ? 1 : -1;
+  const lua_Integer dy = -(y1 > y0 ? y1 - y0 : y0 - y1), sy = y0 < y1 ? 1 : -1;
+  for (lua_Integer err = dx + dy; ; ) {
+    if (x0 >= 0 && y0 >= 0 && (lua_Unsigned)x0 < c->width && (lua_Unsigned)y0 < c->height) {
+      uint8_t *p = pixelptr(*c, (size_t)x0, (size_t)y0);
+      if (alpha == 255)
+        memcpy(p, colour.arr, 3);
+      else
+        blendbytes(p, colour.arr, 3, alpha);
+    }
+    if (x0 == x1 && y0 == y1)
+      break;
+    const lua_Integer e2 = 2 * err;
+    if (e2 >= dy) {
+      err += dy;
+      x0 += sx;
+    }
+    if (e2 <= dx) {
+      err += dx;
+      y0 += sy;
+    }
+  }
+  return 0;
+}
+
+/*
+** canvas:blit(src, x, y, [options]): copies src onto this canvas at x, y, clipped. Options are 'alpha' and the
+** source region 'sx', 'sy', 'width' and 'height'.
+*/
+static int canvas_blit (lua_State *L) {
+  const auto c = checkcanvas(L, 1);
+  const auto src = checkcanvas(L, 2);
+  auto x = luaL_checkinteger(L, 3);
+  auto y = luaL_checkinteger(L, 4);
+  lua_Integer sx = 0, sy = 0, w = src->width, h = src->height;
+  unsigned alpha = 255;
+  if (!lua_isnoneornil(L, 5)) {
+    luaL_checktype(L, 5, LUA_TTABLE);
+    lua_settop(L, 5);
+    if (lua_getfield(L, 5, "sx") > LUA_TNIL) sx = luaL_checkinteger(L, -1);
+    if (lua_getfield(L, 5, "sy") > LUA_TNIL) sy = luaL_checkinteger(L, -1);
+    if (lua_getfield(L, 5, "width") > LUA_TNIL) w = luaL_checkinteger(L, -1);
+    if (lua_getfield(L, 5, "height") > LUA_TNIL) h = luaL_checkinteger(L, -1);
+    if (lua_getfield(L, 5, "alpha") > LUA_TNIL) alpha = checkalpha(L, luaL_checkinteger(L, -1));
+  }
+  lua_Integer skip;
+  /* clip the source region to the source, then the destination to this canvas */
+  if (!clipspan(sx, w, src->width, &skip))
+    return 0;
+  x = luaL_intop(+, x, skip);  /* wraps only if 'x' is far off the canvas, where it stays */
+  if (!clipspan(sy, h, src->height, &skip))
+    return 0;
+  y = luaL_intop(+, y, skip);
+  if (alpha == 0 || !clipspan(x, w, c->width, &skip))
+    return 0;
+  sx += skip;
+  if (!clipspan(y, h, c->height, &skip))
+    return 0;
+  sy += skip;
+  const size_t bytes = (size_t)w * 3;
+  /* when blitting within one canvas, go through the rows in an order that doesn't overwrite unread ones */
+  const bool up = (c == src && y > sy);
+  for (lua_Integer k = 0; k != h; ++k) {
+    const lua_Integer row = up ? h - 1 - k : k;
+    uint8_t *d = pixelptr(*c, (size_t)x, (size_t)(y + row));
+    const uint8_t *s = pixelptr(*src, (size_t)sx, (size_t)(sy + row));
+    if (alpha == 255)
+      memmove(d, s, bytes);
+    else if (c != src || y != sy || x <= sx)
+      blendbytes(d, s, bytes, alpha);
+    else {
+      std::vector<uint8_t> tmp(s, s + bytes);
+      blendbytes(d, tmp.data(), bytes, alpha);
+    }
+  }
+  return 0;
+}
+
+/* Maps each of 'to' cells onto the range of the 'from' cells it covers, at least one. */
+[[nodiscard]] static std::vector<std::pair<size_t, size_t>> resizeranges (size_t from, size_t to) {
+  std::vector<std::pair<size_t, size_t>> ranges(to);
+  for (size_t i = 0; i != to; ++i) {
+    const size_t a = (size_t)((uint64_t)i * from / to);
+    const size_t b = (size_t)((uint64_t)(i + 1) * from / to);
+    ranges[i] = { a, std::max(b, a + 1) };
+  }
+  return ranges;
+}
+
+/* Area-averaging resize, done as a horizontal and then a vertical pass. */
+[[nodiscard]] static soup::Canvas resizeaveraged (soup::Canvas& src, unsigned int w, unsigned int h) {
+  soup::Canvas tmp(w, src.height);
+  const auto xs = resizeranges(src.width, w);
+  for (size_t y = 0; y != src.height; ++y) {
+    const uint8_t *in = pixelptr(src, 0, y);
+    uint8_t *out = pixelptr(tmp, 0, y);
+    for (size_t x = 0; x != w; ++x) {
+      const auto [a, b] = xs[x];
+      const uint32_t n = (uint32_t)(b - a);
+      uint32_t sum[3] = {};
+      for (size_t k = a; k != b; ++k)
+        for (int ch = 0; ch != 3; ++ch)
+          sum[ch] += in[k * 3 + ch];
+      for (int ch = 0; ch != 3; ++ch)
+        out[x * 3 + ch] = (uint8_t)((sum[ch] + n / 2) / n);
+    }
+  }
+  soup::Canvas c(w, h);
+  const auto ys = resizeranges(src.height, h);
+  const size_t bytes = (size_t)w * 3;
+  std::vector<uint32_t> sum(bytes);
+  for (size_t y = 0; y != h; ++y) {
+    const auto [a, b] = ys[y];
+    const uint32_t n = (uint32_t)(b - a);
+    std::fill(sum.begin(), sum.end(), n / 2);
+    for (size_t k = a; k != b; ++k) {
+      const uint8_t *in = pixelptr(tmp, 0, k);
+      for (size_t i = 0; i != bytes; ++i)
+        sum[i] += in[i];
+    }
+    uint8_t *out = pixelptr(c, 0, y);
+    for (size_t i = 0; i != bytes; ++i)
+      out[i] = (uint8_t)(sum[i] / n);
+  }
+  return c;
+}
+
+/* canvas:resize(width, height): scales the contents to any size, averaging the pixels each new pixel covers. */
+static int canvas_resize (lua_State *L) {
+  const auto c = checkcanvas(L, 1);
+  const auto w = luaL_checkinteger(L, 2);
+  const auto h = luaL_checkinteger(L, 3);
+  if (l_unlikely(w < 1 || h < 1 || w > 0xffff || h > 0xffff))
+    luaL_error(L, "size must be between 1 and 65535");
+  if (c->width == 0 || c->height == 0)  /* nothing to average over */
+    *c = soup::Canvas((unsigned int)w, (unsigned int)h);
+  else
+    *c = resizeaveraged(*c, (unsigned int)w, (unsigned int)h);
+  return 0;
+}
+
 static int canvas_tobmp (lua_State* L) {
   pluto_pushstring(L, checkcanvas(L, 1)->toBmp());
   return 1;
 }
 
+/* canvas:topng([options]): options are 'level' (0-9, default 6) and 'filter' (default "adaptive"). */
 static int canvas_topng (lua_State* L) {
-  pluto_pushstring(L, checkcanvas(L, 1)->toPng());
+  const auto c = checkcanvas(L, 1);
+  int level = 6;
+  int filter = PNG_ADAPTIVE;
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    lua_pushliteral(L, "level");
+    if (lua_gettable(L, 2) > LUA_TNIL) {
+      const auto l = luaL_checkinteger(L, -1);
+      if (l_unlikely(l < 0 || l > 9))
+        luaL_error(L, "level must be between 0 and 9");
+      level = (int)l;
+    }
+
+    lua_pushliteral(L, "filter");
+    if (lua_gettable(L, 2) > LUA_TNIL) {
+      const char* const options[] = { "none", "sub", "up", "average", "paeth", "adaptive", nullptr };
+      filter = luaL_checkoption(L, -1, "adaptive", options);
+    }
+  }
+  pluto_pushstring(L, topng(*c, level, filter));
   return 1;
 }
 
@@ -149,12 +725,19 @@ static int canvas_tobwstring(lua_State* L) {
 static const luaL_Reg funcs_canvas[] = {
   {"new", canvas_new},
   {"bmp", canvas_bmp},
+  {"png", canvas_png},
   {"qrcode", canvas_qrcode},
   {"get", canvas_get},
   {"set", canvas_set},
   {"fill", canvas_fill},
   {"size", canvas_size},
   {"mulsize", canvas_mulsize},
+  {"resize", canvas_resize},
+  {"getrow", canvas_getrow},
+  {"setrow", canvas_setrow},
+  {"rect", canvas_rect},
+  {"line", canvas_line},
+  {"blit", canvas_blit},
   {"tobmp", canvas_tobmp},
   {"topng", canvas_topng},
   {"tobwstring", canvas_tobwstring},
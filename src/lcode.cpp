@@ -15,6 +15,8 @@
 #include <math.h>
 #include <stdlib.h>
 
+#include <vector>
+
 #include "lua.h"
 
 #include "lcode.h"
@@ -1435,6 +1437,21 @@ static int isSCint (expdesc *e) {
 }
 
 
+/* Is 't' a number type that type-specialised instructions can use? */
+static int isnumprimitive (ValType t) {
+  return (t == VT_INT || t == VT_FLT);
+}
+
+
+/* Numerals know their own type. */
+static void numeralprimitive (expdesc *e) {
+  if (e->k == VKINT)
+    e->code_primitive = VT_INT;
+  else if (e->k == VKFLT)
+    e->code_primitive = VT_FLT;
+}
+
+
 /*
 ** Check whether expression 'e' is a literal integer or float in
 ** proper range to fit in a register (sB or sC).
@@ -1617,10 +1634,78 @@ static void codeunexpval (FuncState *fs, OpCode op, expdesc *e, int line) {
   freeexp(fs, e);
   e->u.pc = luaK_codeABC(fs, op, 0, r, 0);  /* generate opcode */
   e->k = VRELOC;  /* all those operations are relocatable */
+  if (op == OP_BNOT && isnumprimitive(e->code_primitive))
+    e->code_primitive = VT_INT;
+  else if (op != OP_UNM || !isnumprimitive(e->code_primitive))
+    e->code_primitive = VT_NONE;
   luaK_fixline(fs, line);
 }
 
 
+/*
+** Type-specialised variant of 'op' for operands whose types are known
+** (usually from type hints) to be 't1' and 't2', or 'op' itself. The
+** variants check the types at runtime, so wrong hints only cost speed.
+*/
+static OpCode specialiseop (OpCode op, ValType t1, ValType t2) {
+#ifndef PLUTO_NO_SUPERINSTRUCTIONS
+  if (t1 == VT_INT && t2 == VT_INT) {
+    switch (op) {
+      case OP_ADD: return OP_ADD_INT;
+      case OP_SUB: return OP_SUB_INT;
+      case OP_MUL: return OP_MUL_INT;
+      case OP_EQ: return OP_EQ_INT;
+      case OP_LT: return OP_LT_INT;
+      case OP_LE: return OP_LE_INT;
+      default: break;
+    }
+  }
+  else if (t1 == VT_FLT && t2 == VT_FLT) {
+    switch (op) {
+      case OP_ADD: return OP_ADD_FLT;
+      case OP_SUB: return OP_SUB_FLT;
+      case OP_MUL: return OP_MUL_FLT;
+      case OP_DIV: return OP_DIV_FLT;
+      case OP_LT: return OP_LT_FLT;
+      case OP_LE: return OP_LE_FLT;
+      default: break;
+    }
+  }
+  if (t1 == VT_FLT && isnumprimitive(t2)) {  /* constant operand may be either */
+    switch (op) {
+      case OP_ADDK: return OP_ADDK_FLT;
+      case OP_SUBK: return OP_SUBK_FLT;
+      case OP_MULK: return OP_MULK_FLT;
+      case OP_DIVK: return OP_DIVK_FLT;
+      default: break;
+    }
+  }
+#else
+  (void)t1; (void)t2;
+#endif
+  return op;
+}
+
+
+/*
+** Type of the result of arithmetic opcode 'op' over numbers of types
+** 't1' and 't2'.
+*/
+static ValType arithresult (OpCode op, ValType t1, ValType t2) {
+  if (!isnumprimitive(t1) || !isnumprimitive(t2))
+    return VT_NONE;
+  switch (op) {
+    case OP_POWK: case OP_DIVK: case OP_POW: case OP_DIV:
+      return VT_FLT;
+    case OP_BANDK: case OP_BORK: case OP_BXORK: case OP_SHLI: case OP_SHRI:
+    case OP_BAND: case OP_BOR: case OP_BXOR: case OP_SHL: case OP_SHR:
+      return VT_INT;
+    default:
+      return (t1 == VT_INT && t2 == VT_INT) ? VT_INT : VT_FLT;
+  }
+}
+
+
 /*
 ** Emit code for binary expressions that "produce values"
 ** (everything but logical operators 'and'/'or' and comparison
@@ -1631,10 +1716,12 @@ static void finishbinexpval (FuncState *fs, expdesc *e1, expdesc *e2,
                              OpCode op, int v2, int flip, int line,
                              OpCode mmop, TMS event) {
   int v1 = luaK_exp2anyreg(fs, e1);
-  int pc = luaK_codeABCk(fs, op, 0, v1, v2, 0);
+  ValType t1 = e1->code_primitive, t2 = e2->code_primitive;
+  int pc = luaK_codeABCk(fs, specialiseop(op, t1, t2), 0, v1, v2, 0);
   freeexps(fs, e1, e2);
   e1->u.pc = pc;
   e1->k = VRELOC;  /* all those operations are relocatable */
+  e1->code_primitive = arithresult(op, t1, t2);
   luaK_fixline(fs, line);
   luaK_codeABCk(fs, mmop, v1, v2, cast_int(event), flip);  /* metamethod */
   luaK_fixline(fs, line);
@@ -1793,11 +1880,13 @@ static void codeorder (FuncState *fs, BinOpr opr, expdesc *res, expdesc *e1, exp
   else {  /* regular case, compare two registers */
     r1 = luaK_exp2anyreg(fs, e1);
     r2 = luaK_exp2anyreg(fs, e2);
-    op = binopr2op(opr, OPR_LT, OP_LT);
+    op = specialiseop(binopr2op(opr, OPR_LT, OP_LT),
+                      e1->code_primitive, e2->code_primitive);
   }
   freeexps(fs, e1, e2);
   res->u.pc = condjump(fs, op, r1, r2, isfloat, 1);
   res->k = VJMP;
+  res->code_primitive = VT_BOOL;
 }
 
 
@@ -1839,13 +1928,14 @@ static void codeeq (FuncState *fs, BinOpr opr, expdesc *e1, expdesc *e2) {
     op = OP_EQK;
     r2 = e2->u.info;  /* constant index */
   }
-  else {
-    op = OP_EQ;  /* will compare two registers */
+  else {  /* will compare two registers */
     r2 = luaK_exp2anyreg(fs, e2);
+    op = specialiseop(OP_EQ, e1->code_primitive, e2->code_primitive);
   }
   freeexps(fs, e1, e2);
   e1->u.pc = condjump(fs, op, r1, r2, isfloat, (opr == OPR_EQ));
   e1->k = VJMP;
+  e1->code_primitive = VT_BOOL;
 }
 
 
@@ -1964,39 +2054,8 @@ void luaK_posfix (FuncState *fs, BinOpr opr,
   luaK_dischargevars(fs, e2);
   if (foldbinop(opr) && constfolding(fs, cast_int(opr + LUA_OPADD), e1, e2))
     return;  /* done by folding */
-  if (e1->k == VNONRELOC && e1->code_primitive == VT_INT) { /* lefthand operand is an integer? */
-    switch (opr) { /* optimise operation if possible */
-      case OPR_MOD: {
-        if (e2->k == VKINT && luaispow2(e2->u.ival)) { /* modulo a constant power of 2? */
-          opr = OPR_BAND;
-          --e2->u.ival;
-        }
-        break;
-      }
-      case OPR_IDIV: {
-        if (e2->k == VKINT && luaispow2(e2->u.ival)) { /* IDIV by a constant power of 2? */
-          opr = OPR_SHR;
-          e2->u.ival = (lua_Integer)log2((double)e2->u.ival);
-        }
-        break;
-      }
-      case OPR_SHL: {
-        if (e2->k == VKINT && e2->u.ival == 1) { /* left shift 1 bit? */
-          opr = OPR_ADD;
-          *e2 = *e1;
-        }
-        break;
-      }
-      case OPR_POW: {
-        if (e2->k == VKINT && e2->u.ival == 2) { /* to the power of 2? */
-          opr = OPR_MUL;
-          *e2 = *e1;
-        }
-        break;
-      }
-      default: break;
-    }
-  }
+  numeralprimitive(e1);
+  numeralprimitive(e2);
   switch (opr) { /* finalise code */
     case OPR_AND: {
       lua_assert(e1->t == NO_JUMP);  /* list closed by 'luaK_infix' */
@@ -2007,18 +2066,24 @@ void luaK_posfix (FuncState *fs, BinOpr opr,
     case OPR_OR: {
       lua_assert(e1->f == NO_JUMP);  /* list closed by 'luaK_infix' */
       luaK_concat(fs, &e2->t, e1->t);
+      ValType t1 = e1->code_primitive;
       *e1 = *e2;
+      if (e1->code_primitive != t1)  /* may be either operand */
+        e1->code_primitive = VT_NONE;
       break;
     }
     case OPR_COAL: {
       luaK_exp2reg(fs, e2, e1->u.reg);
       luaK_patchtohere(fs, e1->u.pc);
       e1->k = VNONRELOC;
+      if (e1->code_primitive != e2->code_primitive)
+        e1->code_primitive = VT_NONE;
       break;
     }
     case OPR_CONCAT: {  /* e1 .. e2 */
       luaK_exp2nextreg(fs, e2);
       codeconcat(fs, e1, e2, line);
+      e1->code_primitive = VT_STR;
       break;
     }
     case OPR_ADD: case OPR_MUL: {
@@ -2136,6 +2201,532 @@ static int finaltarget (Instruction *code, int i) {
 }
 
 
+/*
+** {======================================================================
+** Optimization pass, enabled by 'pluto_use optimize' or 'plutoc -O'.
+** It only rewrites code in ways that keep the observable behaviour:
+** registers that are written exactly once, by a constant load, hold
+** that constant wherever the load dominates the use, which lets
+** conditions be folded and operands be turned into constants;
+** unreachable code and jumps to the next instruction are then removed.
+** =======================================================================
+*/
+
+/* instructions whose fast path skips the next instruction */
+static int skipsnext (OpCode op) {
+  op = luaP_baseop(op);
+  return testTMode(op) || op == OP_LFALSESKIP || (OP_ADDI <= op && op <= OP_SHR);
+}
+
+
+/* Collects the instructions that may run after 'i'; returns how many. */
+static int successors (const Instruction *code, int n, int i, int *succ) {
+  Instruction ins = code[i];
+  OpCode op = luaP_baseop(GET_OPCODE(ins));
+  int ns = 0;
+  switch (op) {
+    case OP_JMP:
+      succ[ns++] = i + 1 + GETARG_sJ(ins);
+      break;
+    case OP_RETURN: case OP_RETURN0: case OP_RETURN1:
+      break;
+    case OP_FORPREP: {  /* to the body, or past the matching OP_FORLOOP */
+      int dest = i + 1 + GETARG_Bx(ins);
+      succ[ns++] = i + 1;
+      succ[ns++] = dest;  /* the loop instruction is kept with its loop */
+      succ[ns++] = dest + 1;
+      break;
+    }
+    case OP_TFORPREP:
+      succ[ns++] = i + 1 + GETARG_Bx(ins);
+      break;
+    case OP_FORLOOP: case OP_TFORLOOP:
+      succ[ns++] = i + 1;
+      succ[ns++] = i + 1 - GETARG_Bx(ins);
+      break;
+    default:
+      /* OP_LFALSESKIP always skips, but its next instruction must stay */
+      succ[ns++] = i + 1;
+      if (skipsnext(op))
+        succ[ns++] = i + 2;
+      break;
+  }
+  int j = 0;
+  for (int k = 0; k < ns; k++) {
+    if (succ[k] < n)
+      succ[j++] = succ[k];
+  }
+  return j;
+}
+
+
+/*
+** Registers written by 'ins' are 'first' to 'last' (none if 'last' is
+** smaller). Calls also overwrite everything above their base with the
+** frame of the callee.
+*/
+static void writtenregs (Instruction ins, int maxreg, int *first, int *last) {
+  int a = GETARG_A(ins);
+  OpCode op = luaP_baseop(GET_OPCODE(ins));
+  *first = a;
+  switch (op) {
+    case OP_MOVE: case OP_LOADI: case OP_LOADF: case OP_LOADK: case OP_LOADKX:
+    case OP_LOADFALSE: case OP_LFALSESKIP: case OP_LOADTRUE:
+    case OP_GETUPVAL: case OP_GETTABUP: case OP_GETTABLE: case OP_GETI:
+    case OP_GETFIELD: case OP_NEWTABLE: case OP_UNM: case OP_BNOT: case OP_NOT:
+    case OP_LEN: case OP_CLOSURE: case OP_GETVARG: case OP_IN: case OP_TESTSET:
+      *last = a;
+      break;
+    case OP_LOADNIL:
+      *last = a + GETARG_B(ins);
+      break;
+    case OP_SELF:
+      *last = a + 1;
+      break;
+    case OP_CONCAT:
+      *last = a + GETARG_B(ins) - 1;
+      break;
+    case OP_FORPREP: case OP_FORLOOP:
+      *last = a + 2;
+      break;
+    case OP_CALL: case OP_TAILCALL: case OP_VARARG:
+    case OP_TFORPREP: case OP_TFORCALL: case OP_TFORLOOP:
+      *last = maxreg;
+      break;
+    case OP_SETUPVAL: case OP_SETTABUP: case OP_SETTABLE: case OP_SETI:
+    case OP_SETFIELD: case OP_SETLIST: case OP_MMBIN: case OP_MMBINI:
+    case OP_MMBINK: case OP_CLOSE: case OP_TBC: case OP_JMP: case OP_EQ:
+    case OP_LT: case OP_LE: case OP_EQK: case OP_EQI: case OP_LTI: case OP_LEI:
+    case OP_GTI: case OP_GEI: case OP_TEST: case OP_RETURN: case OP_RETURN0:
+    case OP_RETURN1: case OP_ERRNNIL: case OP_VARARGPREP: case OP_EXTRAARG:
+      *last = a - 1;
+      break;
+    default:
+      if (OP_ADDI <= op && op <= OP_SHR)
+        *last = a;
+      else {  /* unknown; assume the worst */
+        *first = 0;
+        *last = maxreg;
+      }
+      break;
+  }
+}
+
+
+/*
+** Returns whether instruction 'i' loads a constant, putting it in 'v'
+** and its index in 'k' in 'kidx' (-1 if it is not there).
+*/
+static int loadedconstant (FuncState *fs, int i, TValue *v, int *kidx) {
+  const Proto *p = fs->f;
+  Instruction ins = p->code[i];
+  *kidx = -1;
+  switch (GET_OPCODE(ins)) {
+    case OP_LOADI: setivalue(v, GETARG_sBx(ins)); return 1;
+    case OP_LOADF: setfltvalue(v, cast_num(GETARG_sBx(ins))); return 1;
+    case OP_LOADFALSE: setbfvalue(v); return 1;
+    case OP_LOADTRUE: setbtvalue(v); return 1;
+    case OP_LOADNIL: setnilvalue(v); return 1;
+    case OP_LOADK: *kidx = GETARG_Bx(ins); break;
+    case OP_LOADKX: *kidx = GETARG_Ax(p->code[i + 1]); break;
+    default: return 0;
+  }
+  setobj(fs->ls->L, v, &p->k[*kidx]);
+  return 1;
+}
+
+
+/* Returns the index of 'v' in the constants, adding it if needed. */
+static int constindex (FuncState *fs, TValue *v, int known) {
+  if (known >= 0)
+    return known;
+  switch (ttypetag(v)) {
+    case LUA_VNUMINT: return luaK_intK(fs, ivalue(v));
+    case LUA_VNUMFLT: return luaK_numberK(fs, fltvalue(v));
+    case LUA_VFALSE: return boolF(fs);
+    case LUA_VTRUE: return boolT(fs);
+    case LUA_VNIL: return nilK(fs);
+    default: return -1;  /* strings always come from 'k' */
+  }
+}
+
+
+/* A jump to 'offset' instructions after the next one. */
+static Instruction makejump (int offset) {
+  return CREATE_sJ(OP_JMP, offset + OFFSET_sJ, 0);
+}
+
+
+/*
+** Folds a conditional instruction whose condition is known: it either
+** skips the jump that follows it, or lets it run.
+*/
+static Instruction foldcond (int cond, int k) {
+  return makejump(cond != k ? 1 : 0);
+}
+
+
+/* Compares a known number with an immediate operand. */
+static int compareimm (OpCode op, const TValue *v, int imm, int *cond) {
+  if (ttisinteger(v)) {
+    lua_Integer i = ivalue(v);
+    switch (op) {
+      case OP_LTI: *cond = (i < imm); return 1;
+      case OP_LEI: *cond = (i <= imm); return 1;
+      case OP_GTI: *cond = (i > imm); return 1;
+      case OP_GEI: *cond = (i >= imm); return 1;
+      default: return 0;
+    }
+  }
+  else if (ttisfloat(v)) {
+    lua_Number f = fltvalue(v);
+    lua_Number fi = cast_num(imm);
+    switch (op) {
+      case OP_LTI: *cond = luai_numlt(f, fi); return 1;
+      case OP_LEI: *cond = luai_numle(f, fi); return 1;
+      case OP_GTI: *cond = luai_numgt(f, fi); return 1;
+      case OP_GEI: *cond = luai_numge(f, fi); return 1;
+      default: return 0;
+    }
+  }
+  return 0;  /* would call a metamethod or raise an error */
+}
+
+
+struct RegConst {
+  int writer = -1;  /* only instruction writing the register, or -1 */
+  int nwrites = 0;
+  bool captured = false;  /* an upvalue of a nested function? */
+  std::vector<char> undominated;  /* reachable without passing 'writer' */
+};
+
+
+/* Marks the instructions reachable from the entry without passing 'skip'. */
+static void reachable (const Instruction *code, int n, int skip,
+                       std::vector<char> &seen) {
+  seen.assign(n, 0);
+  std::vector<int> stack;
+  if (skip != 0) {
+    seen[0] = 1;
+    stack.push_back(0);
+  }
+  while (!stack.empty()) {
+    int i = stack.back();
+    stack.pop_back();
+    int succ[3];
+    int ns = successors(code, n, i, succ);
+    for (int k = 0; k < ns; k++) {
+      if (succ[k] != skip && !seen[succ[k]]) {
+        seen[succ[k]] = 1;
+        stack.push_back(succ[k]);
+      }
+    }
+  }
+}
+
+
+/*
+** Returns whether register 'reg' holds a known constant at instruction
+** 'use', putting it in 'v' and its index in 'k' (or -1) in 'kidx'.
+*/
+static int knownconst (FuncState *fs, std::vector<RegConst> &regs,
+                       int reg, int use, TValue *v, int *kidx) {
+  if (reg >= cast_int(regs.size()))
+    return 0;
+  RegConst &rc = regs[reg];
+  if (rc.captured || rc.nwrites != 1 || rc.writer < 0 || rc.writer == use)
+    return 0;
+  if (!loadedconstant(fs, rc.writer, v, kidx))
+    return 0;
+  if (rc.undominated.empty())
+    reachable(fs->f->code, fs->pc, rc.writer, rc.undominated);
+  return !rc.undominated[use];
+}
+
+
+static int propagateconstants (FuncState *fs) {
+  Proto *p = fs->f;
+  Instruction *code = p->code;
+  const int n = fs->pc;
+  const int maxreg = p->maxstacksize;
+  std::vector<RegConst> regs(maxreg + 1);
+  for (int c = 0; c < fs->np; c++) {
+    const Proto *np = p->p[c];
+    for (int u = 0; u < np->sizeupvalues; u++) {
+      if (np->upvalues[u].instack && np->upvalues[u].idx <= maxreg)
+        regs[np->upvalues[u].idx].captured = true;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    int first, last;
+    writtenregs(code[i], maxreg, &first, &last);
+    for (int r = first; r <= last && r <= maxreg; r++) {
+      regs[r].nwrites++;
+      regs[r].writer = i;
+    }
+  }
+  for (auto &rc : regs) {
+    TValue v;
+    int kidx;
+    if (rc.nwrites == 1 && !loadedconstant(fs, rc.writer, &v, &kidx))
+      rc.writer = -1;
+  }
+  int changed = 0;
+  TValue va, vb;
+  int ka, kb;
+  for (int i = 0; i < n; i++) {
+    Instruction ins = code[i];
+    OpCode op = GET_OPCODE(ins);
+    int a = GETARG_A(ins);
+    Instruction folded = ins;
+    switch (op) {
+      case OP_NOT: {
+        if (knownconst(fs, regs, GETARG_B(ins), i, &vb, &kb))
+          folded = CREATE_ABCk(l_isfalse(&vb) ? OP_LOADTRUE : OP_LOADFALSE,
+                               a, 0, 0, 0);
+        break;
+      }
+      case OP_LEN: {
+        if (knownconst(fs, regs, GETARG_B(ins), i, &vb, &kb) &&
+            ttisstring(&vb) && fitsBx(cast(lua_Integer, tsslen(tsvalue(&vb)))))
+          folded = CREATE_ABx(OP_LOADI, a,
+                              cast_int(tsslen(tsvalue(&vb))) + OFFSET_sBx);
+        break;
+      }
+      case OP_TEST: {
+        if (knownconst(fs, regs, a, i, &va, &ka))
+          folded = foldcond(!l_isfalse(&va), GETARG_k(ins));
+        break;
+      }
+      case OP_TESTSET: {
+        if (knownconst(fs, regs, GETARG_B(ins), i, &vb, &kb)) {
+          if (l_isfalse(&vb) == GETARG_k(ins))
+            folded = makejump(1);  /* skips the jump */
+          else  /* assigns and jumps */
+            folded = CREATE_ABCk(OP_MOVE, a, GETARG_B(ins), 0, 0);
+        }
+        break;
+      }
+      case OP_EQK: {
+        if (knownconst(fs, regs, a, i, &va, &ka))
+          folded = foldcond(luaV_rawequalobj(&va, &p->k[GETARG_B(ins)]),
+                            GETARG_k(ins));
+        break;
+      }
+      case OP_EQI: {
+        if (knownconst(fs, regs, a, i, &va, &ka)) {
+          int cond = 0;
+          int imm = GETARG_sB(ins);
+          if (ttisinteger(&va))
+            cond = (ivalue(&va) == imm);
+          else if (ttisfloat(&va))
+            cond = luai_numeq(fltvalue(&va), cast_num(imm));
+          folded = foldcond(cond, GETARG_k(ins));
+        }
+        break;
+      }
+      case OP_LTI: case OP_LEI: case OP_GTI: case OP_GEI: {
+        int cond;
+        if (knownconst(fs, regs, a, i, &va, &ka) &&
+            compareimm(op, &va, GETARG_sB(ins), &cond))
+          folded = foldcond(cond, GETARG_k(ins));
+        break;
+      }
+      case OP_EQ: case OP_LT: case OP_LE: {
+        int b = GETARG_B(ins);
+        int k = GETARG_k(ins);
+        int hasa = knownconst(fs, regs, a, i, &va, &ka);
+        int hasb = knownconst(fs, regs, b, i, &vb, &kb);
+        if (hasa && hasb) {
+          if (op == OP_EQ)
+            folded = foldcond(luaV_rawequalobj(&va, &vb), k);
+          else if (ttisinteger(&va) && ttisinteger(&vb))
+            folded = foldcond(op == OP_LT ? ivalue(&va) < ivalue(&vb)
+                                          : ivalue(&va) <= ivalue(&vb), k);
+          else if (ttisfloat(&va) && ttisfloat(&vb))
+            folded = foldcond(op == OP_LT ? luai_numlt(fltvalue(&va), fltvalue(&vb))
+                                          : luai_numle(fltvalue(&va), fltvalue(&vb)), k);
+        }
+        else if (hasb || hasa) {  /* compare a register with a constant */
+          int reg = hasb ? a : b;
+          TValue *v = hasb ? &vb : &va;
+          int kidx = hasb ? kb : ka;
+          if (ttisinteger(v) && fitsC(ivalue(v))) {
+            int imm = int2sC(cast_int(ivalue(v)));
+            if (op == OP_EQ)
+              folded = CREATE_ABCk(OP_EQI, reg, imm, 0, k);
+            else if (op == OP_LT)
+              folded = CREATE_ABCk(hasb ? OP_LTI : OP_GTI, reg, imm, 0, k);
+            else
+              folded = CREATE_ABCk(hasb ? OP_LEI : OP_GEI, reg, imm, 0, k);
+          }
+          else if (op == OP_EQ) {
+            kidx = constindex(fs, v, kidx);
+            if (kidx >= 0 && kidx <= MAXARG_B)
+              folded = CREATE_ABCk(OP_EQK, reg, kidx, 0, k);
+          }
+        }
+        break;
+      }
+      case OP_GETTABLE: {
+        int c = GETARG_C(ins);
+        if (knownconst(fs, regs, c, i, &vb, &kb)) {
+          if (ttisshrstring(&vb) && kb >= 0 && kb <= MAXARG_C)
+            folded = CREATE_ABCk(OP_GETFIELD, a, GETARG_B(ins), kb, 0);
+          else if (ttisinteger(&vb) && l_castS2U(ivalue(&vb)) <= l_castS2U(MAXARG_C))
+            folded = CREATE_ABCk(OP_GETI, a, GETARG_B(ins), cast_int(ivalue(&vb)), 0);
+        }
+        break;
+      }
+      case OP_SETTABLE: case OP_SETI: case OP_SETFIELD: case OP_SETTABUP: {
+        int b = GETARG_B(ins);
+        int c = GETARG_C(ins);
+        int k = GETARG_k(ins);
+        if (!k && knownconst(fs, regs, c, i, &vb, &kb)) {  /* value */
+          kb = constindex(fs, &vb, kb);
+          if (kb >= 0 && kb <= MAXARG_C) {
+            c = kb;
+            k = 1;
+          }
+        }
+        if (op == OP_SETTABLE && knownconst(fs, regs, b, i, &va, &ka)) {  /* key */
+          if (ttisshrstring(&va) && ka >= 0 && ka <= MAXARG_B) {
+            op = OP_SETFIELD;
+            b = ka;
+          }
+          else if (ttisinteger(&va) && l_castS2U(ivalue(&va)) <= l_castS2U(MAXARG_B)) {
+            op = OP_SETI;
+            b = cast_int(ivalue(&va));
+          }
+        }
+        folded = CREATE_ABCk(op, a, b, c, k);
+        break;
+      }
+      case OP_ADD: case OP_SUB: case OP_MUL: case OP_MOD: case OP_POW:
+      case OP_DIV: case OP_IDIV: case OP_BAND: case OP_BOR: case OP_BXOR: {
+        int b = GETARG_B(ins);
+        int c = GETARG_C(ins);
+        if (i + 1 >= n || GET_OPCODE(code[i + 1]) != OP_MMBIN ||
+            !knownconst(fs, regs, c, i, &vb, &kb) || !ttisnumber(&vb))
+          break;
+        int event = GETARG_C(code[i + 1]);
+        if (op >= OP_BAND && !ttisinteger(&vb))
+          break;  /* bitwise operations take integer constants only */
+        if (op == OP_ADD && ttisinteger(&vb) && fitsC(ivalue(&vb))) {
+          int imm = int2sC(cast_int(ivalue(&vb)));
+          code[i] = CREATE_ABCk(OP_ADDI, a, b, imm, 0);
+          code[i + 1] = CREATE_ABCk(OP_MMBINI, b, imm, event, 0);
+          changed = 1;
+          break;
+        }
+        kb = constindex(fs, &vb, kb);
+        if (kb < 0 || kb > MAXARG_C)
+          break;
+        code[i] = CREATE_ABCk(cast(OpCode, OP_ADDK + (op - OP_ADD)), a, b, kb, 0);
+        code[i + 1] = CREATE_ABCk(OP_MMBINK, b, kb, event, 0);
+        changed = 1;
+        break;
+      }
+      default: break;
+    }
+    if (folded != ins) {
+      code[i] = folded;
+      changed = 1;
+    }
+  }
+  return changed;
+}
+
+
+/*
+** Removes unreachable instructions and jumps to the next instruction,
+** then fixes jump offsets, line information and variable ranges.
+*/
+static int removedeadcode (FuncState *fs) {
+  Proto *p = fs->f;
+  Instruction *code = p->code;
+  const int n = fs->pc;
+  for (int i = 0; i < n; i++) {  /* jumps to jumps go to the final target */
+    if (GET_OPCODE(code[i]) == OP_JMP)
+      fixjump(fs, i, finaltarget(code, i));
+  }
+  std::vector<char> keep;
+  reachable(code, n, -1, keep);
+  int removed = 0;
+  for (int i = 0; i < n; i++) {
+    if (keep[i] && GET_OPCODE(code[i]) == OP_JMP && GETARG_sJ(code[i]) == 0 &&
+        !(i > 0 && keep[i - 1] && skipsnext(GET_OPCODE(code[i - 1]))))
+      keep[i] = 0;  /* jump to the next instruction */
+    removed += !keep[i];
+  }
+  if (removed == 0)
+    return 0;
+  /* absolute line of each instruction */
+  std::vector<int> lines(n);
+  int line = p->linedefined;
+  int abs = 0;
+  for (int i = 0; i < n; i++) {
+    if (p->lineinfo[i] == ABSLINEINFO)
+      line = p->abslineinfo[abs++].line;
+    else
+      line += p->lineinfo[i];
+    lines[i] = line;
+  }
+  std::vector<int> newpc(n + 1);
+  int np = 0;
+  for (int i = 0; i < n; i++) {
+    newpc[i] = np;
+    np += keep[i];
+  }
+  newpc[n] = np;
+  for (int i = 0; i < n; i++) {
+    if (!keep[i])
+      continue;
+    Instruction *ins = &code[i];
+    int from = newpc[i] + 1;
+    switch (GET_OPCODE(*ins)) {
+      case OP_JMP:
+        SETARG_sJ(*ins, newpc[i + 1 + GETARG_sJ(*ins)] - from);
+        break;
+      case OP_FORPREP: case OP_TFORPREP:
+        SETARG_Bx(*ins, newpc[i + 1 + GETARG_Bx(*ins)] - from);
+        break;
+      case OP_FORLOOP: case OP_TFORLOOP:
+        SETARG_Bx(*ins, from - newpc[i + 1 - GETARG_Bx(*ins)]);
+        break;
+      default: break;
+    }
+  }
+  fs->nabslineinfo = 0;
+  fs->iwthabs = 0;
+  fs->previousline = p->linedefined;
+  fs->pc = 0;
+  for (int i = 0; i < n; i++) {
+    if (keep[i]) {
+      code[fs->pc++] = code[i];
+      savelineinfo(fs, p, lines[i]);
+    }
+  }
+  for (int v = 0; v < fs->ndebugvars; v++) {
+    p->locvars[v].startpc = newpc[p->locvars[v].startpc];
+    p->locvars[v].endpc = newpc[p->locvars[v].endpc];
+  }
+  return 1;
+}
+
+
+static void optimize (FuncState *fs) {
+  for (int round = 0; round < 4; round++) {
+    int changed = propagateconstants(fs);
+    changed |= removedeadcode(fs);
+    if (!changed)
+      break;
+  }
+}
+
+/* }====================================================================== */
+
+
 /*
 ** Do a final pass over the code of a function, doing small peephole
 ** optimizations and adjustments.
@@ -2183,6 +2774,9 @@ void luaK_finish (FuncState *fs) {
       default: break;
     }
   }
+  if (fs->ls->optimize)
+    optimize(fs);
+  luaP_fuse(p->code, fs->pc);
 }
 
 
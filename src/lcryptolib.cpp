@@ -10,6 +10,7 @@
 #include "lauxlib.h"
 #include "lstring.h"
 #include "lcryptolib.hpp"
+#include "lbufferlib.hpp"
 
 #include "vendor/Soup/soup/adler32.hpp"
 #include "vendor/Soup/soup/aes.hpp"
@@ -37,7 +38,7 @@ static int fnv1(lua_State *L)
   uint64_t hash     = FNV_offset_basis;
   
   size_t l;
-  const char* s = luaL_checklstring(L, 1, &l);
+  const char* s = checkbytes(L, 1, &l);
   for (; l--; ++s) {
     hash *= FNV_prime;
     hash ^= (uint8_t)*s;
@@ -50,7 +51,7 @@ static int fnv1(lua_State *L)
 
 static int fnv1a32 (lua_State *L) {
   size_t size;
-  const char *data = luaL_checklstring(L, 1, &size);
+  const char *data = checkbytes(L, 1, &size);
   uint32_t hash = 2166136261u;
   for (; size--; ++data) {
     hash ^= *reinterpret_cast<const uint8_t*>(data);
@@ -68,7 +69,7 @@ static int fnv1a(lua_State *L)
   uint64_t hash     = FNV_offset_basis;
   
   size_t l;
-  const char *s = luaL_checklstring(L, 1, &l);
+  const char *s = checkbytes(L, 1, &l);
   for (; l--; ++s) {
     hash ^= (uint8_t)*s;
     hash *= FNV_prime;
@@ -83,7 +84,7 @@ static int joaat(lua_State *L)
 {
   /* get input */
   size_t size;
-  const char* data = luaL_checklstring(L, 1, &size);
+  const char* data = checkbytes(L, 1, &size);
 
   /* do partial on input */
   size_t v3 = 0;
@@ -108,7 +109,7 @@ static int times33(lua_State *L)
   unsigned long hash = 0;
  
   size_t l;
-  const char *s = luaL_checklstring(L, 1, &l);
+  const char *s = checkbytes(L, 1, &l);
   for (; l--; ++s) {
     hash = (hash * 33) ^ (unsigned long)*s;
   }
@@ -121,7 +122,7 @@ static int times33(lua_State *L)
 static int murmur1(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = checkbytes(L, 1, &textLen);
   const auto seed = (unsigned int)luaL_optinteger(L, 2, 0);
   const auto hash = MurmurHash1Aligned(text, (int)textLen, seed);
   lua_pushinteger(L, hash);
@@ -134,7 +135,7 @@ static int murmur1(lua_State *L)
 static int murmur2(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = checkbytes(L, 1, &textLen);
   const auto seed = luaL_optinteger(L, 2, 0);
   uint32_t hash;
 
@@ -152,7 +153,7 @@ static int murmur2(lua_State *L)
 static int murmur64a(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = checkbytes(L, 1, &textLen);
   const auto seed = (uint64_t)luaL_optinteger(L, 2, 0);
   const auto hash = MurmurHash64A(text, (int)textLen, seed);
   lua_pushinteger(L, hash);
@@ -164,7 +165,7 @@ static int murmur64a(lua_State *L)
 static int murmur64b(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = checkbytes(L, 1, &textLen);
   const auto seed = (uint64_t)luaL_optinteger(L, 2, 0);
   const auto hash = MurmurHash64B(text, (int)textLen, seed);
   lua_pushinteger(L, hash);
@@ -175,7 +176,7 @@ static int murmur64b(lua_State *L)
 static int murmur2a(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = checkbytes(L, 1, &textLen);
   const auto seed = (uint32_t)luaL_optinteger(L, 2, 0);
   const auto hash = MurmurHash2A(text, (int)textLen, seed);
   lua_pushinteger(L, hash);
@@ -187,7 +188,7 @@ static int murmur2a(lua_State *L)
 static int murmur2neutral(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = checkbytes(L, 1, &textLen);
   const auto seed = (uint32_t)luaL_optinteger(L, 2, 0);
   const auto hash = MurmurHashNeutral2(text, (int)textLen, seed);
   lua_pushinteger(L, hash);
@@ -199,7 +200,7 @@ static int murmur2neutral(lua_State *L)
 static int superfasthash(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = checkbytes(L, 1, &textLen);
   const auto hash = SuperFastHash((const signed char*)text, (int)textLen);
   lua_pushinteger(L, hash);
   return 1;
@@ -237,7 +238,7 @@ static int sdbm(lua_State *L)
 static int lookup3(lua_State *L)
 {
   size_t len;
-  const auto text = luaL_checklstring(L, 1, &len);
+  const auto text = checkbytes(L, 1, &len);
   const auto hash = lookup3_impl(text, (int)len, (uint32_t)luaL_optinteger(L, 2, 0));
   lua_pushinteger(L, hash);
   return 1;
@@ -247,7 +248,7 @@ static int lookup3(lua_State *L)
 static int crc32(lua_State *L)
 {
   size_t len;
-  const auto text = luaL_checklstring(L, 1, &len);
+  const auto text = checkbytes(L, 1, &len);
   const auto hash = soup::crc32::hash((const uint8_t*)text, len, (uint32_t)luaL_optinteger(L, 2, 0));
   lua_pushinteger(L, hash);
   return 1;
@@ -257,7 +258,7 @@ static int crc32(lua_State *L)
 static int crc32c(lua_State *L)
 {
   size_t len;
-  const auto text = luaL_checklstring(L, 1, &len);
+  const auto text = checkbytes(L, 1, &len);
   const auto hash = soup::crc32c::hash((const uint8_t*)text, len, (uint32_t)luaL_optinteger(L, 2, 0));
   lua_pushinteger(L, hash);
   return 1;
@@ -269,7 +270,7 @@ static int crc32c(lua_State *L)
 static int lua(lua_State *L)
 {
   size_t l;
-  const auto text = luaL_checklstring(L, 1, &l);
+  const auto text = checkbytes(L, 1, &l);
   const auto hash = luaS_hash(text, l, (unsigned int)luaL_optinteger(L, 2, 0));
   lua_pushinteger(L, hash);
   return 1;
@@ -279,7 +280,7 @@ static int lua(lua_State *L)
 template <typename T>
 static int l_hashwithdigest (lua_State *L) {
   size_t l;
-  const char *text = luaL_checklstring(L, 1, &l);
+  const char *text = checkbytes(L, 1, &l);
   const bool binary = lua_istrue(L, 2);
 
   typename T::State st;
@@ -308,7 +309,7 @@ template <typename State>
 static int l_hmac_aux (lua_State *L) {
   size_t keylen, datalen;
   const char *key = luaL_checklstring(L, 2, &keylen);
-  const char *data = luaL_checklstring(L, 3, &datalen);
+  const char *data = checkbytes(L, 3, &datalen);
   const bool binary = lua_istrue(L, 4);
 
   State st(key, keylen);
@@ -994,7 +995,7 @@ static int l_x25519 (lua_State *L) {
 
 static int l_adler32 (lua_State *L) {
   size_t size;
-  const char *data = luaL_checklstring(L, 1, &size);
+  const char *data = checkbytes(L, 1, &size);
   lua_pushinteger(L, soup::adler32::hash(data, size));
   return 1;
 }
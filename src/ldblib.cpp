@@ -20,6 +20,14 @@
 #include "lualib.h"
 #include "llimits.h"
 
+#ifdef PLUTO_VMSTATS
+#include <algorithm> // partial_sort
+#include <tuple>
+
+#include "lstate.h"
+#include "lopnames.h"
+#endif
+
 
 /*
 ** The hook table at registry[HOOKKEY] maps threads to their current
@@ -435,6 +443,95 @@ static int db_debug (lua_State *L) {
 }
 
 
+/*
+** debug.vmstats([hotspots [, reset]]): returns the counters of builds
+** with PLUTO_VMSTATS, including the 'hotspots' most executed
+** instructions. If 'reset' is true, the counters are then cleared.
+*/
+static int db_vmstats (lua_State *L) {
+#ifdef PLUTO_VMSTATS
+  PlutoVmStats& stats = *G(L)->vmstats;
+  const lua_Integer nhot = luaL_optinteger(L, 1, 20);
+  const bool reset = lua_toboolean(L, 2);
+  unsigned long long total = 0;
+  lua_newtable(L);
+  lua_newtable(L);
+  for (int op = 0; op != NUM_OPCODES; ++op) {
+    if (stats.ops[op]) {
+      total += stats.ops[op];
+      lua_pushinteger(L, (lua_Integer)stats.ops[op]);
+      lua_setfield(L, -2, opnames[op]);
+    }
+  }
+  lua_setfield(L, -2, "ops");
+  lua_pushinteger(L, (lua_Integer)total);
+  lua_setfield(L, -2, "instructions");
+  lua_createtable(L, 0, 2);
+  lua_pushinteger(L, (lua_Integer)stats.luacalls);
+  lua_setfield(L, -2, "lua");
+  lua_pushinteger(L, (lua_Integer)stats.ccalls);
+  lua_setfield(L, -2, "c");
+  lua_setfield(L, -2, "calls");
+  lua_pushinteger(L, (lua_Integer)(stats.ops[OP_RETURN] + stats.ops[OP_RETURN0] + stats.ops[OP_RETURN1]));
+  lua_setfield(L, -2, "returns");
+  lua_pushinteger(L, (lua_Integer)stats.functions.size());
+  lua_setfield(L, -2, "functions");
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, (lua_Integer)(stats.ops[OP_GETTABUP] + stats.ops[OP_GETTABLE] + stats.ops[OP_GETI]
+                                   + stats.ops[OP_GETFIELD] + stats.ops[OP_SELF] + stats.ops[OP_GETTABUP_GETFIELD]));
+  lua_setfield(L, -2, "gets");
+  lua_pushinteger(L, (lua_Integer)stats.getfallbacks);
+  lua_setfield(L, -2, "getfallbacks");
+  lua_pushinteger(L, (lua_Integer)(stats.ops[OP_SETTABUP] + stats.ops[OP_SETTABLE] + stats.ops[OP_SETI] + stats.ops[OP_SETFIELD]));
+  lua_setfield(L, -2, "sets");
+  lua_pushinteger(L, (lua_Integer)stats.setfallbacks);
+  lua_setfield(L, -2, "setfallbacks");
+  lua_setfield(L, -2, "tables");
+  /* hot spots: (count, function, pc) */
+  std::vector<std::tuple<unsigned long long, const PlutoVmStats::Function*, int>> hot;
+  for (const auto& [p, fn] : stats.functions) {
+    for (size_t pc = 0; pc != fn->counts.size(); ++pc) {
+      if (fn->counts[pc])
+        hot.emplace_back(fn->counts[pc], fn.get(), (int)pc);
+    }
+  }
+  const size_t n = std::min<size_t>(hot.size(), (size_t)std::max<lua_Integer>(nhot, 0));
+  std::partial_sort(hot.begin(), hot.begin() + n, hot.end(), [](const auto& a, const auto& b) {
+    return std::get<0>(a) > std::get<0>(b);
+  });
+  lua_createtable(L, (int)n, 0);
+  for (size_t i = 0; i != n; ++i) {
+    const auto& [count, fn, pc] = hot[i];
+    lua_createtable(L, 0, 6);
+    lua_pushstring(L, fn->source.c_str());
+    lua_setfield(L, -2, "source");
+    lua_pushinteger(L, fn->linedefined);
+    lua_setfield(L, -2, "linedefined");
+    lua_pushinteger(L, fn->lines[pc]);
+    lua_setfield(L, -2, "line");
+    lua_pushinteger(L, pc + 1);
+    lua_setfield(L, -2, "pc");
+    lua_pushstring(L, opnames[fn->ops[pc]]);
+    lua_setfield(L, -2, "op");
+    lua_pushinteger(L, (lua_Integer)count);
+    lua_setfield(L, -2, "count");
+    lua_rawseti(L, -2, (lua_Integer)i + 1);
+  }
+  lua_setfield(L, -2, "hotspots");
+  if (reset) {
+    std::fill(std::begin(stats.ops), std::end(stats.ops), 0);
+    stats.luacalls = stats.ccalls = 0;
+    stats.getfallbacks = stats.setfallbacks = 0;
+    for (auto& [p, fn] : stats.functions)
+      std::fill(fn->counts.begin(), fn->counts.end(), 0);
+  }
+  return 1;
+#else
+  luaL_error(L, "VM statistics are not available in this build (PLUTO_VMSTATS is not defined)");
+#endif
+}
+
+
 static int db_traceback (lua_State *L) {
   int arg;
   lua_State *L1 = getthread(L, &arg);
@@ -466,6 +563,7 @@ static const luaL_Reg dblib[] = {
   {"setmetatable", db_setmetatable},
   {"setupvalue", db_setupvalue},
   {"traceback", db_traceback},
+  {"vmstats", db_vmstats},
   {NULL, NULL}
 };
 
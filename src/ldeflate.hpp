@@ -0,0 +1,503 @@
+#pragma once
+
+#include <algorithm> // min, sort
+#include <cstdint>
+#include <cstring> // memcpy
+#include <string>
+#include <vector>
+
+#include "vendor/Soup/soup/adler32.hpp"
+
+/*
+** DEFLATE (RFC 1951) compressor with a zlib (RFC 1950) wrapper. Soup only
+** decompresses, so this is what produces compressed output, e.g. for PNG.
+**
+** Matches are found with hash chains over a 32K window. From level 4 on,
+** a match is only taken if the next position doesn't have a longer one
+** (lazy matching). Each block is emitted stored, with the fixed codes or
+** with its own dynamic codes, whichever is smallest. Level 0 only stores.
+*/
+
+struct DeflateEncoder {
+  static constexpr size_t WSIZE = 0x8000;
+  static constexpr size_t WMASK = WSIZE - 1;
+  static constexpr int HASHBITS = 15;
+  static constexpr size_t MINMATCH = 3;
+  static constexpr size_t MAXMATCH = 258;
+  static constexpr size_t BLOCKTOKENS = 0x8000;
+  static constexpr size_t NONE = SIZE_MAX;
+
+  struct Token {
+    uint16_t litlen;  /* literal byte, or match length */
+    uint16_t dist;  /* 0 for a literal */
+  };
+
+  std::string& out;
+  uint64_t bitbuf = 0;
+  int bitcount = 0;
+
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  size_t maxchain = 0;
+  size_t good = 0;  /* a previous match this long only gets a quarter of the chain searched */
+  size_t maxlazy = 0;  /* matches this long are taken without looking further, or inserted fully when greedy */
+  size_t nice = 0;  /* matches this long end the search */
+  std::vector<size_t> head;
+  std::vector<size_t> prev;
+  std::vector<Token> tokens;
+  size_t blockstart = 0;  /* first input byte covered by 'tokens' */
+
+  explicit DeflateEncoder (std::string& out) : out(out) {}
+
+  /* Appends the raw DEFLATE stream for the given data at the given level (0-9). */
+  void compress (const uint8_t *in, size_t len, int level) {
+    data = in;
+    size = len;
+    blockstart = 0;
+    if (level <= 0) {
+      storeblocks(0, len, true);
+      flushbits();
+      return;
+    }
+    /* the same trade-offs as zlib */
+    static constexpr uint16_t config[10][4] = {
+      /* good, lazy, nice, chain */
+      { 0, 0, 0, 0 },
+      { 4, 4, 8, 4 },
+      { 4, 5, 16, 8 },
+      { 4, 6, 32, 32 },
+      { 4, 4, 16, 16 },
+      { 8, 16, 32, 32 },
+      { 8, 16, 128, 128 },
+      { 8, 32, 128, 256 },
+      { 32, 128, 258, 1024 },
+      { 32, 258, 258, 4096 },
+    };
+    const auto& cfg = config[std::min(level, 9)];
+    good = cfg[0];
+    maxlazy = cfg[1];
+    nice = cfg[2];
+    maxchain = cfg[3];
+    head.assign((size_t)1 << HASHBITS, NONE);
+    prev.assign(WSIZE, NONE);
+    tokens.clear();
+    tokens.reserve(BLOCKTOKENS);
+    if (level < 4)
+      greedy();
+    else
+      lazy();
+    flushblock(size, true);
+    flushbits();
+  }
+
+  /* Appends a zlib stream: header, DEFLATE data and Adler-32 of the input. */
+  void zlib (const uint8_t *in, size_t len, int level) {
+    const uint8_t flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    uint32_t hdr = (0x78 << 8) | (flevel << 6);
+    hdr += 31 - hdr % 31;
+    out.push_back((char)(hdr >> 8));
+    out.push_back((char)(hdr & 0xff));
+    compress(in, len, level);
+    const uint32_t adler = soup::adler32::hash(in, len);
+    for (int shift = 24; shift >= 0; shift -= 8)
+      out.push_back((char)((adler >> shift) & 0xff));
+  }
+
+  /* Bit output, least significant bit first. */
+
+  void bits (uint32_t v, int n) {
+    bitbuf |= (uint64_t)v << bitcount;
+    bitcount += n;
+    while (bitcount >= 8) {
+      out.push_back((char)(bitbuf & 0xff));
+      bitbuf >>= 8;
+      bitcount -= 8;
+    }
+  }
+
+  void flushbits () {
+    if (bitcount > 0)
+      out.push_back((char)(bitbuf & 0xff));
+    bitbuf = 0;
+    bitcount = 0;
+  }
+
+  /* Match finding */
+
+  [[nodiscard]] size_t hash (size_t p) const {
+    const uint32_t v = ((uint32_t)data[p] << 16) | ((uint32_t)data[p + 1] << 8) | data[p + 2];
+    return (v * 2654435761u) >> (32 - HASHBITS);
+  }
+
+  void insert (size_t p) {
+    if (p + MINMATCH <= size) {
+      const size_t h = hash(p);
+      prev[p & WMASK] = head[h];
+      head[h] = p;
+    }
+  }
+
+  /* Finds the longest earlier match for position p, which must not be inserted yet. */
+  [[nodiscard]] size_t findmatch (size_t p, size_t& dist, size_t chain) const {
+    if (p + MINMATCH > size)
+      return 0;
+    const size_t limit = std::min(MAXMATCH, size - p);
+    size_t best = MINMATCH - 1;
+    size_t cand = head[hash(p)];
+    for (; cand != NONE && p - cand <= WSIZE && chain != 0; --chain) {
+      if (data[cand + best] == data[p + best] && data[cand] == data[p]) {
+        size_t len = 0;
+        for (uint64_t x, y; len + 8 <= limit; len += 8) {  /* word at a time until the first difference */
+          memcpy(&x, data + cand + len, 8);
+          memcpy(&y, data + p + len, 8);
+          if (x != y)
+            break;
+        }
+        while (len != limit && data[cand + len] == data[p + len])
+          ++len;
+        if (len > best) {
+          best = len;
+          dist = p - cand;
+          if (len >= nice || len == limit)
+            break;
+        }
+      }
+      const size_t next = prev[cand & WMASK];
+      if (next == NONE || next >= cand)
+        break;
+      cand = next;
+    }
+    return best >= MINMATCH ? best : 0;
+  }
+
+  void literal (size_t p) {
+    tokens.push_back({ data[p], 0 });
+    if (tokens.size() == BLOCKTOKENS)
+      flushblock(p + 1, false);
+  }
+
+  void match (size_t p, size_t len, size_t dist) {
+    tokens.push_back({ (uint16_t)len, (uint16_t)dist });
+    if (tokens.size() == BLOCKTOKENS)
+      flushblock(p + len, false);
+  }
+
+  void greedy () {
+    for (size_t p = 0; p != size; ) {
+      size_t dist = 0;
+      const size_t len = findmatch(p, dist, maxchain);
+      insert(p);
+      if (len == 0) {
+        literal(p);
+        ++p;
+        continue;
+      }
+      match(p, len, dist);
+      if (len <= maxlazy)  /* long runs are cheap to skip */
+        for (size_t i = 1; i != len; ++i)
+          insert(p + i);
+      p += len;
+    }
+  }
+
+  void lazy () {
+    size_t prevlen = 0, prevdist = 0;
+    bool pending = false;  /* position p - 1 has not been emitted yet */
+    for (size_t p = 0; p != size; ) {
+      size_t dist = 0;
+      size_t len = 0;
+      if (!pending || prevlen < maxlazy)
+        len = findmatch(p, dist, (pending && prevlen >= good) ? maxchain >> 2 : maxchain);
+      insert(p);
+      if (pending) {
+        if (prevlen != 0 && len <= prevlen) {
+          match(p - 1, prevlen, prevdist);
+          for (size_t i = p + 1; i != p - 1 + prevlen; ++i)
+            insert(i);
+          p = p - 1 + prevlen;
+          pending = false;
+          continue;
+        }
+        literal(p - 1);
+      }
+      prevlen = len;
+      prevdist = dist;
+      pending = true;
+      ++p;
+    }
+    if (pending) {
+      if (prevlen != 0)
+        match(size - 1, prevlen, prevdist);
+      else
+        literal(size - 1);
+    }
+  }
+
+  /* Block output */
+
+  static constexpr uint16_t lengthbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+  };
+  static constexpr uint8_t lengthextra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+  };
+  static constexpr uint16_t distbase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+  };
+  static constexpr uint8_t distextra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+  };
+  static constexpr uint8_t clorder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+  [[nodiscard]] static int lengthcode (size_t len) {
+    return (int)(std::upper_bound(lengthbase, lengthbase + 29, (uint16_t)len) - lengthbase) - 1;
+  }
+
+  [[nodiscard]] static int distcode (size_t dist) {
+    return (int)(std::upper_bound(distbase, distbase + 30, (uint16_t)dist) - distbase) - 1;
+  }
+
+  /* Computes Huffman code lengths of at most 'maxbits' for the given frequencies. */
+  static void buildlengths (const uint32_t *freq, int n, uint8_t *lens, int maxbits) {
+    std::vector<int> syms;
+    for (int i = 0; i != n; ++i) {
+      lens[i] = 0;
+      if (freq[i] != 0)
+        syms.push_back(i);
+    }
+    if (syms.size() < 2) {
+      if (!syms.empty()) {  /* pair it up, so the code is complete */
+        lens[syms[0]] = 1;
+        lens[syms[0] == 0 ? 1 : 0] = 1;
+      }
+      return;
+    }
+    std::sort(syms.begin(), syms.end(), [freq](int a, int b) { return freq[a] < freq[b]; });
+    /* two-queue Huffman construction: leaves are 0..m-1, internal nodes follow */
+    const size_t m = syms.size();
+    std::vector<uint64_t> weight(2 * m - 1);
+    std::vector<size_t> parent(2 * m - 1);
+    for (size_t i = 0; i != m; ++i)
+      weight[i] = freq[syms[i]];
+    size_t leaf = 0, node = m;
+    for (size_t next = m; next != 2 * m - 1; ++next) {
+      size_t pick[2];
+      for (auto& c : pick)
+        c = (leaf < m && (node == next || weight[leaf] <= weight[node])) ? leaf++ : node++;
+      weight[next] = weight[pick[0]] + weight[pick[1]];
+      parent[pick[0]] = parent[pick[1]] = next;
+    }
+    std::vector<uint8_t> depth(2 * m - 1, 0);
+    int count[64] = {};
+    for (size_t i = 2 * m - 2; i-- != 0; )
+      depth[i] = (uint8_t)std::min(depth[parent[i]] + 1, 63);
+    for (size_t i = 0; i != m; ++i)
+      ++count[depth[i]];
+    /* move overlong codes to maxbits, then lengthen shorter codes until the code is complete again */
+    for (int i = maxbits + 1; i != 64; ++i) {
+      count[maxbits] += count[i];
+      count[i] = 0;
+    }
+    uint32_t total = 0;
+    for (int i = maxbits; i > 0; --i)
+      total += (uint32_t)count[i] << (maxbits - i);
+    while (total > ((uint32_t)1 << maxbits)) {
+      --count[maxbits];
+      for (int i = maxbits - 1; i > 0; --i) {
+        if (count[i] != 0) {
+          --count[i];
+          count[i + 1] += 2;
+          break;
+        }
+      }
+      --total;
+    }
+    /* least frequent symbols get the longest codes */
+    size_t k = 0;
+    for (int len = maxbits; len > 0; --len)
+      for (int c = count[len]; c != 0; --c)
+        lens[syms[k++]] = (uint8_t)len;
+  }
+
+  /* Computes canonical codes, bit-reversed for LSB-first output. */
+  static void buildcodes (const uint8_t *lens, int n, uint16_t *codes) {
+    uint16_t count[16] = {}, next[16] = {};
+    for (int i = 0; i != n; ++i)
+      ++count[lens[i]];
+    count[0] = 0;
+    for (int len = 1; len != 16; ++len)
+      next[len] = (uint16_t)((next[len - 1] + count[len - 1]) << 1);
+    for (int i = 0; i != n; ++i) {
+      if (lens[i] == 0)
+        continue;
+      uint16_t code = next[lens[i]]++, rev = 0;
+      for (int b = 0; b != lens[i]; ++b, code >>= 1)
+        rev = (uint16_t)((rev << 1) | (code & 1));
+      codes[i] = rev;
+    }
+  }
+
+  /* Run-length encodes the code lengths of a dynamic block header. Extra bits are kept in the upper byte. */
+  static void rlelengths (const uint8_t *lens, int n, std::vector<uint16_t>& rle) {
+    for (int i = 0; i != n; ) {
+      const uint8_t len = lens[i];
+      int run = 1;
+      while (i + run != n && lens[i + run] == len)
+        ++run;
+      i += run;
+      if (len == 0) {
+        while (run >= 11) {
+          const int r = std::min(run, 138);
+          rle.push_back((uint16_t)(18 | ((r - 11) << 8)));
+          run -= r;
+        }
+        if (run >= 3) {
+          rle.push_back((uint16_t)(17 | ((run - 3) << 8)));
+          run = 0;
+        }
+      }
+      else {
+        rle.push_back(len);
+        --run;
+        while (run >= 3) {
+          const int r = std::min(run, 6);
+          rle.push_back((uint16_t)(16 | ((r - 3) << 8)));
+          run -= r;
+        }
+      }
+      for (; run != 0; --run)
+        rle.push_back(len);
+    }
+  }
+
+  [[nodiscard]] static uint64_t cost (const uint32_t *lfreq, const uint8_t *llens, const uint32_t *dfreq, const uint8_t *dlens) {
+    uint64_t total = 0;
+    for (int i = 0; i != 286; ++i)
+      total += (uint64_t)lfreq[i] * (llens[i] + (i > 256 ? lengthextra[i - 257] : 0));
+    for (int i = 0; i != 30; ++i)
+      total += (uint64_t)dfreq[i] * (dlens[i] + distextra[i]);
+    return total;
+  }
+
+  void storeblocks (size_t from, size_t to, bool final) {
+    do {
+      const size_t n = std::min<size_t>(to - from, 0xffff);
+      bits((final && from + n == to) ? 1 : 0, 1);
+      bits(0, 2);
+      flushbits();
+      out.push_back((char)(n & 0xff));
+      out.push_back((char)(n >> 8));
+      out.push_back((char)(~n & 0xff));
+      out.push_back((char)((~n >> 8) & 0xff));
+      out.append((const char*)data + from, n);
+      from += n;
+    } while (from != to);
+  }
+
+  /* Emits the tokens collected for the input up to 'end'. */
+  void flushblock (size_t end, bool final) {
+    uint32_t lfreq[286] = {}, dfreq[30] = {};
+    for (const auto& t : tokens) {
+      if (t.dist == 0)
+        ++lfreq[t.litlen];
+      else {
+        ++lfreq[257 + lengthcode(t.litlen)];
+        ++dfreq[distcode(t.dist)];
+      }
+    }
+    lfreq[256] = 1;
+
+    uint8_t fixedl[288], fixedd[30];
+    memset(fixedl, 8, 144);
+    memset(fixedl + 144, 9, 112);
+    memset(fixedl + 256, 7, 24);
+    memset(fixedl + 280, 8, 8);
+    memset(fixedd, 5, 30);
+
+    uint8_t llens[286], dlens[30];
+    buildlengths(lfreq, 286, llens, 15);
+    uint32_t dfreqs[30];
+    memcpy(dfreqs, dfreq, sizeof(dfreqs));
+    if (std::count_if(dfreqs, dfreqs + 30, [](uint32_t f) { return f != 0; }) < 2) {
+      /* keep the distance code complete */
+      dfreqs[0] |= 1;
+      dfreqs[1] |= 1;
+    }
+    buildlengths(dfreqs, 30, dlens, 15);
+
+    int hlit = 286, hdist = 30;
+    while (hlit > 257 && llens[hlit - 1] == 0)
+      --hlit;
+    while (hdist > 1 && dlens[hdist - 1] == 0)
+      --hdist;
+    uint8_t all[286 + 30];
+    memcpy(all, llens, hlit);
+    memcpy(all + hlit, dlens, hdist);
+    std::vector<uint16_t> rle;
+    rlelengths(all, hlit + hdist, rle);
+    uint32_t cfreq[19] = {};
+    for (uint16_t r : rle)
+      ++cfreq[r & 0xff];
+    uint8_t clens[19];
+    buildlengths(cfreq, 19, clens, 7);
+    int hclen = 19;
+    while (hclen > 4 && clens[clorder[hclen - 1]] == 0)
+      --hclen;
+
+    uint64_t dyncost = 3 + 5 + 5 + 4 + 3 * (uint64_t)hclen + cost(lfreq, llens, dfreq, dlens);
+    for (uint16_t r : rle) {
+      const int sym = r & 0xff;
+      dyncost += clens[sym] + (sym == 16 ? 2 : sym == 17 ? 3 : sym == 18 ? 7 : 0);
+    }
+    const uint64_t fixedcost = 3 + cost(lfreq, fixedl, dfreq, fixedd);
+    const uint64_t storedcost = ((end - blockstart) + 5 * ((end - blockstart) / 0xffff + 1)) * 8 + 7;
+
+    if (storedcost <= fixedcost && storedcost <= dyncost)
+      storeblocks(blockstart, end, final);
+    else if (fixedcost <= dyncost) {
+      bits(final, 1);
+      bits(1, 2);
+      emittokens(fixedl, 288, fixedd);
+    }
+    else {
+      bits(final, 1);
+      bits(2, 2);
+      bits(hlit - 257, 5);
+      bits(hdist - 1, 5);
+      bits(hclen - 4, 4);
+      for (int i = 0; i != hclen; ++i)
+        bits(clens[clorder[i]], 3);
+      uint16_t ccodes[19];
+      buildcodes(clens, 19, ccodes);
+      for (uint16_t r : rle) {
+        const int sym = r & 0xff;
+        bits(ccodes[sym], clens[sym]);
+        if (sym >= 16)
+          bits(r >> 8, sym == 16 ? 2 : sym == 17 ? 3 : 7);
+      }
+      emittokens(llens, 286, dlens);
+    }
+    tokens.clear();
+    blockstart = end;
+  }
+
+  /* 'nlit' is 288 for the fixed code, whose canonical codes also count the two unused symbols. */
+  void emittokens (const uint8_t *llens, int nlit, const uint8_t *dlens) {
+    uint16_t lcodes[288], dcodes[30];
+    buildcodes(llens, nlit, lcodes);
+    buildcodes(dlens, 30, dcodes);
+    for (const auto& t : tokens) {
+      if (t.dist == 0) {
+        bits(lcodes[t.litlen], llens[t.litlen]);
+        continue;
+      }
+      const int lc = lengthcode(t.litlen);
+      bits(lcodes[257 + lc], llens[257 + lc]);
+      bits(t.litlen - lengthbase[lc], lengthextra[lc]);
+      const int dc = distcode(t.dist);
+      bits(dcodes[dc], dlens[dc]);
+      bits(t.dist - distbase[dc], distextra[dc]);
+    }
+    bits(lcodes[256], llens[256]);
+  }
+};
@@ -18,6 +18,7 @@
 #include "lapi.h"
 #include "lgc.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 #include "ltable.h"
 #include "lundump.h"
@@ -174,7 +175,10 @@ static void dumpCode (DumpState *D, const Proto *f) {
   dumpInt(D, f->sizecode);
   dumpAlign(D, sizeof(f->code[0]));
   lua_assert(f->code != NULL);
-  dumpVector(D, f->code, cast_uint(f->sizecode));
+  for (int i = 0; i < f->sizecode; i++) {  /* superinstructions are not dumped */
+    Instruction inst = luaP_unfuse(f->code[i]);
+    dumpVar(D, inst);
+  }
 }
 
 
@@ -264,6 +264,9 @@ Proto *luaF_newproto (lua_State *L) {
   f->lastlinedefined = 0;
   f->source = NULL;
   f->lua_vm_compatible = true;
+#ifdef PLUTO_VMSTATS
+  f->vmstats = NULL;
+#endif
   return f;
 }
 
@@ -293,6 +296,10 @@ void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->k, cast_sizet(f->sizek));
   luaM_freearray(L, f->locvars, cast_sizet(f->sizelocvars));
   luaM_freearray(L, f->upvalues, cast_sizet(f->sizeupvalues));
+#ifdef PLUTO_VMSTATS
+  if (f->vmstats)
+    G(L)->vmstats->functions.erase(f);
+#endif
   luaM_free(L, f);
 }
 
@@ -379,6 +379,7 @@ static void markmt (global_State *g) {
   int i;
   for (i=0; i < LUA_NUMTYPES; i++)
     markobjectN(g, g->mt[i]);
+  markobjectN(g, g->typed_mt);  /* compared against by the VM (see ltypedarray.hpp) */
 }
 
 
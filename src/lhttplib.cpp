@@ -3,6 +3,10 @@
 
 #include "lstate.h"
 
+#include <cstring>
+#include <string>
+
+#include "vendor/Soup/soup/deflate.hpp"
 #include "vendor/Soup/soup/DetachedScheduler.hpp"
 #include "vendor/Soup/soup/HttpRequest.hpp"
 #include "vendor/Soup/soup/HttpRequestTask.hpp"
@@ -64,6 +68,58 @@ static int await_task (lua_State *L, soup::SharedPtr<Task>&& spTask) {
 extern bool PLUTO_HTTP_REQUEST_HOOK(lua_State* L, const char* url);
 #endif
 
+/* Checks the URL at the given index and whether requests to it are allowed. */
+[[nodiscard]] static std::string checkrequesturl (lua_State *L, int idx) {
+  std::string uri = pluto_checkstring(L, idx);
+  if (uri.find_first_of("\n\r") != std::string::npos) {  /* URL contains forbidden characters? */
+    uri.clear(); uri.shrink_to_fit();  /* free memory */
+    luaL_error(L, "URL can't contain CR or LF");  /* raise error */
+  }
+
+#ifdef PLUTO_DISABLE_HTTP_COMPLETELY
+  luaL_error(L, "disallowed by content moderation policy");
+#endif
+#ifdef PLUTO_HTTP_REQUEST_HOOK
+  if (!PLUTO_HTTP_REQUEST_HOOK(L, uri.c_str()))
+    luaL_error(L, "disallowed by content moderation policy");
+#endif
+  return uri;
+}
+
+/* Applies the 'method', 'headers' and 'body' options from the table at the given index. */
+static void applyrequestoptions (lua_State *L, soup::HttpRequest& hr, int optionsidx) {
+  lua_pushliteral(L, "method");
+  if (lua_rawget(L, optionsidx) > LUA_TNIL)
+    hr.method = pluto_checkstring(L, -1);
+  lua_pop(L, 1);
+  lua_pushliteral(L, "headers");
+  if (lua_rawget(L, optionsidx) > LUA_TNIL) {
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      size_t valuelen;
+      const char *value = luaL_checklstring(L, -1, &valuelen);
+      if (strpbrk(value, "\n\r") != nullptr) {  /* header value contains forbidden characters? */
+        /* free memory */
+        hr.headers.clear(); hr.headers.shrink_to_fit();
+        hr.body.clear(); hr.body.shrink_to_fit();
+        hr.method.clear(); hr.method.shrink_to_fit();
+        hr.path.clear(); hr.path.shrink_to_fit();
+        /* raise error */
+        luaL_error(L, "header value can't contain CR or LF");
+      }
+      hr.setHeader(pluto_checkstring(L, -2), pluto_checkstring(L, -1));
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+  lua_pushliteral(L, "body");
+  if (lua_rawget(L, optionsidx) > LUA_TNIL)
+    hr.setPayload(pluto_checkstring(L, -1));
+  else if (hr.method != "GET")
+    hr.setPayload("");
+  lua_pop(L, 1);
+}
+
 static int http_request (lua_State *L) {
   std::string uri;
   int optionsidx = 0;
@@ -71,27 +127,15 @@ static int http_request (lua_State *L) {
     lua_pushliteral(L, "url");
     if (lua_rawget(L, 1) != LUA_TSTRING)
       luaL_error(L, "Table is missing 'url' option");
-    uri = pluto_checkstring(L, -1);
+    uri = checkrequesturl(L, -1);
     lua_pop(L, 1);
     optionsidx = 1;
   }
   else {
-    uri = pluto_checkstring(L, 1);
+    uri = checkrequesturl(L, 1);
     if (lua_type(L, 2) == LUA_TTABLE)
       optionsidx = 2;
   }
-  if (uri.find_first_of("\n\r") != std::string::npos) {  /* URL contains forbidden characters? */
-    uri.clear(); uri.shrink_to_fit();  /* free memory */
-    luaL_error(L, "URL can't contain CR or LF");  /* raise error */
-  }
-
-#ifdef PLUTO_DISABLE_HTTP_COMPLETELY
-  luaL_error(L, "disallowed by content moderation policy");
-#endif
-#ifdef PLUTO_HTTP_REQUEST_HOOK
-  if (!PLUTO_HTTP_REQUEST_HOOK(L, uri.c_str()))
-    luaL_error(L, "disallowed by content moderation policy");
-#endif
 
 #if SOUP_WASM
   if (!lua_isyieldable(L)) {
@@ -114,37 +158,7 @@ static int http_request (lua_State *L) {
       }
       lua_pop(L, 1);
     }
-
-    lua_pushliteral(L, "method");
-    if (lua_rawget(L, optionsidx) > LUA_TNIL)
-      hr.method = pluto_checkstring(L, -1);
-    lua_pop(L, 1);
-    lua_pushliteral(L, "headers");
-    if (lua_rawget(L, optionsidx) > LUA_TNIL) {
-      lua_pushnil(L);
-      while (lua_next(L, -2)) {
-        size_t valuelen;
-        const char *value = luaL_checklstring(L, -1, &valuelen);
-        if (strpbrk(value, "\n\r") != nullptr) {  /* header value contains forbidden characters? */
-          /* free memory */
-          hr.headers.clear(); hr.headers.shrink_to_fit();
-          hr.body.clear(); hr.body.shrink_to_fit();
-          hr.method.clear(); hr.method.shrink_to_fit();
-          hr.path.clear(); hr.path.shrink_to_fit();
-          /* raise error */
-          luaL_error(L, "header value can't contain CR or LF");
-        }
-        hr.setHeader(pluto_checkstring(L, -2), pluto_checkstring(L, -1));
-        lua_pop(L, 1);
-      }
-    }
-    lua_pop(L, 1);
-    lua_pushliteral(L, "body");
-    if (lua_rawget(L, optionsidx) > LUA_TNIL)
-      hr.setPayload(pluto_checkstring(L, -1));
-    else if (hr.method != "GET")
-      hr.setPayload("");
-    lua_pop(L, 1);
+    applyrequestoptions(L, hr, optionsidx);
   }
 
 #if SOUP_WASM
@@ -248,6 +262,351 @@ static int http_closeconnections (lua_State *L) {
   return 0;
 }
 
+#if !SOUP_WASM
+/*
+** Server and connection pool helpers. The connection handling of http.serve and http.pool is Pluto code on top
+** of pluto:socket, so it shares the state's socket reactor and scheduler; parsing and serialisation happen here.
+*/
+
+[[nodiscard]] static bool istoken (const char *s, size_t len) {
+  if (len == 0)
+    return false;
+  for (size_t i = 0; i != len; ++i) {
+    const unsigned char c = s[i];
+    if (c <= ' ' || c >= 0x7f || strchr("\"(),/:;<=>?@[\\]{}", c))
+      return false;
+  }
+  return true;
+}
+
+[[nodiscard]] static bool iequals (const char *s, size_t len, const char *lower) {
+  if (len != strlen(lower))
+    return false;
+  for (size_t i = 0; i != len; ++i) {
+    if (tolower((unsigned char)s[i]) != lower[i])
+      return false;
+  }
+  return true;
+}
+
+[[nodiscard]] static bool hastoken (std::string list, const char *token) {
+  for (auto& c : list)
+    c = (char)tolower((unsigned char)c);
+  size_t i = 0;
+  const size_t toklen = strlen(token);
+  while ((i = list.find(token, i)) != std::string::npos) {
+    const bool start = (i == 0 || list[i - 1] == ',' || list[i - 1] == ' ' || list[i - 1] == '\t');
+    const size_t end = i + toklen;
+    if (start && (end == list.size() || list[end] == ',' || list[end] == ' ' || list[end] == '\t'))
+      return true;
+    i = end;
+  }
+  return false;
+}
+
+/* Framing information gathered from the header fields of a message. */
+struct HttpFraming {
+  bool has_length = false;
+  bool chunked = false;
+  lua_Integer length = 0;
+  std::string connection;
+};
+
+/*
+** Parses the header field lines in [p, end) into the table at 'headers', combining repeated fields. Names are
+** lowercased, or given canonical casing ("Content-Type") if 'canonical' is set. Returns false if a line is malformed.
+*/
+[[nodiscard]] static bool http_parsefields (lua_State *L, const char *p, const char *const end, int headers, bool canonical, HttpFraming& f) {
+  std::string name, key;
+  while (p != end) {
+    const char *eol = (const char*)memchr(p, '\n', end - p);
+    const char *next = eol ? eol + 1 : end;
+    const char *vend = eol ? eol : end;
+    if (vend != p && vend[-1] == '\r')
+      --vend;
+    const char *const colon = (const char*)memchr(p, ':', vend - p);
+    if (!colon || !istoken(p, colon - p))
+      return false;  /* also rejects obsolete line folding */
+    name.assign(p, colon - p);
+    for (auto& c : name)
+      c = (char)tolower((unsigned char)c);
+    const char *value = colon + 1;
+    while (value != vend && (*value == ' ' || *value == '\t'))
+      ++value;
+    while (vend != value && (vend[-1] == ' ' || vend[-1] == '\t'))
+      --vend;
+    if (name == "content-length") {
+      lua_Integer n = 0;
+      if (value == vend)
+        return false;
+      for (const char *d = value; d != vend; ++d) {
+        if (*d < '0' || *d > '9' || n > (LUA_MAXINTEGER - 9) / 10)
+          return false;
+        n = n * 10 + (*d - '0');
+      }
+      if (f.has_length && n != f.length)
+        return false;
+      f.has_length = true;
+      f.length = n;
+    }
+    else if (name == "transfer-encoding") {
+      std::string te(value, vend - value);
+      for (auto& c : te)
+        c = (char)tolower((unsigned char)c);
+      if (te.size() < 7 || te.compare(te.size() - 7, 7, "chunked") != 0)
+        return false;  /* we can only find the end of a body if chunked is the final coding */
+      f.chunked = true;
+    }
+    else if (name == "connection") {
+      if (!f.connection.empty())
+        f.connection.push_back(',');
+      f.connection.append(value, vend - value);
+    }
+    key = name;
+    if (canonical)
+      soup::MimeMessage::normaliseHeaderCasingInplace(key.data(), key.size());
+    pluto_pushstring(L, key);
+    if (lua_rawget(L, headers) == LUA_TSTRING) {  /* repeated header? combine the values */
+      lua_pushliteral(L, ", ");
+      lua_pushlstring(L, value, vend - value);
+      lua_concat(L, 3);
+    }
+    else {
+      lua_pop(L, 1);
+      lua_pushlstring(L, value, vend - value);
+    }
+    pluto_pushstring(L, key);
+    lua_insert(L, -2);
+    lua_rawset(L, headers);
+    p = next;
+  }
+  return !(f.chunked && f.has_length);  /* RFC 9112 6.3: such a message must be treated as an error */
+}
+
+/*
+** Parses a request head (without the blank line that ends it) into a table with method, path, version and
+** headers, the latter keyed by lowercase name. Also returns whether the connection should close after the
+** response, and the body length, which is -1 for a chunked body. Returns nothing if the head is malformed.
+*/
+static int http_parsehead (lua_State *L) {
+  size_t len;
+  const char *head = luaL_checklstring(L, 1, &len);
+  const char *const end = head + len;
+  const char *p = head;
+  while (end - p >= 2 && p[0] == '\r' && p[1] == '\n')  /* RFC 9112 allows empty lines before the request line */
+    p += 2;
+  const char *eol = (const char*)memchr(p, '\n', end - p);
+  const char *const lineend = eol ? eol : end;
+  const char *const sp1 = (const char*)memchr(p, ' ', lineend - p);
+  if (!sp1)
+    return 0;
+  const char *const sp2 = (const char*)memchr(sp1 + 1, ' ', lineend - (sp1 + 1));
+  if (!sp2 || !istoken(p, sp1 - p) || sp2 == sp1 + 1)
+    return 0;
+  const char *version_end = (lineend != p && lineend[-1] == '\r') ? lineend - 1 : lineend;
+  if (version_end - (sp2 + 1) != 8 || memcmp(sp2 + 1, "HTTP/1.", 7) != 0 || (sp2[8] != '0' && sp2[8] != '1'))
+    return 0;
+  const bool http10 = (sp2[8] == '0');
+
+  lua_createtable(L, 0, 5);
+  lua_pushlstring(L, p, sp1 - p);
+  lua_setfield(L, -2, "method");
+  lua_pushlstring(L, sp1 + 1, sp2 - (sp1 + 1));
+  lua_setfield(L, -2, "path");
+  lua_pushlstring(L, sp2 + 1, 8);
+  lua_setfield(L, -2, "version");
+  lua_newtable(L);
+  HttpFraming f;
+  if (!http_parsefields(L, eol ? eol + 1 : end, end, lua_gettop(L), false, f))
+    return 0;
+  lua_setfield(L, -2, "headers");
+  lua_pushboolean(L, http10 ? !hastoken(f.connection, "keep-alive") : hastoken(f.connection, "close"));
+  lua_pushinteger(L, f.chunked ? -1 : f.length);
+  return 3;
+}
+
+/*
+** Parses a response head (without the blank line that ends it). Returns the status code, status text and
+** headers, whether the connection closes after this response, and the body length, which is -1 for a chunked
+** body and -2 for a body that ends when the connection does. Returns nothing if the head is malformed.
+*/
+static int http_parseresponsehead (lua_State *L) {
+  size_t len;
+  const char *head = luaL_checklstring(L, 1, &len);
+  const char *const end = head + len;
+  const char *eol = (const char*)memchr(head, '\n', len);
+  const char *lineend = eol ? eol : end;
+  if (lineend != head && lineend[-1] == '\r')
+    --lineend;
+  if (lineend - head < 12 || memcmp(head, "HTTP/1.", 7) != 0 || head[8] != ' ')
+    return 0;
+  const bool http10 = (head[7] == '0');
+  lua_Integer status = 0;
+  for (int i = 9; i != 12; ++i) {
+    if (head[i] < '0' || head[i] > '9')
+      return 0;
+    status = status * 10 + (head[i] - '0');
+  }
+  lua_pushinteger(L, status);
+  const char *text = head + 12;
+  if (text != lineend && *text == ' ')
+    ++text;
+  lua_pushlstring(L, text, lineend - text);
+  lua_newtable(L);
+  HttpFraming f;
+  if (!http_parsefields(L, eol ? eol + 1 : end, end, lua_gettop(L), true, f))
+    return 0;
+  lua_pushboolean(L, http10 ? !hastoken(f.connection, "keep-alive") : hastoken(f.connection, "close"));
+  lua_pushinteger(L, f.chunked ? -1 : (f.has_length ? f.length : -2));
+  return 5;
+}
+
+/*
+** formatrequest(url, [options, [identity]])
+** Serialises a keep-alive request the way http.request would send it, and returns it with the host, port,
+** whether to use TLS and the method. Options are the method, headers and body options of http.request. With
+** identity, the request doesn't offer to accept a compressed body.
+*/
+static int http_formatrequest (lua_State *L) {
+  soup::HttpRequest hr(soup::Uri(checkrequesturl(L, 1)));
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    applyrequestoptions(L, hr, 2);
+  }
+  hr.setKeepAlive();
+  if (lua_toboolean(L, 3))
+    hr.removeHeader("Accept-Encoding");
+  auto [host, port] = hr.getHostAndPort();
+  pluto_pushstring(L, hr.getDataToSend());
+  pluto_pushstring(L, std::move(host));
+  lua_pushinteger(L, port);
+  lua_pushboolean(L, hr.use_tls);
+  pluto_pushstring(L, hr.method);
+  return 5;
+}
+
+/* Undoes a gzip or deflate content coding. */
+static int http_inflate (lua_State *L) {
+  size_t len;
+  const char *data = luaL_checklstring(L, 1, &len);
+  auto res = soup::deflate::decompress(data, len);
+  if (l_unlikely(res.checksum_mismatch))
+    luaL_error(L, "malformed compressed response body");
+  pluto_pushstring(L, std::move(res.decompressed));
+  return 1;
+}
+
+[[nodiscard]] static const char *reasonphrase (lua_Integer status) {
+  switch (status) {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 409: return "Conflict";
+    case 410: return "Gone";
+    case 411: return "Length Required";
+    case 413: return "Content Too Large";
+    case 414: return "URI Too Long";
+    case 415: return "Unsupported Media Type";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+  }
+  return "";
+}
+
+/*
+** formatresponse(status, headers, body, close, headonly)
+** Serialises a response head and, unless headonly, the body. A nil body announces a chunked body instead.
+*/
+static int http_formatresponse (lua_State *L) {
+  const lua_Integer status = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, status >= 100 && status <= 999, 1, "invalid status code");
+  size_t bodylen = 0;
+  const char *body = luaL_optlstring(L, 3, nullptr, &bodylen);
+  const bool close = lua_toboolean(L, 4);
+  const bool headonly = lua_toboolean(L, 5);
+  const bool bodyless = (status < 200 || status == 204 || status == 304);
+
+  std::string res = "HTTP/1.1 ";
+  res.append(std::to_string(status));
+  res.push_back(' ');
+  res.append(reasonphrase(status));
+  res.append("\r\n");
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+      size_t namelen, valuelen;
+      if (l_unlikely(lua_type(L, -2) != LUA_TSTRING))  /* don't let 'lua_tolstring' convert the key 'lua_next' needs */
+        luaL_error(L, "header name must be a string, got %s", luaL_typename(L, -2));
+      const char *name = lua_tolstring(L, -2, &namelen);
+      const char *value = luaL_tolstring(L, -1, &valuelen);
+      if (l_unlikely(!istoken(name, namelen)))
+        luaL_error(L, "invalid header name: %s", name);
+      if (l_unlikely(strpbrk(value, "\r\n") != nullptr || strlen(value) != valuelen))
+        luaL_error(L, "header value can't contain CR or LF");
+      if (!iequals(name, namelen, "content-length") && !iequals(name, namelen, "transfer-encoding") && !iequals(name, namelen, "connection")) {  /* framing is our business */
+        res.append(name, namelen);
+        res.append(": ");
+        res.append(value, valuelen);
+        res.append("\r\n");
+      }
+      lua_pop(L, 2);
+    }
+  }
+  if (!bodyless) {
+    if (body) {
+      res.append("Content-Length: ");
+      res.append(std::to_string(bodylen));
+      res.append("\r\n");
+    }
+    else
+      res.append("Transfer-Encoding: chunked\r\n");
+  }
+  if (close)
+    res.append("Connection: close\r\n");
+  res.append("\r\n");
+  if (body && !headonly && !bodyless)
+    res.append(body, bodylen);
+  pluto_pushstring(L, std::move(res));
+  return 1;
+}
+
+static int http_formatchunk (lua_State *L) {
+  size_t len;
+  const char *chunk = luaL_checklstring(L, 1, &len);
+  char size[sizeof(size_t) * 2 + 3];
+  const int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+  std::string res;
+  res.reserve(n + len + 2);
+  res.append(size, n);
+  res.append(chunk, len);
+  res.append("\r\n");
+  pluto_pushstring(L, std::move(res));
+  return 1;
+}
+#endif
+
 static const luaL_Reg funcs_http[] = {
   {"request", http_request},
 #if !SOUP_WASM
@@ -257,4 +616,597 @@ static const luaL_Reg funcs_http[] = {
   {nullptr, nullptr}
 };
 
-PLUTO_NEWLIB(http);
+LUAMOD_API int luaopen_http (lua_State *L) {
+  luaL_newlib(L, funcs_http);
+
+#if !SOUP_WASM && !defined(PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO)
+  lua_pushliteral(L, "serve");
+  luaL_loadstring(L, R"EOC(
+local parsehead, formatresponse, formatchunk = ...
+return function(port, handler, opts)
+    opts ??= {}
+    local socket = require "pluto:socket"
+    local scheduler = require "pluto:scheduler"
+    local listener = socket.listen(port)
+    assert(listener, "Failed to bind port "..tostring(port))
+    local maxconnections = opts.maxconnections ?? 1024
+    local maxheadersize = opts.maxheadersize ?? 8192
+    local maxbodysize = opts.maxbodysize ?? 0x1000000
+    local keepalive = (opts.keepalive ?? 5) * 1000
+    local maxrequests = opts.maxrequests
+    local sched = opts.scheduler ?? new scheduler()
+
+    local open = true
+    local conns = {} -- socket -> when it went idle, or false while a request is being handled
+    local numconns = 0
+    local server = {}
+
+    function server:close()
+        open = false
+        listener:close()
+        for s, idle in conns do
+            if idle then
+                s:close()
+            end
+        end
+    end
+
+    function server:connections()
+        return numconns
+    end
+
+    local toolarge = {} -- raised by 'read' when a chunked body exceeds maxbodysize
+
+    local function serveconnection(s)
+        local remaining, chunked, chunkleft, bodyleft, expects100 = 0, false, 0, 0, false
+
+        -- Receives exactly n bytes in pieces of at most 64 KiB, so the sender's claims alone don't allocate anything.
+        local function recvbody(n)
+            if n <= 0x10000 then
+                return s:recvexact(n) ?? error("connection lost")
+            end
+            local pieces = {}
+            while n > 0 do
+                local piece = s:recvexact(math.min(n, 0x10000)) ?? error("connection lost")
+                pieces:insert(piece)
+                n -= #piece
+            end
+            return pieces:concat()
+        end
+
+        -- req:read([n]) returns up to n bytes of the body (all of it by default), or nil at its end.
+        local function read(_, n)
+            if expects100 then
+                expects100 = false
+                s:send("HTTP/1.1 100 Continue\r\n\r\n")
+            end
+            if chunked then
+                if chunkleft == 0 then
+                    local line = s:recvline(1024)
+                    local size = line and tonumber(line:match("^%x+"), 16)
+                    if not size or math.type(size) ~= "integer" or size < 0 then
+                        chunked = false
+                        error("malformed chunked request body")
+                    end
+                    if size > bodyleft then
+                        chunked = false
+                        error(toolarge)
+                    end
+                    bodyleft -= size
+                    if size == 0 then
+                        while (trailer := s:recvline(maxheadersize)) and trailer ~= "" do end -- trailer fields
+                        chunked = false
+                        return nil
+                    end
+                    chunkleft = size
+                end
+                local data = recvbody(math.min(n ?? chunkleft, chunkleft))
+                chunkleft -= #data
+                if chunkleft == 0 then
+                    s:recvline(2)
+                end
+                return data
+            end
+            if remaining == 0 then
+                return nil
+            end
+            local data = recvbody(math.min(n ?? remaining, remaining))
+            remaining -= #data
+            return data
+        end
+
+        local served = 0
+        while open do
+            conns[s] = os.millis()
+            local ok, head = pcall(s.recvuntil, s, "\r\n\r\n", maxheadersize)
+            if not ok then
+                s:send(formatresponse(431, nil, "", true))
+                break
+            end
+            if not head then
+                break
+            end
+            conns[s] = false
+            local req, close, length = parsehead(head)
+            if not req then
+                s:send(formatresponse(400, nil, "", true))
+                break
+            end
+            if length > maxbodysize then
+                s:send(formatresponse(413, nil, "", true))
+                break
+            end
+            ++served
+            close = close or served == maxrequests
+            chunked, chunkleft, bodyleft = length == -1, 0, maxbodysize
+            remaining = chunked ? 0 : length
+            expects100 = length ~= 0 and (req.headers.expect ?? ""):lower() == "100-continue"
+            req.read = read
+
+            local body, status, headers
+            ok, body, status, headers = pcall(handler, req)
+            if not ok then
+                if body == toolarge then
+                    body, status = "", 413
+                else
+                    warn("http.serve: handler failed: "..tostring(body))
+                    body, status = "", 500
+                end
+                headers, close = nil, true
+            end
+            close = close or not open or expects100 -- an unread body we didn't ask for can't be skipped
+            local headonly = req.method == "HEAD"
+            if type(body) == "function" and req.version == "HTTP/1.0" then
+                local chunks = {}
+                while chunk := body() do
+                    chunks:insert(chunk)
+                end
+                body = chunks:concat()
+            end
+            if type(body) == "function" then
+                s:send(formatresponse(status ?? 200, headers, nil, close, headonly))
+                if not headonly then
+                    while chunk := body() do
+                        if #chunk ~= 0 then
+                            s:send(formatchunk(chunk))
+                        end
+                    end
+                    s:send("0\r\n\r\n")
+                end
+            else
+                s:send(formatresponse(status ?? 200, headers, tostring(body ?? ""), close, headonly))
+            end
+            if close then
+                break
+            end
+            if not pcall(|| -> do
+                while read(nil, 0x10000) do end -- skip whatever the handler left unread
+            end) then
+                break
+            end
+        end
+        conns[s] = nil
+        numconns -= 1
+        s:close()
+    end
+
+    sched:add(function()
+        while s := listener:accept() do
+            ++numconns
+            conns[s] = false
+            sched:add(function()
+                serveconnection(s)
+            end)
+            while numconns >= maxconnections and open do
+                coroutine.yield()
+            end
+        end
+    end)
+
+    sched:add(function()
+        local nextsweep = 0
+        while open do
+            coroutine.yield()
+            local now = os.millis()
+            if now >= nextsweep then
+                nextsweep = now + 100
+                for s, idle in conns do
+                    if idle and now - idle >= keepalive then
+                        s:close()
+                    end
+                end
+            end
+        end
+    end)
+
+    if opts.scheduler then
+        return server
+    end
+    sched:run()
+end)EOC");
+  lua_pushcfunction(L, http_parsehead);
+  lua_pushcfunction(L, http_formatresponse);
+  lua_pushcfunction(L, http_formatchunk);
+  lua_call(L, 3, 1);
+  lua_settable(L, -3);
+
+  luaL_loadstring(L, R"EOC(
+local formatrequest, parseresponsehead, inflate = ...
+local socket = require "pluto:socket"
+
+local function pool(opts)
+    opts ??= {}
+    local maxconnections = opts.maxconnections ?? 6
+    local idletimeout = (opts.idletimeout ?? 30) * 1000
+    local pipelining = opts.pipelining ?? 1
+    local maxheadersize = opts.maxheadersize ?? 65536
+
+    -- "scheme://host:port" -> list of connections. A connection has a socket once connected, the number of requests
+    -- in flight on it, a queue of tickets so pipelined responses are read in order, whether all requests in flight
+    -- may be pipelined, and the time it went idle.
+    local hosts = {}
+    local client = { capacity = maxconnections * pipelining } -- requests a host can have in flight
+
+    local release
+
+    local function drop(key, c)
+        if c.sock then
+            c.sock:close()
+        end
+        for i, other in hosts[key] do
+            if other == c then
+                hosts[key]:remove(i)
+                break
+            end
+        end
+    end
+
+    -- Returns a connection to use and whether it was used before, or nil and a message.
+    local function acquire(key, host, port, tls, safe)
+        hosts[key] ??= {}
+        local conns = hosts[key]
+        while true do
+            local now = os.millis()
+            local idle, busy
+            for i = #conns, 1, -1 do
+                local c = conns[i]
+                if c.sock then
+                    if c.inflight == 0 then
+                        if now - c.idle >= idletimeout or not c.sock:isopen() then
+                            c.sock:close()
+                            conns:remove(i)
+                        else
+                            idle = c
+                        end
+                    elseif safe and c.safe and c.inflight < pipelining and (not busy or c.inflight < busy.inflight) then
+                        busy = c
+                    end
+                end
+            end
+            if idle then
+                return idle, true
+            end
+            -- Rather open another connection than queue behind a response that may be slow.
+            if #conns < maxconnections or not coroutine.isyieldable() then
+                local c = { inflight = 0, queue = {}, safe = true, idle = now }
+                conns:insert(c)
+                local s = socket.connect(host, port)
+                if s and tls and not s:starttls(host) then
+                    s:close()
+                    s = nil
+                end
+                if not s then
+                    drop(key, c)
+                    return nil, "failed to connect to "..host..":"..port
+                end
+                c.sock = s
+                return c, false
+            end
+            if busy then
+                return busy, true
+            end
+            coroutine.yield()
+        end
+    end
+
+    -- Reads a response head. Returns the status, status text, headers, whether the server closes the connection
+    -- and the body length, or nil if the connection was closed before a response started.
+    local function readhead(s)
+        local status, text, headers, close, length
+        repeat
+            local head = s:recvuntil("\r\n\r\n", maxheadersize)
+            if not head then
+                return nil
+            end
+            status, text, headers, close, length = parseresponsehead(head)
+            if not status then
+                error("malformed response head")
+            end
+        until status >= 200 or status == 101
+        return status, text, headers, close or status == 101, length
+    end
+
+    -- Returns a function that reads the next piece of the body, up to n bytes, or nil at its end. If it is given a
+    -- file, the piece is written there and its size is returned instead. Raises an error for a broken body.
+    local function bodyreader(s, method, status, length)
+        local left = length -- bytes left in the body, or in the current chunk of a chunked body
+        local chunked, untilclose, started = (length == -1), (length == -2), false
+        if method == "HEAD" or status < 200 or status == 204 or status == 304 then
+            left, chunked, untilclose = 0, false, false
+        elseif chunked then
+            left = 0
+        end
+        return function(n, file)
+            if untilclose then
+                local piece
+                if file then
+                    piece = s:recvfile(file, n)
+                else
+                    piece = s:recv()
+                end
+                if not piece then
+                    untilclose = false
+                end
+                return piece
+            end
+            if chunked and left == 0 then
+                if started then
+                    s:recvline(2)
+                end
+                started = true
+                local line = s:recvline(1024) ?? error("connection lost")
+                local size = tonumber(line:match("^%x+"), 16) ?? error("malformed chunked response body")
+                if size == 0 then
+                    while (trailer := s:recvline(maxheadersize)) and trailer ~= "" do end -- trailer fields
+                    chunked = false
+                    return nil
+                end
+                left = size
+            end
+            if left == 0 then
+                return nil
+            end
+            n = math.min(n, left)
+            if file then
+                local written = s:recvfile(file, n) ?? error("connection lost")
+                left -= written
+                return written
+            end
+            local piece = s:recvexact(n) ?? error("connection lost")
+            left -= #piece
+            return piece
+        end
+    end
+
+    -- Sends a request and reads the response head. Returns the connection and its key, the method and then what
+    -- readhead returns, or nil and a message. Identity asks the server not to compress the body.
+    local function exchange(url, options, identity)
+        local data, host, port, tls, method = formatrequest(url, options, identity)
+        local key = (tls ? "https://" : "http://")..host..":"..port
+        local safe = (method == "GET" or method == "HEAD")
+        local idempotent = safe or method == "PUT" or method == "DELETE" or method == "OPTIONS"
+        for attempt = 1, 2 do
+            local c, reused = acquire(key, host, port, tls, safe)
+            if not c then
+                return nil, reused
+            end
+            c.inflight += 1
+            c.safe = c.safe and safe
+            local ticket = {}
+            c.queue:insert(ticket)
+            c.sock:send(data)
+            while c.queue[1] ~= ticket do
+                coroutine.yield()
+            end
+            local ok, status, text, headers, close, length = pcall(readhead, c.sock)
+            if ok and status then
+                return c, key, method, status, text, headers, close, length
+            end
+            release(key, c, false)
+            -- A reused connection may have been closed by the server before it saw our request.
+            if not (ok and reused and idempotent and attempt == 1) then
+                return nil, ok ? "connection closed" : tostring(status)
+            end
+        end
+    end
+
+    -- Takes the request whose response was just read off the connection, and keeps the connection if it can be reused.
+    function release(key, c, reusable)
+        c.queue:remove(1)
+        c.inflight -= 1
+        if c.inflight == 0 then
+            c.safe, c.idle = true, os.millis()
+        end
+        if not reusable then
+            drop(key, c)
+        end
+    end
+
+    -- Same arguments and results as http.request. With the 'sink' option, each piece of the body is passed to that
+    -- function as it arrives and the body returned is empty. With the 'stream' option, the body returned is a
+    -- function that returns the next piece of it, or nil at its end; the connection is busy until then.
+    function client:request(url, options)
+        if type(url) == "table" then
+            options = url
+            url = options.url ?? error("Table is missing 'url' option")
+        end
+        local sink = options and options.sink
+        local stream = options and options.stream
+        local c, key, method, status, text, headers, close, length = exchange(url, options, sink or stream)
+        if not c then
+            return nil, key
+        end
+        local read = bodyreader(c.sock, method, status, length)
+        if stream then
+            local done = false
+            return function()
+                if done then
+                    return nil
+                end
+                local ok, piece = pcall(read, 0x10000)
+                if ok and piece then
+                    return piece
+                end
+                done = true
+                release(key, c, ok and not close)
+                if not ok then
+                    error(piece, 0)
+                end
+            end, status, headers, text
+        end
+        local pieces = {}
+        local ok, err = pcall(function()
+            while piece := read(0x10000) do
+                if sink then
+                    sink(piece)
+                else
+                    pieces:insert(piece)
+                end
+            end
+        end)
+        release(key, c, ok and not close)
+        if not ok then
+            return nil, tostring(err)
+        end
+        local body = pieces:concat()
+        local encoding = headers["Content-Encoding"]
+        if not sink and (encoding == "gzip" or encoding == "deflate") then
+            body = inflate(body)
+            headers["Content-Encoding"] = nil
+        end
+        return body, status, headers, text
+    end
+
+    -- Writes the body of a successful response to a file, without it passing through Lua strings. Returns the number
+    -- of bytes written, the status and the headers; or nil and a message, followed by the status and headers if the
+    -- response was not successful, in which case the file is left alone.
+    function client:download(url, path, options)
+        local c, key, method, status, text, headers, close, length = exchange(url, options, true)
+        if not c then
+            return nil, key
+        end
+        local read = bodyreader(c.sock, method, status, length)
+        local file, err
+        if status >= 200 and status < 300 then
+            file, err = io.open(path, "wb")
+        end
+        local written = 0
+        local ok, readerr = pcall(function()
+            while n := read(0x100000, file) do
+                if file then
+                    written += n
+                end
+            end
+        end)
+        release(key, c, ok and not close)
+        if file then
+            file:close()
+        end
+        if not ok then
+            return nil, tostring(readerr)
+        end
+        if not file then
+            return nil, err ?? (status.." "..text), status, headers
+        end
+        return written, status, headers
+    end
+
+    function client:connections()
+        local n = 0
+        for hosts as conns do
+            n += #conns
+        end
+        return n
+    end
+
+    function client:close()
+        for key, conns in hosts do
+            for conns as c do
+                if c.sock then
+                    c.sock:close()
+                end
+            end
+            hosts[key] = nil
+        end
+    end
+
+    return client
+end
+
+local function requestall(requests, opts)
+    opts ??= {}
+    local p = opts.pool ?? pool(opts)
+    local concurrency = opts.concurrency
+    if not concurrency then
+        -- Workers beyond what the pool can carry would only wait for a connection.
+        local hostset, numhosts = {}, 0
+        for requests as r do
+            local host = (type(r) == "table" ? r.url : r):match("^[^/]*//([^/?#]+)") ?? ""
+            if not hostset[host] then
+                hostset[host] = true
+                ++numhosts
+            end
+        end
+        concurrency = numhosts * p.capacity
+    end
+    local results = {}
+    local nextidx = 1
+    local function worker()
+        while nextidx <= #requests do
+            local i = nextidx
+            nextidx += 1
+            local body, status, headers, text = p:request(requests[i])
+            results[i] = body ? { body = body, status = status, headers = headers, status_text = text } : { error = status }
+        end
+    end
+    local workers = {}
+    for i = 1, math.min(#requests, concurrency) do
+        workers[i] = coroutine.create(worker)
+    end
+    local running = #workers
+    while running ~= 0 do
+        running = 0
+        for workers as co do
+            if coroutine.status(co) == "suspended" then
+                local ok, err = coroutine.resume(co)
+                if not ok then
+                    error(err, 0)
+                end
+                if coroutine.status(co) == "suspended" then
+                    ++running
+                end
+            end
+        end
+        if running ~= 0 and coroutine.isyieldable() then
+            coroutine.yield()
+        end
+    end
+    if not opts.pool then
+        p:close()
+    end
+    return results
+end
+
+local function download(url, path, opts)
+    opts ??= {}
+    local p = opts.pool ?? pool(opts)
+    local written, status, headers, errheaders = p:download(url, path, opts)
+    if not opts.pool then
+        p:close()
+    end
+    return written, status, headers, errheaders
+end
+
+return pool, requestall, download)EOC");
+  lua_pushcfunction(L, http_formatrequest);
+  lua_pushcfunction(L, http_parseresponsehead);
+  lua_pushcfunction(L, http_inflate);
+  lua_call(L, 3, 3);
+  lua_setfield(L, -4, "download");
+  lua_setfield(L, -3, "requestall");
+  lua_setfield(L, -2, "pool");
+#endif
+
+  return 1;
+}
+const Pluto::PreloadedLibrary Pluto::preloaded_http{ "http", funcs_http, &luaopen_http };
@@ -66,6 +66,7 @@ static const luaL_Reg stdlibs[] = {
   {PLUTO_WASMLIBNAME, luaopen_wasm},
 #ifndef __EMSCRIPTEN__
   {PLUTO_SOCKETLIBNAME, luaopen_socket},
+  {PLUTO_THREADLIBNAME, luaopen_thread},
 #endif
   {NULL, NULL}
 };
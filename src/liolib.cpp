@@ -17,14 +17,22 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm> // max
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <memory> // unique_ptr
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "lua.h"
 
 #include "lauxlib.h"
 #include "lualib.h"
 #include "llimits.h"
+#include "lbufferlib.hpp"
 
 #include "vendor/Soup/soup/filesystem.hpp"
 #include "vendor/Soup/soup/string.hpp"
@@ -770,8 +778,8 @@ static int g_write (lua_State *L, FILE *f, int arg) {
       s = buff;
       len--;
     }
-    else  /* must be a string */
-      s = luaL_checklstring(L, arg, &len);
+    else  /* must be a string or buffer */
+      s = checkbytes(L, arg, &len);
     numbytes = fwrite(s, sizeof(char), len, f);
     totalbytes += numbytes;
     if (numbytes < len) {  /* write error? */
@@ -1131,6 +1139,321 @@ static int listdir (lua_State *L) {
 }
 
 
+static void pushpath (lua_State *L, const std::filesystem::path& path) {
+#if SOUP_WINDOWS
+  lua_pushstring(L, (const char*)path.u8string().c_str());
+#else
+  /* already UTF-8 (or at least bytes), no need to convert */
+  const auto& native = path.native();
+  lua_pushlstring(L, native.data(), native.size());
+#endif
+}
+
+[[nodiscard]] static std::time_t file_time_to_unix_time (std::filesystem::file_time_type ft);
+
+struct DirEntry {
+  std::filesystem::directory_entry entry;
+  lua_Integer depth;
+};
+
+static int direntry_index (lua_State *L) {
+  const DirEntry& de = *(DirEntry*)luaL_checkudata(L, 1, "pluto:direntry");
+  const char *const fields[] = { "type", "size", "mtime", "name", "path", "depth", nullptr };
+  std::error_code ec;
+  switch (luaL_checkoption(L, 2, nullptr, fields)) {
+    case 0:  /* type, from the directory entry without following symlinks */
+      if (de.entry.is_symlink(ec))
+        lua_pushliteral(L, "symlink");
+      else if (de.entry.is_directory(ec))
+        lua_pushliteral(L, "directory");
+      else if (de.entry.is_regular_file(ec))
+        lua_pushliteral(L, "file");
+      else
+        lua_pushliteral(L, "other");
+      return 1;
+    case 1: {  /* size, cached on Windows, otherwise only stat'ed when requested */
+      const auto size = de.entry.file_size(ec);
+      if (ec)
+        return 0;
+      lua_pushinteger(L, (lua_Integer)size);
+      return 1;
+    }
+    case 2: {
+      const auto ft = de.entry.last_write_time(ec);
+      if (ec)
+        return 0;
+      lua_pushinteger(L, (lua_Integer)file_time_to_unix_time(ft));
+      return 1;
+    }
+    case 3:
+      pushpath(L, de.entry.path().filename());
+      return 1;
+    case 4:
+      pushpath(L, de.entry.path());
+      return 1;
+    default:
+      lua_pushinteger(L, de.depth);
+      return 1;
+  }
+}
+
+static void pushdirentry (lua_State *L, const std::filesystem::directory_entry& entry, lua_Integer depth) {
+  new (lua_newuserdata(L, sizeof(DirEntry))) DirEntry{ entry, depth };
+  if (luaL_newmetatable(L, "pluto:direntry")) {
+    lua_pushliteral(L, "__index");
+    lua_pushcfunction(L, direntry_index);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__gc");
+    lua_pushcfunction(L, [](lua_State *L) {
+      pluto_errorifnotgc(L);
+      std::destroy_at<>((DirEntry*)luaL_checkudata(L, 1, "pluto:direntry"));
+      return 0;
+    });
+    lua_settable(L, -3);
+  }
+  lua_setmetatable(L, -2);
+}
+
+#if !SOUP_WASM
+/*
+** Parallel traversal. Worker threads list directories from a shared work
+** queue and hand their entries to the iterating state via a bounded queue.
+** Entries therefore arrive in no particular order.
+*/
+struct ParallelDirWalker {
+  struct Item {
+    std::filesystem::directory_entry entry;
+    lua_Integer depth;
+  };
+
+  std::mutex mtx;
+  std::condition_variable haswork;
+  std::condition_variable hasitems;
+  std::condition_variable hasspace;
+  std::deque<Item> work;  /* directories to be listed */
+  std::deque<Item> items;  /* entries to be yielded */
+  size_t active = 0;  /* directories queued or being listed */
+  lua_Integer maxdepth;
+  bool stop = false;
+  std::vector<std::thread> threads;
+
+  static constexpr size_t MAX_ITEMS = 4096;
+
+  ParallelDirWalker (std::filesystem::directory_entry root, lua_Integer maxdepth, unsigned nthreads)
+    : maxdepth(maxdepth) {
+    work.emplace_back(Item{ std::move(root), 0 });
+    active = 1;
+    for (unsigned i = 0; i != nthreads; ++i)
+      threads.emplace_back(&ParallelDirWalker::run, this);
+  }
+
+  ~ParallelDirWalker () {
+    {
+      std::lock_guard lock(mtx);
+      stop = true;
+    }
+    haswork.notify_all();
+    hasspace.notify_all();
+    for (auto& t : threads)
+      t.join();
+  }
+
+  void run () {
+    std::unique_lock lock(mtx);
+    while (true) {
+      haswork.wait(lock, [&] { return stop || active == 0 || !work.empty(); });
+      if (stop || work.empty())
+        return;
+      Item dir = std::move(work.front());
+      work.pop_front();
+      lock.unlock();
+      std::error_code ec;
+      std::filesystem::directory_iterator it(dir.entry.path(), std::filesystem::directory_options::skip_permission_denied, ec);
+      for (; !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+        const bool descend = (maxdepth == 0 || dir.depth + 1 < maxdepth)
+          && it->is_directory(ec) && !it->is_symlink(ec);
+        lock.lock();
+        hasspace.wait(lock, [&] { return stop || items.size() < MAX_ITEMS; });
+        if (stop)
+          return;
+        items.emplace_back(Item{ *it, dir.depth + 1 });
+        if (descend) {
+          work.emplace_back(Item{ *it, dir.depth + 1 });
+          ++active;
+          haswork.notify_one();
+        }
+        hasitems.notify_one();
+        lock.unlock();
+      }
+      lock.lock();
+      if (--active == 0) {
+        haswork.notify_all();
+        hasitems.notify_all();
+      }
+    }
+  }
+
+  /* Blocks until an entry is available. Returns false once the traversal is complete. */
+  bool next (Item& out) {
+    std::unique_lock lock(mtx);
+    hasitems.wait(lock, [&] { return active == 0 || !items.empty(); });
+    if (items.empty())
+      return false;
+    out = std::move(items.front());
+    items.pop_front();
+    hasspace.notify_one();
+    return true;
+  }
+};
+#endif
+
+struct DirWalker {
+  std::vector<std::filesystem::directory_iterator> stack;
+  std::filesystem::path pending;  /* directory to enter before advancing */
+  bool descend = false;
+  bool started = false;
+  lua_Integer maxdepth = 0;
+#if !SOUP_WASM
+  std::unique_ptr<ParallelDirWalker> parallel;
+#endif
+
+  void advance () {
+    std::error_code ec;
+    stack.back().increment(ec);
+    if (l_unlikely(ec.operator bool()))
+      stack.back() = std::filesystem::directory_iterator();  /* skip the rest of this directory */
+  }
+
+  /* Moves to the next entry. Returns false once the traversal is complete. */
+  bool step () {
+    if (descend) {
+      descend = false;
+      std::error_code ec;
+      std::filesystem::directory_iterator sub(pending, std::filesystem::directory_options::skip_permission_denied, ec);
+      if (!ec)
+        stack.emplace_back(std::move(sub));
+      else
+        advance();  /* skip this directory if we failed to enter it */
+    }
+    else if (started)
+      advance();
+    started = true;
+    while (!stack.empty() && stack.back() == std::filesystem::directory_iterator()) {
+      stack.pop_back();
+      if (!stack.empty())
+        advance();
+    }
+    return !stack.empty();
+  }
+};
+
+/* Calls the callback at the given upvalue with the path and entry at the top of the stack. */
+static bool walk_callback (lua_State *L, int upvalue) {
+  lua_pushvalue(L, lua_upvalueindex(upvalue));
+  lua_pushvalue(L, -3);
+  lua_pushvalue(L, -3);
+  lua_call(L, 2, 1);
+  const bool res = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return res;
+}
+
+static int walk_next (lua_State *L) {
+  DirWalker& w = *(DirWalker*)lua_touserdata(L, lua_upvalueindex(1));
+  const bool hasfilter = !lua_isnil(L, lua_upvalueindex(2));
+  const bool hasprune = !lua_isnil(L, lua_upvalueindex(3));
+#if !SOUP_WASM
+  if (w.parallel) {
+    ParallelDirWalker::Item item;
+    while (w.parallel->next(item)) {
+      pushpath(L, item.entry.path());
+      pushdirentry(L, item.entry, item.depth);
+      if (!hasfilter || walk_callback(L, 2))
+        return 2;
+      lua_pop(L, 2);
+    }
+    return 0;
+  }
+#endif
+  while (w.step()) {
+    const auto& entry = *w.stack.back();
+    const auto depth = (lua_Integer)w.stack.size();
+    pushpath(L, entry.path());
+    pushdirentry(L, entry, depth);
+    std::error_code ec;
+    if ((w.maxdepth == 0 || depth < w.maxdepth)
+        && entry.is_directory(ec) && !entry.is_symlink(ec)
+        && (!hasprune || !walk_callback(L, 3))) {
+      w.pending = entry.path();
+      w.descend = true;
+    }
+    if (!hasfilter || walk_callback(L, 2))
+      return 2;
+    lua_pop(L, 2);
+  }
+  return 0;
+}
+
+/*
+** io.walk(dir, opts) -> iterator yielding path, entry
+**   opts.depth: maximum depth to descend to (1 = only direct children)
+**   opts.filter: function(path, entry) -> whether to yield the entry
+**   opts.prune: function(path, entry) -> whether to skip descending into a directory
+**   opts.parallel: true or a thread count to list directories on worker threads
+*/
+static int io_walk (lua_State *L) {
+  FS_FUNCTION
+  lua_settop(L, 2);
+  auto& f = getStringStreamPathForRead(L, 1);
+  /* stack: dir, opts, path */
+  auto& w = *pluto_newclassinst(L, DirWalker);
+  /* stack: dir, opts, path, walker */
+  unsigned nthreads = 0;
+  if (!lua_isnil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "depth");
+    w.maxdepth = luaL_optinteger(L, -1, 0);
+    lua_getfield(L, 2, "filter");
+    lua_getfield(L, 2, "prune");
+    lua_getfield(L, 2, "parallel");
+    if (lua_isinteger(L, -1))
+      nthreads = (unsigned)std::max<lua_Integer>(1, lua_tointeger(L, -1));
+    else if (lua_toboolean(L, -1))
+      nthreads = std::max(1u, std::thread::hardware_concurrency());
+    lua_pop(L, 1);
+    lua_remove(L, -3);
+  }
+  else {
+    lua_pushnil(L);
+    lua_pushnil(L);
+  }
+  /* stack: dir, opts, path, walker, filter, prune */
+  std::error_code ec;
+  if (nthreads != 0) {
+#if SOUP_WASM
+    luaL_error(L, "parallel traversal is not available on this platform");
+#else
+    if (l_unlikely(!lua_isnil(L, -1)))
+      luaL_error(L, "prune is not supported in parallel mode");
+    std::filesystem::directory_entry root(f, ec);
+    if (l_unlikely(ec || !root.is_directory(ec))) {
+      luaL_error(L, "operation failed");
+    }
+    w.parallel = std::make_unique<ParallelDirWalker>(std::move(root), w.maxdepth, nthreads);
+#endif
+  }
+  else {
+    std::filesystem::directory_iterator it(f, std::filesystem::directory_options::skip_permission_denied, ec);
+    if (l_unlikely(ec.operator bool())) {
+      luaL_error(L, "operation failed");
+    }
+    w.stack.emplace_back(std::move(it));
+  }
+  lua_pushcclosure(L, walk_next, 3);
+  return 1;
+}
+
+
 int l_os_remove (lua_State *L) {
   FS_FUNCTION
   auto& path = getStringStreamPathForWrite(L, 1);
@@ -1363,6 +1686,7 @@ static const luaL_Reg iolib[] = {
   {"remove", l_remove},
   {"listdir", listdir},
   {"scandir", listdir},
+  {"walk", io_walk},
   {"makedir", makedir},
   {"mkdir", makedir},
   {"makedirs", makedirs},
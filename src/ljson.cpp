@@ -7,6 +7,8 @@
 #include "lualib.h"
 #include "ljson.hpp" // isIndexBasedTable
 #include "lstate.h" // luaE_incCstack
+#include "ldo.h" // luaD_throw
+#include "lbufferlib.hpp"
 
 #include "vendor/Soup/soup/json.hpp"
 #include "vendor/Soup/soup/JsonArray.hpp"
@@ -126,6 +128,14 @@ static void checkJson(lua_State* L, int i, soup::UniquePtr<soup::JsonNode>& out)
 			return;
 		}
 	}
+	else if (type == LUA_TUSERDATA)
+	{
+		if (const auto buf = testbuffer(L, i))
+		{
+			out = soup::make_unique<soup::JsonString>(std::string(buf->size() ? (const char*)buf->data() : "", buf->size()));
+			return;
+		}
+	}
 	else if (type == LUA_TLIGHTUSERDATA)
 	{
 		if (reinterpret_cast<uintptr_t>(lua_touserdata(L, i)) == 0xF01D)
@@ -152,25 +162,49 @@ static int encode(lua_State* L) {
 		fmt = luaL_checkoption(L, 2, "compact", fmts);
 	}
 
+	PlutoBuffer* const sink = lua_isnoneornil(L, 3) ? nullptr : checkbuffer(L, 3);
+	if (l_unlikely(sink && sink->parent))
+		luaL_error(L, "cannot resize a view");
+
 	auto& up = *pluto_newclassinst(L, soup::UniquePtr<soup::JsonNode>);
 	checkJson(L, 1, up);
-	
+
+	std::string str;
 	switch (fmt)
 	{
 	case 0: default:
-		pluto_pushstring(L, up->encode());
+		str = up->encode();
 		break;
 
 	case 1:
-		pluto_pushstring(L, up->encodePretty());
+		str = up->encodePretty();
 		break;
 
 	case 2:
 		soup::StringWriter sw;
 		up->msgpackEncode(sw);
-		pluto_pushstring(L, std::move(sw.data));
+		str = std::move(sw.data);
 		break;
 	}
+
+	if (sink)
+	{
+		/* append to the given buffer instead of creating a string */
+		bool fail = false;
+		try
+		{
+			sink->buffer.append(str);
+		}
+		catch (const std::bad_alloc&)
+		{
+			fail = true;
+		}
+		if (l_unlikely(fail))
+			luaD_throw(L, LUA_ERRMEM);
+		lua_pushvalue(L, 3);
+		return 1;
+	}
+	pluto_pushstring(L, str);
 	return 1;
 }
 
@@ -111,4 +111,27 @@ static const void *const disptab[NUM_OPCODES] = {
 &&L_OP_VARARGPREP,
 &&L_OP_EXTRAARG,
 &&L_OP_IN,
+&&L_OP_GETTABUP_GETFIELD,
+&&L_OP_MOVE_CALL,
+&&L_OP_MOVE_MOVE,
+&&L_OP_LOADK_CALL,
+&&L_OP_LOADI_CALL,
+&&L_OP_ADD_EQ,
+&&L_OP_MODK_EQI,
+&&L_OP_ADD_INT,
+&&L_OP_SUB_INT,
+&&L_OP_MUL_INT,
+&&L_OP_ADD_FLT,
+&&L_OP_SUB_FLT,
+&&L_OP_MUL_FLT,
+&&L_OP_DIV_FLT,
+&&L_OP_ADDK_FLT,
+&&L_OP_SUBK_FLT,
+&&L_OP_MULK_FLT,
+&&L_OP_DIVK_FLT,
+&&L_OP_EQ_INT,
+&&L_OP_LT_INT,
+&&L_OP_LE_INT,
+&&L_OP_LT_FLT,
+&&L_OP_LE_FLT,
 };
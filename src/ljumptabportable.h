@@ -96,6 +96,29 @@ case OP_ERRNNIL: goto L_OP_ERRNNIL; \
 case OP_VARARGPREP: goto L_OP_VARARGPREP; \
 case OP_EXTRAARG: goto L_OP_EXTRAARG; \
 case OP_IN: goto L_OP_IN; \
+case OP_GETTABUP_GETFIELD: goto L_OP_GETTABUP_GETFIELD; \
+case OP_MOVE_CALL: goto L_OP_MOVE_CALL; \
+case OP_MOVE_MOVE: goto L_OP_MOVE_MOVE; \
+case OP_LOADK_CALL: goto L_OP_LOADK_CALL; \
+case OP_LOADI_CALL: goto L_OP_LOADI_CALL; \
+case OP_ADD_EQ: goto L_OP_ADD_EQ; \
+case OP_MODK_EQI: goto L_OP_MODK_EQI; \
+case OP_ADD_INT: goto L_OP_ADD_INT; \
+case OP_SUB_INT: goto L_OP_SUB_INT; \
+case OP_MUL_INT: goto L_OP_MUL_INT; \
+case OP_ADD_FLT: goto L_OP_ADD_FLT; \
+case OP_SUB_FLT: goto L_OP_SUB_FLT; \
+case OP_MUL_FLT: goto L_OP_MUL_FLT; \
+case OP_DIV_FLT: goto L_OP_DIV_FLT; \
+case OP_ADDK_FLT: goto L_OP_ADDK_FLT; \
+case OP_SUBK_FLT: goto L_OP_SUBK_FLT; \
+case OP_MULK_FLT: goto L_OP_MULK_FLT; \
+case OP_DIVK_FLT: goto L_OP_DIVK_FLT; \
+case OP_EQ_INT: goto L_OP_EQ_INT; \
+case OP_LT_INT: goto L_OP_LT_INT; \
+case OP_LE_INT: goto L_OP_LE_INT; \
+case OP_LT_FLT: goto L_OP_LT_FLT; \
+case OP_LE_FLT: goto L_OP_LE_FLT; \
 }
 
 #define vmcase(l)     L_##l:
@@ -451,6 +451,7 @@ struct LexState {
   KeywordState keyword_states[END_NON_COMPAT - FIRST_NON_COMPAT];
   bool nodiscard = false;
   bool used_walrus = false;
+  bool optimize = false;  /* run the optimization pass over functions as they are finished? */
   std::unordered_map<int, int> uninformed_reserved{}; // When a reserved word is intelligently disabled for compatibility, it is added to this map. (token, line)
   std::unordered_map<const TString*, Macro> macros{};  /* used during preprocessor pass */
   std::unordered_map<const TString*, std::vector<Token>> macro_args{};  /* used during preprocessor pass */
@@ -626,6 +626,9 @@ typedef struct Proto {
   GCObject *gclist;
   bool lua_vm_compatible;
   lu_byte min_required_version;
+#ifdef PLUTO_VMSTATS
+  unsigned long long *vmstats;  /* execution counts, owned by 'G(L)->vmstats' */
+#endif
 
   void onPlutoOpUsed(lu_byte min_required_version) noexcept {
     if (lua_vm_compatible || min_required_version > this->min_required_version) {
@@ -793,6 +796,7 @@ typedef struct Table {
   Node *node;
   struct Table *metatable;
   GCObject *gclist;
+  lua_Unsigned hbound;  /* hint for a border in the hash part [Pluto] */
 #ifdef PLUTO_ENABLE_TABLE_FREEZING
   bool isfrozen;
 #endif
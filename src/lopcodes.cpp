@@ -107,6 +107,29 @@ LUAI_DDEF const lu_byte luaP_opmodes[NUM_OPCODES] = {
  ,opmode(0, 0, 1, 0, 1, iABC)		/* OP_VARARGPREP */
  ,opmode(0, 0, 0, 0, 0, iAx)		/* OP_EXTRAARG */
  ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_IN */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_GETTABUP_GETFIELD */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_MOVE_CALL */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_MOVE_MOVE */
+ ,opmode(0, 0, 0, 0, 1, iABx)		/* OP_LOADK_CALL */
+ ,opmode(0, 0, 0, 0, 1, iAsBx)		/* OP_LOADI_CALL */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_ADD_EQ */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_MODK_EQI */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_ADD_INT */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_SUB_INT */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_MUL_INT */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_ADD_FLT */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_SUB_FLT */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_MUL_FLT */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_DIV_FLT */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_ADDK_FLT */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_SUBK_FLT */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_MULK_FLT */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_DIVK_FLT */
+ ,opmode(0, 0, 0, 1, 0, iABC)		/* OP_EQ_INT */
+ ,opmode(0, 0, 0, 1, 0, iABC)		/* OP_LT_INT */
+ ,opmode(0, 0, 0, 1, 0, iABC)		/* OP_LE_INT */
+ ,opmode(0, 0, 0, 1, 0, iABC)		/* OP_LT_FLT */
+ ,opmode(0, 0, 0, 1, 0, iABC)		/* OP_LE_FLT */
 };
 
 
@@ -139,3 +162,84 @@ int luaP_isIT (Instruction i) {
   }
 }
 
+
+/*
+** Opcode that a superinstruction starts with.
+*/
+OpCode luaP_baseop (OpCode op) {
+  switch (op) {
+    case OP_GETTABUP_GETFIELD: return OP_GETTABUP;
+    case OP_MOVE_CALL: case OP_MOVE_MOVE: return OP_MOVE;
+    case OP_LOADK_CALL: return OP_LOADK;
+    case OP_LOADI_CALL: return OP_LOADI;
+    case OP_ADD_EQ: return OP_ADD;
+    case OP_MODK_EQI: return OP_MODK;
+    case OP_ADD_INT: case OP_ADD_FLT: return OP_ADD;
+    case OP_SUB_INT: case OP_SUB_FLT: return OP_SUB;
+    case OP_MUL_INT: case OP_MUL_FLT: return OP_MUL;
+    case OP_DIV_FLT: return OP_DIV;
+    case OP_ADDK_FLT: return OP_ADDK;
+    case OP_SUBK_FLT: return OP_SUBK;
+    case OP_MULK_FLT: return OP_MULK;
+    case OP_DIVK_FLT: return OP_DIVK;
+    case OP_EQ_INT: return OP_EQ;
+    case OP_LT_INT: case OP_LT_FLT: return OP_LT;
+    case OP_LE_INT: case OP_LE_FLT: return OP_LE;
+    default: return op;
+  }
+}
+
+
+/*
+** Instruction without fusion, as understood by any Lua VM.
+*/
+Instruction luaP_unfuse (Instruction i) {
+  SET_OPCODE(i, luaP_baseop(GET_OPCODE(i)));
+  return i;
+}
+
+
+/*
+** Replace the first instruction of common pairs with a superinstruction.
+** Arithmetic instructions are paired with the instruction after their
+** OP_MMBIN*, which their fast path skips.
+*/
+void luaP_fuse (Instruction *code, int n) {
+#ifndef PLUTO_NO_SUPERINSTRUCTIONS
+  int pc;
+  for (pc = 0; pc + 1 < n; pc++) {
+    OpCode next = luaP_baseop(GET_OPCODE(code[pc + 1]));
+    switch (GET_OPCODE(code[pc])) {
+      case OP_GETTABUP:
+        if (next == OP_GETFIELD)
+          SET_OPCODE(code[pc], OP_GETTABUP_GETFIELD);
+        break;
+      case OP_MOVE:
+        if (next == OP_CALL)
+          SET_OPCODE(code[pc], OP_MOVE_CALL);
+        else if (next == OP_MOVE)
+          SET_OPCODE(code[pc], OP_MOVE_MOVE);
+        break;
+      case OP_LOADK:
+        if (next == OP_CALL)
+          SET_OPCODE(code[pc], OP_LOADK_CALL);
+        break;
+      case OP_LOADI:
+        if (next == OP_CALL)
+          SET_OPCODE(code[pc], OP_LOADI_CALL);
+        break;
+      case OP_ADD:
+        if (pc + 2 < n && luaP_baseop(GET_OPCODE(code[pc + 2])) == OP_EQ)
+          SET_OPCODE(code[pc], OP_ADD_EQ);
+        break;
+      case OP_MODK:
+        if (pc + 2 < n && luaP_baseop(GET_OPCODE(code[pc + 2])) == OP_EQI)
+          SET_OPCODE(code[pc], OP_MODK_EQI);
+        break;
+      default: break;
+    }
+  }
+#else
+  (void)code; (void)n;
+#endif
+}
@@ -353,6 +353,33 @@ else
   push R(B):contains(R(A)) ~= nil
 */
 
+/* superinstructions (see luaP_fuse) */
+OP_GETTABUP_GETFIELD,/* GETTABUP followed by GETFIELD			*/
+OP_MOVE_CALL,/*	MOVE followed by CALL					*/
+OP_MOVE_MOVE,/*	MOVE followed by MOVE					*/
+OP_LOADK_CALL,/* LOADK followed by CALL					*/
+OP_LOADI_CALL,/* LOADI followed by CALL					*/
+OP_ADD_EQ,/*	ADD followed by MMBIN and EQ				*/
+OP_MODK_EQI,/*	MODK followed by MMBINK and EQI				*/
+
+/* type-specialised instructions (see 'luaK_posfix') */
+OP_ADD_INT,/*	A B C	ADD for operands hinted as integers		*/
+OP_SUB_INT,/*	A B C	SUB for operands hinted as integers		*/
+OP_MUL_INT,/*	A B C	MUL for operands hinted as integers		*/
+OP_ADD_FLT,/*	A B C	ADD for operands hinted as floats		*/
+OP_SUB_FLT,/*	A B C	SUB for operands hinted as floats		*/
+OP_MUL_FLT,/*	A B C	MUL for operands hinted as floats		*/
+OP_DIV_FLT,/*	A B C	DIV for operands hinted as floats		*/
+OP_ADDK_FLT,/*	A B C	ADDK for an operand hinted as float		*/
+OP_SUBK_FLT,/*	A B C	SUBK for an operand hinted as float		*/
+OP_MULK_FLT,/*	A B C	MULK for an operand hinted as float		*/
+OP_DIVK_FLT,/*	A B C	DIVK for an operand hinted as float		*/
+OP_EQ_INT,/*	A B k	EQ for operands hinted as integers		*/
+OP_LT_INT,/*	A B k	LT for operands hinted as integers		*/
+OP_LE_INT,/*	A B k	LE for operands hinted as integers		*/
+OP_LT_FLT,/*	A B k	LT for operands hinted as floats		*/
+OP_LE_FLT,/*	A B k	LE for operands hinted as floats		*/
+
 NUM_OPCODES
 } OpCode;
 
@@ -415,6 +442,19 @@ NUM_OPCODES
   original operand was a float. (It must be corrected in case of
   metamethods.)
 
+  (*) A superinstruction replaces the opcode of the first instruction of
+  a common pair. It has the same arguments and executes like that
+  instruction, but then continues directly with the handler of the next
+  instruction, which is left in place. Jumps to the second instruction
+  and debug information therefore remain valid. Superinstructions are
+  only introduced by 'luaP_fuse' and are never dumped.
+
+  (*) A type-specialised instruction replaces the opcode of an arithmetic
+  or comparison instruction whose operands are hinted (or known) to be
+  integers or floats. It checks the types of its operands and, if they
+  do not match, continues as the generic instruction. Like
+  superinstructions, they are never dumped.
+
 ===========================================================================*/
 
 
@@ -440,6 +480,9 @@ LUAI_DDEC(const lu_byte luaP_opmodes[NUM_OPCODES];)
 
 LUAI_FUNC int luaP_isOT (Instruction i);
 LUAI_FUNC int luaP_isIT (Instruction i);
+LUAI_FUNC OpCode luaP_baseop (OpCode op);
+LUAI_FUNC Instruction luaP_unfuse (Instruction i);
+LUAI_FUNC void luaP_fuse (Instruction *code, int n);
 
 
 #endif
@@ -100,6 +100,29 @@ static const char *const opnames[] = {
   "EXTRAARG",
   // end of lua opcodes
   "IN",
+  "GETTABUP_GETFIELD",
+  "MOVE_CALL",
+  "MOVE_MOVE",
+  "LOADK_CALL",
+  "LOADI_CALL",
+  "ADD_EQ",
+  "MODK_EQI",
+  "ADD_INT",
+  "SUB_INT",
+  "MUL_INT",
+  "ADD_FLT",
+  "SUB_FLT",
+  "MUL_FLT",
+  "DIV_FLT",
+  "ADDK_FLT",
+  "SUBK_FLT",
+  "MULK_FLT",
+  "DIVK_FLT",
+  "EQ_INT",
+  "LT_INT",
+  "LE_INT",
+  "LT_FLT",
+  "LE_FLT",
   // end of pluto opcodes
   NULL
 };
@@ -422,6 +422,7 @@ static int os_sleep (lua_State *L) {
 /* }====================================================== */
 
 
+void pluto_localechanged ();  /* defined in lstrlib.cpp */
 static int os_setlocale (lua_State *L) {
   static const int cat[] = {LC_ALL, LC_COLLATE, LC_CTYPE, LC_MONETARY,
                       LC_NUMERIC, LC_TIME};
@@ -429,7 +430,10 @@ static int os_setlocale (lua_State *L) {
      "numeric", "time", NULL};
   const char *l = luaL_optstring(L, 1, NULL);
   int op = luaL_checkoption(L, 2, "all", catnames);
-  lua_pushstring(L, setlocale(cat[op], l));
+  const char *res = setlocale(cat[op], l);
+  if (l != NULL && res != NULL)
+    pluto_localechanged();  /* character classes of compiled patterns may differ now */
+  lua_pushstring(L, res);
   return 1;
 }
 
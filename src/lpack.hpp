@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+
+#include "lua.h"
+
+/*
+** The string.pack/string.unpack machinery, for libraries that pack into or
+** unpack from memory other than Lua strings, like pluto:buffer.
+*/
+
+/* Destination for packed bytes: 'prep' returns room for at least 'n' more bytes, 'add' commits 'n' of them. */
+struct PackSink {
+  virtual ~PackSink () = default;
+  virtual char *prep (size_t n) = 0;
+  virtual void add (size_t n) = 0;
+};
+
+/*
+** Packs the values after index 'fmtarg' by the format at 'fmtarg', as string.pack does. Alignment is
+** relative to 'offset', the position the first byte ends up at.
+*/
+void pluto_pack (lua_State *L, int fmtarg, size_t offset, PackSink& sink);
+
+/*
+** Unpacks from 'data' starting at zero-based 'pos', as string.unpack does. Pushes the values followed by the
+** next one-based position, and returns the number of values pushed. 'dataarg' is used in error messages.
+*/
+int pluto_unpack (lua_State *L, const char *fmt, const char *data, size_t ld, size_t pos, int dataarg);
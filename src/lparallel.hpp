@@ -0,0 +1,200 @@
+#pragma once
+
+/*
+** A pool of worker threads shared by the data-parallel paths of the standard library, e.g.
+** table.sort, table.map and table.filter on large arrays (see ltablib.cpp). Jobs only ever work on
+** raw memory and must not touch a lua_State or raise errors. The calling thread takes part in
+** running a job, and if the pool is already busy (e.g. with a job from another state), it simply
+** runs the whole job by itself. The number of threads to use is given with each job, so states
+** can have their own setting (see table.parallelism).
+*/
+
+#include <algorithm> // min, sort, merge, copy
+#include <cstddef>
+
+#ifndef __EMSCRIPTEN__
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+/* Parallel jobs are split into tasks of at least this many elements. */
+#define PARALLEL_GRAIN 16384
+
+/* Upper bound for the number of threads, including the caller. */
+#define PARALLEL_MAXTHREADS 256
+
+#ifndef __EMSCRIPTEN__
+
+struct ParallelPool {
+  std::mutex busy;  /* held by the thread whose job is running */
+  std::mutex mtx;  /* protects the fields below */
+  std::condition_variable wake;
+  std::condition_variable idle;
+  std::vector<std::thread> workers;
+  void (*run)(void *ud, size_t i) = nullptr;
+  void *ud = nullptr;
+  size_t ntasks = 0;
+  size_t pending = 0;  /* tasks not yet finished */
+  std::atomic<size_t> next{0};  /* next task to be claimed */
+  unsigned generation = 0;  /* incremented for each job */
+  unsigned helpers = 0;  /* number of workers taking part in the current job */
+  unsigned inside = 0;  /* number of workers currently running tasks */
+  bool stop = false;
+
+  ~ParallelPool () {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stop = true;
+    }
+    wake.notify_all();
+    for (auto& w : workers)
+      w.join();
+  }
+
+  /* Claims and runs tasks of the current job until there are none left; returns how many it ran. */
+  size_t runtasks (void (*f)(void*, size_t), void *u, size_t n) {
+    size_t done = 0;
+    for (size_t i; (i = next.fetch_add(1)) < n; ++done)
+      f(u, i);
+    return done;
+  }
+
+  void finish (size_t done) {  /* called with 'mtx' held */
+    pending -= done;
+    if (pending == 0 && inside == 0)
+      idle.notify_all();
+  }
+
+  void workerloop (unsigned id) {
+    unsigned seen = 0;
+    std::unique_lock<std::mutex> lock(mtx);
+    for (;;) {
+      wake.wait(lock, [&] { return stop || generation != seen; });
+      if (stop)
+        return;
+      seen = generation;
+      if (id >= helpers || pending == 0)
+        continue;  /* not needed for this job */
+      auto f = run;
+      auto u = ud;
+      const size_t n = ntasks;
+      ++inside;
+      lock.unlock();
+      const size_t done = runtasks(f, u, n);
+      lock.lock();
+      --inside;
+      finish(done);
+    }
+  }
+
+  template <typename F>
+  void parallelfor (size_t n, unsigned nthreads, F& f) {
+    if (n <= 1 || nthreads <= 1 || !busy.try_lock()) {
+      for (size_t i = 0; i != n; ++i)
+        f(i);
+      return;
+    }
+    std::lock_guard<std::mutex> guard(busy, std::adopt_lock);
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      try {
+        while (workers.size() < nthreads - 1) {
+          const unsigned id = static_cast<unsigned>(workers.size());
+          workers.emplace_back([this, id] { workerloop(id); });
+        }
+      }
+      catch (...) {}  /* could not start more threads; use the ones we have */
+      run = [](void *u, size_t i) { (*static_cast<F*>(u))(i); };
+      ud = &f;
+      ntasks = n;
+      pending = n;
+      next = 0;
+      helpers = static_cast<unsigned>(std::min<size_t>({ static_cast<size_t>(nthreads - 1), workers.size(), n - 1 }));
+      ++generation;
+    }
+    wake.notify_all();
+    const size_t done = runtasks(run, ud, n);
+    std::unique_lock<std::mutex> lock(mtx);
+    finish(done);
+    idle.wait(lock, [this] { return pending == 0 && inside == 0; });
+  }
+};
+
+[[nodiscard]] inline ParallelPool& parallelpool () {
+  static ParallelPool pool;
+  return pool;
+}
+
+/* The number of threads a new state uses for parallel jobs, including the calling thread. */
+[[nodiscard]] inline unsigned defaultparallelthreads () {
+  return std::max(1u, std::min<unsigned>(std::thread::hardware_concurrency(), PARALLEL_MAXTHREADS));
+}
+
+/* Runs 'f(i)' for each 'i' in '[0, n)', spread over up to 'nthreads' threads of the pool. */
+template <typename F>
+inline void parallelfor (size_t n, unsigned nthreads, F f) {
+  parallelpool().parallelfor(n, nthreads, f);
+}
+
+#else
+
+[[nodiscard]] inline unsigned defaultparallelthreads () {
+  return 1;
+}
+
+template <typename F>
+inline void parallelfor (size_t n, unsigned, F f) {
+  for (size_t i = 0; i != n; ++i)
+    f(i);
+}
+
+#endif
+
+/* Runs 'f(begin, end)' over '[0, n)' in tasks of at least PARALLEL_GRAIN elements. */
+template <typename F>
+inline void parallelrange (size_t n, unsigned nthreads, F f) {
+  const size_t ntasks = std::max<size_t>(1, std::min<size_t>(n / PARALLEL_GRAIN, nthreads));
+  parallelfor(ntasks, nthreads, [n, ntasks, &f](size_t i) {
+    f(n * i / ntasks, n * (i + 1) / ntasks);
+  });
+}
+
+/*
+** Sorts 'a[0 .. n-1]' by sorting one run per thread and then merging pairs of runs, also in
+** parallel, until one is left. 'tmp' must have room for 'n' elements.
+*/
+template <typename T, typename Less>
+inline void parallelsort (T *a, T *tmp, size_t n, unsigned nthreads, Less less) {
+  size_t nruns = std::min<size_t>(n / PARALLEL_GRAIN, nthreads);
+  if (nruns <= 1) {
+    std::sort(a, a + n, less);
+    return;
+  }
+  size_t bounds[PARALLEL_MAXTHREADS + 1];
+  for (size_t i = 0; i <= nruns; ++i)
+    bounds[i] = n * i / nruns;
+  parallelfor(nruns, nthreads, [a, &bounds, &less](size_t i) {
+    std::sort(a + bounds[i], a + bounds[i + 1], less);
+  });
+  T *src = a;
+  T *dst = tmp;
+  while (nruns > 1) {
+    const size_t npairs = (nruns + 1) / 2;
+    parallelfor(npairs, nthreads, [src, dst, nruns, &bounds, &less](size_t i) {
+      const size_t lo = bounds[2 * i];
+      const size_t mid = bounds[std::min(2 * i + 1, nruns)];
+      const size_t hi = bounds[std::min(2 * i + 2, nruns)];
+      std::merge(src + lo, src + mid, src + mid, src + hi, dst + lo, less);
+    });
+    for (size_t i = 0; i < npairs; ++i)
+      bounds[i] = bounds[std::min(2 * i, nruns)];
+    bounds[npairs] = n;
+    nruns = npairs;
+    std::swap(src, dst);
+  }
+  if (src != a)
+    std::copy(src, src + n, a);
+}
@@ -773,6 +773,9 @@ static void process_assign (LexState *ls, int vidx, const TypeHint& t, int line)
     ls->L->top.p--;  /* pop 'err' */
     var->vd.prop->clear();  /* don't raise further warnings about this variable */
   }
+  else if (hinted && !knownvalue) {
+    var->vd.prop->merge(*var->vd.hint);  /* trust the hint */
+  }
   else {
     var->vd.prop->merge(t); /* propagate type */
   }
@@ -5027,11 +5030,13 @@ static void repeatstat (LexState *ls) {
 ** stack slot.
 **
 */
-static void exp1 (LexState *ls) {
+static ValType exp1 (LexState *ls) {
   expdesc e;
   expr(ls, &e);
+  ValType t = (e.k == VKINT) ? VT_INT : (e.k == VKFLT) ? VT_FLT : VT_NONE;
   luaK_exp2nextreg(ls->fs, &e);
   lua_assert(e.k == VNONRELOC);
+  return (t != VT_NONE) ? t : e.code_primitive;  /* type of the value, if known */
 }
 
 
@@ -5086,17 +5091,20 @@ static void fornum (LexState *ls, TString *varname, tdn_t *nprop, TypeHint *prop
   int base = fs->freereg;
   new_localvarliteral(ls, "(for state)");
   new_localvarliteral(ls, "(for state)");
-  new_varkind(ls, varname, RDKCONST);  /* control variable */
+  int vidx = new_varkind(ls, varname, RDKCONST);  /* control variable */
+  ValType tinit, tstep = VT_INT;
   checknext(ls, '=');
-  exp1(ls);  /* initial value */
+  tinit = exp1(ls);  /* initial value */
   checknext(ls, ',');
   exp1(ls);  /* limit */
   if (testnext(ls, ','))
-    exp1(ls);  /* optional step */
+    tstep = exp1(ls);  /* optional step */
   else {  /* default step = 1 */
     luaK_int(fs, fs->freereg, 1);
     luaK_reserveregs(fs, 1);
   }
+  if (tinit == VT_INT && tstep == VT_INT)  /* loop over integers? */
+    getlocalvardesc(fs, vidx)->vd.prop->emplaceTypeDesc(VT_INT);
   adjustlocalvars(ls, 2);  /* start scope for internal variables */
   forbody(ls, base, line, 1, 0, nprop, prop);
 }
@@ -5950,6 +5958,19 @@ static void usestat (LexState *ls) {
   const auto line = ls->t.line;
   luaX_next(ls); /* skip 'pluto_use' */
   do {
+    /* 'optimize' is not a keyword but a code generation option */
+    if (ls->t.token == TK_NAME && strcmp(getstr(ls->t.seminfo.ts), "optimize") == 0) {
+      luaX_next(ls);
+      bool enable = true;
+      if (testnext(ls, '=')) {
+        if (testnext(ls, TK_FALSE))
+          enable = false;
+        else checknext(ls, TK_TRUE);
+      }
+      ls->optimize = enable;
+      continue;
+    }
+
     /* check affected tokens */
     bool is_all = false;
     bool is_version = false;
@@ -6809,6 +6830,7 @@ LClosure *luaY_parser (lua_State *L, LexState& lexstate, ZIO *z, Mbuffer *buff,
     applyenvkeywordpreference(&lexstate, TK_PARENT, L->l_G->preference_parent);
   if (L->l_G->have_preference_export)
     applyenvkeywordpreference(&lexstate, TK_EXPORT, L->l_G->preference_export);
+  lexstate.optimize = L->l_G->optimize;
   mainfunc(&lexstate, &funcstate);
   lua_assert(!funcstate.prev && funcstate.nups == 1 && !lexstate.fs);
   /* all scopes should be correctly finished */
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <algorithm> // min
+#include <climits> // INT_MAX
+#include <cstdint>
+#include <cstring> // memcpy
+#include <string>
+#include <unordered_map>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lstate.h" // luaE_incCstack
+
+/*
+** Compact binary encoding of Lua values, used by serialise/deserialise and
+** to move values between states.
+**
+** The first byte is the format version. It is followed by a single value:
+**   nil, false, true        tag only
+**   integer                 tag, zigzag varint
+**   float                   tag, 8 bytes IEEE 754 (little endian)
+**   string                  tag, varint length, bytes
+**   table                   tag, varint narr, varint nhash, narr values, nhash key/value pairs
+**   reference               tag, varint index of a previously started table
+** Tables are numbered in the order they are started, so shared references and
+** cycles are preserved. Metatables are not. Tags from SER_EXT onwards are
+** reserved for users of the encoder that need to handle additional types.
+*/
+
+#define PLUTO_SERIALISE_VERSION 1
+
+enum SerialiseTag : uint8_t {
+  SER_NIL,
+  SER_FALSE,
+  SER_TRUE,
+  SER_INT,
+  SER_FLT,
+  SER_STR,
+  SER_TABLE,
+  SER_REF,
+  SER_EXT,
+};
+
+struct Serialiser {
+  std::string& out;
+  std::unordered_map<const void*, lua_Unsigned> tables;
+
+  explicit Serialiser (std::string& out) : out(out) {}
+  virtual ~Serialiser () = default;
+
+  void writeu (lua_Unsigned v) {
+    while (v >= 0x80) {
+      out.push_back((char)((v & 0x7f) | 0x80));
+      v >>= 7;
+    }
+    out.push_back((char)v);
+  }
+
+  void writeflt (lua_Number n) {
+    const double d = (double)n;
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    for (int i = 0; i != 8; ++i, bits >>= 8)
+      out.push_back((char)(bits & 0xff));
+  }
+
+  /* Override to encode userdata; return false to reject the value. */
+  virtual bool encodeuserdata (lua_State *L, int idx) {
+    return false;
+  }
+
+  void encode (lua_State *L, int idx) {
+    idx = lua_absindex(L, idx);
+    switch (lua_type(L, idx)) {
+      case LUA_TNIL:
+        out.push_back(SER_NIL);
+        return;
+      case LUA_TBOOLEAN:
+        out.push_back(lua_toboolean(L, idx) ? SER_TRUE : SER_FALSE);
+        return;
+      case LUA_TNUMBER:
+        if (lua_isinteger(L, idx)) {
+          const auto i = (lua_Unsigned)lua_tointeger(L, idx);
+          out.push_back(SER_INT);
+          writeu((i << 1) ^ (lua_Unsigned)((lua_Integer)i >> (sizeof(lua_Integer) * 8 - 1)));
+        }
+        else {
+          out.push_back(SER_FLT);
+          writeflt(lua_tonumber(L, idx));
+        }
+        return;
+      case LUA_TSTRING: {
+        size_t len;
+        const char *str = lua_tolstring(L, idx, &len);
+        out.push_back(SER_STR);
+        writeu(len);
+        out.append(str, len);
+        return;
+      }
+      case LUA_TTABLE:
+        encodetable(L, idx);
+        return;
+      case LUA_TUSERDATA:
+        if (encodeuserdata(L, idx))
+          return;
+        [[fallthrough]];
+      default:
+        luaL_error(L, "cannot serialise a %s value", luaL_typename(L, idx));
+    }
+  }
+
+  void encodetable (lua_State *L, int idx) {
+    const void *p = lua_topointer(L, idx);
+    if (auto e = tables.find(p); e != tables.end()) {
+      out.push_back(SER_REF);
+      writeu(e->second);
+      return;
+    }
+    const auto ref = (lua_Unsigned)tables.size();
+    tables.emplace(p, ref);
+    luaE_incCstack(L);
+    luaL_checkstack(L, 3, "table is nested too deeply");
+    const lua_Unsigned narr = lua_rawlen(L, idx);
+    lua_Unsigned nhash = 0;
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      lua_pop(L, 1);
+      if (!inarray(L, -1, narr))
+        ++nhash;
+    }
+    out.push_back(SER_TABLE);
+    writeu(narr);
+    writeu(nhash);
+    for (lua_Unsigned i = 1; i <= narr; ++i) {
+      lua_rawgeti(L, idx, (lua_Integer)i);
+      encode(L, -1);
+      lua_pop(L, 1);
+    }
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      if (!inarray(L, -2, narr)) {
+        encode(L, -2);
+        encode(L, -1);
+      }
+      lua_pop(L, 1);
+    }
+    L->nCcalls--;
+  }
+
+  [[nodiscard]] static bool inarray (lua_State *L, int idx, lua_Unsigned narr) {
+    return lua_isinteger(L, idx) && (lua_Unsigned)lua_tointeger(L, idx) - 1 < narr;
+  }
+};
+
+struct Deserialiser {
+  const char *data;
+  size_t size;
+  size_t i = 0;
+  int refs = 0;  /* stack index of the table of started tables */
+  lua_Integer nrefs = 0;
+
+  Deserialiser (const char *data, size_t size) : data(data), size(size) {}
+  virtual ~Deserialiser () = default;
+
+  [[noreturn]] static void malformed (lua_State *L) {
+    luaL_error(L, "malformed serialised data");
+  }
+
+  [[nodiscard]] uint8_t readbyte (lua_State *L) {
+    if (l_unlikely(i == size))
+      malformed(L);
+    return (uint8_t)data[i++];
+  }
+
+  [[nodiscard]] lua_Unsigned readu (lua_State *L) {
+    lua_Unsigned v = 0;
+    for (int shift = 0; ; shift += 7) {
+      const uint8_t b = readbyte(L);
+      if (l_unlikely(shift >= (int)(sizeof(lua_Unsigned) * 8)))
+        malformed(L);
+      v |= (lua_Unsigned)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return v;
+    }
+  }
+
+  [[nodiscard]] lua_Number readflt (lua_State *L) {
+    if (l_unlikely(size - i < 8))
+      malformed(L);
+    uint64_t bits = 0;
+    for (int b = 7; b >= 0; --b)
+      bits = (bits << 8) | (uint8_t)data[i + b];
+    i += 8;
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return (lua_Number)d;
+  }
+
+  /* Override to decode tags from SER_EXT onwards. */
+  virtual void decodeext (lua_State *L, uint8_t tag) {
+    malformed(L);
+  }
+
+  /* Pushes 'n' decoded values. */
+  void decodevalues (lua_State *L, int n) {
+    luaL_checkstack(L, n + 1, "too many values");
+    lua_newtable(L);
+    refs = lua_gettop(L);
+    for (int k = 0; k != n; ++k)
+      decode(L);
+    lua_remove(L, refs);
+    refs = 0;
+  }
+
+  /* Pushes the next decoded value. Must be called via decodevalues. */
+  void decode (lua_State *L) {
+    const uint8_t tag = readbyte(L);
+    switch (tag) {
+      case SER_NIL: lua_pushnil(L); return;
+      case SER_FALSE: lua_pushboolean(L, false); return;
+      case SER_TRUE: lua_pushboolean(L, true); return;
+      case SER_INT: {
+        const lua_Unsigned u = readu(L);
+        lua_pushinteger(L, (lua_Integer)((u >> 1) ^ (~(u & 1) + 1)));
+        return;
+      }
+      case SER_FLT:
+        lua_pushnumber(L, readflt(L));
+        return;
+      case SER_STR: {
+        const lua_Unsigned len = readu(L);
+        if (l_unlikely(len > size - i))
+          malformed(L);
+        lua_pushlstring(L, data + i, (size_t)len);
+        i += (size_t)len;
+        return;
+      }
+      case SER_TABLE:
+        decodetable(L);
+        return;
+      case SER_REF: {
+        const lua_Unsigned ref = readu(L);
+        if (l_unlikely(ref >= (lua_Unsigned)nrefs))
+          malformed(L);
+        lua_rawgeti(L, refs, (lua_Integer)ref + 1);
+        return;
+      }
+      default:
+        decodeext(L, tag);
+    }
+  }
+
+  void decodetable (lua_State *L) {
+    const lua_Unsigned narr = readu(L);
+    const lua_Unsigned nhash = readu(L);
+    /* each element takes at least one byte, so this also bounds the preallocation */
+    if (l_unlikely(narr > size - i || nhash > (size - i) / 2))
+      malformed(L);
+    luaE_incCstack(L);
+    luaL_checkstack(L, 4, "table is nested too deeply");
+    lua_createtable(L, (int)std::min<lua_Unsigned>(narr, INT_MAX), (int)std::min<lua_Unsigned>(nhash, INT_MAX));
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, refs, ++nrefs);
+    for (lua_Unsigned k = 1; k <= narr; ++k) {
+      decode(L);
+      lua_rawseti(L, -2, (lua_Integer)k);
+    }
+    for (lua_Unsigned k = 0; k != nhash; ++k) {
+      decode(L);
+      decode(L);
+      lua_rawset(L, -3);
+    }
+    L->nCcalls--;
+  }
+};
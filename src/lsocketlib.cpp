@@ -4,6 +4,7 @@
 #include "lualib.h"
 #include "lstate.h"
 
+#include <algorithm> // max
 #include <deque>
 #include <queue>
 #include <vector>
@@ -15,24 +16,116 @@
 #include "vendor/Soup/soup/os.hpp"
 #include "vendor/Soup/soup/ResolveIpAddrTask.hpp"
 #include "vendor/Soup/soup/Scheduler.hpp"
-#include "vendor/Soup/soup/Server.hpp"
-#include "vendor/Soup/soup/ServerService.hpp"
 #include "vendor/Soup/soup/Socket.hpp"
+#include "vendor/Soup/soup/StringWriter.hpp"
+#include "vendor/Soup/soup/time.hpp"
 #include "vendor/Soup/soup/TlsExtAlpn.hpp"
+#include "vendor/Soup/soup/TlsRecord.hpp"
+
+#if !SOUP_WINDOWS
+#include <cerrno>
+#include <sys/uio.h>
+#endif
+#if SOUP_LINUX
+#include <sys/sendfile.h>
+#endif
+
+#include "lbufferlib.hpp"
+
+/*
+** All sockets and listeners of a state share one scheduler, so a round of
+** blocked coroutines costs a single poll over every descriptor instead of one
+** poll per socket. It lives in the registry and is created on first use.
+*/
+struct Reactor : public soup::Scheduler {
+  std::time_t next_tick = 0;
+
+  void tick() {
+    const auto start = soup::time::micros();
+    soup::Scheduler::tick();
+    const auto end = soup::time::micros();
+    next_tick = end + std::max<std::time_t>(1, end - start);
+  }
+
+  /* However many coroutines are waiting, spend at most half the time polling. */
+  void tickIfDue() {
+    if (soup::time::micros() >= next_tick)
+      tick();
+  }
+};
+
+[[nodiscard]] static Reactor& getreactor (lua_State *L) {
+  if (lua_getfield(L, LUA_REGISTRYINDEX, "pluto:socket-reactor") == LUA_TNIL) {
+    lua_pop(L, 1);
+    pluto_newclassinst(L, Reactor);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "pluto:socket-reactor");
+  }
+  Reactor& r = *(Reactor*)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return r;
+}
+
+/* Closes a socket owned by a collected object and makes sure the reactor never fires its callbacks again. */
+static void releasesocket (soup::Socket& s) {
+  s.close();
+  s.setWorkDone();
+}
 
 struct StandaloneSocket {
-  soup::Scheduler sched;
+  Reactor* reactor;
   soup::SharedPtr<soup::Socket> sock;
+#if SOUP_WINDOWS
+  soup::SharedPtr<soup::Socket> udp4;  /* for UDP servers, which need a socket per address family */
+  soup::SharedPtr<soup::Socket> udp6;
+#endif
+  soup::SharedPtr<soup::Worker> task;  /* pending connect or resolve */
   std::deque<std::string> recvd;
+  size_t consumed = 0;  /* bytes at the start of recvd.front() already taken by framed receives */
+  size_t position = 0;  /* bytes taken from the stream so far (modulo SIZE_MAX + 1), see 'recvuntilk' */
+  size_t received = 0;  /* likewise, bytes put in the queue so far */
+  size_t wanted = 0;  /* bytes a pending read waits for, which are queued regardless of the limit below */
   bool udp = false;
   bool did_tls_handshake = false;
   bool from_listener = false;
 
+  StandaloneSocket(Reactor& reactor) : reactor(&reactor) {}
+
+  ~StandaloneSocket() {
+    if (sock)
+      releasesocket(*sock);
+#if SOUP_WINDOWS
+    if (udp4)
+      releasesocket(*udp4);
+    if (udp6)
+      releasesocket(*udp6);
+#endif
+  }
+
+  /*
+  ** Once this many chunks are queued, stop reading until half of them were consumed, so a slow reader holds back the
+  ** peer instead of filling our memory. A read that needs more data than that keeps reading going until it has it.
+  */
+  static constexpr size_t max_queued_chunks = 256;
+
   void recvLoop() SOUP_EXCAL {
     sock->recv([](soup::Socket&, std::string&& data, soup::Capture&& cap) SOUP_EXCAL {
       StandaloneSocket& ss = *cap.get<StandaloneSocket*>();
+      ss.received += data.size();
       ss.recvd.push_back(std::move(data));
-      ss.recvLoop();
+      if (ss.recvd.size() < max_queued_chunks || ss.available() < ss.wanted)
+        ss.recvLoop();
+      else
+        ss.pauseRecv();
+    }, this);
+  }
+
+  void pauseRecv() noexcept {
+    sock->holdup_type = soup::Worker::IDLE;
+    sock->holdup_callback.set([](soup::Worker&, soup::Capture&& cap) SOUP_EXCAL {
+      StandaloneSocket& ss = *cap.get<StandaloneSocket*>();
+      if (ss.recvd.size() < max_queued_chunks / 2 || ss.available() < ss.wanted)
+        ss.recvLoop();
     }, this);
   }
 
@@ -45,13 +138,72 @@ struct StandaloneSocket {
 #if SOUP_WINDOWS
       if (ss.from_listener) {
         s.peer = std::move(addr);
-        ss.sock = ss.sched.getShared(s);  /* we may need to switch from IPv6 to IPv4 or vice-versa */
+        ss.sock = (&s == ss.udp4.get()) ? ss.udp4 : ss.udp6;  /* we may need to switch from IPv6 to IPv4 or vice-versa */
       }
 #endif
+      ss.received += data.size();
       ss.recvd.push_back(std::move(data));
       ss.recvLoopUdp(s);
     }, this);
   }
+
+  /* Drops the bytes framed receives took from the first chunk, for code that works on whole chunks. */
+  void trim() {
+    if (consumed != 0) {
+      recvd.front().erase(0, consumed);
+      consumed = 0;
+    }
+  }
+
+  [[nodiscard]] size_t available() const noexcept {
+    return received - position;
+  }
+
+  /* Removes n bytes from the queue, which must hold at least that many. */
+  [[nodiscard]] std::string take(size_t n) {
+    position += n;
+    if (consumed == 0 && recvd.front().size() == n) {
+      std::string res = std::move(recvd.front());
+      recvd.pop_front();
+      return res;
+    }
+    std::string res;
+    res.reserve(n);
+    while (res.size() != n) {
+      const std::string& chunk = recvd.front();
+      const size_t k = std::min(n - res.size(), chunk.size() - consumed);
+      res.append(chunk, consumed, k);
+      consumed += k;
+      if (consumed == chunk.size()) {
+        recvd.pop_front();
+        consumed = 0;
+      }
+    }
+    return res;
+  }
+
+  /*
+  ** Looks for the delimiter, joining chunks into the first one as needed so it never straddles a boundary.
+  ** 'scanned' is where the search resumes in the first chunk. Returns the offset of the delimiter from the
+  ** start of the unread data, or npos.
+  */
+  [[nodiscard]] size_t find(const char *delim, size_t dlen, size_t& scanned) {
+    if (recvd.empty())
+      return std::string::npos;
+    while (true) {
+      const std::string& front = recvd.front();
+      const size_t pos = front.find(delim, std::max(scanned, consumed), dlen);
+      if (pos != std::string::npos)
+        return pos - consumed;
+      scanned = front.size() >= dlen ? front.size() - dlen + 1 : 0;
+      if (recvd.size() == 1)
+        return std::string::npos;
+      std::string joined = std::move(recvd.front());
+      recvd.pop_front();
+      joined.append(recvd.front());
+      recvd.front() = std::move(joined);
+    }
+  }
 };
 
 using AlpnProtocol = std::string;
@@ -62,7 +214,8 @@ static StandaloneSocket* checksocket (lua_State *L, int i) {
 }
 
 static StandaloneSocket& pushsocket (lua_State *L) {
-  StandaloneSocket& ss = *new (lua_newuserdata(L, sizeof(StandaloneSocket))) StandaloneSocket{};
+  Reactor& reactor = getreactor(L);  /* created first, so it is also finalised after the socket on close */
+  StandaloneSocket& ss = *new (lua_newuserdata(L, sizeof(StandaloneSocket))) StandaloneSocket(reactor);
   if (luaL_newmetatable(L, "pluto:socket")) {
     lua_pushliteral(L, "__index");
     luaL_loadbuffer(L, "return require\"pluto:socket\"", 28, 0);
@@ -81,38 +234,40 @@ static StandaloneSocket& pushsocket (lua_State *L) {
 }
 
 static int connectcont (lua_State *L, int status, lua_KContext ctx) {
-  StandaloneSocket& ss = *checksocket(L, -1);
-  auto pTask = reinterpret_cast<soup::netConnectTask*>(ctx);
-  if (pTask->isWorkDone()) {
-    if (!pTask->wasSuccessful()) {
-      return 0;
-    }
-    ss.sock = pTask->getSocket(ss.sched);
-    ss.recvLoop();
-    ss.sched.tick();  /* get rid of netConnectTask */
-    return 1;
+  StandaloneSocket& ss = *reinterpret_cast<StandaloneSocket*>(ctx);
+  if (!ss.task->isWorkDone()) {
+    ss.reactor->tickIfDue();
+    if (!ss.task->isWorkDone())
+      return lua_yieldk(L, 0, ctx, connectcont);
+  }
+  auto spTask = std::move(ss.task);  /* the reactor drops finished tasks on its own */
+  auto pTask = static_cast<soup::netConnectTask*>(spTask.get());
+  if (!pTask->wasSuccessful()) {
+    return 0;
   }
-  ss.sched.tick();
-  return lua_yieldk(L, 0, ctx, connectcont);
+  ss.sock = pTask->getSocket(*ss.reactor);
+  ss.recvLoop();
+  return 1;
 }
 
-static int restconnectudp (lua_State *L, soup::ResolveIpAddrTask *pTask) {
+static int restconnectudp (lua_State *L, StandaloneSocket& ss) {
+  auto spTask = std::move(ss.task);
+  auto pTask = static_cast<soup::ResolveIpAddrTask*>(spTask.get());
   if (l_unlikely(!pTask->result.has_value())) {
     return 0;
   }
-  StandaloneSocket& ss = *checksocket(L, -1);
   ss.sock->peer.ip = std::move(*pTask->result);
-  ss.sched.tick();  /* get rid of ResolveIpAddrTask */
   return 1;
 }
 
 static int connectudpcont (lua_State *L, int status, lua_KContext ctx) {
-  auto pTask = reinterpret_cast<soup::ResolveIpAddrTask*>(ctx);
-  if (pTask->isWorkDone())
-    return restconnectudp(L, pTask);
-  StandaloneSocket& ss = *checksocket(L, -1);
-  ss.sched.tick();
-  return lua_yieldk(L, 0, ctx, connectudpcont);
+  StandaloneSocket& ss = *reinterpret_cast<StandaloneSocket*>(ctx);
+  if (!ss.task->isWorkDone()) {
+    ss.reactor->tickIfDue();
+    if (!ss.task->isWorkDone())
+      return lua_yieldk(L, 0, ctx, connectudpcont);
+  }
+  return restconnectudp(L, ss);
 }
 
 static int l_connect (lua_State *L) {
@@ -124,7 +279,7 @@ static int l_connect (lua_State *L) {
   StandaloneSocket& ss = pushsocket(L);
 
   if (udp) {
-    ss.sock = ss.sched.addSocket();
+    ss.sock = ss.reactor->addSocket();
     const bool host_is_ip_addr = ss.sock->peer.ip.fromString(host);
     ss.sock->peer.port = soup::Endianness::toNetwork(soup::native_u16_t(port));
 #if SOUP_WINDOWS
@@ -135,50 +290,361 @@ static int l_connect (lua_State *L) {
     ss.udp = true;
     ss.recvLoopUdp(*ss.sock);
     if (!host_is_ip_addr) {
-      auto spTask = ss.sched.add<soup::ResolveIpAddrTask>(host);
-      ss.sched.tick();
-      lua_assert(!spTask->isWorkDone());
-      if (lua_isyieldable(L)) {
-        const auto ctx = reinterpret_cast<lua_KContext>(spTask.get());
-        spTask.reset();
-        return lua_yieldk(L, 0, ctx, connectudpcont);
-      }
-      do {
+      ss.task = ss.reactor->add<soup::ResolveIpAddrTask>(host);
+      ss.reactor->tickIfDue();
+      if (lua_isyieldable(L))
+        return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(&ss), connectudpcont);
+      while (!ss.task->isWorkDone()) {
         soup::os::sleep(1);
-        ss.sched.tick();
-      } while (!spTask->isWorkDone());
-      return restconnectudp(L, spTask.get());
+        ss.reactor->tick();
+      }
+      return restconnectudp(L, ss);
     }
     return 1;
   }
 
   if (!lua_isyieldable(L)) {
-    ss.sock = ss.sched.addSocket();
+    ss.sock = ss.reactor->addSocket();
     if (l_unlikely(!ss.sock->connect(host, port)))
       return 0;
     ss.recvLoop();
     return 1;
   }
 
-  auto pTask = ss.sched.add<soup::netConnectTask>(host, port).get();
-  ss.sched.tick();
-  lua_assert(!pTask->isWorkDone());
-  return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(pTask), connectcont);
+  ss.task = ss.reactor->add<soup::netConnectTask>(host, port);
+  ss.reactor->tickIfDue();
+  return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(&ss), connectcont);
+}
+
+/* Progress of a send, sendfile or sendv call, kept on the stack while it waits for the socket to become writable. */
+struct PendingSend {
+  StandaloneSocket* ss;
+  lua_Integer sent = 0;
+  /* sendfile */
+  FILE* file = nullptr;
+  bool ownsfile = false;
+  lua_Integer offset = 0;
+  lua_Integer remaining = -1;  /* not yet taken from the file, or -1 to send up to its end */
+  std::string chunk;  /* read from the file but not yet written, for when the kernel can't send the file itself */
+  size_t chunkoff = 0;
+  /* send and sendv */
+  lua_Integer idx = 1;
+  size_t off = 0;
+
+  PendingSend(StandaloneSocket& ss) : ss(&ss) {}
+
+  ~PendingSend() {
+    if (ownsfile)
+      fclose(file);
+  }
+};
+
+/* Writes what the socket takes right away. Returns the number of bytes written, 0 if it would block, or -1 on error. */
+[[nodiscard]] static lua_Integer writesome (soup::Socket& sock, const char *data, size_t len) {
+#if SOUP_WINDOWS
+  const int n = ::send(sock.fd, data, (int)std::min<size_t>(len, INT_MAX), 0);
+  if (n == SOCKET_ERROR)
+    return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+#else
+  const ssize_t n = ::send(sock.fd, data, len, 0);
+  if (n < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+#endif
+  return n;
+}
+
+/* Blocks until the socket is writable, for callers that can't yield. */
+static void awaitwritable (soup::Socket& sock) {
+  pollfd pfd{};
+  pfd.fd = sock.fd;
+  pfd.events = POLLOUT;
+#if SOUP_WINDOWS
+  ::WSAPoll(&pfd, 1, 100);
+#else
+  ::poll(&pfd, 1, 100);
+#endif
+}
+
+[[nodiscard]] static bool isplaintcp (const StandaloneSocket& ss) {
+  return !ss.udp && !ss.sock->tls_encrypter_send.isActive();
+}
+
+/*
+** Encrypts data into TLS application data records like Socket::send does, but leaves writing them to the caller, so
+** that they can wait for the socket like plain data rather than have records cut short.
+*/
+static void tlsseal (soup::Socket& sock, const char *data, size_t len, std::string& out) {
+  out.clear();
+  while (len != 0) {
+    const size_t n = std::min<size_t>(len, 16384);
+    const auto body = sock.tls_encrypter_send.encrypt(soup::TlsContentType::application_data, data, n);
+    soup::TlsRecord record{};
+    record.content_type = soup::TlsContentType::application_data;
+    record.length = static_cast<uint16_t>(body.size());
+    soup::StringWriter w;
+    record.write(w);
+    out.append(w.data);
+    out.append((const char*)body.data(), body.size());
+    data += n;
+    len -= n;
+  }
+}
+
+/* Seeks to an absolute offset, which may be past 2 GiB even where 'long' has 32 bits. */
+[[nodiscard]] static bool seekto (FILE *f, lua_Integer offset) {
+#if SOUP_WINDOWS
+  return _fseeki64(f, (__int64)offset, SEEK_SET) == 0;
+#else
+  return fseeko(f, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static int sendk (lua_State *L, int status, lua_KContext ctx) {
+  PendingSend& ps = *reinterpret_cast<PendingSend*>(ctx);
+  soup::Socket& sock = *ps.ss->sock;
+  size_t len;
+  const char *str = tobytes(L, 2, &len);
+  while (ps.off < len && !sock.isWorkDoneOrClosed()) {  /* a buffer may have shrunk while we were waiting */
+    const lua_Integer n = writesome(sock, str + ps.off, len - ps.off);
+    if (n < 0)
+      break;
+    if (n > 0) {
+      ps.off += n;
+      continue;
+    }
+    if (lua_isyieldable(L))
+      return lua_yieldk(L, 0, ctx, sendk);
+    awaitwritable(sock);
+  }
+  return 0;
 }
 
 static int l_send (lua_State *L) {
   size_t len;
-  const char *str = luaL_checklstring(L, 2, &len);
+  const char *str = checkbytes(L, 2, &len);
   StandaloneSocket& ss = *checksocket(L, 1);
   if (ss.udp)
     ss.sock->udpServerSend(ss.sock->peer, str, len);
-  else
+  else if (!isplaintcp(ss))
     ss.sock->send(str, len);
+  else {
+    /* Write straight from the string or buffer, and wait rather than drop data when the socket's buffer is full. */
+    const lua_Integer n = writesome(*ss.sock, str, len);
+    if (n >= 0 && (size_t)n != len) {
+      lua_settop(L, 2);
+      PendingSend& ps = *pluto_newclassinst(L, PendingSend, ss);
+      ps.off = (size_t)n;
+      return sendk(L, 0, reinterpret_cast<lua_KContext>(&ps));
+    }
+  }
   return 0;
 }
 
+static int sendfilek (lua_State *L, int status, lua_KContext ctx) {
+  PendingSend& ps = *reinterpret_cast<PendingSend*>(ctx);
+  soup::Socket& sock = *ps.ss->sock;
+  const bool plain = isplaintcp(*ps.ss);
+#if SOUP_LINUX
+  bool kernel = plain;
+#endif
+  while ((ps.remaining != 0 || ps.chunkoff != ps.chunk.size()) && !sock.isWorkDoneOrClosed()) {
+#if SOUP_LINUX
+    if (kernel && ps.chunkoff == ps.chunk.size()) {
+      off_t off = (off_t)ps.offset;
+      const size_t count = (ps.remaining < 0 || ps.remaining > 0x40000000) ? 0x40000000 : (size_t)ps.remaining;
+      const ssize_t n = ::sendfile(sock.fd, fileno(ps.file), &off, count);
+      if (n > 0) {
+        ps.offset += n;
+        ps.sent += n;
+        if (ps.remaining > 0)
+          ps.remaining -= n;
+        continue;
+      }
+      if (n == 0)
+        break;  /* end of file */
+      if (errno == EINVAL || errno == ENOSYS) {  /* not something the kernel can send from, e.g. a pipe */
+        kernel = false;
+        continue;
+      }
+      if (errno != EAGAIN && errno != EINTR)
+        break;
+      if (lua_isyieldable(L))
+        return lua_yieldk(L, 0, ctx, sendfilek);
+      awaitwritable(sock);
+      continue;
+    }
+#endif
+    if (ps.chunkoff == ps.chunk.size()) {
+      ps.chunk.resize((ps.remaining < 0 || ps.remaining > 0x10000) ? 0x10000 : (size_t)ps.remaining);
+      if (!seekto(ps.file, ps.offset))
+        break;
+      ps.chunk.resize(fread(ps.chunk.data(), 1, ps.chunk.size(), ps.file));
+      ps.chunkoff = 0;
+      if (ps.chunk.empty())
+        break;  /* end of file */
+      ps.offset += ps.chunk.size();
+      if (ps.remaining > 0)
+        ps.remaining -= ps.chunk.size();
+      if (!plain) {  /* TLS needs the data in user space anyway; what gets written are the records */
+        ps.sent += ps.chunk.size();
+        std::string records;
+        tlsseal(sock, ps.chunk.data(), ps.chunk.size(), records);
+        ps.chunk = std::move(records);
+      }
+    }
+    const lua_Integer n = writesome(sock, ps.chunk.data() + ps.chunkoff, ps.chunk.size() - ps.chunkoff);
+    if (n < 0)
+      break;
+    if (n > 0) {
+      ps.chunkoff += n;
+      if (plain)
+        ps.sent += n;
+      continue;
+    }
+    if (lua_isyieldable(L))
+      return lua_yieldk(L, 0, ctx, sendfilek);
+    awaitwritable(sock);
+  }
+  lua_pushinteger(L, ps.sent);
+  return 1;
+}
+
+static int l_sendfile (lua_State *L) {
+  StandaloneSocket& ss = *checksocket(L, 1);
+  if (l_unlikely(ss.udp))
+    luaL_error(L, "sendfile is only available on TCP sockets");
+  const lua_Integer offset = luaL_optinteger(L, 3, 0);
+  luaL_argcheck(L, offset >= 0, 3, "offset must be non-negative");
+  const lua_Integer len = luaL_optinteger(L, 4, -1);
+  luaL_argcheck(L, len >= -1, 4, "length must be non-negative");
+  lua_settop(L, 4);
+  PendingSend& ps = *pluto_newclassinst(L, PendingSend, ss);
+  if (const auto stream = (luaL_Stream*)luaL_testudata(L, 2, LUA_FILEHANDLE)) {
+    if (l_unlikely(stream->closef == nullptr))
+      luaL_error(L, "attempt to use a closed file");
+    fflush(stream->f);
+    ps.file = stream->f;
+  }
+  else {
+    const char *path = luaL_checkstring(L, 2);
+    ps.file = fopen(path, "rb");
+    if (l_unlikely(!ps.file))
+      return luaL_fileresult(L, 0, path);
+    ps.ownsfile = true;
+  }
+  ps.offset = offset;
+  ps.remaining = len;
+  return sendfilek(L, 0, reinterpret_cast<lua_KContext>(&ps));
+}
+
+[[nodiscard]] static const char *sendvelement (lua_State *L, int idx, size_t *len) {
+  if (lua_type(L, idx) == LUA_TSTRING)
+    return lua_tolstring(L, idx, len);
+  if (const auto buf = testbuffer(L, idx)) {
+    *len = buf->size();
+    return buf->data() ? (const char*)buf->data() : "";
+  }
+  luaL_error(L, "sendv expects a list of strings and buffers, found %s", luaL_typename(L, idx));
+}
+
+static int sendvk (lua_State *L, int status, lua_KContext ctx) {
+  PendingSend& ps = *reinterpret_cast<PendingSend*>(ctx);
+  soup::Socket& sock = *ps.ss->sock;
+  while (!sock.isWorkDoneOrClosed()) {
+#if SOUP_WINDOWS
+    WSABUF iov[64];
+#else
+    iovec iov[64];
+#endif
+    int n = 0;
+    for (lua_Integer i = ps.idx; n != 64; ++i) {
+      if (lua_rawgeti(L, 2, i) == LUA_TNIL) {
+        lua_pop(L, 1);
+        break;
+      }
+      size_t len;
+      const char *data = sendvelement(L, -1, &len);  /* stays alive because the list references it */
+      lua_pop(L, 1);
+      if (i == ps.idx) {
+        const size_t skip = std::min(ps.off, len);  /* a buffer may have shrunk while we were waiting */
+        data += skip;
+        len -= skip;
+      }
+      if (len == 0)
+        continue;
+#if SOUP_WINDOWS
+      iov[n].buf = (CHAR*)data;
+      iov[n].len = (ULONG)std::min<size_t>(len, ULONG_MAX);
+#else
+      iov[n].iov_base = (void*)data;
+      iov[n].iov_len = len;
+#endif
+      ++n;
+    }
+    if (n == 0)
+      break;  /* all written */
+#if SOUP_WINDOWS
+    DWORD written;
+    lua_Integer w = (::WSASend(sock.fd, iov, n, &written, 0, nullptr, nullptr) == 0) ? (lua_Integer)written : (WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1);
+#else
+    lua_Integer w = ::writev(sock.fd, iov, n);
+    if (w < 0)
+      w = (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+#endif
+    if (w < 0)
+      break;
+    if (w == 0) {
+      if (lua_isyieldable(L))
+        return lua_yieldk(L, 0, ctx, sendvk);
+      awaitwritable(sock);
+      continue;
+    }
+    ps.sent += w;
+    while (w != 0) {  /* advance past what was written */
+      lua_rawgeti(L, 2, ps.idx);
+      size_t len;
+      (void)sendvelement(L, -1, &len);  /* only the length is needed; the data is already written */
+      lua_pop(L, 1);
+      const size_t k = std::min<size_t>((size_t)w, len - ps.off);
+      ps.off += k;
+      w -= k;
+      if (ps.off == len) {
+        ++ps.idx;
+        ps.off = 0;
+      }
+    }
+  }
+  lua_pushinteger(L, ps.sent);
+  return 1;
+}
+
+static int l_sendv (lua_State *L) {
+  StandaloneSocket& ss = *checksocket(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  if (!isplaintcp(ss)) {  /* a datagram or TLS record needs to be assembled in user space anyway */
+    std::string data;
+    for (lua_Integer i = 1; lua_rawgeti(L, 2, i) != LUA_TNIL; ++i) {
+      size_t len;
+      const char *str = sendvelement(L, -1, &len);
+      data.append(str, len);
+      lua_pop(L, 1);
+    }
+    if (ss.udp)
+      ss.sock->udpServerSend(ss.sock->peer, data);
+    else
+      ss.sock->send(data);
+    lua_pushinteger(L, (lua_Integer)data.size());
+    return 1;
+  }
+  PendingSend& ps = *pluto_newclassinst(L, PendingSend, ss);
+  return sendvk(L, 0, reinterpret_cast<lua_KContext>(&ps));
+}
+
 static int restrecv (lua_State *L, StandaloneSocket& ss) {
   if (!ss.recvd.empty()) {
+    ss.trim();
+    ss.position += ss.recvd.front().size();
     pluto_pushstring(L, std::move(ss.recvd.front()));
     ss.recvd.pop_front();
     return 1;
@@ -189,8 +655,8 @@ static int restrecv (lua_State *L, StandaloneSocket& ss) {
 static int recvcont (lua_State *L, int status, lua_KContext ctx) {
   StandaloneSocket& ss = *reinterpret_cast<StandaloneSocket*>(ctx);
   if (ss.recvd.empty()) {
-    ss.sched.tick();
-    if (!ss.sock->isWorkDone()) {
+    ss.reactor->tickIfDue();
+    if (ss.recvd.empty() && !ss.sock->isWorkDone()) {
       return lua_yieldk(L, 0, ctx, recvcont);
     }
   }
@@ -199,8 +665,9 @@ static int recvcont (lua_State *L, int status, lua_KContext ctx) {
 
 static int l_peek (lua_State *L) {
   StandaloneSocket& ss = *checksocket(L, 1);
-  ss.sched.tick();
+  ss.reactor->tickIfDue();
   if (!ss.recvd.empty()) {
+    ss.trim();
     pluto_pushstring(L, ss.recvd.front());
     return 1;
   }
@@ -209,26 +676,193 @@ static int l_peek (lua_State *L) {
 
 static int l_recv (lua_State *L) {
   StandaloneSocket& ss = *checksocket(L, 1);
-  ss.sched.tick();
+  if (ss.recvd.empty())
+    ss.reactor->tickIfDue();
   if (ss.recvd.empty()) {
     if (lua_isyieldable(L))
       return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(&ss), recvcont);
     while (ss.recvd.empty() && !ss.sock->isWorkDone()) {
       soup::os::sleep(1);
-      ss.sched.tick();
+      ss.reactor->tick();
     }
   }
   return restrecv(L, ss);
 }
 
+/* Writes what has arrived, up to the given number of bytes, to the file. */
+static int restrecvfile (lua_State *L, StandaloneSocket& ss) {
+  if (ss.recvd.empty())
+    return 0;
+  FILE *f = ((luaL_Stream*)lua_touserdata(L, 2))->f;
+  const lua_Integer max = luaL_optinteger(L, 3, LUA_MAXINTEGER);
+  lua_Integer written = 0;
+  while (!ss.recvd.empty() && written != max) {
+    const std::string& chunk = ss.recvd.front();
+    const size_t k = (size_t)std::min<lua_Integer>(chunk.size() - ss.consumed, max - written);
+    if (l_unlikely(fwrite(chunk.data() + ss.consumed, 1, k, f) != k))
+      return luaL_fileresult(L, 0, nullptr);
+    written += k;
+    ss.consumed += k;
+    ss.position += k;
+    if (ss.consumed == chunk.size()) {
+      ss.recvd.pop_front();
+      ss.consumed = 0;
+    }
+  }
+  lua_pushinteger(L, written);
+  return 1;
+}
+
+static int recvfilecont (lua_State *L, int status, lua_KContext ctx) {
+  StandaloneSocket& ss = *reinterpret_cast<StandaloneSocket*>(ctx);
+  if (ss.recvd.empty()) {
+    ss.reactor->tickIfDue();
+    if (ss.recvd.empty() && !ss.sock->isWorkDone()) {
+      return lua_yieldk(L, 0, ctx, recvfilecont);
+    }
+  }
+  return restrecvfile(L, ss);
+}
+
+/* Like recv, but writes the data to a file handle instead of returning it, and returns the number of bytes written. */
+static int recvfile (lua_State *L) {
+  StandaloneSocket& ss = *checksocket(L, 1);
+  const auto stream = (luaL_Stream*)luaL_checkudata(L, 2, LUA_FILEHANDLE);
+  if (l_unlikely(stream->closef == nullptr))
+    luaL_error(L, "attempt to use a closed file");
+  luaL_argcheck(L, luaL_optinteger(L, 3, 1) > 0, 3, "length must be positive");
+  if (ss.recvd.empty())
+    ss.reactor->tickIfDue();
+  if (ss.recvd.empty()) {
+    if (lua_isyieldable(L))
+      return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(&ss), recvfilecont);
+    while (ss.recvd.empty() && !ss.sock->isWorkDone()) {
+      soup::os::sleep(1);
+      ss.reactor->tick();
+    }
+  }
+  return restrecvfile(L, ss);
+}
+
 static int unrecv (lua_State *L) {
-  checksocket(L, 1)->recvd.push_front(pluto_checkstring(L, 2));
+  StandaloneSocket& ss = *checksocket(L, 1);
+  ss.trim();
+  const size_t skip = ss.available() + 1;  /* renumbers the queued data, so searches in progress start over */
+  ss.position += skip;
+  ss.received += skip;
+  ss.recvd.push_front(pluto_checkstring(L, 2));
+  ss.received += ss.recvd.front().size();
   return 0;
 }
 
+static int recvexactk (lua_State *L);
+
+static int recvexactcont (lua_State *L, int status, lua_KContext ctx) {
+  return recvexactk(L);
+}
+
+static int recvexactk (lua_State *L) {
+  StandaloneSocket& ss = *checksocket(L, 1);
+  const lua_Integer n = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, n >= 0, 2, "length must be non-negative");
+  for (bool ticked = false; ; ticked = true) {
+    if (ss.available() >= (size_t)n) {
+      ss.wanted = 0;
+      pluto_pushstring(L, n == 0 ? std::string() : ss.take((size_t)n));
+      return 1;
+    }
+    ss.wanted = (size_t)n;  /* keep reading even if that is more than is normally queued */
+    if (!ticked) {
+      ss.reactor->tickIfDue();
+      continue;
+    }
+    if (ss.sock->isWorkDone()) {
+      ss.wanted = 0;
+      return 0;
+    }
+    if (lua_isyieldable(L))
+      return lua_yieldk(L, 0, 0, recvexactcont);
+    soup::os::sleep(1);
+    ss.reactor->tick();
+  }
+}
+
+static int recvexact (lua_State *L) {
+  return recvexactk(L);
+}
+
+/*
+** Shared by recvuntil and recvline; the stack holds the socket, delimiter and limit. 'resume' is the
+** stream position up to which an earlier attempt searched. It is kept as a position in the stream
+** rather than an offset into the queue, because other coroutines may receive while we are yielded.
+*/
+static int recvuntilk (lua_State *L, size_t resume, bool line);
+
+static int recvuntilcont (lua_State *L, int status, lua_KContext ctx) {
+  return recvuntilk(L, (size_t)ctx, false);
+}
+
+static int recvlinecont (lua_State *L, int status, lua_KContext ctx) {
+  return recvuntilk(L, (size_t)ctx, true);
+}
+
+static int recvuntilk (lua_State *L, size_t resume, bool line) {
+  StandaloneSocket& ss = *checksocket(L, 1);
+  size_t dlen;
+  const char *delim = luaL_checklstring(L, 2, &dlen);
+  luaL_argcheck(L, dlen != 0, 2, "delimiter must not be empty");
+  const lua_Integer max = luaL_optinteger(L, 3, LUA_MAXINTEGER);
+  luaL_argcheck(L, max >= 0, 3, "limit must be non-negative");
+  size_t scanned = 0;  /* where the search resumes in the first chunk */
+  if (const size_t done = resume - ss.position; done <= ss.available())  /* otherwise, that data is gone */
+    scanned = ss.consumed + done;
+  for (bool ticked = false; ; ticked = true) {
+    const size_t len = ss.find(delim, dlen, scanned);
+    const size_t searched = len != std::string::npos ? len : scanned > ss.consumed ? scanned - ss.consumed : 0;
+    if (l_unlikely(searched > (lua_Unsigned)max))
+      luaL_error(L, "delimiter not found within %I bytes", (LUAI_UACINT)max);
+    if (len != std::string::npos) {
+      std::string& front = ss.recvd.front();
+      size_t end = ss.consumed + len;
+      if (line && end != ss.consumed && front[end - 1] == '\r')
+        --end;
+      lua_pushlstring(L, front.data() + ss.consumed, end - ss.consumed);
+      ss.consumed += len + dlen;
+      ss.position += len + dlen;
+      if (ss.consumed == front.size()) {
+        ss.recvd.pop_front();
+        ss.consumed = 0;
+      }
+      return 1;
+    }
+    if (!ticked) {
+      ss.reactor->tickIfDue();
+      continue;
+    }
+    if (ss.sock->isWorkDone())
+      return 0;
+    if (lua_isyieldable(L))
+      return lua_yieldk(L, 0, (lua_KContext)(ss.position + searched), line ? recvlinecont : recvuntilcont);
+    soup::os::sleep(1);
+    ss.reactor->tick();
+  }
+}
+
+static int recvuntil (lua_State *L) {
+  lua_settop(L, 3);
+  return recvuntilk(L, checksocket(L, 1)->position, false);
+}
+
+static int recvline (lua_State *L) {
+  lua_settop(L, 2);
+  lua_pushliteral(L, "\n");
+  lua_insert(L, 2);
+  return recvuntilk(L, checksocket(L, 1)->position, true);
+}
+
 static int starttlscont (lua_State *L, int status, lua_KContext ctx) {
   StandaloneSocket& ss = *reinterpret_cast<StandaloneSocket*>(ctx);
-  ss.sched.tick();
+  ss.reactor->tickIfDue();
   if (l_likely(!ss.did_tls_handshake && !ss.sock->isWorkDone()))
     return lua_yieldk(L, 0, ctx, starttlscont);
   lua_pushboolean(L, ss.did_tls_handshake);
@@ -303,10 +937,12 @@ static int starttls (lua_State *L) {
     }
 
     /* We may have already consumed the client_hello, so we need to give it back to Soup. */
+    ss.trim();
     while (!ss.recvd.empty()) {
       ss.sock->transport_unrecv(ss.recvd.back());
       ss.recvd.pop_back();
     }
+    ss.position = ss.received;
     if (lua_gettop(L) >= 3 && lua_type(L, 3) == LUA_TTABLE) {
       lua_pushliteral(L, "alpn");
       if (lua_rawget(L, 3) > 0) {
@@ -361,7 +997,7 @@ static int starttls (lua_State *L) {
 
   do {
     soup::os::sleep(1);
-    ss.sched.tick();
+    ss.reactor->tick();
   } while (!ss.did_tls_handshake && !ss.sock->isWorkDone());
   lua_pushboolean(L, ss.did_tls_handshake);
   if (ss.sock->custom_data.isStructInMap(AlpnProtocol)) {
@@ -431,7 +1067,7 @@ static int socket_setpeer(lua_State* L) {
 #if SOUP_WINDOWS
   if (ss.from_listener) {
     /* We may need to switch from IPv4 to IPv6 or vice-versa */
-    ss.sock = ss.sched.workers.at(ip.isV4() ? 1 : 0);
+    ss.sock = ip.isV4() ? ss.udp4 : ss.udp6;
   }
   else if (ss.sock->peer.ip.isV4() != ip.isV4()) {
     luaL_error(L, "cannot change address family");
@@ -443,14 +1079,64 @@ static int socket_setpeer(lua_State* L) {
 }
 
 struct Listener {
-  soup::Server serv;
-  soup::ServerService srv{ &onTunnelEstablished };
-  soup::SharedPtr<soup::Socket> accepted;
+  Reactor* reactor;
+  std::vector<soup::SharedPtr<soup::Socket>> socks;  /* empty once closed */
+  std::deque<soup::SharedPtr<soup::Socket>> accepted;
+
+  Listener(Reactor& reactor) : reactor(&reactor) {}
+
+  ~Listener() {
+    close();
+  }
 
-  static void onTunnelEstablished(soup::Socket&, soup::ServerService&, soup::Server& serv) SOUP_EXCAL {
-    auto l = reinterpret_cast<Listener*>(&serv);
-    auto sock = l->serv.pending_workers.pop_front();  /* a bit dirty, but it works. */
-    l->accepted = std::move(*sock);
+  void close() {
+    for (const auto& sock : socks)
+      releasesocket(*sock);
+    socks.clear();
+    accepted.clear();
+  }
+
+  template <bool v4>
+  static void onAcceptable(soup::Worker& w, soup::Capture&& cap) SOUP_EXCAL {
+    auto& s = static_cast<soup::Socket&>(w);
+    Listener& l = *cap.get<Listener*>();
+    do {
+      soup::Socket conn = v4 ? s.accept4() : s.accept6();
+      if (!conn.hasConnection())
+        break;
+      l.accepted.emplace_back(soup::make_shared<soup::Socket>(std::move(conn)));
+    } while (!SOUP_WINDOWS);  /* listening sockets are only non-blocking elsewhere, so that is where we can drain the backlog */
+  }
+
+  bool add(soup::Socket&& sock, bool v4) {
+    sock.holdup_type = soup::Worker::SOCKET;
+    sock.holdup_callback.fp = v4 ? &onAcceptable<true> : &onAcceptable<false>;
+    sock.holdup_callback.cap = this;
+    socks.emplace_back(reactor->addSocket(std::move(sock)));
+    return true;
+  }
+
+  [[nodiscard]] bool bind(uint16_t port) {
+    soup::Socket sock6;
+    if (!sock6.bind6(port))
+      return false;
+    add(std::move(sock6), false);
+#if SOUP_WINDOWS
+    soup::Socket sock4;
+    if (!sock4.bind4(port))
+      return false;
+    add(std::move(sock4), true);
+#endif
+    return true;
+  }
+
+  [[nodiscard]] bool bind(const soup::IpAddr& ip, uint16_t port) {
+    soup::Socket sock;
+#if SOUP_WINDOWS
+    if (ip.isV4())
+      return sock.bind4(SOCK_STREAM, port, ip) && add(std::move(sock), true);
+#endif
+    return sock.bind6(SOCK_STREAM, port, ip) && add(std::move(sock), false);
   }
 };
 
@@ -460,47 +1146,52 @@ static Listener* checklistener (lua_State *L, int i) {
 
 static int restaccept (lua_State *L, Listener& l) {
   auto& ss = pushsocket(L);
-  ss.sock = l.accepted;
-  ss.sched.addSocket(std::move(l.accepted));
+  ss.sock = std::move(l.accepted.front());
+  l.accepted.pop_front();
+  ss.reactor->addSocket(ss.sock);
   ss.from_listener = true;
   ss.recvLoop();
-  l.serv.tick();  /* avoid having the to yield/block for the next call to accept */
   return 1;
 }
 
 static int acceptcont (lua_State *L, int status, lua_KContext ctx) {
   auto& l = *reinterpret_cast<Listener*>(ctx);
-  if (!l.accepted) {
-    l.serv.tick();
-    return lua_yieldk(L, 0, ctx, acceptcont);
+  if (l.accepted.empty()) {
+    if (l.socks.empty())  /* closed while waiting? */
+      return 0;
+    l.reactor->tickIfDue();
+    if (l.accepted.empty())
+      return lua_yieldk(L, 0, ctx, acceptcont);
   }
   return restaccept(L, l);
 }
 
 static int listener_accept (lua_State *L) {
   auto& l = *checklistener(L, 1);
-  if (!l.accepted) {
-    if (lua_isyieldable(L)) {
-      l.serv.tick();
+  if (l.accepted.empty()) {
+    if (l_unlikely(l.socks.empty()))
+      return 0;
+    l.reactor->tickIfDue();
+    if (lua_isyieldable(L))
       return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(&l), acceptcont);
-    }
-    do {
-      l.serv.tick();
+    while (l.accepted.empty()) {
       soup::os::sleep(1);
-    } while (!l.accepted);
+      l.reactor->tick();
+    }
   }
   return restaccept(L, l);
 }
 
+static int listener_close (lua_State *L) {
+  checklistener(L, 1)->close();
+  return 0;
+}
+
 static int listener_hasconnection (lua_State *L) {
   auto& l = *checklistener(L, 1);
-  if (l.accepted) {
-    lua_pushboolean(L, true);
-  }
-  else {
-    lua_pushboolean(L, false);
-    l.serv.tick();
-  }
+  if (l.accepted.empty())
+    l.reactor->tickIfDue();
+  lua_pushboolean(L, !l.accepted.empty());
   return 1;
 }
 
@@ -519,7 +1210,8 @@ static int l_listen (lua_State *L) {
   soup::SocketAddr addr = checkaddr(L, 1);
   const auto port = addr.getPort();
 
-  Listener& l = *new (lua_newuserdata(L, sizeof(Listener))) Listener{};
+  Reactor& reactor = getreactor(L);
+  Listener& l = *new (lua_newuserdata(L, sizeof(Listener))) Listener(reactor);
   if (luaL_newmetatable(L, "pluto:socket-listener")) {
     lua_pushliteral(L, "__index");
     lua_newtable(L);
@@ -529,6 +1221,9 @@ static int l_listen (lua_State *L) {
     lua_pushliteral(L, "hasconnection");
     lua_pushcfunction(L, listener_hasconnection);
     lua_settable(L, -3);
+    lua_pushliteral(L, "close");
+    lua_pushcfunction(L, listener_close);
+    lua_settable(L, -3);
     lua_settable(L, -3);
     lua_pushliteral(L, "__gc");
     lua_pushcfunction(L, [](lua_State *L) {
@@ -540,7 +1235,7 @@ static int l_listen (lua_State *L) {
   }
   lua_setmetatable(L, -2);
 
-  return (addr.ip.isZero() ? l.serv.bind(port, &l.srv) : l.serv.bind(addr.ip, port, &l.srv)) ? 1 : 0;
+  return (addr.ip.isZero() ? l.bind(port) : l.bind(addr.ip, port)) ? 1 : 0;
 }
 
 static int l_udpserver (lua_State *L) {
@@ -548,7 +1243,7 @@ static int l_udpserver (lua_State *L) {
   const auto port = addr.getPort();
 
   StandaloneSocket& ss = pushsocket(L);
-  ss.sock = ss.sched.addSocket();
+  ss.sock = ss.reactor->addSocket();
   ss.udp = true;
   ss.from_listener = true;
   if (addr.ip.isZero()) {
@@ -556,27 +1251,31 @@ static int l_udpserver (lua_State *L) {
       return 0;
     ss.recvLoopUdp(*ss.sock);
 #if SOUP_WINDOWS
-    auto ipv4_sock = ss.sched.addSocket();
-    if (l_likely(ipv4_sock->udpBind4(port)))
-      ss.recvLoopUdp(*ipv4_sock);
+    ss.udp6 = ss.sock;
+    ss.udp4 = ss.reactor->addSocket();
+    if (l_likely(ss.udp4->udpBind4(port)))
+      ss.recvLoopUdp(*ss.udp4);
 #endif
   }
   else {
     if (l_unlikely(!ss.sock->udpBind(addr.ip, addr.port)))
       return 0;
   }
-#if SOUP_WINDOWS
-  ss.sched.tick(); lua_assert(ss.sched.workers.size() >= 2);
-#endif
   return 1;
 }
 
 static const luaL_Reg funcs_socket[] = {
   {"connect", l_connect},
   {"send", l_send},
+  {"sendfile", l_sendfile},
+  {"sendv", l_sendv},
   {"peek", l_peek},
   {"recv", l_recv},
   {"unrecv", unrecv},
+  {"recvexact", recvexact},
+  {"recvuntil", recvuntil},
+  {"recvline", recvline},
+  {"recvfile", recvfile},
   {"starttls", starttls},
   {"istls", socket_istls},
   {"isudp", socket_isudp},
@@ -26,6 +26,7 @@
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#include "lparallel.hpp"
 
 #include "vendor/Soup/soup/DetachedScheduler.hpp"
 
@@ -275,6 +276,9 @@ static void close_state (lua_State *L) {
   }
   luaM_freearray(L, G(L)->strt.hash, cast_sizet(G(L)->strt.size));
   freestack(L);
+#ifdef PLUTO_VMSTATS
+  delete g->vmstats;
+#endif
   lua_assert(gettotalbytes(g) == sizeof(global_State));
   (*g->frealloc)(g->ud, g, sizeof(global_State), 0);  /* free main block */
 }
@@ -361,6 +365,8 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud, unsigned seed) {
   g->ud = ud;
   g->warnf = NULL;
   g->ud_warn = NULL;
+  g->patcache = NULL;
+  g->fmtcache = NULL;
   g->seed = seed;
   g->gcstp = GCSTPGC;  /* no GC while building state */
   g->strt.size = g->strt.nuse = 0;
@@ -514,8 +520,18 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud, unsigned seed) {
 #else
   g->warn_unused = true;
 #endif
+#ifdef PLUTO_OPTIMIZE
+  g->optimize = true;
+#else
+  g->optimize = false;
+#endif
 #ifdef PLUTO_ETL_ENABLE
   g->deadline = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() + PLUTO_ETL_NANOS;
+#endif
+  g->typed_mt = NULL;
+  g->parallelthreads = defaultparallelthreads();
+#ifdef PLUTO_VMSTATS
+  g->vmstats = new PlutoVmStats();
 #endif
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
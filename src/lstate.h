@@ -22,6 +22,33 @@ typedef struct CallInfo CallInfo;
 #include <chrono>
 #endif
 
+#ifdef PLUTO_VMSTATS
+#include <memory> // unique_ptr
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "lopcodes.h"
+
+/* counters of the VM statistics mode, see 'debug.vmstats' */
+struct PlutoVmStats {
+  struct Function {
+    std::string source;
+    int linedefined;
+    std::vector<int> lines;  /* line of each instruction */
+    std::vector<lu_byte> ops;  /* opcode of each instruction */
+    std::vector<unsigned long long> counts;  /* executions of each instruction */
+  };
+
+  unsigned long long ops[NUM_OPCODES] = {};
+  unsigned long long luacalls = 0;
+  unsigned long long ccalls = 0;
+  unsigned long long getfallbacks = 0;  /* table reads that missed the fast path */
+  unsigned long long setfallbacks = 0;  /* table writes that missed the fast path */
+  std::unordered_map<const Proto*, std::unique_ptr<Function>> functions;  /* dropped with their prototypes */
+};
+#endif
+
 
 /*
 ** Some notes about garbage-collected objects: All objects in Lua must
@@ -402,6 +429,8 @@ typedef struct global_State {
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
   lua_WarnFunction warnf;  /* warning function */
   void *ud_warn;         /* auxiliary data to 'warnf' */
+  void *patcache;  /* compiled patterns of the string library; internal use only */
+  void *fmtcache;  /* compiled formats of the string library; internal use only */
 #ifndef PLUTO_LUA_LINKABLE
   void* user_data;  /* a pointer to data you, the user, would like to specify */
 
@@ -445,6 +474,11 @@ typedef struct global_State {
   bool warn_discarded_return : 1;
   bool warn_field_shadow : 1;
   bool warn_unused : 1;
+
+  /*
+  ** Whether the parser runs the optimization pass over every function, as if each chunk started with 'pluto_use optimize'.
+  */
+  bool optimize : 1;
 #endif
 #ifdef PLUTO_ETL_ENABLE
   std::time_t deadline;  /* internal use only; do not use this in your own code. */
@@ -452,6 +486,11 @@ typedef struct global_State {
 #ifndef PLUTO_NO_DEFAULT_TABLE_METATABLE
   TValue table_mt;  /* internal use only; do not use this in your own code. */
 #endif
+  struct Table *typed_mt;  /* metatable of typed arrays, once created; see ltypedarray.hpp */
+  unsigned parallelthreads;  /* threads for data-parallel library functions; see lparallel.hpp */
+#ifdef PLUTO_VMSTATS
+  PlutoVmStats *vmstats;  /* internal use only; do not use this in your own code. */
+#endif
 
   void setCompatibilityMode(bool b) noexcept {
     have_preference_switch = true;
@@ -8,8 +8,12 @@
 #define LUA_LIB
 
 #include "lprefix.h"
+#include <algorithm> // copy
+#include <atomic>
+#include <cstdint>
 #include <string>
 #include <string_view>
+#include <vector>
 #include <ctype.h>
 #include <float.h>
 #include <limits.h>
@@ -26,6 +30,9 @@
 #include "lualib.h"
 #include "llimits.h"
 #include "lstring.h"
+#include "lstate.h"
+#include "lgc.h"
+#include "lpack.hpp"
 
 
 #include "vendor/Soup/soup/bitutil.hpp"
@@ -411,10 +418,15 @@ static const luaL_Reg stringmetamethods[] = {
 #define CAP_POSITION	(-2)
 
 
+struct PatItem;
+struct PatProgram;
+
 typedef struct MatchState {
   const char *src_init;  /* init of source string */
   const char *src_end;  /* end ('\0') of source string */
   const char *p_end;  /* end ('\0') of pattern */
+  const PatProgram *prog;  /* compiled pattern, or NULL to interpret it */
+  const PatItem *items;  /* items of 'prog' */
   lua_State *L;
   int matchdepth;  /* control for recursive depth (to avoid C stack overflow) */
   int level;  /* total number of captures (finished or unfinished) */
@@ -456,19 +468,20 @@ static int capture_to_close (MatchState *ms) {
 }
 
 
-static const char *classend (MatchState *ms, const char *p) {
+/* like 'classend', but returns NULL for a malformed class */
+static const char *tryclassend (const char *p, const char *p_end) {
   switch (*p++) {
     case L_ESC: {
-      if (l_unlikely(p == ms->p_end))
-        luaL_error(ms->L, "malformed pattern (ends with '%%')");
+      if (l_unlikely(p == p_end))
+        return NULL;
       return p+1;
     }
     case '[': {
       if (*p == '^') p++;
       do {  /* look for a ']' */
-        if (l_unlikely(p == ms->p_end))
-          luaL_error(ms->L, "malformed pattern (missing ']')");
-        if (*(p++) == L_ESC && p < ms->p_end)
+        if (l_unlikely(p == p_end))
+          return NULL;
+        if (*(p++) == L_ESC && p < p_end)
           p++;  /* skip escapes (e.g. '%]') */
       } while (*p != ']');
       return p+1;
@@ -480,6 +493,17 @@ static const char *classend (MatchState *ms, const char *p) {
 }
 
 
+static const char *classend (MatchState *ms, const char *p) {
+  const char *ep = tryclassend(p, ms->p_end);
+  if (l_unlikely(ep == NULL)) {
+    if (*p == L_ESC)
+      luaL_error(ms->L, "malformed pattern (ends with '%%')");
+    luaL_error(ms->L, "malformed pattern (missing ']')");
+  }
+  return ep;
+}
+
+
 static int match_class (int c, int cl) {
   int res;
   switch (tolower(cl)) {
@@ -811,9 +835,500 @@ static int nospecials (const char *p, size_t l) {
 }
 
 
+/*
+** {======================================================
+** COMPILED PATTERNS
+** A pattern is translated once into a list of items, in which every
+** single-character class is a 256-bit set, and the result is kept in
+** a small per-state cache. 'cmatch' walks the items exactly like
+** 'match' walks the pattern (including the accounting of 'matchdepth'),
+** so results and errors are the same. Patterns that are malformed are
+** left to 'match', which reports the problem only if it is reached.
+** =======================================================
+*/
+
+/* longer patterns are interpreted */
+#if !defined(PAT_MAXCOMPILE)
+#define PAT_MAXCOMPILE	256
+#endif
+
+/* number of compiled patterns kept per state */
+#if !defined(PAT_CACHESIZE)
+#define PAT_CACHESIZE	32
+#endif
+
+#define PAT_MAXPREFIX	16
+
+
+enum PatOp : lu_byte {
+  PO_CLASS,  /* single-character class with optional suffix */
+  PO_OPEN,  /* '(' */
+  PO_POSITION,  /* '()' */
+  PO_CLOSE,  /* ')' */
+  PO_END,  /* '$' at the end of the pattern */
+  PO_BALANCE,  /* '%bxy' */
+  PO_FRONTIER,  /* '%f[set]' */
+  PO_BACKREF  /* '%0' to '%9' */
+};
+
+struct PatItem {
+  PatOp op;
+  char suffix;  /* '*', '+', '-', '?' or '\0' for PO_CLASS */
+  char a, b;  /* delimiters for PO_BALANCE, digit for PO_BACKREF */
+  uint32_t set[256 / 32];  /* for PO_CLASS and PO_FRONTIER */
+
+  [[nodiscard]] bool has (int c) const noexcept {
+    return (set[c >> 5] >> (c & 31)) & 1;
+  }
+};
+
+struct PatProgram {
+  int nitems;  /* -1 if the pattern is left to 'match' */
+  int first;  /* index of a class every match starts with, or -1 */
+  unsigned int prefixlen;  /* length of a literal every match starts with */
+  char prefix[PAT_MAXPREFIX];
+};
+
+
+static const char *cmatch (MatchState *ms, const char *s, const PatItem *p);
+
+
+static const char *cmax_expand (MatchState *ms, const char *s,
+                                  const PatItem *p) {
+  ptrdiff_t i = 0;  /* counts maximum expand for item */
+  const ptrdiff_t avail = ms->src_end - s;
+  while (i < avail && p->has(cast_uchar(s[i])))
+    i++;
+  const PatItem *next = p + 1;
+  /* a following class without '*', '?' or '-' has to match right away */
+  const bool mustmatch = (next != ms->items + ms->prog->nitems &&
+                          next->op == PO_CLASS &&
+                          (next->suffix == '\0' || next->suffix == '+'));
+  /* keeps trying to match with the maximum repetitions */
+  while (i>=0) {
+    if (mustmatch && ms->matchdepth != 0 &&  /* 'cmatch' would fail without side effects? */
+        (i == avail || !next->has(cast_uchar(s[i])))) {
+      i--;
+      continue;
+    }
+    const char *res = cmatch(ms, (s+i), next);
+    if (res) return res;
+    i--;  /* else didn't match; reduce 1 repetition to try again */
+  }
+  return NULL;
+}
+
+
+static const char *cmatchbalance (MatchState *ms, const char *s,
+                                    const PatItem *p) {
+  if (*s != p->a) return NULL;
+  else {
+    int cont = 1;
+    while (++s < ms->src_end) {
+      if (*s == p->b) {
+        if (--cont == 0) return s+1;
+      }
+      else if (*s == p->a) cont++;
+    }
+  }
+  return NULL;  /* string ends out of balance */
+}
+
+
+static const char *cmin_expand (MatchState *ms, const char *s,
+                                  const PatItem *p) {
+  for (;;) {
+    const char *res = cmatch(ms, s, p + 1);
+    if (res != NULL)
+      return res;
+    else if (s < ms->src_end && p->has(cast_uchar(*s)))
+      s++;  /* try with one more repetition */
+    else return NULL;
+  }
+}
+
+
+static const char *cstart_capture (MatchState *ms, const char *s,
+                                     const PatItem *p, int what) {
+  const char *res;
+  int level = ms->level;
+  if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
+  ms->capture[level].init = s;
+  ms->capture[level].len = what;
+  ms->level = level+1;
+  if ((res=cmatch(ms, s, p)) == NULL)  /* match failed? */
+    ms->level--;  /* undo capture */
+  return res;
+}
+
+
+static const char *cend_capture (MatchState *ms, const char *s,
+                                   const PatItem *p) {
+  int l = capture_to_close(ms);
+  const char *res;
+  ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
+  if ((res = cmatch(ms, s, p)) == NULL)  /* match failed? */
+    ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
+  return res;
+}
+
+
+static const char *cmatch (MatchState *ms, const char *s, const PatItem *p) {
+  const PatItem *const p_end = ms->items + ms->prog->nitems;
+  if (l_unlikely(ms->matchdepth-- == 0))
+    luaL_error(ms->L, "pattern too complex");
+  init: /* using goto to optimize tail recursion */
+  if (p != p_end) {  /* end of pattern? */
+    switch (p->op) {
+      case PO_OPEN: {
+        s = cstart_capture(ms, s, p + 1, CAP_UNFINISHED);
+        break;
+      }
+      case PO_POSITION: {
+        s = cstart_capture(ms, s, p + 1, CAP_POSITION);
+        break;
+      }
+      case PO_CLOSE: {
+        s = cend_capture(ms, s, p + 1);
+        break;
+      }
+      case PO_END: {
+        s = (s == ms->src_end) ? s : NULL;  /* check end of string */
+        break;
+      }
+      case PO_BALANCE: {
+        s = cmatchbalance(ms, s, p);
+        if (s != NULL) {
+          p++; goto init;
+        }
+        break;
+      }
+      case PO_FRONTIER: {
+        char previous = (s == ms->src_init) ? '\0' : *(s - 1);
+        if (!p->has(cast_uchar(previous)) && p->has(cast_uchar(*s))) {
+          p++; goto init;
+        }
+        s = NULL;  /* match failed */
+        break;
+      }
+      case PO_BACKREF: {
+        s = match_capture(ms, s, cast_uchar(p->a));
+        if (s != NULL) {
+          p++; goto init;
+        }
+        break;
+      }
+      case PO_CLASS: {
+        /* does not match at least once? */
+        if (!(s < ms->src_end && p->has(cast_uchar(*s)))) {
+          if (p->suffix == '*' || p->suffix == '?' || p->suffix == '-') {  /* accept empty? */
+            p++; goto init;
+          }
+          else  /* '+' or no suffix */
+            s = NULL;  /* fail */
+        }
+        else {  /* matched once */
+          switch (p->suffix) {  /* handle optional suffix */
+            case '?': {  /* optional */
+              const char *res;
+              if ((res = cmatch(ms, s + 1, p + 1)) != NULL)
+                s = res;
+              else {
+                p++; goto init;
+              }
+              break;
+            }
+            case '+':  /* 1 or more repetitions */
+              s++;  /* 1 match already done */
+              [[fallthrough]];
+            case '*':  /* 0 or more repetitions */
+              s = cmax_expand(ms, s, p);
+              break;
+            case '-':  /* 0 or more repetitions (minimum) */
+              s = cmin_expand(ms, s, p);
+              break;
+            default:  /* no suffix */
+              s++; p++; goto init;
+          }
+        }
+        break;
+      }
+    }
+  }
+  ms->matchdepth++;
+  return s;
+}
+
+
+/* Fills the set of 'it' with the characters that 'singlematch' accepts for the class at 'p'. */
+static void compileclass (PatItem& it, const char *p, const char *ep) {
+  for (int c = 0; c != 256; ++c) {
+    int res;
+    switch (*p) {
+      case '.': res = 1; break;
+      case L_ESC: res = match_class(c, cast_uchar(*(p+1))); break;
+      case '[': res = matchbracketclass(c, p, ep-1); break;
+      default: res = (cast_uchar(*p) == c); break;
+    }
+    if (res)
+      it.set[c >> 5] |= (uint32_t)1 << (c & 31);
+  }
+}
+
+
+/*
+** Translates a pattern (without its '^' anchor) following the same
+** decisions as 'match'. Returns false if the pattern is malformed.
+*/
+static bool compilepattern (const char *p, size_t lp, PatProgram& prog,
+                            std::vector<PatItem>& items) {
+  const char *const p_end = p + lp;
+  while (p != p_end) {
+    PatItem& it = items.emplace_back();
+    switch (*p) {
+      case '(': {
+        if (*(p + 1) == ')') {
+          it.op = PO_POSITION;
+          p += 2;
+        }
+        else {
+          it.op = PO_OPEN;
+          p++;
+        }
+        continue;
+      }
+      case ')': {
+        it.op = PO_CLOSE;
+        p++;
+        continue;
+      }
+      case '$': {
+        if ((p + 1) != p_end)
+          break;  /* literal '$' */
+        it.op = PO_END;
+        p++;
+        continue;
+      }
+      case L_ESC: {
+        switch (*(p + 1)) {
+          case 'b': {
+            if (p + 2 >= p_end - 1)
+              return false;  /* missing arguments */
+            it.op = PO_BALANCE;
+            it.a = *(p + 2);
+            it.b = *(p + 3);
+            p += 4;
+            continue;
+          }
+          case 'f': {
+            p += 2;
+            const char *ep;
+            if (*p != '[' || (ep = tryclassend(p, p_end)) == NULL)
+              return false;
+            it.op = PO_FRONTIER;
+            compileclass(it, p, ep);
+            p = ep;
+            continue;
+          }
+          case '0': case '1': case '2': case '3':
+          case '4': case '5': case '6': case '7':
+          case '8': case '9': {
+            it.op = PO_BACKREF;
+            it.a = *(p + 1);
+            p += 2;
+            continue;
+          }
+          default: break;
+        }
+        break;
+      }
+    }
+    /* pattern class plus optional suffix */
+    const char *ep = tryclassend(p, p_end);
+    if (ep == NULL)
+      return false;
+    it.op = PO_CLASS;
+    compileclass(it, p, ep);
+    if (ep != p_end && (*ep == '*' || *ep == '+' || *ep == '-' || *ep == '?'))
+      it.suffix = *ep++;
+    p = ep;
+  }
+  prog.nitems = (int)items.size();
+  /* what every match has to start with, after any opening captures */
+  size_t k = 0;
+  while (k != items.size() && (items[k].op == PO_OPEN || items[k].op == PO_POSITION))
+    k++;
+  if (k > LUA_MAXCAPTURES)  /* 'match' would raise an error at every position */
+    return true;
+  if (k != items.size() && items[k].op == PO_CLASS &&
+      (items[k].suffix == '\0' || items[k].suffix == '+'))
+    prog.first = (int)k;
+  for (; k != items.size() && prog.prefixlen != PAT_MAXPREFIX; ++k) {
+    const PatItem& it = items[k];
+    if (it.op != PO_CLASS || it.suffix != '\0')
+      break;
+    int c = -1;
+    for (int i = 0; i != 8; ++i) {
+      if (it.set[i] == 0)
+        continue;
+      if (c != -1 || (it.set[i] & (it.set[i] - 1)) != 0)
+        goto done;  /* more than one character */
+      c = i * 32 + soup::bitutil::getLeastSignificantSetBit(it.set[i]);
+    }
+    if (c == -1)
+      break;
+    prog.prefix[prog.prefixlen++] = (char)c;
+  }
+  done:
+  return true;
+}
+
+
+static std::atomic<unsigned int> ctypegen{ 0 };
+
+/* Called by 'os.setlocale', since character classes depend on the locale. */
+void pluto_localechanged () {
+  ++ctypegen;
+}
+
+
+struct PatternCache {
+  struct Entry {
+    const char *key = nullptr;  /* pattern, kept alive by the cache's user value */
+    size_t len = 0;
+    unsigned int used = 0;
+    unsigned int pins = 0;  /* matches in progress that may call back into Lua */
+    PatProgram prog{};
+    std::vector<PatItem> items;
+  };
+
+  global_State *g;
+  unsigned int clock = 0;
+  unsigned int gen;
+  Entry entries[PAT_CACHESIZE];
+
+  explicit PatternCache (global_State *g) : g(g), gen(ctypegen) {}
+
+  ~PatternCache () {
+    g->patcache = nullptr;
+  }
+};
+
+static const char patcachekey = 'k';
+
+
+/*
+** Returns the compiled form of the pattern 'p' (at stack index 'arg' or
+** a suffix of it), or NULL if it is to be interpreted.
+*/
+static PatternCache::Entry *getpattern (lua_State *L, int arg,
+                                              const char *p, size_t lp) {
+  global_State *g = G(L);
+  if (lp > PAT_MAXCOMPILE || (g->gcstp & GCSTPCLS))
+    return NULL;
+  auto pc = (PatternCache *)g->patcache;
+  if (l_unlikely(pc == NULL)) {
+    pc = pluto_newclassinst(L, PatternCache, g);
+    lua_createtable(L, PAT_CACHESIZE, 0);
+    lua_setiuservalue(L, -2, 1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &patcachekey);
+    g->patcache = pc;
+  }
+  if (l_unlikely(pc->gen != ctypegen)) {  /* locale changed? */
+    pc->gen = ctypegen;
+    for (auto& e : pc->entries)
+      e.key = nullptr;
+  }
+  PatternCache::Entry *victim = NULL;
+  for (auto& e : pc->entries) {
+    if (e.key == p && e.len == lp) {
+      e.used = ++pc->clock;
+      return e.prog.nitems < 0 ? NULL : &e;
+    }
+    if (e.pins == 0 && (victim == NULL || e.used < victim->used))
+      victim = &e;
+  }
+  if (l_unlikely(victim == NULL))  /* all entries in use? */
+    return NULL;
+  /* compile into the least recently used entry */
+  victim->key = nullptr;
+  victim->items.clear();
+  victim->prog = PatProgram{};
+  victim->prog.first = -1;
+  if (!compilepattern(p, lp, victim->prog, victim->items)) {
+    victim->items.clear();
+    victim->prog.nitems = -1;
+  }
+  /* the key stays valid for as long as the string is referenced */
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &patcachekey);
+  lua_getiuservalue(L, -1, 1);
+  lua_pushvalue(L, arg);
+  lua_rawseti(L, -2, (victim - pc->entries) + 1);
+  lua_pop(L, 2);
+  victim->key = p;
+  victim->len = lp;
+  victim->used = ++pc->clock;
+  return victim->prog.nitems < 0 ? NULL : victim;
+}
+
+
+/* Skips positions at which no match can start. */
+static const char *skipto (const MatchState *ms, const char *s) {
+  const PatProgram *prog = ms->prog;
+  if (prog == NULL)
+    return s;
+  if (prog->prefixlen > 1) {
+    const char *r = lmemfind(s, ct_diff2sz(ms->src_end - s), prog->prefix, prog->prefixlen);
+    return r ? r : ms->src_end;
+  }
+  if (prog->prefixlen == 1) {
+    const char *r = (const char *)memchr(s, prog->prefix[0], ct_diff2sz(ms->src_end - s));
+    return r ? r : ms->src_end;
+  }
+  if (prog->first >= 0) {
+    const PatItem& it = ms->items[prog->first];
+    while (s < ms->src_end && !it.has(cast_uchar(*s)))
+      s++;
+  }
+  return s;
+}
+
+
+static void compilestate (MatchState *ms, const PatternCache::Entry *e) {
+  if (e) {
+    ms->prog = &e->prog;
+    ms->items = e->items.data();
+  }
+}
+
+
+/* Keeps a cache entry alive while Lua code runs that may evict it. */
+template <typename Entry>
+struct CachePin {
+  Entry *e;
+
+  explicit CachePin (Entry *e) : e(e) {
+    if (e) e->pins++;
+  }
+
+  ~CachePin () {
+    if (e) e->pins--;
+  }
+};
+
+
+static const char *domatch (MatchState *ms, const char *s, const char *p) {
+  return ms->prog ? cmatch(ms, s, ms->items) : match(ms, s, p);
+}
+
+/* }====================================================== */
+
+
 static void prepstate (MatchState *ms, lua_State *L,
                        const char *s, size_t ls, const char *p, size_t lp) {
   ms->L = L;
+  ms->prog = NULL;
+  ms->items = NULL;
   ms->matchdepth = MAXCCALLS;
   ms->src_init = s;
   ms->src_end = s + ls;
@@ -846,10 +1361,13 @@ static int str_find_aux (lua_State *L, const char *s, size_t ls, const char *p,
       p++; lp--;  /* skip anchor character */
     }
     prepstate(&ms, L, s, ls, p, lp);
+    compilestate(&ms, getpattern(L, 2, p, lp));
     do {
       const char *res;
+      if (!anchor)
+        s1 = skipto(&ms, s1);
       reprepstate(&ms);
-      if ((res=match(&ms, s1, p)) != NULL) {
+      if ((res=domatch(&ms, s1, p)) != NULL) {
         if (find) {
           lua_pushinteger(L, ct_diff2S(s1 - s) + 1);  /* start */
           lua_pushinteger(L, ct_diff2S(res - s));   /* end */
@@ -895,6 +1413,7 @@ typedef struct GMatchState {
   const char *p;  /* pattern */
   const char *lastmatch;  /* end of last match */
   MatchState ms;  /* match state */
+  PatProgram prog;  /* copy of the compiled pattern, followed by its items */
 } GMatchState;
 
 
@@ -904,8 +1423,9 @@ static int gmatch_aux (lua_State *L) {
   gm->ms.L = L;
   for (src = gm->src; src <= gm->ms.src_end; src++) {
     const char *e;
+    src = skipto(&gm->ms, src);
     reprepstate(&gm->ms);
-    if ((e = match(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
+    if ((e = domatch(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
       gm->src = gm->lastmatch = e;
       return push_captures(&gm->ms, src, e);
     }
@@ -921,10 +1441,20 @@ static int gmatch (lua_State *L) {
   size_t init = posrelatI(luaL_optinteger(L, 3, 1), ls) - 1;
   GMatchState *gm;
   lua_settop(L, 2);  /* keep strings on closure to avoid being collected */
-  gm = (GMatchState *)lua_newuserdatauv(L, sizeof(GMatchState), 0);
+  /* the iterator may outlive the cache entry, so it gets its own copy */
+  const PatternCache::Entry *cp = getpattern(L, 2, p, lp);
+  const size_t nitems = cp ? cp->items.size() : 0;
+  gm = (GMatchState *)lua_newuserdatauv(L, sizeof(GMatchState) + nitems * sizeof(PatItem), 0);
   if (init > ls)  /* start after string's end? */
     init = ls + 1;  /* avoid overflows in 's + init' */
   prepstate(&gm->ms, L, s, ls, p, lp);
+  if (cp) {
+    PatItem *items = reinterpret_cast<PatItem *>(gm + 1);
+    std::copy(cp->items.begin(), cp->items.end(), items);
+    gm->prog = cp->prog;
+    gm->ms.prog = &gm->prog;
+    gm->ms.items = items;
+  }
   gm->src = s + init; gm->p = p; gm->lastmatch = NULL;
   lua_pushcclosure(L, gmatch_aux, 3);
   return 1;
@@ -1023,10 +1553,17 @@ static int str_gsub (lua_State *L) {
     p++; lp--;  /* skip anchor character */
   }
   prepstate(&ms, L, src, srcl, p, lp);
+  CachePin<PatternCache::Entry> pin(getpattern(L, 2, p, lp));
+  compilestate(&ms, pin.e);
   while (n < max_s) {
     const char *e;
+    if (!anchor) {
+      const char *next = skipto(&ms, src);
+      luaL_addlstring(&b, src, ct_diff2sz(next - src));  /* keep unmatched text */
+      src = next;
+    }
     reprepstate(&ms);  /* (re)prepare state for new match */
-    if ((e = match(&ms, src, p)) != NULL && e != lastmatch) {  /* match? */
+    if ((e = domatch(&ms, src, p)) != NULL && e != lastmatch) {  /* match? */
       n++;
       changed = add_value(&ms, &b, src, e, tr) || changed;
       src = lastmatch = e;
@@ -1338,8 +1875,8 @@ static const char *get2digits (const char *s) {
 ** be a valid conversion specifier. 'flags' are the accepted flags;
 ** 'precision' signals whether to accept a precision.
 */
-static void checkformat (lua_State *L, const char *form, const char *flags,
-                                       int precision) {
+static int validformat (const char *form, const char *flags,
+                                          int precision) {
   const char *spec = form + 1;  /* skip '%' */
   spec += strspn(spec, flags);  /* skip flags */
   if (*spec != '0') {  /* a width cannot start with '0' */
@@ -1349,7 +1886,13 @@ static void checkformat (lua_State *L, const char *form, const char *flags,
       spec = get2digits(spec);  /* skip precision */
     }
   }
-  if (!isalpha(cast_uchar(*spec)))  /* did not go to the end? */
+  return isalpha(cast_uchar(*spec));  /* went to the end? */
+}
+
+
+static void checkformat (lua_State *L, const char *form, const char *flags,
+                                       int precision) {
+  if (!validformat(form, flags, precision))
     luaL_error(L, "invalid conversion specification: '%s'", form);
 }
 
@@ -1386,113 +1929,383 @@ static void addlenmod (char *form, const char *lenmod) {
 }
 
 
+/*
+** Adds the conversion of argument 'arg' according to 'form' ('%...'
+** ending in the conversion specifier 'conv'). When 'checked', 'form'
+** was validated beforehand and already carries its length modifier.
+*/
+static void addformat (lua_State *L, luaL_Buffer *b, int arg,
+                                     char *form, char conv, int checked) {
+  unsigned maxitem = MAX_ITEM;  /* maximum length for the result */
+  char *buff = luaL_prepbuffsize(b, maxitem);  /* to put result */
+  int nb = 0;  /* number of bytes in result */
+  const char *flags;
+  switch (conv) {
+    case 'c': {
+      if (!checked)
+        checkformat(L, form, L_FMTFLAGSC, 0);
+      nb = l_sprintf(buff, maxitem, form, (int)luaL_checkinteger(L, arg));
+      break;
+    }
+    case 'd': case 'i':
+      flags = L_FMTFLAGSI;
+      goto intcase;
+    case 'u':
+      flags = L_FMTFLAGSU;
+      goto intcase;
+    case 'o': case 'x': case 'X':
+      flags = L_FMTFLAGSX;
+     intcase: {
+      lua_Integer n = luaL_checkinteger(L, arg);
+      if (!checked) {
+        checkformat(L, form, flags, 1);
+        addlenmod(form, LUA_INTEGER_FRMLEN);
+      }
+      nb = l_sprintf(buff, maxitem, form, (LUAI_UACINT)n);
+      break;
+    }
+    case 'a': case 'A':
+      if (!checked) {
+        checkformat(L, form, L_FMTFLAGSF, 1);
+        addlenmod(form, LUA_NUMBER_FRMLEN);
+      }
+      nb = lua_number2strx(L, buff, maxitem, form,
+                              luaL_checknumber(L, arg));
+      break;
+    case 'f':
+      maxitem = MAX_ITEMF;  /* extra space for '%f' */
+      buff = luaL_prepbuffsize(b, maxitem);
+      [[fallthrough]];
+    case 'e': case 'E': case 'g': case 'G': {
+      lua_Number n = luaL_checknumber(L, arg);
+      if (!checked) {
+        checkformat(L, form, L_FMTFLAGSF, 1);
+        addlenmod(form, LUA_NUMBER_FRMLEN);
+      }
+      nb = l_sprintf(buff, maxitem, form, (LUAI_UACNUMBER)n);
+      break;
+    }
+    case 'p': {
+      const void *p = lua_topointer(L, arg);
+      if (!checked)
+        checkformat(L, form, L_FMTFLAGSC, 0);
+      if (p == NULL) {  /* avoid calling 'printf' with argument NULL */
+        p = "(null)";  /* result */
+        form[strlen(form) - 1] = 's';  /* format it as a string */
+      }
+      nb = l_sprintf(buff, maxitem, form, p);
+      break;
+    }
+    case 'q': {
+      if (form[2] != '\0')  /* modifiers? */
+        luaL_error(L, "specifier '%%q' cannot have modifiers");
+      addliteral(L, b, arg);
+      break;
+    }
+    case 'Q': {  /* [Pluto] utf-8-safe quoting */
+      if (form[2] != '\0')  /* modifiers? */
+        luaL_error(L, "specifier '%%Q' cannot have modifiers");
+      addliteral(L, b, arg, true);
+      break;
+    }
+    case 's': {
+      size_t l;
+      const char *s = luaL_tolstring(L, arg, &l);
+      if (form[2] == '\0')  /* no modifiers? */
+        luaL_addvalue(b);  /* keep entire string */
+      else {
+        luaL_argcheck(L, l == strlen(s), arg, "string contains zeros");
+        if (!checked)
+          checkformat(L, form, L_FMTFLAGSC, 1);
+        if (strchr(form, '.') == NULL && l >= 100) {
+          /* no precision and string is too long to be formatted */
+          luaL_addvalue(b);  /* keep entire string */
+        }
+        else {  /* format the string into 'buff' */
+          nb = l_sprintf(buff, maxitem, form, s);
+          lua_pop(L, 1);  /* remove result from 'luaL_tolstring' */
+        }
+      }
+      break;
+    }
+    default: {  /* also treat cases 'pnLlh' */
+      luaL_error(L, "invalid conversion '%s' to 'format'", form);
+    }
+  }
+  lua_assert(cast_uint(nb) < maxitem);
+  luaL_addsize(b, cast_uint(nb));
+}
+
+
+/*
+** {======================================================
+** COMPILED FORMATS
+** A format string is split once into runs of text and validated
+** conversion specifications, and the result is kept in a small
+** per-state cache, so that calls with the same format (usually a
+** constant) only convert their arguments. Formats with an invalid
+** specification are never cached; 'str_format' reports the problem
+** at the same point as always.
+** =======================================================
+*/
+
+/* longer formats are interpreted */
+#if !defined(FMT_MAXCOMPILE)
+#define FMT_MAXCOMPILE	256
+#endif
+
+/* number of compiled formats kept per state */
+#if !defined(FMT_CACHESIZE)
+#define FMT_CACHESIZE	16
+#endif
+
+
+enum FormatKind : uint8_t {
+  FK_TEXT,  /* only the text */
+  FK_INT,  /* '%d' or '%i' without modifiers */
+  FK_STRING,  /* '%s' without modifiers */
+  FK_OTHER  /* anything else, formatted with 'form' */
+};
+
+
+struct FormatItem {
+  size_t off, len;  /* text preceding the conversion */
+  FormatKind kind;
+  char conv;  /* conversion specifier */
+  char form[MAX_FORMAT];  /* specification with its length modifier */
+};
+
+
+/* Splits 'fmt' into items; fails if any specification is invalid. */
+static bool compileformat (const char *fmt, size_t lf,
+                           std::vector<FormatItem>& items) {
+  const char *p = fmt;
+  const char *fmt_end = fmt + lf;
+  for (;;) {
+    FormatItem it{};
+    it.off = ct_diff2sz(p - fmt);
+    const char *e = (const char *)memchr(p, L_ESC, ct_diff2sz(fmt_end - p));
+    if (e == NULL) {  /* trailing text */
+      it.len = ct_diff2sz(fmt_end - p);
+      it.kind = FK_TEXT;
+      if (it.len != 0)
+        items.push_back(it);
+      return true;
+    }
+    it.len = ct_diff2sz(e - p);
+    p = e + 1;  /* skip '%' */
+    if (*p == L_ESC) {  /* %% */
+      it.len++;  /* keep the first '%' with the text */
+      it.kind = FK_TEXT;
+      items.push_back(it);
+      p++;
+      continue;
+    }
+    /* same rules as 'getformat' */
+    size_t len = strspn(p, L_FMTFLAGSF "123456789.") + 1;
+    if (len >= MAX_FORMAT - 10)
+      return false;
+    it.form[0] = '%';
+    memcpy(it.form + 1, p, len);
+    p += len;
+    it.conv = *(p - 1);
+    const bool plain = (it.form[2] == '\0');
+    switch (it.conv) {
+      case 'c': case 'p':
+        if (!validformat(it.form, L_FMTFLAGSC, 0))
+          return false;
+        break;
+      case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': {
+        const char *flags = (it.conv == 'u') ? L_FMTFLAGSU
+                          : (it.conv == 'd' || it.conv == 'i') ? L_FMTFLAGSI
+                          : L_FMTFLAGSX;
+        if (!validformat(it.form, flags, 1))
+          return false;
+        addlenmod(it.form, LUA_INTEGER_FRMLEN);
+        break;
+      }
+      case 'a': case 'A': case 'f': case 'e': case 'E': case 'g': case 'G':
+        if (!validformat(it.form, L_FMTFLAGSF, 1))
+          return false;
+        addlenmod(it.form, LUA_NUMBER_FRMLEN);
+        break;
+      case 'q': case 'Q':
+        if (!plain)
+          return false;
+        break;
+      case 's':
+        if (!plain && !validformat(it.form, L_FMTFLAGSC, 1))
+          return false;
+        break;
+      default:  /* includes the end of the string */
+        return false;
+    }
+    if (plain && (it.conv == 'd' || it.conv == 'i'))
+      it.kind = FK_INT;
+    else if (plain && it.conv == 's')
+      it.kind = FK_STRING;
+    else
+      it.kind = FK_OTHER;
+    items.push_back(it);
+  }
+}
+
+
+struct FormatCache {
+  struct Entry {
+    const char *key = nullptr;  /* format, kept alive by the cache's user value */
+    size_t len = 0;
+    unsigned int used = 0;
+    unsigned int pins = 0;  /* calls in progress that may call back into Lua */
+    bool valid = false;
+    std::vector<FormatItem> items;
+  };
+
+  global_State *g;
+  unsigned int clock = 0;
+  Entry entries[FMT_CACHESIZE];
+
+  explicit FormatCache (global_State *g) : g(g) {}
+
+  ~FormatCache () {
+    g->fmtcache = nullptr;
+  }
+};
+
+static const char fmtcachekey = 'k';
+
+
+/*
+** Returns the compiled form of the format at stack index 1, or NULL if
+** it is to be interpreted.
+*/
+static FormatCache::Entry *getformatentry (lua_State *L,
+                                           const char *fmt, size_t lf) {
+  global_State *g = G(L);
+  if (lf > FMT_MAXCOMPILE || (g->gcstp & GCSTPCLS))
+    return NULL;
+  auto fc = (FormatCache *)g->fmtcache;
+  if (l_unlikely(fc == NULL)) {
+    fc = pluto_newclassinst(L, FormatCache, g);
+    lua_createtable(L, FMT_CACHESIZE, 0);
+    lua_setiuservalue(L, -2, 1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &fmtcachekey);
+    g->fmtcache = fc;
+  }
+  FormatCache::Entry *victim = NULL;
+  for (auto& e : fc->entries) {
+    if (e.key == fmt && e.len == lf) {
+      e.used = ++fc->clock;
+      return e.valid ? &e : NULL;
+    }
+    if (e.pins == 0 && (victim == NULL || e.used < victim->used))
+      victim = &e;
+  }
+  if (l_unlikely(victim == NULL))  /* all entries in use? */
+    return NULL;
+  /* compile into the least recently used entry */
+  victim->key = nullptr;
+  victim->items.clear();
+  victim->valid = compileformat(fmt, lf, victim->items);
+  if (!victim->valid)
+    victim->items.clear();
+  /* the key stays valid for as long as the string is referenced */
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &fmtcachekey);
+  lua_getiuservalue(L, -1, 1);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, (victim - fc->entries) + 1);
+  lua_pop(L, 2);
+  victim->key = fmt;
+  victim->len = lf;
+  victim->used = ++fc->clock;
+  return victim->valid ? victim : NULL;
+}
+
+
+/* Writes 'n' in decimal, as '%d' would; returns the number of bytes. */
+static int addintdigits (char *buff, lua_Integer n) {
+  char digits[3 * sizeof(lua_Integer)];
+  char *const end = digits + sizeof(digits);
+  char *d = end;
+  lua_Unsigned u = (n < 0) ? 0u - l_castS2U(n) : l_castS2U(n);
+  do {
+    *--d = cast_char('0' + u % 10);
+    u /= 10;
+  } while (u != 0);
+  if (n < 0)
+    *--d = '-';
+  memcpy(buff, d, ct_diff2sz(end - d));
+  return cast_int(end - d);
+}
+
+
+static int formatcompiled (lua_State *L, FormatCache::Entry *e,
+                                         const char *strfrmt) {
+  CachePin<FormatCache::Entry> pin(e);
+  int top = lua_gettop(L);
+  int arg = 1;
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  for (const FormatItem& it : e->items) {
+    luaL_addlstring(&b, strfrmt + it.off, it.len);
+    if (it.kind == FK_TEXT)
+      continue;
+    if (++arg > top)
+      return luaL_argerror(L, arg, "no value");
+    switch (it.kind) {
+      case FK_INT: {
+        lua_Integer n = luaL_checkinteger(L, arg);
+        char *buff = luaL_prepbuffsize(&b, MAX_ITEM);
+        luaL_addsize(&b, cast_uint(addintdigits(buff, n)));
+        break;
+      }
+      case FK_STRING: {
+        luaL_tolstring(L, arg, NULL);
+        luaL_addvalue(&b);
+        break;
+      }
+      default: {
+        char form[MAX_FORMAT];
+        memcpy(form, it.form, sizeof(form));
+        addformat(L, &b, arg, form, it.conv, 1);
+      }
+    }
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+/* }====================================================== */
+
+
 static int str_format (lua_State *L) {
   int top = lua_gettop(L);
   int arg = 1;
   size_t sfl;
   const char *strfrmt = luaL_checklstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
-  const char *flags;
+  FormatCache::Entry *cf = getformatentry(L, strfrmt, sfl);
+  if (cf)
+    return formatcompiled(L, cf, strfrmt);
   luaL_Buffer b;
   luaL_buffinit(L, &b);
   while (strfrmt < strfrmt_end) {
-    if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
+    if (*strfrmt != L_ESC) {  /* copy the text up to the next '%' at once */
+      const char *e = (const char *)memchr(strfrmt, L_ESC,
+                                           ct_diff2sz(strfrmt_end - strfrmt));
+      if (e == NULL)
+        e = strfrmt_end;
+      luaL_addlstring(&b, strfrmt, ct_diff2sz(e - strfrmt));
+      strfrmt = e;
+    }
     else if (*++strfrmt == L_ESC)
       luaL_addchar(&b, *strfrmt++);  /* %% */
     else { /* format item */
       char form[MAX_FORMAT];  /* to store the format ('%...') */
-      unsigned maxitem = MAX_ITEM;  /* maximum length for the result */
-      char *buff = luaL_prepbuffsize(&b, maxitem);  /* to put result */
-      int nb = 0;  /* number of bytes in result */
       if (++arg > top)
         return luaL_argerror(L, arg, "no value");
       strfrmt = getformat(L, strfrmt, form);
-      switch (*strfrmt++) {
-        case 'c': {
-          checkformat(L, form, L_FMTFLAGSC, 0);
-          nb = l_sprintf(buff, maxitem, form, (int)luaL_checkinteger(L, arg));
-          break;
-        }
-        case 'd': case 'i':
-          flags = L_FMTFLAGSI;
-          goto intcase;
-        case 'u':
-          flags = L_FMTFLAGSU;
-          goto intcase;
-        case 'o': case 'x': case 'X':
-          flags = L_FMTFLAGSX;
-         intcase: {
-          lua_Integer n = luaL_checkinteger(L, arg);
-          checkformat(L, form, flags, 1);
-          addlenmod(form, LUA_INTEGER_FRMLEN);
-          nb = l_sprintf(buff, maxitem, form, (LUAI_UACINT)n);
-          break;
-        }
-        case 'a': case 'A':
-          checkformat(L, form, L_FMTFLAGSF, 1);
-          addlenmod(form, LUA_NUMBER_FRMLEN);
-          nb = lua_number2strx(L, buff, maxitem, form,
-                                  luaL_checknumber(L, arg));
-          break;
-        case 'f':
-          maxitem = MAX_ITEMF;  /* extra space for '%f' */
-          buff = luaL_prepbuffsize(&b, maxitem);
-          [[fallthrough]];
-        case 'e': case 'E': case 'g': case 'G': {
-          lua_Number n = luaL_checknumber(L, arg);
-          checkformat(L, form, L_FMTFLAGSF, 1);
-          addlenmod(form, LUA_NUMBER_FRMLEN);
-          nb = l_sprintf(buff, maxitem, form, (LUAI_UACNUMBER)n);
-          break;
-        }
-        case 'p': {
-          const void *p = lua_topointer(L, arg);
-          checkformat(L, form, L_FMTFLAGSC, 0);
-          if (p == NULL) {  /* avoid calling 'printf' with argument NULL */
-            p = "(null)";  /* result */
-            form[strlen(form) - 1] = 's';  /* format it as a string */
-          }
-          nb = l_sprintf(buff, maxitem, form, p);
-          break;
-        }
-        case 'q': {
-          if (form[2] != '\0')  /* modifiers? */
-            return luaL_error(L, "specifier '%%q' cannot have modifiers");
-          addliteral(L, &b, arg);
-          break;
-        }
-        case 'Q': {  /* [Pluto] utf-8-safe quoting */
-          if (form[2] != '\0')  /* modifiers? */
-            luaL_error(L, "specifier '%%Q' cannot have modifiers");
-          addliteral(L, &b, arg, true);
-          break;
-        }
-        case 's': {
-          size_t l;
-          const char *s = luaL_tolstring(L, arg, &l);
-          if (form[2] == '\0')  /* no modifiers? */
-            luaL_addvalue(&b);  /* keep entire string */
-          else {
-            luaL_argcheck(L, l == strlen(s), arg, "string contains zeros");
-            checkformat(L, form, L_FMTFLAGSC, 1);
-            if (strchr(form, '.') == NULL && l >= 100) {
-              /* no precision and string is too long to be formatted */
-              luaL_addvalue(&b);  /* keep entire string */
-            }
-            else {  /* format the string into 'buff' */
-              nb = l_sprintf(buff, maxitem, form, s);
-              lua_pop(L, 1);  /* remove result from 'luaL_tolstring' */
-            }
-          }
-          break;
-        }
-        default: {  /* also treat cases 'pnLlh' */
-          return luaL_error(L, "invalid conversion '%s' to 'format'", form);
-        }
-      }
-      lua_assert(cast_uint(nb) < maxitem);
-      luaL_addsize(&b, cast_uint(nb));
+      addformat(L, &b, arg, form, *strfrmt++, 0);
     }
   }
   luaL_pushresult(&b);
@@ -1698,9 +2511,9 @@ static KOption getdetails (Header *h, size_t totalsize, const char **fmt,
 ** the size of a Lua integer, correcting the extra sign-extension
 ** bytes if necessary (by default they would be zeros).
 */
-static void packint (luaL_Buffer *b, lua_Unsigned n,
+static void packint (PackSink& b, lua_Unsigned n,
                      int islittle, unsigned size, int neg) {
-  char *buff = luaL_prepbuffsize(b, size);
+  char *buff = b.prep(size);
   unsigned i;
   buff[islittle ? 0 : size - 1] = (char)(n & MC);  /* first byte */
   for (i = 1; i < size; i++) {
@@ -1711,7 +2524,7 @@ static void packint (luaL_Buffer *b, lua_Unsigned n,
     for (i = SZINT; i < size; i++)  /* correct extra bytes */
       buff[islittle ? i : size - 1 - i] = (char)MC;
   }
-  luaL_addsize(b, size);  /* add result to buffer */
+  b.add(size);  /* add result to buffer */
 }
 
 
@@ -1731,15 +2544,24 @@ static void copywithendian (char *dest, const char *src,
 }
 
 
-static int str_pack (lua_State *L) {
-  luaL_Buffer b;
+static void addbytes (PackSink& b, const char *s, size_t len) {
+  memcpy(b.prep(len), s, len);
+  b.add(len);
+}
+
+
+static void addbyte (PackSink& b, char c) {
+  *b.prep(1) = c;
+  b.add(1);
+}
+
+
+void pluto_pack (lua_State *L, int fmtarg, size_t offset, PackSink& b) {
   Header h;
-  const char *fmt = luaL_checkstring(L, 1);  /* format string */
-  int arg = 1;  /* current argument to pack */
-  size_t totalsize = 0;  /* accumulate total size of result */
+  const char *fmt = luaL_checkstring(L, fmtarg);  /* format string */
+  int arg = fmtarg;  /* current argument to pack */
+  size_t totalsize = offset;  /* accumulate total size of result */
   initheader(L, &h);
-  lua_pushnil(L);  /* mark to separate arguments from string buffer */
-  luaL_buffinit(L, &b);
   while (*fmt != '\0') {
     unsigned ntoalign;
     size_t size;
@@ -1748,7 +2570,7 @@ static int str_pack (lua_State *L) {
                      "result too long");
     totalsize += ntoalign + size;
     while (ntoalign-- > 0)
-     luaL_addchar(&b, LUAL_PACKPADBYTE);  /* fill alignment */
+     addbyte(b, LUAL_PACKPADBYTE);  /* fill alignment */
     arg++;
     switch (opt) {
       case Kint: {  /* signed integers */
@@ -1757,7 +2579,7 @@ static int str_pack (lua_State *L) {
           lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
           luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
         }
-        packint(&b, (lua_Unsigned)n, h.islittle, cast_uint(size), (n < 0));
+        packint(b, (lua_Unsigned)n, h.islittle, cast_uint(size), (n < 0));
         break;
       }
       case Kuint: {  /* unsigned integers */
@@ -1765,43 +2587,43 @@ static int str_pack (lua_State *L) {
         if (size < SZINT)  /* need overflow check? */
           luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
                            arg, "unsigned overflow");
-        packint(&b, (lua_Unsigned)n, h.islittle, cast_uint(size), 0);
+        packint(b, (lua_Unsigned)n, h.islittle, cast_uint(size), 0);
         break;
       }
       case Kfloat: {  /* C float */
         float f = (float)luaL_checknumber(L, arg);  /* get argument */
-        char *buff = luaL_prepbuffsize(&b, sizeof(f));
+        char *buff = b.prep(sizeof(f));
         /* move 'f' to final result, correcting endianness if needed */
         copywithendian(buff, (char *)&f, sizeof(f), h.islittle);
-        luaL_addsize(&b, size);
+        b.add(size);
         break;
       }
       case Knumber: {  /* Lua float */
         lua_Number f = luaL_checknumber(L, arg);  /* get argument */
-        char *buff = luaL_prepbuffsize(&b, sizeof(f));
+        char *buff = b.prep(sizeof(f));
         /* move 'f' to final result, correcting endianness if needed */
         copywithendian(buff, (char *)&f, sizeof(f), h.islittle);
-        luaL_addsize(&b, size);
+        b.add(size);
         break;
       }
       case Kdouble: {  /* C double */
         double f = (double)luaL_checknumber(L, arg);  /* get argument */
-        char *buff = luaL_prepbuffsize(&b, sizeof(f));
+        char *buff = b.prep(sizeof(f));
         /* move 'f' to final result, correcting endianness if needed */
         copywithendian(buff, (char *)&f, sizeof(f), h.islittle);
-        luaL_addsize(&b, size);
+        b.add(size);
         break;
       }
       case Kchar: {  /* fixed-size string */
         size_t len;
         const char *s = luaL_checklstring(L, arg, &len);
         luaL_argcheck(L, len <= size, arg, "string longer than given size");
-        luaL_addlstring(&b, s, len);  /* add string */
+        addbytes(b, s, len);  /* add string */
         if (len < size) {  /* does it need padding? */
           size_t psize = size - len;  /* pad size */
-          char *buff = luaL_prepbuffsize(&b, psize);
+          char *buff = b.prep(psize);
           memset(buff, LUAL_PACKPADBYTE, psize);
-          luaL_addsize(&b, psize);
+          b.add(psize);
         }
         break;
       }
@@ -1812,8 +2634,8 @@ static int str_pack (lua_State *L) {
                          len < ((lua_Unsigned)1 << (size * NB)),
                          arg, "string length does not fit in given size");
         /* pack length */
-        packint(&b, (lua_Unsigned)len, h.islittle, cast_uint(size), 0);
-        luaL_addlstring(&b, s, len);
+        packint(b, (lua_Unsigned)len, h.islittle, cast_uint(size), 0);
+        addbytes(b, s, len);
         totalsize += len;
         break;
       }
@@ -1821,18 +2643,39 @@ static int str_pack (lua_State *L) {
         size_t len;
         const char *s = luaL_checklstring(L, arg, &len);
         luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
-        luaL_addlstring(&b, s, len);
-        luaL_addchar(&b, '\0');  /* add zero at the end */
+        addbytes(b, s, len);
+        addbyte(b, '\0');  /* add zero at the end */
         totalsize += len + 1;
         break;
       }
-      case Kpadding: luaL_addchar(&b, LUAL_PACKPADBYTE); [[fallthrough]];
+      case Kpadding: addbyte(b, LUAL_PACKPADBYTE); [[fallthrough]];
       case Kpaddalign: case Knop:
         arg--;  /* undo increment */
         break;
     }
   }
-  luaL_pushresult(&b);
+}
+
+
+struct LuaBufferSink : PackSink {
+  luaL_Buffer b;
+
+  char *prep (size_t n) final {
+    return luaL_prepbuffsize(&b, n);
+  }
+
+  void add (size_t n) final {
+    luaL_addsize(&b, n);
+  }
+};
+
+
+static int str_pack (lua_State *L) {
+  LuaBufferSink sink;
+  lua_pushnil(L);  /* mark to separate arguments from string buffer */
+  luaL_buffinit(L, &sink.b);
+  pluto_pack(L, 1, 0, sink);
+  luaL_pushresult(&sink.b);
   return 1;
 }
 
@@ -1892,20 +2735,15 @@ static lua_Integer unpackint (lua_State *L, const char *str,
 }
 
 
-static int str_unpack (lua_State *L) {
+int pluto_unpack (lua_State *L, const char *fmt, const char *data, size_t ld, size_t pos, int dataarg) {
   Header h;
-  const char *fmt = luaL_checkstring(L, 1);
-  size_t ld;
-  const char *data = luaL_checklstring(L, 2, &ld);
-  size_t pos = posrelatI(luaL_optinteger(L, 3, 1), ld) - 1;
   int n = 0;  /* number of results */
-  luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
   initheader(L, &h);
   while (*fmt != '\0') {
     unsigned ntoalign;
     size_t size;
     KOption opt = getdetails(&h, pos, &fmt, &size, &ntoalign);
-    luaL_argcheck(L, ntoalign + size <= ld - pos, 2,
+    luaL_argcheck(L, ntoalign + size <= ld - pos, dataarg,
                     "data string too short");
     pos += ntoalign;  /* skip alignment */
     /* stack space for item + next position */
@@ -1944,15 +2782,17 @@ static int str_unpack (lua_State *L) {
       case Kstring: {
         lua_Unsigned len = (lua_Unsigned)unpackint(L, data + pos,
                                           h.islittle, cast_int(size), 0);
-        luaL_argcheck(L, len <= ld - pos - size, 2, "data string too short");
+        luaL_argcheck(L, len <= ld - pos - size, dataarg, "data string too short");
         lua_pushlstring(L, data + pos + size, cast_sizet(len));
         pos += cast_sizet(len);  /* skip string */
         break;
       }
       case Kzstr: {
-        size_t len = strlen(data + pos);
-        luaL_argcheck(L, pos + len < ld, 2,
+        /* not strlen: the data need not be zero-terminated */
+        const char *zero = (const char *)memchr(data + pos, '\0', ld - pos);
+        luaL_argcheck(L, zero != NULL, dataarg,
                          "unfinished string for format 'z'");
+        size_t len = cast_sizet(zero - (data + pos));
         lua_pushlstring(L, data + pos, len);
         pos += len + 1;  /* skip string plus final '\0' */
         break;
@@ -1968,6 +2808,16 @@ static int str_unpack (lua_State *L) {
 }
 
 
+static int str_unpack (lua_State *L) {
+  const char *fmt = luaL_checkstring(L, 1);
+  size_t ld;
+  const char *data = luaL_checklstring(L, 2, &ld);
+  size_t pos = posrelatI(luaL_optinteger(L, 3, 1), ld) - 1;
+  luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
+  return pluto_unpack(L, fmt, data, ld, pos, 2);
+}
+
+
 static int str_startswith (lua_State *L) {
   size_t len;
   const char *str = luaL_checkstring(L, 1);
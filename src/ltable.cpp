@@ -358,15 +358,20 @@ static unsigned findindex (lua_State *L, Table *t, TValue *key,
 }
 
 
-int luaH_next (lua_State *L, Table *t, StkId key) {
-  unsigned int asize = t->asize;
-  unsigned int i = findindex(L, t, s2v(key), asize);  /* find original key */
+/*
+** Puts the first entry at or after traversal index 'i' into 'key' and
+** 'key + 1'. Returns the traversal index of that entry plus one (which
+** is what 'findindex' gives for its key), or 0 if there are no more
+** elements.
+*/
+static unsigned nextfrom (lua_State *L, Table *t, StkId key, unsigned i,
+                                                       unsigned asize) {
   for (; i < asize; i++) {  /* try first array part */
     lu_byte tag = *getArrTag(t, i);
     if (!tagisempty(tag)) {  /* a non-empty entry? */
       setivalue(s2v(key), cast_int(i) + 1);
       farr2val(t, i, tag, s2v(key + 1));
-      return 1;
+      return i + 1;
     }
   }
   for (i -= asize; i < sizenode(t); i++) {  /* hash part */
@@ -374,13 +379,54 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
       Node *n = gnode(t, i);
       getnodekey(L, s2v(key), n);
       setobj2s(L, key + 1, gval(n));
-      return 1;
+      return asize + i + 1;
     }
   }
   return 0;  /* no more elements */
 }
 
 
+int luaH_next (lua_State *L, Table *t, StkId key) {
+  unsigned int asize = t->asize;
+  unsigned int i = findindex(L, t, s2v(key), asize);  /* find original key */
+  return nextfrom(L, t, key, i, asize) != 0;
+}
+
+
+/*
+** Check whether 'cursor' is still the traversal index of 'key', i.e.,
+** the entry it points to holds that key.
+*/
+static int cursormatches (Table *t, const TValue *key, unsigned cursor,
+                                                       unsigned asize) {
+  if (cursor == 0)
+    return ttisnil(key);
+  else if (cursor <= asize)
+    return ttisinteger(key) && l_castS2U(ivalue(key)) == cursor;
+  else {
+    cursor -= asize + 1;
+    return cursor < sizenode(t) && equalkey(key, gnode(t, cursor), 1);
+  }
+}
+
+
+/*
+** Same as 'luaH_next', for generic 'for' loops (see OP_TFORCALL), which
+** also keep the traversal index of the previous key in '*cursor'. That
+** saves hashing the key again, as long as the cursor still matches it;
+** otherwise (e.g., the table was resized during the traversal) the key
+** is looked up as usual.
+*/
+int luaH_nextcursor (lua_State *L, Table *t, StkId key, unsigned *cursor) {
+  unsigned int asize = t->asize;
+  unsigned int i = *cursor;
+  if (!cursormatches(t, s2v(key), i, asize))
+    i = findindex(L, t, s2v(key), asize);
+  *cursor = nextfrom(L, t, key, i, asize);
+  return *cursor != 0;
+}
+
+
 /* Extra space in Node array if it has a lastfree entry */
 #define extraLastfree(t)	(haslastfree(t) ? sizeof(Limbox) : 0)
 
@@ -696,6 +742,27 @@ static void clearNewSlice (Table *t, unsigned oldasize, unsigned newasize) {
 }
 
 
+/*
+** Computes the length hint for the array part after a resize, carrying
+** over the previous border when the new array still covers it (or, if
+** the border was past the old array, the hint kept for the hash part),
+** so that a table that grows by appending does not search again.
+*/
+static unsigned resizehint (const Table *t, unsigned oldasize,
+                                            unsigned newasize) {
+  lua_Unsigned hint;
+  if (oldasize > 0 && *lenhint(t) < oldasize)
+    hint = *lenhint(t);
+  else if (t->hbound > oldasize)
+    hint = t->hbound;
+  else if (oldasize > 0)
+    hint = oldasize;
+  else
+    return newasize / 2u;  /* no information; set an initial hint */
+  return (hint <= newasize) ? cast_uint(hint) : newasize;
+}
+
+
 /*
 ** Resize table 't' for the new given sizes. Both allocations (for
 ** the hash part and for the array part) can fail, which creates some
@@ -716,6 +783,7 @@ void luaH_resize (lua_State *L, Table *t, unsigned newasize,
                                           unsigned nhsize) {
   Table newt;  /* to keep the new hash part */
   unsigned oldasize = t->asize;
+  unsigned hint;
   Value *newarray;
   if (newasize > MAXASIZE)
     luaG_runerror(L, "table overflow");
@@ -728,6 +796,7 @@ void luaH_resize (lua_State *L, Table *t, unsigned newasize,
     reinsertOldSlice(t, oldasize, newasize);
     exchangehashpart(t, &newt);  /* restore old hash (in case of errors) */
   }
+  hint = resizehint(t, oldasize, newasize);  /* before old array is freed */
   /* allocate new array */
   newarray = resizearray(L, t, oldasize, newasize);
   if (l_unlikely(newarray == NULL && newasize > 0)) {  /* allocation failed? */
@@ -739,7 +808,7 @@ void luaH_resize (lua_State *L, Table *t, unsigned newasize,
   t->array = newarray;  /* set new array part */
   t->asize = newasize;
   if (newarray != NULL)
-    *lenhint(t) = newasize / 2u;  /* set an initial hint */
+    *lenhint(t) = hint;
   clearNewSlice(t, oldasize, newasize);
   /* re-insert elements from old hash part into new parts */
   reinserthash(L, &newt, t);  /* 'newt' now has the old hash */
@@ -802,6 +871,7 @@ Table *luaH_new (lua_State *L) {
   t->flags = maskflags;  /* table has no metamethod fields */
   t->array = NULL;
   t->asize = 0;
+  t->hbound = 0;
 #ifdef PLUTO_ENABLE_TABLE_FREEZING
   t->isfrozen = false;
 #endif
@@ -1104,8 +1174,27 @@ static int rawfinishnodeset (const TValue *slot, TValue *val) {
 }
 
 
+/*
+** Moves the border hint for the hash part along with a store of 'val'
+** into 'key', so that pushing to or popping from the end of a sequence
+** keeps it exact. (If the store does not happen after all, e.g. because
+** of a '__newindex' metamethod, the hint is merely stale; 'luaH_getn'
+** checks it before use.)
+*/
+l_sinline void movehbound (Table *t, lua_Integer key, const TValue *val) {
+  lua_Unsigned b = t->hbound;
+  if (l_castS2U(key) == b + 1u) {
+    if (!ttisnil(val))
+      t->hbound = b + 1u;
+  }
+  else if (l_castS2U(key) == b && b > 0 && ttisnil(val))
+    t->hbound = b - 1u;
+}
+
+
 int luaH_psetint (Table *t, lua_Integer key, TValue *val) {
   lua_assert(!ikeyinarray(t, key));
+  movehbound(t, key, val);
   return finishnodeset(t, getintfromhash(t, key), val);
 }
 
@@ -1236,10 +1325,15 @@ void luaH_set (lua_State *L, Table *t, const TValue *key, TValue *value) {
 */
 void luaH_setint (lua_State *L, Table *t, lua_Integer key, TValue *value) {
   unsigned ik = ikeyinarray(t, key);
-  if (ik > 0)
+  if (ik > 0) {
     obj2arr(t, ik - 1, value);
+    if (ik == *lenhint(t) + 1u && !ttisnil(value))
+      *lenhint(t) = ik;  /* appended right after the border */
+  }
   else {
-    int ok = rawfinishnodeset(getintfromhash(t, key), value);
+    int ok;
+    movehbound(t, key, value);
+    ok = rawfinishnodeset(getintfromhash(t, key), value);
     if (!ok) {
       TValue k;
       setivalue(&k, key);
@@ -1310,6 +1404,36 @@ static unsigned int binsearch (Table *array, unsigned int i, unsigned int j) {
 }
 
 
+/*
+** Find a border in the hash part, knowing that 'asize + 1' is present.
+** As for the array part, first look in the vicinity of the previous
+** result ('t->hbound', which stores to the hash part also keep up to
+** date) and only then fall back to a full search. [Pluto]
+*/
+static lua_Unsigned hashborder (lua_State *L, Table *t, unsigned asize) {
+  const unsigned maxvicinity = 4;
+  lua_Unsigned limit = t->hbound;
+  if (limit > asize && limit <= l_castS2U(LUA_MAXINTEGER)) {
+    unsigned i;
+    if (!hashkeyisempty(t, limit)) {  /* look for a border after it */
+      for (i = 0; i < maxvicinity; i++) {
+        if (limit == l_castS2U(LUA_MAXINTEGER) || hashkeyisempty(t, limit + 1))
+          return t->hbound = limit;
+        limit++;
+      }
+    }
+    else {  /* 'asize + 1' is present, so there is a border before it */
+      for (i = 0; i < maxvicinity; i++) {
+        limit--;
+        if (!hashkeyisempty(t, limit))
+          return t->hbound = limit;
+      }
+    }
+  }
+  return t->hbound = hash_search(L, t, asize);
+}
+
+
 /* return a border, saving it as a hint for next call */
 static lua_Unsigned newhint (Table *t, unsigned hint) {
   lua_assert(hint <= t->asize);
@@ -1370,7 +1494,7 @@ lua_Unsigned luaH_getn (lua_State *L, Table *t) {
   if (isdummy(t) || hashkeyisempty(t, asize + 1))
     return asize;  /* 'asize + 1' is empty */
   else  /* 'asize + 1' is also non empty */
-    return hash_search(L, t, asize);
+    return hashborder(L, t, asize);
 }
 
 
@@ -1395,6 +1519,7 @@ LUAI_FUNC void luaH_clear (lua_State *L, Table *t) {
   resizearray(L, t, t->asize, 0);
   t->array = NULL;
   t->asize = 0;
+  t->hbound = 0;
   /* clear hash part */
   freehash(L, t);
   setnodevector(L, t, 0);
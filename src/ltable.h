@@ -174,6 +174,8 @@ LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned nasize);
 LUAI_FUNC lu_mem luaH_size (Table *t);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
+LUAI_FUNC int luaH_nextcursor (lua_State *L, Table *t, StkId key,
+                                                   unsigned *cursor);
 LUAI_FUNC lua_Unsigned luaH_getn (lua_State *L, Table *t);
 
 
@@ -11,17 +11,29 @@
 
 
 #include <limits.h>
+#include <math.h>
 #include <stddef.h>
 #include <string.h>
 
+#include <algorithm> // fill_n, reverse, reverse_copy
+#include <cstdint>
+#include <type_traits>
+
 #include "lua.h"
 
 #include "lauxlib.h"
 #include "lualib.h"
 #include "llimits.h"
 #include "ljson.hpp" // isIndexBasedTable
+#include "lgc.h"
 #include "lstate.h"
+#include "lstring.h"
 #include "ltable.h"
+#include "ltm.h"
+#include "ltypedarray.hpp"
+#include "lparallel.hpp"
+
+LUAI_FUNC int luaB_ipairsaux (lua_State *L);
 
 
 /*
@@ -62,6 +74,150 @@ static void checktab (lua_State *L, int arg, int what) {
 }
 
 
+TValue *index2value (lua_State *L, int idx);
+
+
+/*
+** {======================================================
+** Direct access to array parts
+** Present entries of an array part can be read without going through
+** the API, as reading them never involves '__index'. Functions that
+** also rely on absent entries not reaching a metamethod use
+** 'plaintable' to check for that first.
+** =======================================================
+*/
+
+
+/*
+** Returns the table at 'arg' if it is one whose absent entries can be
+** read ('TAB_R') or written ('TAB_W') without calling a metamethod, or
+** NULL otherwise.
+*/
+static Table *plaintable (lua_State *L, int arg, int what) {
+  const TValue *o = index2value(L, arg);
+  if (!ttistable(o))
+    return NULL;
+  Table *t = hvalue(o);
+  if ((what & TAB_R) && fasttm(L, t->metatable, TM_INDEX) != NULL)
+    return NULL;
+  if (what & TAB_W) {
+    if (fasttm(L, t->metatable, TM_NEWINDEX) != NULL)
+      return NULL;
+#ifdef PLUTO_ENABLE_TABLE_FREEZING
+    if (t->isfrozen)
+      return NULL;  /* let the API raise the error */
+#endif
+  }
+  return t;
+}
+
+
+/* Direct stores into an array part skip the GC barrier that 'lua_rawset' would do. */
+static void arraybarrier (lua_State *L, Table *t) {
+  if (isblack(t))
+    luaC_barrierback_(L, obj2gco(t));
+}
+
+
+/* Number of entries in a table, used to presize results. */
+static unsigned countentries (Table *t) {
+  unsigned n = luaH_gethsize(t);
+  for (unsigned k = 0; k != t->asize; ++k)
+    n += !tagisempty(*getArrTag(t, k));
+  return n;
+}
+
+
+/*
+** Traverses the table at 'idx' like a 'lua_next' loop would, in the same
+** order, but takes the entries of the array part (from C index 'from')
+** directly. 'f' is called with the key and value pushed and must pop
+** the value; if it returns true, the traversal stops and whatever it
+** left on the stack is kept.
+*/
+template <typename F>
+static bool traverse (lua_State *L, int idx, F f, unsigned from = 0) {
+  Table *t = hvalue(index2value(L, idx));
+  for (unsigned k = from; k < t->asize; ++k) {  /* 'f' may resize the table */
+    const lu_byte tag = *getArrTag(t, k);
+    if (!tagisempty(tag)) {
+      lua_pushinteger(L, (lua_Integer)k + 1);
+      farr2val(t, k, tag, s2v(L->top.p));
+      L->top.p++;
+      if (f())
+        return true;
+      lua_pop(L, 1);  /* key */
+    }
+  }
+  if (t->asize > 0)
+    lua_pushinteger(L, t->asize);  /* continue after the array part */
+  else
+    lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    if (f())
+      return true;
+  }
+  return false;
+}
+
+
+/* Returns the index of the first entry in the array part of 't' for which 'eq' holds, or 0. */
+template <typename Eq>
+static lua_Integer scanarray (Table *t, Eq eq) {
+  const unsigned asize = t->asize;
+  for (unsigned k = 0; k != asize; ++k) {
+    if (eq(*getArrTag(t, k), *getArrVal(t, k)))
+      return (lua_Integer)k + 1;
+  }
+  return 0;
+}
+
+
+/*
+** Looks for 'v' in the array part of 't' the way '==' compares, with a
+** loop specialised for its type. The caller ensures that '==' cannot call
+** '__eq', i.e. 'v' is neither a table nor a full userdata.
+*/
+static lua_Integer findinarray (Table *t, const TValue *v) {
+  lua_Integer i;
+  switch (ttypetag(v)) {
+    case LUA_VNUMINT: {
+      i = ivalue(v);
+      break;
+    }
+    case LUA_VNUMFLT: {
+      if (luaV_flttointeger(fltvalue(v), &i, F2Ieq))
+        break;  /* an integral float equals the same integers */
+      const lua_Number n = fltvalue(v);
+      return scanarray(t, [n](lu_byte tag, const Value &e) {
+        return tag == LUA_VNUMFLT && luai_numeq(e.n, n);
+      });
+    }
+    case LUA_VSHRSTR: {  /* short strings are internalised */
+      const GCObject *ts = gcvalue(v);
+      return scanarray(t, [ts](lu_byte tag, const Value &e) {
+        return tag == ctb(LUA_VSHRSTR) && e.gc == ts;
+      });
+    }
+    default: {
+      return scanarray(t, [v](lu_byte tag, const Value &e) {
+        TValue o;
+        o.value_ = e;
+        o.tt_ = tag;
+        return !tagisempty(tag) && luaV_rawequalobj(v, &o);
+      });
+    }
+  }
+  return scanarray(t, [i](lu_byte tag, const Value &e) {
+    lua_Integer fi;
+    return (tag == LUA_VNUMINT && e.i == i) ||
+           (tag == LUA_VNUMFLT && luaV_flttointeger(e.n, &fi, F2Ieq) && fi == i);
+  });
+}
+
+/* }====================================================== */
+
+
 static int tcreate (lua_State *L) {
   lua_Unsigned sizeseq = (lua_Unsigned)luaL_checkinteger(L, 1);
   lua_Unsigned sizerest = (lua_Unsigned)luaL_optinteger(L, 2, 0);
@@ -162,7 +318,16 @@ static int tmove (lua_State *L) {
     n = e - f + 1;  /* number of elements to move */
     luaL_argcheck(L, t <= LUA_MAXINTEGER - n + 1, 4,
                   "destination wrap around");
-    if (t > e || t <= f || (tt != 1 && !lua_compare(L, 1, tt, LUA_OPEQ))) {
+    Table *src = plaintable(L, 1, TAB_R);
+    Table *dst = plaintable(L, tt, TAB_W);
+    if (src && dst && f >= 1 && l_castS2U(e) <= src->asize &&
+        t >= 1 && l_castS2U(t) - 1u + l_castS2U(n) <= dst->asize) {
+      /* both ranges are in array parts: move tags and values as blocks */
+      memmove(getArrTag(dst, t - 1), getArrTag(src, f - 1), (size_t)n);
+      memmove(getArrVal(dst, t + n - 2), getArrVal(src, e - 1), (size_t)n * sizeof(Value));
+      arraybarrier(L, dst);
+    }
+    else if (t > e || t <= f || (tt != 1 && !lua_compare(L, 1, tt, LUA_OPEQ))) {
       for (i = 0; i < n; i++) {
         lua_geti(L, 1, f + i);
         lua_seti(L, tt, t + i);
@@ -180,7 +345,15 @@ static int tmove (lua_State *L) {
 }
 
 
-static void addfield (lua_State *L, luaL_Buffer *b, lua_Integer i) {
+static void addfield (lua_State *L, luaL_Buffer *b, Table *t, lua_Integer i) {
+  if (t != NULL && l_castS2U(i) - 1u < t->asize) {  /* strings in the array part are added directly */
+    const lu_byte tag = *getArrTag(t, i - 1);
+    if (tag == ctb(LUA_VSHRSTR) || tag == ctb(LUA_VLNGSTR)) {
+      TString *ts = gco2ts(getArrVal(t, i - 1)->gc);
+      luaL_addlstring(b, getstr(ts), tsslen(ts));
+      return;
+    }
+  }
   lua_geti(L, 1, i);
   if (l_unlikely(!lua_isstring(L, -1)))
     luaL_error(L, "invalid value (%s) at index %I in table for 'concat'",
@@ -196,13 +369,14 @@ static int tconcat (lua_State *L) {
   const char *sep = luaL_optlstring(L, 2, "", &lsep);
   lua_Integer i = luaL_optinteger(L, 3, 1);
   last = luaL_optinteger(L, 4, last);
+  Table *t = (lua_type(L, 1) == LUA_TTABLE) ? hvalue(index2value(L, 1)) : NULL;
   luaL_buffinit(L, &b);
   for (; i < last; i++) {
-    addfield(L, &b, i);
+    addfield(L, &b, t, i);
     luaL_addlstring(&b, sep, lsep);
   }
   if (i == last)  /* add last value (if interval was not empty) */
-    addfield(L, &b, i);
+    addfield(L, &b, t, i);
   luaL_pushresult(&b);
   return 1;
 }
@@ -271,9 +445,31 @@ static void trivialcopy (lua_State* L) {
 static void auxclone (lua_State *L, int i, int depth) {
   --depth;
   lua_checkstack(L, 6);
-  lua_newtable(L);
+  Table *t = hvalue(index2value(L, i));
+  const unsigned asize = t->asize;
+  lua_createtable(L, (int)asize, (int)luaH_gethsize(t));
   lua_pushvalue(L, i < 0 ? i - 1 : i);
-  lua_pushnil(L);
+  /* stack now: newtable, table */
+  if (asize > 0) {  /* copy the array part as a block, then clone the tables in it */
+    Table *nt = hvalue(index2value(L, -2));
+    memcpy(getArrTag(nt, 0), getArrTag(t, 0), asize);
+    memcpy(getArrVal(nt, asize - 1), getArrVal(t, asize - 1), asize * sizeof(Value));
+    *lenhint(nt) = *lenhint(t);
+    arraybarrier(L, nt);
+    if (depth > 0) {
+      for (unsigned k = 0; k != asize; ++k) {
+        if (*getArrTag(nt, k) == ctb(LUA_VTABLE)) {
+          lua_rawgeti(L, -1, (lua_Integer)k + 1);
+          auxclone(L, -1, depth);
+          lua_rawseti(L, -4, (lua_Integer)k + 1);
+          lua_pop(L, 1);
+        }
+      }
+    }
+    lua_pushinteger(L, asize);  /* continue with the hash part */
+  }
+  else
+    lua_pushnil(L);
   while (lua_next(L, -2)) {
     /* stack now: newtable, table, key, value */
     lua_pushvalue(L, -2);
@@ -469,13 +665,82 @@ static void auxsort (lua_State *L, IdxT lo, IdxT up, unsigned rnd) {
 }
 
 
+/*
+** Sorts 'a[1 .. n]' without calling back into Lua. This is possible when
+** there is no order function and the elements are all in the array part
+** and are either all integers, all floats (none of them NaN) or all
+** strings, as '<' then cannot call a metamethod or fail. Large arrays are
+** sorted in parallel (see lparallel.hpp). Returns false if the general
+** algorithm has to be used instead.
+*/
+static bool sortarray (lua_State *L, unsigned n) {
+  if (lua_type(L, 1) != LUA_TTABLE)
+    return false;
+  Table *t = hvalue(index2value(L, 1));
+  if (n > t->asize)
+    return false;
+#ifdef PLUTO_ENABLE_TABLE_FREEZING
+  if (t->isfrozen)
+    return false;  /* let 'lua_seti' raise the error */
+#endif
+  const lu_byte tag = *getArrTag(t, 0);
+  const bool isstr = (novariant(tag) == LUA_TSTRING);
+  if (tag != LUA_VNUMINT && tag != LUA_VNUMFLT && !isstr)
+    return false;
+  for (unsigned k = 1; k != n; ++k) {
+    const lu_byte tk = *getArrTag(t, k);
+    if (isstr ? novariant(tk) != LUA_TSTRING : tk != tag)
+      return false;
+  }
+  /* the values of 'a[n] .. a[1]' are in this order in memory, so they are sorted in descending order */
+  Value *v = getArrVal(t, n - 1);
+  if (tag == LUA_VNUMFLT) {
+    for (unsigned k = 0; k != n; ++k) {
+      if (luai_numisnan(v[k].n))
+        return false;
+    }
+  }
+  Value *tmp = nullptr;  /* 'parallelsort' only needs room to merge if it splits the array */
+  const unsigned nthreads = G(L)->parallelthreads;
+  if (n / PARALLEL_GRAIN > 1 && nthreads > 1)
+    tmp = static_cast<Value*>(lua_newuserdatauv(L, n * sizeof(Value), 0));
+  switch (tag) {
+    case LUA_VNUMINT: {
+      parallelsort(v, tmp, n, nthreads, [](const Value &a, const Value &b) {
+        return b.i < a.i;
+      });
+      break;
+    }
+    case LUA_VNUMFLT: {
+      parallelsort(v, tmp, n, nthreads, [](const Value &a, const Value &b) {
+        return luai_numlt(b.n, a.n);
+      });
+      break;
+    }
+    default: {
+      parallelsort(v, tmp, n, nthreads, [](const Value &a, const Value &b) {
+        return a.gc != b.gc && luaV_strcmp(gco2ts(b.gc), gco2ts(a.gc)) < 0;
+      });
+      for (unsigned k = 0; k != n; ++k)  /* short and long strings have different tags */
+        *getArrTag(t, k) = ctb(gco2ts(getArrVal(t, k)->gc)->tt);
+      break;
+    }
+  }
+  return true;
+}
+
+
 template <bool make_copy>
 static int sort (lua_State *L) {
   lua_Integer n = aux_getn(L, 1, TAB_RW);
   if (make_copy) {
-    lua_newtable(L);
-    lua_pushvalue(L, 1);
-    trivialcopy(L);
+    if (lua_type(L, 1) == LUA_TTABLE)
+      auxclone(L, 1, 1);  /* shallow copy */
+    else {
+      lua_newtable(L);
+      lua_pushvalue(L, 1);
+      trivialcopy(L);
+    }
     lua_replace(L, 1);
   }
   if (n > 1) {  /* non-trivial interval? */
@@ -483,7 +748,8 @@ static int sort (lua_State *L) {
     if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
       luaL_checktype(L, 2, LUA_TFUNCTION);  /* must be a function */
     lua_settop(L, 2);  /* make sure there are two arguments */
-    auxsort(L, 1, (IdxT)n, 0);
+    if (!lua_isnil(L, 2) || !sortarray(L, (unsigned)n))
+      auxsort(L, 1, (IdxT)n, 0);
   }
   lua_settop(L, 1);
   return 1;
@@ -520,29 +786,256 @@ static int tisfrozen (lua_State *L) {
 static int tcontains (lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
   luaL_checkany(L, 2);
+  lua_settop(L, 2);
 
-  lua_pushvalue(L, 1);
-  lua_pushnil(L);
-  while (lua_next(L, -2)) {
-    lua_pushvalue(L, -2);
-    if (lua_compare(L, 2, -2, LUA_OPEQ)) {
-      lua_pushvalue(L, -1);
+  Table *t = hvalue(index2value(L, 1));
+  const TValue *v = index2value(L, 2);
+  unsigned from = 0;
+  if (!ttistable(v) && !ttisfulluserdata(v)) {  /* '==' cannot call '__eq'? */
+    if (const lua_Integer i = findinarray(t, v)) {
+      lua_pushinteger(L, i);
       return 1;
     }
-    else {
-      lua_pop(L, 2);
+    from = t->asize;  /* only the hash part is left */
+  }
+  const bool found = traverse(L, 1, [L]() {
+    if (lua_compare(L, 2, -1, LUA_OPEQ))
+      return true;
+    lua_pop(L, 1);
+    return false;
+  }, from);
+  if (found)
+    lua_pop(L, 1);  /* leave the key */
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+
+/*
+** {======================================================
+** Builtin operations for table.map and table.filter
+** Instead of a function, these also accept the name of an operation,
+** which is applied to the values without calling back into Lua, so the
+** array part can be processed in parallel (see lparallel.hpp).
+** =======================================================
+*/
+
+
+/*
+** Element-wise operations, also used by typed arrays. "div" is '/' and "idiv" is '//', as for
+** the operators, so integer typed arrays only support the latter.
+*/
+enum TypedOp { TOP_ADD, TOP_SUB, TOP_MUL, TOP_DIV, TOP_IDIV, TOP_NEG, TOP_ABS, TOP_SQUARE, TOP_MIN, TOP_MAX, TOP_SQRT, TOP_FLOOR, TOP_CEIL };
+static const char *const typedops[] = {"add", "sub", "mul", "div", "idiv", "neg", "abs", "square", "min", "max", "sqrt", "floor", "ceil", nullptr};
+
+enum FilterOp { FOP_LT, FOP_LE, FOP_GT, FOP_GE, FOP_EQ, FOP_NE };
+static const char *const filterops[] = {"lt", "le", "gt", "ge", "eq", "ne", nullptr};
+
+
+/* Pushes the table to work on: the one at index 1, or a shallow copy of it. */
+template <bool make_copy>
+static Table *optable (lua_State *L) {
+  if (make_copy)
+    auxclone(L, 1, 1);
+  else {
+#ifdef PLUTO_ENABLE_TABLE_FREEZING
+    lua_erriffrozen(L, 1);
+#endif
+    lua_pushvalue(L, 1);
+  }
+  return hvalue(index2value(L, -1));
+}
+
+
+/*
+** Applies 'f(k, v)' to the values of the table at the top, where 'k' is
+** the C index in the array part or -1 for the hash part. 'f' returns
+** false to remove the entry and otherwise may update 'v'. The array part
+** is split across the worker pool; 'f' must not touch the stack there.
+*/
+template <typename F>
+static void applyop (lua_State *L, Table *t, F f) {
+  const unsigned asize = t->asize;
+  parallelrange(asize, G(L)->parallelthreads, [t, &f](size_t lo, size_t hi) {
+    for (size_t k = lo; k != hi; ++k) {
+      const lu_byte tag = *getArrTag(t, k);
+      if (!tagisempty(tag)) {
+        TValue v;
+        farr2val(t, k, tag, &v);
+        if (f(&v))
+          obj2arr(t, k, &v);
+        else
+          *getArrTag(t, k) = LUA_VNIL;
+      }
     }
+  });
+  if (asize > 0)
+    lua_pushinteger(L, asize);  /* continue with the hash part */
+  else
+    lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    /* stack now: table, key, value */
+    TValue v;
+    setobj(L, &v, index2value(L, -1));
+    lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    if (f(&v)) {
+      setobj2s(L, L->top.p, &v);
+      L->top.p++;
+    }
+    else
+      lua_pushnil(L);
+    lua_rawset(L, -4);  /* assigning to existing fields is allowed during traversal */
   }
-  
-  lua_pop(L, 1);
-  lua_pushnil(L);
+}
+
+
+/* Raises an error unless every value of the table at index 1 satisfies 'ok(tag)'. */
+template <typename F>
+static void checkvalues (lua_State *L, F ok, const char *fmt, const char *what) {
+  Table *t = hvalue(index2value(L, 1));
+  int bad = LUA_TNONE;
+  for (unsigned k = 0; k != t->asize && bad == LUA_TNONE; ++k) {
+    const lu_byte tag = *getArrTag(t, k);
+    if (!tagisempty(tag) && !ok(tag))
+      bad = novariant(tag);
+  }
+  if (bad == LUA_TNONE) {
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+      if (!ok(ttypetag(index2value(L, -1)))) {
+        bad = lua_type(L, -1);
+        break;
+      }
+      lua_pop(L, 1);
+    }
+  }
+  if (bad != LUA_TNONE)
+    luaL_error(L, fmt, what, lua_typename(L, bad));
+}
+
+
+/* Computes 'op' on the number 'v' like the corresponding operator or function of the math library would. */
+static void mapnumber (lua_State *L, int op, TValue *v, const TValue *x) {
+  if (ttisinteger(v)) {
+    const lua_Integer i = ivalue(v);
+    switch (op) {
+      case TOP_NEG: setivalue(v, intop(-, 0, i)); return;
+      case TOP_ABS: setivalue(v, i < 0 ? intop(-, 0, i) : i); return;
+      case TOP_SQUARE: setivalue(v, intop(*, i, i)); return;
+      case TOP_FLOOR: case TOP_CEIL: return;
+      default: break;
+    }
+    if (ttisinteger(x)) {
+      const lua_Integer y = ivalue(x);
+      switch (op) {
+        case TOP_ADD: setivalue(v, intop(+, i, y)); return;
+        case TOP_SUB: setivalue(v, intop(-, i, y)); return;
+        case TOP_MUL: setivalue(v, intop(*, i, y)); return;
+        case TOP_IDIV: setivalue(v, luaV_idiv(L, i, y)); return;  /* 'y' is not 0 (see 'tmapop') */
+        default: break;
+      }
+    }
+  }
+  const lua_Number n = nvalue(v);
+  switch (op) {
+    case TOP_ADD: setfltvalue(v, luai_numadd(L, n, nvalue(x))); break;
+    case TOP_SUB: setfltvalue(v, luai_numsub(L, n, nvalue(x))); break;
+    case TOP_MUL: setfltvalue(v, luai_nummul(L, n, nvalue(x))); break;
+    case TOP_DIV: setfltvalue(v, luai_numdiv(L, n, nvalue(x))); break;
+    case TOP_IDIV: setfltvalue(v, luai_numidiv(L, n, nvalue(x))); break;
+    case TOP_NEG: setfltvalue(v, luai_numunm(L, n)); break;
+    case TOP_ABS: setfltvalue(v, l_mathop(fabs)(n)); break;
+    case TOP_SQUARE: setfltvalue(v, luai_nummul(L, n, n)); break;
+    case TOP_MIN: if (luaV_lessthan(L, x, v)) { setobj(L, v, x); } break;  /* numbers never reach 'L' */
+    case TOP_MAX: if (luaV_lessthan(L, v, x)) { setobj(L, v, x); } break;
+    case TOP_SQRT: setfltvalue(v, l_mathop(sqrt)(n)); break;
+    default: {
+      const lua_Number f = (op == TOP_FLOOR) ? l_mathop(floor)(n) : l_mathop(ceil)(n);
+      lua_Integer i;
+      if (luaV_flttointeger(f, &i, F2Ieq)) {
+        setivalue(v, i);
+      }
+      else {
+        setfltvalue(v, f);
+      }
+      break;
+    }
+  }
+}
+
+
+/* table.map(t, op [, x]) and table.mapped(t, op [, x]) */
+template <bool make_copy>
+static int tmapop (lua_State *L) {
+  const int op = luaL_checkoption(L, 2, nullptr, typedops);
+  if (op <= TOP_IDIV || op == TOP_MIN || op == TOP_MAX)
+    luaL_checknumber(L, 3);
+  luaL_argcheck(L, op != TOP_IDIV || !lua_isinteger(L, 3) || lua_tointeger(L, 3) != 0, 3, "attempt to perform 'n//0'");
+  lua_settop(L, 3);
+  const TValue *x = index2value(L, 3);
+  checkvalues(L, [](lu_byte tag) { return novariant(tag) == LUA_TNUMBER; },
+              "attempt to perform '%s' on a %s value", typedops[op]);
+  Table *t = optable<make_copy>(L);
+  applyop(L, t, [L, op, x](TValue *v) {
+    mapnumber(L, op, v, x);
+    return true;
+  });
+  return 1;
+}
+
+
+/* table.filter(t, op, x) and table.filtered(t, op, x), keeping the values 'v' for which 'v op x' holds */
+template <bool make_copy>
+static int tfilterop (lua_State *L) {
+  const int op = luaL_checkoption(L, 2, nullptr, filterops);
+  const int xt = lua_type(L, 3);
+  luaL_argexpected(L, xt == LUA_TNUMBER || xt == LUA_TSTRING, 3, "number or string");
+  lua_settop(L, 3);
+  const TValue *x = index2value(L, 3);
+  if (op < FOP_EQ) {  /* ordering needs values of the same kind */
+    checkvalues(L, [xt](lu_byte tag) { return novariant(tag) == xt; },
+                "attempt to compare %s with %s", lua_typename(L, xt));
+  }
+  Table *t = optable<make_copy>(L);
+  applyop(L, t, [L, op, x](TValue *v) {
+    switch (op) {  /* numbers and strings never reach 'L' */
+      case FOP_LT: return luaV_lessthan(L, v, x) != 0;
+      case FOP_LE: return luaV_lessequal(L, v, x) != 0;
+      case FOP_GT: return luaV_lessthan(L, x, v) != 0;
+      case FOP_GE: return luaV_lessequal(L, x, v) != 0;
+      case FOP_EQ: return luaV_rawequalobj(v, x) != 0;
+      default: return luaV_rawequalobj(v, x) == 0;
+    }
+  });
+  return 1;
+}
+
+
+/*
+** table.parallelism([n]): gets or sets the number of threads used for the above and sorting.
+** The setting belongs to the state, so other states are unaffected.
+*/
+static int tparallelism (lua_State *L) {
+  const unsigned old = G(L)->parallelthreads;
+  if (!lua_isnoneornil(L, 1)) {
+    const lua_Integer n = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, n >= 1, 1, "must be at least 1");
+    G(L)->parallelthreads = (n > PARALLEL_MAXTHREADS) ? PARALLEL_MAXTHREADS : (unsigned)n;
+  }
+  lua_pushinteger(L, old);
   return 1;
 }
 
+/* }====================================================== */
+
 
 template <bool make_copy>
 static int tfilter (lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
+  if (lua_type(L, 2) == LUA_TSTRING)
+    return tfilterop<make_copy>(L);
   luaL_checktype(L, 2, LUA_TFUNCTION);
   const bool callwithkey = lua_istrue(L, 3);
 
@@ -591,6 +1084,8 @@ static int tfilter (lua_State *L) {
 template <bool make_copy>
 static int tmap (lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
+  if (lua_type(L, 2) == LUA_TSTRING)
+    return tmapop<make_copy>(L);
   luaL_checktype(L, 2, LUA_TFUNCTION);
   const bool callwithkey = lua_istrue(L, 3);
 
@@ -631,11 +1126,29 @@ template <bool make_copy>
 static int treverse (lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
 
-  if (make_copy) {
+  if (make_copy)
     lua_settop(L, 1);
-    lua_newtable(L);
-  }
   const lua_Unsigned l = lua_rawlen(L, 1);
+  Table *t = hvalue(index2value(L, 1));
+  if (l <= t->asize) {  /* all in the array part: reverse tags and values as blocks */
+    const unsigned n = (unsigned)l;
+    if (make_copy) {
+      lua_createtable(L, (int)n, 0);
+      if (n > 0) {
+        Table *nt = hvalue(index2value(L, 2));
+        std::reverse_copy(getArrTag(t, 0), getArrTag(t, n), getArrTag(nt, 0));
+        std::reverse_copy(getArrVal(t, n - 1), getArrVal(t, 0) + 1, getArrVal(nt, n - 1));
+        arraybarrier(L, nt);
+      }
+    }
+    else if (n > 0) {
+      std::reverse(getArrTag(t, 0), getArrTag(t, n));
+      std::reverse(getArrVal(t, n - 1), getArrVal(t, 0) + 1);
+    }
+    return 1;
+  }
+  if (make_copy)
+    lua_newtable(L);
   for (lua_Unsigned i = 1; i <= l/2; ++i) {
     lua_pushinteger(L, l - i + 1);
     lua_pushinteger(L, i);
@@ -657,7 +1170,6 @@ static int treverse (lua_State *L) {
 }
 
 
-TValue *index2value (lua_State *L, int idx);
 template <bool make_copy>
 static int treorder (lua_State* L) {
   luaL_checktype(L, 1, LUA_TTABLE);
@@ -744,27 +1256,23 @@ template <bool findindex>
 static int tfind (lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
   luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_settop(L, 2);
 
-  lua_pushvalue(L, 1);
-  lua_pushnil(L);
-  /* stack now: table, key */
-  while (lua_next(L, -2)) {
-    /* stack now: table, key, value */
+  const bool found = traverse(L, 1, [L]() {
+    /* stack now: table, func, key, value */
     lua_pushvalue(L, 2);
-    /* stack now: table, key, value, func */
     lua_pushvalue(L, -2);
-    /* stack now: table, key, value, func, value */
     lua_call(L, 1, 1);
-    /* stack now: table, key, value, bool */
-    if (lua_toboolean(L, -1)) {
-      lua_pop(L, findindex ? 2 : 1);
-      return 1;
-    }
+    /* stack now: table, func, key, value, bool */
+    if (lua_toboolean(L, -1))
+      return true;
     lua_pop(L, 2);
-    /* stack now: table, key */
-  }
-  lua_pop(L, 1);
-  lua_pushnil(L);
+    return false;
+  });
+  if (found)
+    lua_pop(L, findindex ? 2 : 1);
+  else
+    lua_pushnil(L);
   return 1;
 }
 
@@ -827,44 +1335,50 @@ static int modset (lua_State *L) {
 }
 
 
-static int tkeys (lua_State *L) {
-  lua_newtable(L);
-  lua_Integer i = 0;
-  lua_pushnil(L);
-  /* stack now: res, key */
-  while (lua_next(L, 1)) {
-    /* stack now: res, key, value */
-    lua_pop(L, 1);
-    /* stack now: res, key */
-    lua_pushinteger(L, ++i);
-    /* stack now: res, key, index */
-    lua_pushvalue(L, -2);
-    /* stack now: res, key, index, key */
-    lua_settable(L, -4);
-    /* stack now: res, key */
+/*
+** table.keys and table.values. The result is presized to hold every entry,
+** so the entries of the array part go straight into its array part.
+*/
+template <bool keys>
+static int tcollect (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  Table *t = hvalue(index2value(L, 1));
+  lua_createtable(L, (int)countentries(t), 0);
+  Table *res = hvalue(index2value(L, 2));
+  unsigned i = 0;
+  for (unsigned k = 0; k != t->asize; ++k) {
+    const lu_byte tag = *getArrTag(t, k);
+    if (!tagisempty(tag)) {
+      if constexpr (keys) {
+        *getArrTag(res, i) = LUA_VNUMINT;
+        getArrVal(res, i)->i = (lua_Integer)k + 1;
+      }
+      else {
+        *getArrTag(res, i) = tag;
+        *getArrVal(res, i) = *getArrVal(t, k);
+      }
+      ++i;
+    }
   }
-  /* stack now: res */
-  return 1;
-}
-
-
-static int tvalues (lua_State *L) {
-  lua_newtable(L);
-  lua_Integer i = 0;
-  lua_pushnil(L);
-  /* stack now: res, key */
+  if (i > 0) {
+    *lenhint(res) = i;
+    if constexpr (!keys)
+      arraybarrier(L, res);
+  }
+  if (t->asize > 0)
+    lua_pushinteger(L, t->asize);  /* continue with the hash part */
+  else
+    lua_pushnil(L);
   while (lua_next(L, 1)) {
-    /* stack now: res, key, value */
-    lua_pushinteger(L, ++i);
-    /* stack now: res, key, value, index */
-    lua_pushvalue(L, -2);
-    /* stack now: res, key, value, index, value */
-    lua_settable(L, -5);
-    /* stack now: res, key, value */
-    lua_pop(L, 1);
-    /* stack now: res, key */
+    /* stack now: table, res, key, value */
+    if constexpr (keys)
+      lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 2, ++i);
+    if constexpr (!keys)
+      lua_pop(L, 1);
   }
-  /* stack now: res */
   return 1;
 }
 
@@ -874,16 +1388,14 @@ static int tcountvalues (lua_State *L) {
   lua_settop(L, 1);
 
   lua_newtable(L);
-  lua_pushnil(L);
-  while (lua_next(L, 1)) { /* og, result, key */
-    lua_pushvalue(L, 4); /* push the key, prepare for result[value] */
-    lua_gettable(L, 2); /* push result[value] */
-    const lua_Integer i = luaL_optinteger(L, -1, 0) + 1; /* start or update count */
-    lua_pushvalue(L, 4); /* push the key again */
+  traverse(L, 1, [L]() { /* og, result, key, value */
+    lua_pushvalue(L, 4); /* prepare for result[value] */
+    const lua_Integer i = (lua_rawget(L, 2) == LUA_TNIL ? 0 : lua_tointeger(L, -1)) + 1; /* start or update count */
+    lua_pop(L, 1);
     lua_pushinteger(L, i); /* push updated count */
-    lua_settable(L, 2); /* update result */
-    lua_settop(L, 3); /* reset stack to og, result, key */
-  }
+    lua_rawset(L, 2); /* update result, popping the value */
+    return false;
+  });
 
   return 1;
 }
@@ -891,24 +1403,27 @@ static int tcountvalues (lua_State *L) {
 
 static int tdeduplicate (lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
+#ifdef PLUTO_ENABLE_TABLE_FREEZING
+  lua_erriffrozen(L, 1);  /* the raw assignments below would not check */
+#endif
   lua_settop(L, 1);
 
   lua_newtable(L);  /* set of seen values */
-  lua_pushnil(L);
-  while (lua_next(L, 1)) {
+  traverse(L, 1, [L]() {  /* og, seen, key, value */
     lua_pushvalue(L, 4);
-    if (lua_gettable(L, 2) > LUA_TNIL) {  /* seen this value before? */
+    if (lua_rawget(L, 2) > LUA_TNIL) {  /* seen this value before? */
       lua_pushvalue(L, 3);
       lua_pushnil(L);
-      lua_settable(L, 1);
+      lua_rawset(L, 1);
+    }
+    else {
+      lua_pushvalue(L, 4);
+      lua_pushboolean(L, true);
+      lua_rawset(L, 2);
     }
-
-    lua_pushvalue(L, 4);
-    lua_pushboolean(L, true);
-    lua_settable(L, 2);
-
     lua_settop(L, 3);
-  }
+    return false;
+  });
 
   lua_settop(L, 1);
   return 1;
@@ -922,21 +1437,18 @@ static int tdeduplicated (lua_State *L) {
   lua_Integer i = 1;
   lua_newtable(L);  /* result */
   lua_newtable(L);  /* set of seen values */
-  lua_pushnil(L);
-  while (lua_next(L, 1)) {
+  traverse(L, 1, [L, &i]() {  /* og, result, seen, key, value */
     lua_pushvalue(L, 5);
-    if (lua_gettable(L, 3) <= LUA_TNIL) {  /* value not seen before? */
-      lua_pushinteger(L, i++);
+    if (lua_rawget(L, 3) <= LUA_TNIL) {  /* value not seen before? */
+      lua_pushvalue(L, 5);
+      lua_rawseti(L, 2, i++);
       lua_pushvalue(L, 5);
-      lua_settable(L, 2);
+      lua_pushboolean(L, true);
+      lua_rawset(L, 3);
     }
-
-    lua_pushvalue(L, 5);
-    lua_pushboolean(L, true);
-    lua_settable(L, 3);
-
     lua_settop(L, 4);
-  }
+    return false;
+  });
 
   lua_settop(L, 2);
   return 1;
@@ -1061,6 +1573,342 @@ static int tisarray (lua_State *L) {
 
 /* }====================================================== */
 
+/*
+** {======================================================
+** Typed arrays (see ltypedarray.hpp)
+** =======================================================
+*/
+
+static const char *const typedkinds[] = {"f64", "i64", "i32", "u8", nullptr};
+
+
+static TypedArray *checktyped (lua_State *L, int arg) {
+  return (TypedArray*)luaL_checkudata(L, arg, PLUTO_TYPEDARRAY_MT);
+}
+
+
+/* Calls 'f' with a pointer to the elements of 'a', typed according to its kind. */
+template <typename F>
+static void withelems (TypedArray *a, F&& f) {
+  switch (a->kind) {
+    case TA_F64: f(a->elems<double>()); break;
+    case TA_I64: f(a->elems<int64_t>()); break;
+    case TA_I32: f(a->elems<int32_t>()); break;
+    default: f(a->elems<uint8_t>()); break;
+  }
+}
+
+
+template <typename T>
+static void pushelem (lua_State *L, T v) {
+  if constexpr (std::is_floating_point_v<T>)
+    lua_pushnumber(L, v);
+  else
+    lua_pushinteger(L, v);
+}
+
+
+/* Integer arrays wrap around like Lua integers do, so their arithmetic is done on unsigned values. */
+template <typename T>
+static T wrapint (lua_Unsigned v) {
+  return static_cast<T>(v);
+}
+
+
+static int typed_len (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)checktyped(L, 1)->len);
+  return 1;
+}
+
+
+/* Typed arrays have no keys besides their indices, so 'pairs' works like 'ipairs'. */
+static int typed_pairs (lua_State *L) {
+  checktyped(L, 1);
+  lua_pushcfunction(L, luaB_ipairsaux);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
+
+
+static int typed_newindex (lua_State *L) {
+  checktyped(L, 1);
+  lua_settable(L, 1);  /* handled by the VM; raises the appropriate error for bad keys or values */
+  return 0;
+}
+
+
+static int typed_kind (lua_State *L) {
+  lua_pushstring(L, typedkinds[checktyped(L, 1)->kind]);
+  return 1;
+}
+
+
+/* The sums use several accumulators, so that the loop has no dependency chain and can be vectorised. */
+static int typed_sum (lua_State *L) {
+  auto a = checktyped(L, 1);
+  const size_t n = a->len;
+  withelems(a, [L, n](auto p) {
+    using T = std::remove_pointer_t<decltype(p)>;
+    if constexpr (std::is_floating_point_v<T>) {
+      lua_Number s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+      size_t i = 0;
+      for (; i + 4 <= n; i += 4) {
+        s0 += p[i];
+        s1 += p[i + 1];
+        s2 += p[i + 2];
+        s3 += p[i + 3];
+      }
+      for (; i != n; ++i)
+        s0 += p[i];
+      lua_pushnumber(L, (s0 + s1) + (s2 + s3));
+    }
+    else {
+      lua_Unsigned s = 0;
+      for (size_t i = 0; i != n; ++i)
+        s += static_cast<lua_Unsigned>(p[i]);
+      lua_pushinteger(L, l_castU2S(s));
+    }
+  });
+  return 1;
+}
+
+
+template <bool max>
+static int typed_minmax (lua_State *L) {
+  auto a = checktyped(L, 1);
+  const size_t n = a->len;
+  if (n == 0) {
+    luaL_pushfail(L);
+    return 1;
+  }
+  withelems(a, [L, n](auto p) {
+    auto m = p[0];
+    for (size_t i = 1; i != n; ++i) {
+      if constexpr (max)
+        m = (p[i] > m) ? p[i] : m;
+      else
+        m = (p[i] < m) ? p[i] : m;
+    }
+    pushelem(L, m);
+  });
+  return 1;
+}
+
+
+static int typed_dot (lua_State *L) {
+  auto a = checktyped(L, 1);
+  auto b = checktyped(L, 2);
+  luaL_argcheck(L, a->kind == b->kind, 2, "element types differ");
+  luaL_argcheck(L, a->len == b->len, 2, "lengths differ");
+  const size_t n = a->len;
+  withelems(a, [L, n, b](auto p) {
+    using T = std::remove_pointer_t<decltype(p)>;
+    const T *q = b->elems<T>();
+    if constexpr (std::is_floating_point_v<T>) {
+      lua_Number s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+      size_t i = 0;
+      for (; i + 4 <= n; i += 4) {
+        s0 += p[i] * q[i];
+        s1 += p[i + 1] * q[i + 1];
+        s2 += p[i + 2] * q[i + 2];
+        s3 += p[i + 3] * q[i + 3];
+      }
+      for (; i != n; ++i)
+        s0 += p[i] * q[i];
+      lua_pushnumber(L, (s0 + s1) + (s2 + s3));
+    }
+    else {
+      lua_Unsigned s = 0;
+      for (size_t i = 0; i != n; ++i)
+        s += static_cast<lua_Unsigned>(p[i]) * static_cast<lua_Unsigned>(q[i]);
+      lua_pushinteger(L, l_castU2S(s));
+    }
+  });
+  return 1;
+}
+
+
+template <typename T, typename F>
+static void mapelems (T *p, size_t n, F f) {
+  for (size_t i = 0; i != n; ++i)
+    p[i] = f(p[i]);
+}
+
+
+template <typename T>
+static void mapfloat (lua_State *L, T *p, size_t n, int op) {
+  const lua_Number x = (op <= TOP_IDIV || op == TOP_MIN || op == TOP_MAX) ? luaL_checknumber(L, 3) : 0;
+  switch (op) {
+    case TOP_ADD: mapelems(p, n, [x](T v) { return v + x; }); break;
+    case TOP_SUB: mapelems(p, n, [x](T v) { return v - x; }); break;
+    case TOP_MUL: mapelems(p, n, [x](T v) { return v * x; }); break;
+    case TOP_DIV: mapelems(p, n, [x](T v) { return v / x; }); break;
+    case TOP_IDIV: mapelems(p, n, [x](T v) { return l_mathop(floor)(v / x); }); break;
+    case TOP_NEG: mapelems(p, n, [](T v) { return -v; }); break;
+    case TOP_ABS: mapelems(p, n, [](T v) { return l_mathop(fabs)(v); }); break;
+    case TOP_SQUARE: mapelems(p, n, [](T v) { return v * v; }); break;
+    case TOP_MIN: mapelems(p, n, [x](T v) { return (x < v) ? x : v; }); break;
+    case TOP_MAX: mapelems(p, n, [x](T v) { return (x > v) ? x : v; }); break;
+    case TOP_SQRT: mapelems(p, n, [](T v) { return l_mathop(sqrt)(v); }); break;
+    case TOP_FLOOR: mapelems(p, n, [](T v) { return l_mathop(floor)(v); }); break;
+    case TOP_CEIL: mapelems(p, n, [](T v) { return l_mathop(ceil)(v); }); break;
+  }
+}
+
+
+template <typename T>
+static void mapint (lua_State *L, T *p, size_t n, int op) {
+  if (op == TOP_DIV || op == TOP_SQRT)
+    luaL_argerror(L, 2, "operation requires an f64 array");
+  const lua_Integer x = (op <= TOP_IDIV || op == TOP_MIN || op == TOP_MAX) ? luaL_checkinteger(L, 3) : 0;
+  const lua_Unsigned ux = l_castS2U(x);
+  switch (op) {
+    case TOP_ADD: mapelems(p, n, [ux](T v) { return wrapint<T>(static_cast<lua_Unsigned>(v) + ux); }); break;
+    case TOP_SUB: mapelems(p, n, [ux](T v) { return wrapint<T>(static_cast<lua_Unsigned>(v) - ux); }); break;
+    case TOP_MUL: mapelems(p, n, [ux](T v) { return wrapint<T>(static_cast<lua_Unsigned>(v) * ux); }); break;
+    case TOP_IDIV: {
+      luaL_argcheck(L, x != 0, 3, "attempt to perform 'n//0'");
+      if (x == -1)
+        mapelems(p, n, [](T v) { return wrapint<T>(0u - static_cast<lua_Unsigned>(v)); });
+      else {
+        mapelems(p, n, [x](T v) {
+          lua_Integer q = static_cast<lua_Integer>(v) / x;
+          if ((static_cast<lua_Integer>(v) % x != 0) && ((static_cast<lua_Integer>(v) ^ x) < 0))
+            q -= 1;
+          return wrapint<T>(l_castS2U(q));
+        });
+      }
+      break;
+    }
+    case TOP_NEG: mapelems(p, n, [](T v) { return wrapint<T>(0u - static_cast<lua_Unsigned>(v)); }); break;
+    case TOP_ABS: mapelems(p, n, [](T v) { return (v < 0) ? wrapint<T>(0u - static_cast<lua_Unsigned>(v)) : v; }); break;
+    case TOP_SQUARE: mapelems(p, n, [](T v) { return wrapint<T>(static_cast<lua_Unsigned>(v) * static_cast<lua_Unsigned>(v)); }); break;
+    case TOP_MIN: mapelems(p, n, [x](T v) { return (x < static_cast<lua_Integer>(v)) ? static_cast<T>(x) : v; }); break;
+    case TOP_MAX: mapelems(p, n, [x](T v) { return (x > static_cast<lua_Integer>(v)) ? static_cast<T>(x) : v; }); break;
+    case TOP_FLOOR: case TOP_CEIL: break;  /* already integral */
+    default: luaL_argerror(L, 2, "operation requires an f64 array");
+  }
+}
+
+
+/* Applies one of the builtin operations to every element, in place. */
+static int typed_map (lua_State *L) {
+  auto a = checktyped(L, 1);
+  const int op = luaL_checkoption(L, 2, nullptr, typedops);
+  const size_t n = a->len;
+  withelems(a, [L, n, op](auto p) {
+    using T = std::remove_pointer_t<decltype(p)>;
+    if constexpr (std::is_floating_point_v<T>)
+      mapfloat(L, p, n, op);
+    else
+      mapint(L, p, n, op);
+  });
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int typed_scale (lua_State *L) {
+  checktyped(L, 1);
+  luaL_checkany(L, 2);
+  lua_settop(L, 2);
+  lua_pushliteral(L, "mul");
+  lua_insert(L, 2);
+  return typed_map(L);
+}
+
+
+static int typed_fill (lua_State *L) {
+  auto a = checktyped(L, 1);
+  const size_t n = a->len;
+  if (a->kind == TA_F64) {
+    const lua_Number x = luaL_checknumber(L, 2);
+    std::fill_n(a->elems<double>(), n, x);
+  }
+  else {
+    const lua_Integer x = luaL_checkinteger(L, 2);
+    withelems(a, [n, x](auto p) {
+      using T = std::remove_pointer_t<decltype(p)>;
+      std::fill_n(p, n, static_cast<T>(x));
+    });
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int typed_totable (lua_State *L) {
+  auto a = checktyped(L, 1);
+  const size_t n = a->len;
+  luaL_argcheck(L, n < (size_t)INT_MAX, 1, "too many elements");
+  lua_createtable(L, (int)n, 0);
+  withelems(a, [L, n](auto p) {
+    for (size_t i = 0; i != n; ++i) {
+      pushelem(L, p[i]);
+      lua_rawseti(L, -2, (lua_Integer)i + 1);
+    }
+  });
+  return 1;
+}
+
+
+static const luaL_Reg typed_funcs[] = {
+  {"kind", typed_kind},
+  {"sum", typed_sum},
+  {"min", typed_minmax<false>},
+  {"max", typed_minmax<true>},
+  {"dot", typed_dot},
+  {"map", typed_map},
+  {"scale", typed_scale},
+  {"fill", typed_fill},
+  {"totable", typed_totable},
+  {nullptr, nullptr}
+};
+
+
+/* The VM recognises typed arrays by their metatable, so it is also kept in the global state. */
+static void pushtypedmt (lua_State *L) {
+  if (luaL_newmetatable(L, PLUTO_TYPEDARRAY_MT)) {
+    luaL_newlib(L, typed_funcs);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, typed_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, typed_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, typed_pairs);
+    lua_setfield(L, -2, "__pairs");
+    G(L)->typed_mt = hvalue(index2value(L, -1));
+  }
+}
+
+
+static int ttyped (lua_State *L) {
+  const auto kind = static_cast<TypedKind>(luaL_checkoption(L, 1, nullptr, typedkinds));
+  const size_t elemsize = typedelemsize(kind);
+  const bool fromtable = lua_istable(L, 2);
+  const lua_Integer n = fromtable ? luaL_len(L, 2) : luaL_checkinteger(L, 2);
+  luaL_argcheck(L, n >= 0 && (lua_Unsigned)n <= (MAX_SIZE - sizeof(TypedArray)) / elemsize, 2, "invalid size");
+  auto a = (TypedArray*)lua_newuserdatauv(L, sizeof(TypedArray) + (size_t)n * elemsize, 0);
+  a->len = (size_t)n;
+  a->kind = kind;
+  memset(a->data(), 0, (size_t)n * elemsize);
+  pushtypedmt(L);
+  lua_setmetatable(L, -2);
+  if (fromtable) {
+    for (lua_Integer i = 0; i != n; ++i) {
+      lua_geti(L, 2, i + 1);
+      if (l_unlikely(!typedset(a, (size_t)i, index2value(L, -1))))
+        luaL_error(L, "element %I cannot be stored in a %s array", (LUAI_UACINT)(i + 1), typedkinds[kind]);
+      lua_pop(L, 1);
+    }
+  }
+  return 1;
+}
+
+/* }====================================================== */
+
+
 
 static const luaL_Reg tab_funcs[] = {
   {"isarray", tisarray},
@@ -1072,8 +1920,8 @@ static const luaL_Reg tab_funcs[] = {
   {"deduplicate", tdeduplicate},
   {"deduped", tdeduplicated},
   {"deduplicated", tdeduplicated},
-  {"keys", tkeys},
-  {"values", tvalues},
+  {"keys", tcollect<true>},
+  {"values", tcollect<false>},
   {"modget", modget},
   {"modset", modset},
   {"back", tback},
@@ -1109,6 +1957,8 @@ static const luaL_Reg tab_funcs[] = {
   {"sorted", sort<true>},
   {"clone", clone},
   {"getn", getn},
+  {"typed", ttyped},
+  {"parallelism", tparallelism},
   {NULL, NULL}
 };
 
@@ -0,0 +1,415 @@
+#ifndef __EMSCRIPTEN__
+
+#define LUA_LIB
+#include "lualib.h"
+
+#include <algorithm> // max
+#include <atomic>
+#include <condition_variable>
+#include <cstring> // memcpy, strcmp
+#include <deque>
+#include <memory> // shared_ptr, destroy_at
+#include <mutex>
+#include <string>
+#include <thread> // hardware_concurrency
+#include <vector>
+
+#include "vendor/Soup/soup/Thread.hpp"
+
+#include "lbufferlib.hpp"
+#include "lserialise.hpp"
+
+/*
+** Values cannot be shared between states, so anything passed to a worker or
+** through a channel is serialised into a message. Buffers are moved out of the
+** sending state without copying their contents and channels are shared; both
+** are referenced from 'data' by their index in the side vectors.
+*/
+
+struct ThreadChannel;
+
+struct ThreadMessage {
+  std::string data;
+  std::vector<soup::Buffer<>> buffers;
+  std::vector<std::shared_ptr<ThreadChannel>> channels;
+  int nvalues = 0;
+};
+
+enum ThreadMessageTag : uint8_t {
+  TM_BUFFER = SER_EXT,
+  TM_CHANNEL,
+};
+
+struct ThreadChannel {
+  std::mutex mtx;
+  std::condition_variable notempty;
+  std::condition_variable notfull;
+  std::deque<ThreadMessage> queue;
+  size_t capacity;
+  bool closed = false;
+
+  explicit ThreadChannel (size_t capacity) : capacity(capacity) {}
+};
+
+struct ThreadWorker {
+  std::string chunk;  /* source or binary chunk */
+  ThreadMessage args;
+  ThreadMessage results;
+  std::string error;
+  bool ok = false;
+  std::atomic_bool done = false;
+};
+
+struct ThreadHandle {
+  soup::Thread thrd;
+  std::shared_ptr<ThreadWorker> worker;
+  bool joined = false;
+};
+
+struct ChannelRef {
+  std::shared_ptr<ThreadChannel> ch;
+};
+
+
+static ThreadHandle* checkhandle (lua_State *L, int i) {
+  return (ThreadHandle*)luaL_checkudata(L, i, "pluto:thread");
+}
+
+static ChannelRef* checkchannel (lua_State *L, int i) {
+  return (ChannelRef*)luaL_checkudata(L, i, "pluto:thread-channel");
+}
+
+static void setlibmetatable (lua_State *L, const char *tname, lua_CFunction gc) {
+  if (luaL_newmetatable(L, tname)) {
+    lua_pushliteral(L, "__index");
+    luaL_loadbuffer(L, "return require\"pluto:thread\"", 28, 0);
+    lua_call(L, 0, 1);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__gc");
+    lua_pushcfunction(L, gc);
+    lua_settable(L, -3);
+  }
+  lua_setmetatable(L, -2);
+}
+
+static void pushchannel (lua_State *L, std::shared_ptr<ThreadChannel> ch) {
+  new (lua_newuserdata(L, sizeof(ChannelRef))) ChannelRef{ std::move(ch) };
+  setlibmetatable(L, "pluto:thread-channel", [](lua_State *L) {
+    pluto_errorifnotgc(L);
+    std::destroy_at<>(checkchannel(L, 1));
+    return 0;
+  });
+}
+
+
+/*
+** {======================================================
+** Message encoding
+** =======================================================
+*/
+
+struct MessageEncoder : public Serialiser {
+  ThreadMessage& msg;
+  std::vector<PlutoBuffer*> buffers;
+
+  explicit MessageEncoder (ThreadMessage& msg) : Serialiser(msg.data), msg(msg) {}
+
+  bool encodeuserdata (lua_State *L, int idx) final {
+    if (auto buf = testbuffer(L, idx)) {
+      for (const PlutoBuffer *b : buffers) {
+        if (l_unlikely(b == buf))
+          luaL_error(L, "cannot transfer the same buffer more than once");
+      }
+      out.push_back(TM_BUFFER);
+      writeu(buffers.size());
+      buffers.emplace_back(buf);
+      return true;
+    }
+    if (auto ref = (ChannelRef*)luaL_testudata(L, idx, "pluto:thread-channel")) {
+      out.push_back(TM_CHANNEL);
+      writeu(msg.channels.size());
+      msg.channels.emplace_back(ref->ch);
+      return true;
+    }
+    return false;
+  }
+
+  /* Moves the contents of all encountered buffers into the message. Only done once encoding succeeded. */
+  void takebuffers () {
+    for (PlutoBuffer *buf : buffers) {
+      if (buf->parent) {
+        /* a view does not own its memory, so it is copied and left as-is */
+        msg.buffers.emplace_back().append(buf->data(), buf->size());
+        continue;
+      }
+#ifdef PLUTO_MEMORY_LIMIT
+      /* the buffer's memory is accounted to its state, so we have to copy it */
+      msg.buffers.emplace_back().append(buf->buffer.data(), buf->buffer.size());
+      buf->buffer.clear();
+#else
+      msg.buffers.emplace_back(std::move(buf->buffer));
+#endif
+    }
+  }
+};
+
+/* Encodes the values from index 'first' to the top of the stack. */
+static void encodemessage (lua_State *L, int first, ThreadMessage& msg) {
+  auto& enc = *pluto_newclassinst(L, MessageEncoder, msg);
+  const int top = lua_gettop(L) - 1;
+  for (int i = first; i <= top; ++i)
+    enc.encode(L, i);
+  enc.takebuffers();
+  lua_pop(L, 1);
+  msg.nvalues = top >= first ? (top - first + 1) : 0;
+}
+
+struct MessageDecoder : public Deserialiser {
+  ThreadMessage& msg;
+
+  explicit MessageDecoder (ThreadMessage& msg) : Deserialiser(msg.data.data(), msg.data.size()), msg(msg) {}
+
+  void decodeext (lua_State *L, uint8_t tag) final {
+    const lua_Unsigned i = readu(L);
+    if (tag == TM_BUFFER && i < msg.buffers.size()) {
+      auto buf = pushbuffer(L);
+#ifdef PLUTO_MEMORY_LIMIT
+      buf->buffer.append(msg.buffers[i].data(), msg.buffers[i].size());
+#else
+      buf->buffer = std::move(msg.buffers[i]);
+#endif
+    }
+    else if (tag == TM_CHANNEL && i < msg.channels.size())
+      pushchannel(L, msg.channels[i]);
+    else
+      malformed(L);
+  }
+};
+
+/* Pushes all values of the message and returns how many there were. */
+static int decodemessage (lua_State *L, ThreadMessage& msg) {
+  MessageDecoder dec{ msg };
+  dec.decodevalues(L, msg.nvalues);
+  return msg.nvalues;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Workers
+** =======================================================
+*/
+
+static int workerbody (lua_State *L) {
+  auto w = (ThreadWorker*)lua_touserdata(L, 1);
+  lua_settop(L, 0);
+  if (luaL_loadbuffer(L, w->chunk.data(), w->chunk.size(), "=thread") != LUA_OK)
+    lua_error(L);
+  lua_call(L, decodemessage(L, w->args), LUA_MULTRET);
+  encodemessage(L, 1, w->results);
+  return 0;
+}
+
+static void workermain (soup::Capture&& cap) {
+  ThreadWorker& w = *cap.get<std::shared_ptr<ThreadWorker>>();
+  lua_State *L = luaL_newstate();
+  if (l_unlikely(L == nullptr)) {
+    w.error = "cannot create state: not enough memory";
+  }
+  else {
+    luaL_openlibs(L);
+    lua_pushcfunction(L, workerbody);
+    lua_pushlightuserdata(L, &w);
+    if (lua_pcall(L, 1, 0, 0) == LUA_OK)
+      w.ok = true;
+    else if (lua_type(L, -1) == LUA_TSTRING)
+      w.error = lua_tostring(L, -1);
+    else
+      w.error = std::string("(error object is a ") + luaL_typename(L, -1) + " value)";
+    lua_close(L);
+  }
+  w.done = true;
+}
+
+static int chunkwriter (lua_State *L, const void *b, size_t size, void *ud) {
+  ((std::string*)ud)->append((const char*)b, size);
+  return 0;
+}
+
+static int thread_run (lua_State *L) {
+  auto w = std::make_shared<ThreadWorker>();
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    w->chunk = pluto_checkstring(L, 1);
+  }
+  else {
+    luaL_argexpected(L, lua_type(L, 1) == LUA_TFUNCTION && !lua_iscfunction(L, 1), 1, "Lua function or chunk");
+    /* upvalues cannot be carried over, except for _ENV which the new state provides */
+    for (int i = 1; const char *name = lua_getupvalue(L, 1, i); ++i) {
+      lua_pop(L, 1);
+      if (l_unlikely(i != 1 || strcmp(name, "_ENV") != 0))
+        luaL_error(L, "thread function cannot capture upvalue '%s'", name);
+    }
+    lua_pushvalue(L, 1);
+    lua_dump(L, chunkwriter, &w->chunk, 0);
+    lua_pop(L, 1);
+  }
+  encodemessage(L, 2, w->args);
+
+  auto h = new (lua_newuserdata(L, sizeof(ThreadHandle))) ThreadHandle{};
+  setlibmetatable(L, "pluto:thread", [](lua_State *L) {
+    pluto_errorifnotgc(L);
+    auto h = checkhandle(L, 1);
+    h->thrd.detach();  /* let it run to completion by itself */
+    std::destroy_at<>(h);
+    return 0;
+  });
+  h->worker = w;
+  h->thrd.start(&workermain, std::move(w));
+  return 1;
+}
+
+static int restjoin (lua_State *L, ThreadHandle& h) {
+  h.thrd.awaitCompletion();
+  h.joined = true;
+  if (l_unlikely(!h.worker->ok)) {
+    pluto_pushstring(L, h.worker->error);
+    lua_error(L);
+  }
+  return decodemessage(L, h.worker->results);
+}
+
+static int joincont (lua_State *L, int status, lua_KContext ctx) {
+  ThreadHandle& h = *checkhandle(L, 1);
+  if (!h.worker->done)
+    return lua_yieldk(L, 0, ctx, joincont);
+  return restjoin(L, h);
+}
+
+static int thread_join (lua_State *L) {
+  ThreadHandle& h = *checkhandle(L, 1);
+  if (l_unlikely(h.joined))
+    luaL_error(L, "thread has already been joined");
+  if (!h.worker->done && lua_isyieldable(L))
+    return lua_yieldk(L, 0, 0, joincont);
+  return restjoin(L, h);
+}
+
+static int thread_isdone (lua_State *L) {
+  lua_pushboolean(L, checkhandle(L, 1)->worker->done);
+  return 1;
+}
+
+static int thread_cores (lua_State *L) {
+  lua_pushinteger(L, std::max(1u, std::thread::hardware_concurrency()));
+  return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Channels
+** =======================================================
+*/
+
+static int thread_channel (lua_State *L) {
+  const lua_Integer capacity = luaL_optinteger(L, 1, 64);
+  luaL_argcheck(L, capacity > 0, 1, "capacity must be positive");
+  pushchannel(L, std::make_shared<ThreadChannel>((size_t)capacity));
+  return 1;
+}
+
+/* Tries to enqueue the message at the top of the stack. */
+static bool trysend (lua_State *L, ThreadChannel& ch) {
+  std::lock_guard lock(ch.mtx);
+  if (l_unlikely(ch.closed))
+    luaL_error(L, "cannot send to a closed channel");
+  if (ch.queue.size() == ch.capacity)
+    return false;
+  ch.queue.emplace_back(std::move(*(ThreadMessage*)lua_touserdata(L, -1)));
+  ch.notempty.notify_one();
+  return true;
+}
+
+static int sendcont (lua_State *L, int status, lua_KContext ctx) {
+  if (!trysend(L, *checkchannel(L, 1)->ch))
+    return lua_yieldk(L, 0, ctx, sendcont);
+  return 0;
+}
+
+static int channel_send (lua_State *L) {
+  auto ch = checkchannel(L, 1)->ch;
+  auto msg = pluto_newclassinst(L, ThreadMessage);
+  lua_insert(L, 2);
+  encodemessage(L, 3, *msg);
+  lua_settop(L, 2);
+  while (!trysend(L, *ch)) {
+    if (lua_isyieldable(L))
+      return lua_yieldk(L, 0, 0, sendcont);
+    std::unique_lock lock(ch->mtx);
+    ch->notfull.wait(lock, [&] { return ch->closed || ch->queue.size() != ch->capacity; });
+  }
+  return 0;
+}
+
+/* Tries to dequeue a message. Returns -1 if the channel is empty but still open. */
+static int tryrecv (lua_State *L, ThreadChannel& ch) {
+  std::unique_lock lock(ch.mtx);
+  if (ch.queue.empty())
+    return ch.closed ? 0 : -1;
+  ThreadMessage msg = std::move(ch.queue.front());
+  ch.queue.pop_front();
+  ch.notfull.notify_one();
+  lock.unlock();
+  return decodemessage(L, msg);
+}
+
+static int recvcont (lua_State *L, int status, lua_KContext ctx) {
+  const int n = tryrecv(L, *checkchannel(L, 1)->ch);
+  if (n == -1)
+    return lua_yieldk(L, 0, ctx, recvcont);
+  return n;
+}
+
+static int channel_recv (lua_State *L) {
+  auto ch = checkchannel(L, 1)->ch;
+  int n;
+  while ((n = tryrecv(L, *ch)) == -1) {
+    if (lua_isyieldable(L))
+      return lua_yieldk(L, 0, 0, recvcont);
+    std::unique_lock lock(ch->mtx);
+    ch->notempty.wait(lock, [&] { return ch->closed || !ch->queue.empty(); });
+  }
+  return n;
+}
+
+static int channel_close (lua_State *L) {
+  ThreadChannel& ch = *checkchannel(L, 1)->ch;
+  std::lock_guard lock(ch.mtx);
+  ch.closed = true;
+  ch.notempty.notify_all();
+  ch.notfull.notify_all();
+  return 0;
+}
+
+/* }====================================================== */
+
+
+static const luaL_Reg funcs_thread[] = {
+  {"run", thread_run},
+  {"join", thread_join},
+  {"isdone", thread_isdone},
+  {"cores", thread_cores},
+  {"channel", thread_channel},
+  {"send", channel_send},
+  {"recv", channel_recv},
+  {"close", channel_close},
+  {nullptr, nullptr}
+};
+
+PLUTO_NEWLIB(thread)
+
+#endif
@@ -42,6 +42,7 @@ typedef enum {
   TM_LE,
   TM_CONCAT,
   TM_CLOSE,
+  TM_PAIRS,
   TM_N		/* number of elements in the enum */
 } TMS;
 
@@ -54,7 +55,7 @@ inline const char *const luaT_eventname[] = {  /* ORDER TM */
   "__div", "__idiv",
   "__band", "__bor", "__bxor", "__shl", "__shr",
   "__unm", "__bnot", "__lt", "__le",
-  "__concat", "__close"
+  "__concat", "__close", "__pairs"
 };
 
 
@@ -0,0 +1,119 @@
+#pragma once
+
+/*
+** Typed arrays, as created by table.typed: a full userdata holding a fixed number of unboxed
+** numbers of one kind, stored contiguously right after the header. Indexing, assignment, '#'
+** and ipairs are handled by the VM directly (see lvm.cpp); the library part is in ltablib.cpp.
+*/
+
+#include <cstdint>
+
+#include "lobject.h"
+#include "lstate.h"
+#include "lvm.h"
+
+#define PLUTO_TYPEDARRAY_MT "pluto:typed"
+
+enum TypedKind : lu_byte {
+  TA_F64,
+  TA_I64,
+  TA_I32,
+  TA_U8,
+};
+
+struct TypedArray {
+  size_t len;
+  TypedKind kind;
+
+  [[nodiscard]] void *data () noexcept { return this + 1; }
+  [[nodiscard]] const void *data () const noexcept { return this + 1; }
+
+  template <typename T>
+  [[nodiscard]] T *elems () noexcept { return static_cast<T*>(data()); }
+};
+
+static_assert(sizeof(TypedArray) % sizeof(lua_Number) == 0, "elements must be aligned");
+
+[[nodiscard]] inline size_t typedelemsize (TypedKind kind) noexcept {
+  switch (kind) {
+    case TA_F64: return sizeof(double);
+    case TA_I64: return sizeof(int64_t);
+    case TA_I32: return sizeof(int32_t);
+    default: return sizeof(uint8_t);
+  }
+}
+
+/* Returns the typed array in 'o', or nullptr if it is any other value. */
+[[nodiscard]] inline TypedArray *totypedarray (lua_State *L, const TValue *o) {
+  if (ttisfulluserdata(o)) {
+    Udata *u = uvalue(o);
+    if (u->metatable != NULL && u->metatable == G(L)->typed_mt)
+      return reinterpret_cast<TypedArray*>(getudatamem(u));
+  }
+  return nullptr;
+}
+
+/* Converts an index into a 0-based position, or returns false if it is not within the array. */
+[[nodiscard]] inline bool typedpos (const TypedArray *a, const TValue *key, size_t *pos) {
+  lua_Integer k;
+  if (ttisinteger(key))
+    k = ivalue(key);
+  else if (!ttisfloat(key) || !luaV_flttointeger(fltvalue(key), &k, F2Ieq))
+    return false;
+  if (l_castS2U(k) - 1u >= a->len)
+    return false;
+  *pos = static_cast<size_t>(k - 1);
+  return true;
+}
+
+/* Reads the element at a 0-based position. */
+inline void typedget (const TypedArray *a, size_t pos, TValue *res) {
+  switch (a->kind) {
+    case TA_F64: setfltvalue(res, static_cast<const double*>(a->data())[pos]); break;
+    case TA_I64: setivalue(res, static_cast<const int64_t*>(a->data())[pos]); break;
+    case TA_I32: setivalue(res, static_cast<const int32_t*>(a->data())[pos]); break;
+    default: setivalue(res, static_cast<const uint8_t*>(a->data())[pos]); break;
+  }
+}
+
+/*
+** Writes a number to a 0-based position. Integer kinds accept floats with an exact integer
+** representation and wrap around like C conversions do. Returns false if 'val' is unsuitable.
+*/
+[[nodiscard]] inline bool typedset (TypedArray *a, size_t pos, const TValue *val) {
+  if (a->kind == TA_F64) {
+    lua_Number n;
+    if (!tonumberns(val, n))
+      return false;
+    a->elems<double>()[pos] = n;
+    return true;
+  }
+  lua_Integer i;
+  if (ttisinteger(val))
+    i = ivalue(val);
+  else if (!ttisfloat(val) || !luaV_flttointeger(fltvalue(val), &i, F2Ieq))
+    return false;
+  switch (a->kind) {
+    case TA_I64: a->elems<int64_t>()[pos] = i; break;
+    case TA_I32: a->elems<int32_t>()[pos] = static_cast<int32_t>(i); break;
+    default: a->elems<uint8_t>()[pos] = static_cast<uint8_t>(i); break;
+  }
+  return true;
+}
+
+/* Fast path for the VM: reads 'o[k]' if 'o' is a typed array and 'k' is one of its indices. */
+[[nodiscard]] inline bool typedfastgeti (lua_State *L, const TValue *o, lua_Integer k, TValue *res) {
+  const TypedArray *a = totypedarray(L, o);
+  if (a == nullptr || l_castS2U(k) - 1u >= a->len)
+    return false;
+  typedget(a, static_cast<size_t>(k - 1), res);
+  return true;
+}
+
+/* Likewise for 'o[k] = val'; anything that would fail is left to 'luaV_finishset' to report. */
+[[nodiscard]] inline bool typedfastseti (lua_State *L, const TValue *o, lua_Integer k, const TValue *val) {
+  TypedArray *a = totypedarray(L, o);
+  if (a == nullptr || l_castS2U(k) - 1u >= a->len)
+    return false;
+  return typedset(a, static_cast<size_t>(k - 1), val);
+}
@@ -104,6 +104,8 @@ static void print_usage (const char *badoption) {
   "  -E        ignore environment variables\n"
   "  -W        turn warnings off\n"
   "  -c        enable compatibility mode\n"
+  "  -s        print VM statistics at exit (needs PLUTO_VMSTATS)\n"
+  "  -O        optimize bytecode (as if by 'pluto_use optimize')\n"
   "  --        stop handling options\n"
   "  -         stop handling options and execute stdin\n"
   ,
@@ -283,6 +285,8 @@ static int handle_script (lua_State *L, char **argv) {
 #define has_e		8	/* -e */
 #define has_E		16	/* -E */
 #define has_c       32  /* -c */
+#define has_s       64  /* -s */
+#define has_O       128  /* -O */
 
 
 /*
@@ -344,6 +348,16 @@ static int collectargs (char **argv, int *first) {
       case 'c':
         args |= has_c;
         break;
+      case 's':
+        if (argv[i][2] != '\0')  /* extra characters? */
+          return has_error;  /* invalid option */
+        args |= has_s;
+        break;
+      case 'O':
+        if (argv[i][2] != '\0')  /* extra characters? */
+          return has_error;  /* invalid option */
+        args |= has_O;
+        break;
       default:  /* invalid option */
         return has_error;
     }
@@ -704,6 +718,35 @@ static void doREPL (lua_State *L) {
 
 /* }================================================================== */
 
+
+/*
+** Prints the counters of 'debug.vmstats' to stderr (option '-s').
+*/
+static const char *const vmstats_report = R"(
+local s = debug.vmstats(20)
+local out = io.stderr
+out:write(string.format("VM statistics: %d instructions, %d Lua calls, %d C calls, %d returns\n",
+  s.instructions, s.calls.lua, s.calls.c, s.returns))
+out:write(string.format("table gets: %d (%d fallbacks), table sets: %d (%d fallbacks)\n",
+  s.tables.gets, s.tables.getfallbacks, s.tables.sets, s.tables.setfallbacks))
+local ops = {}
+for name, count in pairs(s.ops) do ops[#ops + 1] = { name = name, count = count } end
+table.sort(ops, function(a, b) return a.count > b.count end)
+out:write("opcodes:\n")
+for _, op in ipairs(ops) do
+  out:write(string.format("  %-18s %14d  %5.1f%%\n", op.name, op.count, op.count * 100 / s.instructions))
+end
+out:write("hot spots:\n")
+for _, h in ipairs(s.hotspots) do
+  out:write(string.format("  %14d  %-18s %s:%d (pc %d)\n", h.count, h.op, h.source, h.line, h.pc))
+end
+)";
+
+static void print_vmstats (lua_State *L) {
+  dostring(L, vmstats_report, "=vmstats");
+}
+
+
 #if !defined(luai_openlibs)
 #define luai_openlibs(L)	luaL_openselectedlibs(L, PLUTO_DEFAULTLOADLIBS, ~0)
 #endif
@@ -734,6 +777,9 @@ static int pmain (lua_State *L) {
   if (args & has_c) {
     L->l_G->setCompatibilityMode(true);
   }
+  if (args & has_O) {
+    L->l_G->optimize = true;
+  }
   luai_openlibs(L);  /* open standard libraries */
   createargtable(L, argv, argc, script);  /* create table 'arg' */
   lua_gc(L, LUA_GCRESTART);  /* start GC... */
@@ -757,6 +803,8 @@ static int pmain (lua_State *L) {
     }
     else dofile(L, NULL);  /* executes stdin as a file */
   }
+  if (args & has_s)  /* -s option? */
+    print_vmstats(L);
   lua_pushboolean(L, 1);  /* signal no errors */
   return 1;
 }
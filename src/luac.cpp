@@ -42,6 +42,7 @@ static int listing=0;			/* list bytecodes? */
 static int dumping=1;			/* dump bytecodes? */
 static int stripping=0;			/* strip debug information? */
 static int compat=0;            /* [Pluto] compatibility mode? */
+static int optimizing=0;        /* [Pluto] run the optimization pass? */
 static char Output[]={ OUTPUT };	/* default output file name */
 static const char* output=Output;	/* actual output file name */
 static const char* progname=PROGNAME;	/* actual program name */
@@ -73,7 +74,8 @@ static void usage(const char* message)
   "  -p       parse only\n"
   "  -s       strip debug information\n"
   "  -v       show version information\n"
-  "  -c       enable compatibility mode"
+  "  -c       enable compatibility mode\n"
+  "  -O       optimize bytecode (as if by 'pluto_use optimize')\n"
   "  --       stop handling options\n"
   "  -        stop handling options and process stdin\n"
   ,progname,Output);
@@ -114,6 +116,8 @@ static int doargs(int argc, char* argv[])
    stripping=1;
   else if (IS("-c"))			/* enable compatibility mode */
    compat=1;
+  else if (IS("-O"))			/* optimize bytecode */
+   optimizing=1;
   else if (IS("-v"))			/* show version */
    ++version;
   else					/* unknown option */
@@ -187,6 +191,9 @@ static int pmain(lua_State* L)
  if (compat) {
    L->l_G->setCompatibilityMode(compat);
  }
+ if (optimizing) {
+   L->l_G->optimize = true;
+ }
  for (i=0; i<argc; i++)
  {
   const char* filename=IS("-") ? NULL : argv[i];
@@ -377,7 +384,7 @@ static void PrintCode(const Proto* f)
   printf("\t%d\t",pc+1);
   if (line>0) printf("[%d]\t",line); else printf("[-]\t");
   printf("%-9s\t",opnames[o]);
-  switch (o)
+  switch (luaP_baseop(o))  /* superinstructions print like their first half */
   {
    case OP_MOVE:
 	printf("%d %d",a,b);
@@ -687,6 +694,12 @@ static void PrintCode(const Proto* f)
    case OP_EXTRAARG:
 	printf("%d",ax);
 	break;
+   case OP_GETTABUP_GETFIELD: case OP_MOVE_CALL: case OP_MOVE_MOVE:
+   case OP_LOADK_CALL: case OP_LOADI_CALL: case OP_ADD_EQ: case OP_MODK_EQI:
+   case OP_ADD_INT: case OP_SUB_INT: case OP_MUL_INT: case OP_ADD_FLT:
+   case OP_SUB_FLT: case OP_MUL_FLT: case OP_DIV_FLT: case OP_ADDK_FLT:
+   case OP_SUBK_FLT: case OP_MULK_FLT: case OP_DIVK_FLT: case OP_EQ_INT:
+   case OP_LT_INT: case OP_LE_INT: case OP_LT_FLT: case OP_LE_FLT:
    case NUM_OPCODES: SOUP_UNREACHABLE;
 #if 0
    default:
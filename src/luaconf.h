@@ -849,6 +849,9 @@
 // If defined, the "unused" warning is disabled by default.
 //#define PLUTO_NO_WARN_UNUSED
 
+// If defined, every chunk is compiled as if it started with 'pluto_use optimize'.
+//#define PLUTO_OPTIMIZE
+
 
 /*
 ** {====================================================================
@@ -988,6 +991,31 @@
 
 #endif // PLUTO_VMDUMP
 
+/*
+** {====================================================================
+** Pluto Configuration: VM Statistics
+** =====================================================================}
+*/
+
+// If defined, the VM counts executed instructions per opcode and per instruction, as well as calls and table access fallbacks.
+// The counts can be queried via debug.vmstats, and the standalone interpreter prints them at exit when given the '-s' option.
+//#define PLUTO_VMSTATS
+
+/*
+** {====================================================================
+** Pluto Configuration: Superinstructions
+** =====================================================================}
+*/
+
+// If defined, the compiler and undumper will not fuse common instruction pairs into superinstructions,
+// and the compiler will not emit type-specialised instructions for hinted operands.
+// This is implied by PLUTO_VMDUMP so every instruction is printed.
+//#define PLUTO_NO_SUPERINSTRUCTIONS
+
+#if defined(PLUTO_VMDUMP) && !defined(PLUTO_NO_SUPERINSTRUCTIONS)
+#define PLUTO_NO_SUPERINSTRUCTIONS
+#endif
+
 /*
 ** {====================================================================
 ** Pluto Configuration: Content Moderation
@@ -134,6 +134,10 @@ LUAMOD_API int (luaopen_wasm)	(lua_State *L);
 #define PLUTO_SOCKETLIBNAME "socket"
 #define PLUTO_SOCKETLIBK (PLUTO_WASMLIBK << 1)
 LUAMOD_API int (luaopen_socket)(lua_State* L);
+
+#define PLUTO_THREADLIBNAME "thread"
+#define PLUTO_THREADLIBK (PLUTO_SOCKETLIBK << 1)
+LUAMOD_API int (luaopen_thread)	(lua_State *L);
 #endif
 
 
@@ -158,6 +162,7 @@ namespace Pluto {
   extern const PreloadedLibrary preloaded_wasm;
 #ifndef __EMSCRIPTEN__
   extern const PreloadedLibrary preloaded_socket;
+  extern const PreloadedLibrary preloaded_thread;
 #endif
 
   inline const PreloadedLibrary* const all_preloaded[] = {
@@ -181,6 +186,7 @@ namespace Pluto {
     &preloaded_wasm,
 #ifndef __EMSCRIPTEN__
     &preloaded_socket,
+    &preloaded_thread,
 #endif
   };
 
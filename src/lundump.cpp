@@ -20,6 +20,7 @@
 #include "lfunc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstring.h"
 #include "ltable.h"
 #include "lundump.h"
@@ -195,6 +196,7 @@ static void loadCode (LoadState *S, Proto *f) {
     f->code = luaM_newvectorchecked(S->L, n, Instruction);
     f->sizecode = n;
     loadVector(S, f->code, n);
+    luaP_fuse(f->code, n);
   }
 }
 
@@ -31,6 +31,8 @@
 #include "ltm.h"
 #include "lvm.h"
 
+#include "ltypedarray.hpp"
+
 #ifdef PLUTO_ETL_ENABLE
 #include <chrono>
 #endif
@@ -291,6 +293,9 @@ lu_byte luaV_finishget (lua_State *L, const TValue *t, TValue *key,
   int loop;  /* counter to avoid infinite loops */
   const TValue *tm;  /* metamethod */
   int isValueString = ttisstring(t) && ttisinteger(key);
+#ifdef PLUTO_VMSTATS
+  G(L)->vmstats->getfallbacks++;
+#endif
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
     if (tag == LUA_VNOTABLE) {  /* 't' is not a table? */
       lua_assert(!ttistable(t));
@@ -308,6 +313,15 @@ lu_byte luaV_finishget (lua_State *L, const TValue *t, TValue *key,
           return LUA_TSTRING;
         }
       }
+      else if (TypedArray *a = totypedarray(L, t); a && ttisnumber(key)) {  /* element of a typed array */
+        size_t pos;
+        if (!typedpos(a, key, &pos)) {
+          setnilvalue(s2v(val));
+          return LUA_VNIL;
+        }
+        typedget(a, pos, s2v(val));
+        return ttypetag(s2v(val));
+      }
       else {
         tm = luaT_gettmbyobj(L, t, TM_INDEX);
         if (notm(tm) && mindex)
@@ -353,6 +367,9 @@ lu_byte luaV_finishget (lua_State *L, const TValue *t, TValue *key,
 void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
                       TValue *val, int hres) {
   int loop;  /* counter to avoid infinite loops */
+#ifdef PLUTO_VMSTATS
+  G(L)->vmstats->setfallbacks++;
+#endif
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
     const TValue *tm;  /* '__newindex' metamethod */
     if (hres != HNOTATABLE) {  /* is 't' a table? */
@@ -372,6 +389,19 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
       }
       /* else will try the metamethod */
     }
+    else if (TypedArray *a = totypedarray(L, t)) {  /* typed arrays only have elements */
+      size_t pos;
+      if (l_unlikely(!ttisnumber(key)))
+        luaG_runerror(L, "attempt to index a typed array with a %s value", luaT_objtypename(L, key));
+      if (l_unlikely(!typedpos(a, key, &pos)))
+        luaG_runerror(L, "typed array index out of bounds");
+      if (l_unlikely(!typedset(a, pos, val))) {
+        if (ttisnumber(val))
+          luaG_runerror(L, "number has no integer representation");
+        luaG_runerror(L, "attempt to store a %s value in a typed array", luaT_objtypename(L, val));
+      }
+      return;
+    }
     else {  /* not a table; check metamethod */
       tm = luaT_gettmbyobj(L, t, TM_NEWINDEX);
       if (l_unlikely(notm(tm)))
@@ -384,7 +414,7 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
     }
     t = tm;  /* else repeat assignment over 'tm' */
 #ifdef PLUTO_ENABLE_TABLE_FREEZING
-    if (l_unlikely(hvalue(t)->isfrozen)) luaG_runerror(L, "attempt to modify frozen table.");
+    if (ttistable(t) && l_unlikely(hvalue(t)->isfrozen)) luaG_runerror(L, "attempt to modify frozen table.");
 #endif
     luaV_fastset(t, key, val, hres, luaH_pset);
     if (hres == HOK) {
@@ -413,7 +443,7 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
 ** of the strings. Note that segments can compare equal but still
 ** have different lengths.
 */
-static int l_strcmp (const TString *ts1, const TString *ts2) {
+int luaV_strcmp (const TString *ts1, const TString *ts2) {
   size_t rl1;  /* real length */
   const char *s1 = getlstr(ts1, rl1);
   size_t rl2;
@@ -562,7 +592,7 @@ l_sinline int LEnum (const TValue *l, const TValue *r) {
 static int lessthanothers (lua_State *L, const TValue *l, const TValue *r) {
   lua_assert(!ttisnumber(l) || !ttisnumber(r));
   if (ttisstring(l) && ttisstring(r))  /* both are strings? */
-    return l_strcmp(tsvalue(l), tsvalue(r)) < 0;
+    return luaV_strcmp(tsvalue(l), tsvalue(r)) < 0;
   else
     return luaT_callorderTM(L, l, r, TM_LT);
 }
@@ -584,7 +614,7 @@ int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
 static int lessequalothers (lua_State *L, const TValue *l, const TValue *r) {
   lua_assert(!ttisnumber(l) || !ttisnumber(r));
   if (ttisstring(l) && ttisstring(r))  /* both are strings? */
-    return l_strcmp(tsvalue(l), tsvalue(r)) <= 0;
+    return luaV_strcmp(tsvalue(l), tsvalue(r)) <= 0;
   else
     return luaT_callorderTM(L, l, r, TM_LE);
 }
@@ -772,6 +802,10 @@ void luaV_objlen (lua_State *L, StkId ra, const TValue *rb) {
       return;
     }
     default: {  /* try metamethod */
+      if (const TypedArray *a = totypedarray(L, rb)) {
+        setivalue(s2v(ra), cast_st2S(a->len));
+        return;
+      }
       tm = luaT_gettmbyobj(L, rb, TM_LEN);
       if (l_unlikely(notm(tm)))  /* no metamethod? */
         luaG_typeerror(L, rb, "get length of");
@@ -921,6 +955,50 @@ static void inopr (lua_State *L, StkId ra, TValue *a, TValue *b) {
 }
 
 
+#ifdef PLUTO_VMSTATS
+/*
+** Start counting the executions of the instructions of 'p'.
+*/
+void luaV_statsregister (lua_State *L, Proto *p) {
+  auto fn = std::make_unique<PlutoVmStats::Function>();
+  fn->source = p->source ? getstr(p->source) : "=?";
+  fn->linedefined = p->linedefined;
+  fn->lines.resize(p->sizecode);
+  fn->ops.resize(p->sizecode);
+  fn->counts.resize(p->sizecode);
+  for (int pc = 0; pc < p->sizecode; pc++) {
+    fn->lines[pc] = luaG_getfuncline(p, pc);
+    fn->ops[pc] = cast_byte(GET_OPCODE(p->code[pc]));
+  }
+  p->vmstats = fn->counts.data();
+  G(L)->vmstats->functions[p] = std::move(fn);
+}
+#endif
+
+
+/* for implicit pairs */
+LUAI_FUNC int luaB_next (lua_State *L);
+LUAI_FUNC int luaB_ipairsaux (lua_State *L);
+
+
+/*
+** Completes OP_TFORPREP once 'ra' holds the iterator function, the state,
+** the initial value and the closing variable: swaps the control and the
+** closing variables and marks the closing variable as to-be-closed.
+*/
+static void tforprep (lua_State *L, StkId ra) {
+  TValue temp;  /* to swap control and closing variables */
+  setobj(L, &temp, s2v(ra + 3));
+  setobjs2s(L, ra + 3, ra + 2);
+  setobj2s(L, ra + 2, &temp);
+  /* create to-be-closed upvalue (if closing var. is not nil) */
+  luaF_newtbcupval(L, ra + 2);
+  /* a traversal with 'next' keeps its position in the unused closing variable (see OP_TFORCALL) */
+  if (ttisnil(s2v(ra + 2)) && ttislcf(s2v(ra)) && fvalue(s2v(ra)) == luaB_next)
+    setivalue(s2v(ra + 2), 0);
+}
+
+
 /*
 ** finish execution of an opcode interrupted by a yield
 */
@@ -928,7 +1006,7 @@ void luaV_finishOp (lua_State *L) {
   CallInfo *ci = L->ci;
   StkId base = ci->func.p + 1;
   Instruction inst = *(ci->u.l.savedpc - 1);  /* interrupted instruction */
-  OpCode op = GET_OPCODE(inst);
+  OpCode op = luaP_baseop(GET_OPCODE(inst));
   switch (op) {  /* finish its execution */
     case OP_MMBIN: case OP_MMBINI: case OP_MMBINK: {
       setobjs2s(L, base + GETARG_A(*(ci->u.l.savedpc - 2)), --L->top.p);
@@ -964,6 +1042,14 @@ void luaV_finishOp (lua_State *L) {
       ci->u.l.savedpc--;  /* repeat instruction to close other vars. */
       break;
     }
+    case OP_TFORPREP: {  /* yielded in '__pairs' */
+      StkId ra = base + GETARG_A(inst);
+      for (int n = 0; n != 4; n++)
+        setobjs2s(L, ra + n, ra + 2 + n);
+      tforprep(L, ra);
+      ci->u.l.savedpc += GETARG_Bx(inst);  /* continue with the OP_TFORCALL */
+      break;
+    }
     case OP_RETURN: {  /* yielded closing variables */
       StkId ra = base + GETARG_A(inst);
       /* adjust top to signal correct number of returns, in case the
@@ -1005,6 +1091,7 @@ void luaV_finishOp (lua_State *L) {
 
 #define l_lti(a,b)	(a < b)
 #define l_lei(a,b)	(a <= b)
+#define l_eqi(a,b)	(a == b)
 #define l_gti(a,b)	(a > b)
 #define l_gei(a,b)	(a >= b)
 
@@ -1157,6 +1244,61 @@ void luaV_finishOp (lua_State *L) {
   }  \
   docondjump(); }
 
+
+/*
+** Type-specialised instructions. They only handle operands of the
+** types they were specialised for; anything else is left to the
+** generic instruction 'gop'.
+*/
+#define op_arithint(L,iop,gop) {  \
+  TValue *v1 = vRB(i);  \
+  TValue *v2 = vRC(i);  \
+  if (l_likely(ttisinteger(v1) && ttisinteger(v2))) {  \
+    lua_Integer i1 = ivalue(v1); lua_Integer i2 = ivalue(v2);  \
+    pc++; setivalue(vRA(i), iop(L, i1, i2));  \
+  }  \
+  else vmdeopt(gop); }
+
+
+#define op_arithflt(L,fop,gop) {  \
+  TValue *v1 = vRB(i);  \
+  TValue *v2 = vRC(i);  \
+  if (l_likely(ttisfloat(v1) && ttisfloat(v2))) {  \
+    lua_Number n1 = fltvalue(v1); lua_Number n2 = fltvalue(v2);  \
+    pc++; setfltvalue(vRA(i), fop(L, n1, n2));  \
+  }  \
+  else vmdeopt(gop); }
+
+
+#define op_arithfltK(L,fop,gop) {  \
+  TValue *v1 = vRB(i);  \
+  TValue *v2 = KC(i); lua_assert(ttisnumber(v2));  \
+  if (l_likely(ttisfloat(v1))) {  \
+    lua_Number n1 = fltvalue(v1); lua_Number n2 = nvalue(v2);  \
+    pc++; setfltvalue(vRA(i), fop(L, n1, n2));  \
+  }  \
+  else vmdeopt(gop); }
+
+
+#define op_orderint(L,opi,gop) {  \
+  TValue *ra = vRA(i);  \
+  TValue *rb = vRB(i);  \
+  if (l_likely(ttisinteger(ra) && ttisinteger(rb))) {  \
+    int cond = opi(ivalue(ra), ivalue(rb));  \
+    docondjump();  \
+  }  \
+  else vmdeopt(gop); }
+
+
+#define op_orderflt(L,opf,gop) {  \
+  TValue *ra = vRA(i);  \
+  TValue *rb = vRB(i);  \
+  if (l_likely(ttisfloat(ra) && ttisfloat(rb))) {  \
+    int cond = opf(fltvalue(ra), fltvalue(rb));  \
+    docondjump();  \
+  }  \
+  else vmdeopt(gop); }
+
 /* }================================================================== */
 
 
@@ -1253,6 +1395,18 @@ void luaV_finishOp (lua_State *L) {
            luai_threadyield(L); }
 
 
+#ifdef PLUTO_VMSTATS
+#define vmStatsEnter() \
+  if (l_unlikely(cl->p->vmstats == NULL)) luaV_statsregister(L, cl->p);
+#define vmStatsCount() { \
+  G(L)->vmstats->ops[GET_OPCODE(i)]++; \
+  cl->p->vmstats[pc - 1 - cl->p->code]++; \
+}
+#else
+#define vmStatsEnter()
+#define vmStatsCount()
+#endif
+
 /* fetch an instruction and prepare its execution */
 #define vmfetch()	{ \
   if (l_unlikely(trap)) {  /* stack reallocation or hooks? */ \
@@ -1260,15 +1414,30 @@ void luaV_finishOp (lua_State *L) {
     updatebase(ci);  /* correct stack */ \
   } \
   i = *(pc++); \
+  vmStatsCount(); \
 }
 
 #define vmdispatch(o)	switch(o)
 #define vmcase(l)	case l:
 #define vmbreak		break
 
+/*
+** Handlers that can run as the second half of a superinstruction get an
+** extra label, so the superinstruction can continue there without going
+** through the dispatch. If hooks or a stack reallocation are pending, the
+** second instruction goes through the regular 'vmfetch' instead.
+*/
+#define vmfusedcase(l)	vmcase(l) fused_##l:
+#define vmfused(l)	{ \
+  if (l_unlikely(trap)) { vmbreak; } \
+  i = *(pc++); \
+  vmStatsCount(); \
+  goto fused_##l; \
+}
+
+/* type-specialised instructions fall back to the generic handler */
+#define vmdeopt(l)	goto fused_##l
 
-/* for implicit pairs */
-LUAI_FUNC int luaB_next (lua_State *L);
 
 
 #ifdef PLUTO_VMDUMP
@@ -1392,6 +1561,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
   trap = L->hookmask;
  returning:  /* trap already set */
   cl = ci_func(ci);
+  vmStatsEnter();
   k = cl->p->k;
   pc = ci->u.l.savedpc;
   if (l_unlikely(trap))
@@ -1414,7 +1584,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
     /* for tests, invalidate top for instructions not expecting it - [Pluto] this is similar to a debug hook being active */
     lua_assert(luaP_isIT(i) || (cast_void(L->top.p = base), 1));
     vmdispatch (GET_OPCODE(i)) {
-      vmcase(OP_MOVE) {
+      vmfusedcase(OP_MOVE) {
         StkId ra = RA(i);
         setobjs2s(L, ra, RB(i));
         vmDumpInit();
@@ -1547,8 +1717,10 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         }
         else
           luaV_fastget(rb, rc, s2v(ra), luaH_get, tag);
-        if (tagisempty(tag))
-          Protect(luaV_finishget(L, rb, rc, ra, tag, GETARG_k(i)));
+        if (tagisempty(tag)) {
+          if (!(tag == LUA_VNOTABLE && ttisinteger(rc) && typedfastgeti(L, rb, ivalue(rc), s2v(ra))))
+            Protect(luaV_finishget(L, rb, rc, ra, tag, GETARG_k(i)));
+        }
         vmDumpInit();
         vmDumpAddA();
         vmDumpAddB();
@@ -1562,7 +1734,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         int c = GETARG_C(i);
         lu_byte tag;
         luaV_fastgeti(rb, c, s2v(ra), tag);
-        if (tagisempty(tag)) {
+        if (tagisempty(tag) && !(tag == LUA_VNOTABLE && typedfastgeti(L, rb, c, s2v(ra)))) {
           TValue key;
           setivalue(&key, c);
           Protect(luaV_finishget(L, rb, &key, ra, tag));
@@ -1574,7 +1746,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         vmDumpOut("; push T[" << c << "] for " << stringify_tvalue(s2v(ra)) << " (T=" << stringify_tvalue(rb) << ")");
         vmbreak;
       }
-      vmcase(OP_GETFIELD) {
+      vmfusedcase(OP_GETFIELD) {
         StkId ra = RA(i);
         TValue *rb = vRB(i);
         TValue *rc = KC(i);
@@ -1619,7 +1791,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rb = vRB(i);  /* key (table is in 'ra') */
         TValue *rc = RKC(i);  /* value */
 #ifdef PLUTO_ENABLE_TABLE_FREEZING
-        if (l_unlikely(hvalue(s2v(ra))->isfrozen))
+        if (ttistable(s2v(ra)) && l_unlikely(hvalue(s2v(ra))->isfrozen))
           halfProtect(luaG_runerror(L, "attempt to modify frozen table."));
 #endif
         if (ttisinteger(rb)) {  /* fast track for integers? */
@@ -1631,7 +1803,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         if (hres == HOK) {
           luaV_finishfastset(L, s2v(ra), rc);
         }
-        else
+        else if (!(hres == HNOTATABLE && ttisinteger(rb) && typedfastseti(L, s2v(ra), ivalue(rb), rc)))
           Protect(luaV_finishset(L, s2v(ra), rb, rc, hres));
         vmDumpInit();
         vmDumpAddA();
@@ -1646,14 +1818,14 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         int b = GETARG_B(i);
         TValue *rc = RKC(i);
 #ifdef PLUTO_ENABLE_TABLE_FREEZING
-        if (l_unlikely(hvalue(s2v(ra))->isfrozen))
+        if (ttistable(s2v(ra)) && l_unlikely(hvalue(s2v(ra))->isfrozen))
           halfProtect(luaG_runerror(L, "attempt to modify frozen table."));
 #endif
         luaV_fastseti(s2v(ra), b, rc, hres);
         if (hres == HOK) {
           luaV_finishfastset(L, s2v(ra), rc);
         }
-        else {
+        else if (!(hres == HNOTATABLE && typedfastseti(L, s2v(ra), b, rc))) {
           TValue key;
           setivalue(&key, b);
           Protect(luaV_finishset(L, s2v(ra), &key, rc, hres));
@@ -1672,7 +1844,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rc = RKC(i);
         TString *key = tsvalue(rb);  /* key must be a short string */
 #ifdef PLUTO_ENABLE_TABLE_FREEZING
-        if (l_unlikely(hvalue(s2v(ra))->isfrozen))
+        if (ttistable(s2v(ra)) && l_unlikely(hvalue(s2v(ra))->isfrozen))
           halfProtect(luaG_runerror(L, "attempt to modify frozen table."));
 #endif
         luaV_fastset(s2v(ra), key, rc, hres, luaH_psetshortstr);
@@ -1743,7 +1915,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         op_arithI(L, l_addi, luai_numadd);
         vmbreak;
       }
-      vmcase(OP_ADDK) {
+      vmfusedcase(OP_ADDK) {
         vmDumpInit();
         vmDumpAddA();
         vmDumpAddB();
@@ -1752,7 +1924,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         op_arithK(L, l_addi, luai_numadd);
         vmbreak;
       }
-      vmcase(OP_SUBK) {
+      vmfusedcase(OP_SUBK) {
         vmDumpInit();
         vmDumpAddA();
         vmDumpAddB();
@@ -1761,7 +1933,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         op_arithK(L, l_subi, luai_numsub);
         vmbreak;
       }
-      vmcase(OP_MULK) {
+      vmfusedcase(OP_MULK) {
         vmDumpInit();
         vmDumpAddA();
         vmDumpAddB();
@@ -1789,7 +1961,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         op_arithfK(L, luai_numpow);
         vmbreak;
       }
-      vmcase(OP_DIVK) {
+      vmfusedcase(OP_DIVK) {
         vmDumpInit();
         vmDumpAddA();
         vmDumpAddB();
@@ -1866,7 +2038,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         }
         vmbreak;
       }
-      vmcase(OP_ADD) {
+      vmfusedcase(OP_ADD) {
         vmDumpInit();
         vmDumpAddA();
         vmDumpAddB();
@@ -1875,7 +2047,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         op_arith(L, l_addi, luai_numadd);
         vmbreak;
       }
-      vmcase(OP_SUB) {
+      vmfusedcase(OP_SUB) {
         vmDumpInit();
         vmDumpAddA();
         vmDumpAddB();
@@ -1884,7 +2056,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         op_arith(L, l_subi, luai_numsub);
         vmbreak;
       }
-      vmcase(OP_MUL) {
+      vmfusedcase(OP_MUL) {
         vmDumpInit();
         vmDumpAddA();
         vmDumpAddB();
@@ -1912,7 +2084,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         op_arithf(L, luai_numpow);
         vmbreak;
       }
-      vmcase(OP_DIV) {  /* float division (always with floats) */
+      vmfusedcase(OP_DIV) {  /* float division (always with floats) */
         vmDumpInit();
         vmDumpAddA();
         vmDumpAddB();
@@ -1982,7 +2154,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rb = vRB(i);
         TMS tm = (TMS)GETARG_C(i);
         StkId result = RA(pi);
-        lua_assert(OP_ADD <= GET_OPCODE(pi) && GET_OPCODE(pi) <= OP_SHR);
+        lua_assert(OP_ADD <= luaP_baseop(GET_OPCODE(pi)) && luaP_baseop(GET_OPCODE(pi)) <= OP_SHR);
         Protect(luaT_trybinTM(L, s2v(ra), rb, result, tm));
         vmDumpInit();
         vmDumpAddA();
@@ -2132,7 +2304,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         vmDumpOut ("; offset=" << offset << " newpc=" << pc);
         vmbreak;
       }
-      vmcase(OP_EQ) {
+      vmfusedcase(OP_EQ) {
         StkId ra = RA(i);
         int cond;
         TValue *rb = vRB(i);
@@ -2145,7 +2317,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         vmDumpOut ("; " << stringify_tvalue(s2v(ra)) << " == " << stringify_tvalue(rb));
         vmbreak;
       }
-      vmcase(OP_LT) {
+      vmfusedcase(OP_LT) {
         op_order(L, l_lti, LTnum, lessthanothers);
         vmDumpInit();
         vmDumpAddA();
@@ -2154,7 +2326,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         vmDumpOut ("; " << stringify_tvalue(s2v(RA(i))) << " < " << stringify_tvalue(vRB(i)));
         vmbreak;
       }
-      vmcase(OP_LE) {
+      vmfusedcase(OP_LE) {
         op_order(L, l_lei, LEnum, lessequalothers);
         vmDumpInit();
         vmDumpAddA();
@@ -2176,7 +2348,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         vmDumpOut ("; " << stringify_tvalue(s2v(ra)) << " == " << stringify_tvalue(rb));
         vmbreak;
       }
-      vmcase(OP_EQI) {
+      vmfusedcase(OP_EQI) {
         StkId ra = RA(i);
         int cond;
         int im = GETARG_sB(i);
@@ -2275,7 +2447,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         }
         vmbreak;
       }
-      vmcase(OP_CALL) {
+      vmfusedcase(OP_CALL) {
         StkId ra = RA(i);
         CallInfo *newci;
         int b = GETARG_B(i);
@@ -2496,16 +2668,28 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         if (ttistable(s2v(ra))
           && l_likely(!fasttm(L, hvalue(s2v(ra))->metatable, TM_CALL))
         ) {
+          const TValue *tm = luaT_gettmbyobj(L, s2v(ra), TM_PAIRS);
+          if (l_unlikely(!notm(tm))) {  /* same as 'pairs': let '__pairs' provide all 4 values */
+            setobjs2s(L, ra + 3, ra);
+            setobj2s(L, ra + 2, tm);
+            L->top.p = ra + 4;
+            ProtectNT(luaD_call(L, ra + 2, 4));  /* may yield (see 'luaV_finishOp') */
+            updatestack(ci);
+            for (int n = 0; n != 4; n++)
+              setobjs2s(L, ra + n, ra + 2 + n);
+          }
+          else {
+            setobjs2s(L, ra + 1, ra);
+            setfvalue(s2v(ra), luaB_next);
+          }
+        }
+        else if (totypedarray(L, s2v(ra))) {  /* typed arrays are traversed like with 'ipairs' */
           setobjs2s(L, ra + 1, ra);
-          setfvalue(s2v(ra), luaB_next);
+          setfvalue(s2v(ra), luaB_ipairsaux);
+          setivalue(s2v(ra + 2), 0);
         }
 
-        TValue temp;  /* to swap control and closing variables */
-        setobj(L, &temp, s2v(ra + 3));
-        setobjs2s(L, ra + 3, ra + 2);
-        setobj2s(L, ra + 2, &temp);
-        /* create to-be-closed upvalue (if closing var. is not nil) */
-        halfProtect(luaF_newtbcupval(L, ra + 2));
+        halfProtect(tforprep(L, ra));
         pc += GETARG_Bx(i);  /* go to end of the loop */
         i = *(pc++);  /* fetch next instruction */
         lua_assert(GET_OPCODE(i) == OP_TFORCALL && ra == RA(i));
@@ -2529,6 +2713,48 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
            return will be the new value for the control variable.
         */
         StkId ra = RA(i);
+        /* traversals of plain tables with 'next' and 'ipairs', and of typed arrays, are done here, without calls */
+        if (ttislcf(s2v(ra)) && (ttistable(s2v(ra + 1)) || ttisfulluserdata(s2v(ra + 1)))) {
+          lua_CFunction f = fvalue(s2v(ra));
+          int found = -1;
+          if (!ttistable(s2v(ra + 1))) {
+            const TypedArray *a = totypedarray(L, s2v(ra + 1));
+            if (a && f == luaB_ipairsaux && ttisinteger(s2v(ra + 3))) {
+              lua_Integer k = intop(+, ivalue(s2v(ra + 3)), 1);
+              found = (l_castS2U(k) - 1u < a->len);
+              if (found) {
+                typedget(a, cast_sizet(k - 1), s2v(ra + 4));
+                setivalue(s2v(ra + 3), k);
+              }
+            }
+          }
+          else if (f == luaB_next && ttisinteger(s2v(ra + 2))) {  /* 'ra + 2' has the traversal index */
+            unsigned cursor = cast_uint(ivalue(s2v(ra + 2)));
+            halfProtect(found = luaH_nextcursor(L, hvalue(s2v(ra + 1)), ra + 3, &cursor));
+            setivalue(s2v(ra + 2), cursor);
+          }
+          else if (f == luaB_ipairsaux && ttisinteger(s2v(ra + 3))) {
+            Table *t = hvalue(s2v(ra + 1));
+            lua_Integer k = intop(+, ivalue(s2v(ra + 3)), 1);
+            lu_byte tag;
+            luaH_fastgeti(t, k, s2v(ra + 4), tag);
+            if (!tagisempty(tag))
+              found = 1;
+            else if (!fasttm(L, t->metatable, TM_INDEX))  /* nil without '__index'? */
+              found = 0;
+            if (found == 1)
+              setivalue(s2v(ra + 3), k);
+          }
+          if (found != -1) {
+            if (!found)
+              setnilvalue(s2v(ra + 3));
+            for (int n = 2; n < GETARG_C(i); n++)  /* other loop variables are nil */
+              setnilvalue(s2v(ra + 3 + n));
+            i = *(pc++);
+            lua_assert(GET_OPCODE(i) == OP_TFORLOOP && ra == RA(i));
+            goto l_tforloop;
+          }
+        }
         setobjs2s(L, ra + 5, ra + 3);  /* copy the control variable */
         setobjs2s(L, ra + 4, ra + 1);  /* copy state */
         setobjs2s(L, ra + 3, ra);  /* copy function */
@@ -2669,6 +2895,119 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         vmDumpOut ("; " << old << " in " << stringify_tvalue(b) << " (" << stringify_tvalue(s2v(ra)) << ")");
         vmbreak;
       }
+      vmcase(OP_GETTABUP_GETFIELD) {
+        StkId ra = RA(i);
+        TValue *upval = cl->upvals[GETARG_B(i)]->v.p;
+        TValue *rc = KC(i);
+        TString *key = tsvalue(rc);  /* key must be a short string */
+        lu_byte tag;
+        luaV_fastget(upval, key, s2v(ra), luaH_getshortstr, tag);
+        if (tagisempty(tag))
+          Protect(luaV_finishget(L, upval, rc, ra, tag));
+        vmfused(OP_GETFIELD);
+      }
+      vmcase(OP_MOVE_CALL) {
+        StkId ra = RA(i);
+        setobjs2s(L, ra, RB(i));
+        vmfused(OP_CALL);
+      }
+      vmcase(OP_MOVE_MOVE) {
+        StkId ra = RA(i);
+        setobjs2s(L, ra, RB(i));
+        vmfused(OP_MOVE);
+      }
+      vmcase(OP_LOADK_CALL) {
+        StkId ra = RA(i);
+        TValue *rb = k + GETARG_Bx(i);
+        setobj2s(L, ra, rb);
+        vmfused(OP_CALL);
+      }
+      vmcase(OP_LOADI_CALL) {
+        StkId ra = RA(i);
+        lua_Integer b = GETARG_sBx(i);
+        setivalue(s2v(ra), b);
+        vmfused(OP_CALL);
+      }
+      vmcase(OP_ADD_EQ) {
+        const Instruction *mmbin = pc;
+        op_arith(L, l_addi, luai_numadd);
+        if (pc != mmbin)  /* no metamethod needed? */
+          vmfused(OP_EQ);
+        vmbreak;
+      }
+      vmcase(OP_MODK_EQI) {
+        const Instruction *mmbin = pc;
+        savestate(L, ci);  /* in case of division by 0 */
+        op_arithK(L, luaV_mod, luaV_modf);
+        if (pc != mmbin)  /* no metamethod needed? */
+          vmfused(OP_EQI);
+        vmbreak;
+      }
+      vmcase(OP_ADD_INT) {
+        op_arithint(L, l_addi, OP_ADD);
+        vmbreak;
+      }
+      vmcase(OP_SUB_INT) {
+        op_arithint(L, l_subi, OP_SUB);
+        vmbreak;
+      }
+      vmcase(OP_MUL_INT) {
+        op_arithint(L, l_muli, OP_MUL);
+        vmbreak;
+      }
+      vmcase(OP_ADD_FLT) {
+        op_arithflt(L, luai_numadd, OP_ADD);
+        vmbreak;
+      }
+      vmcase(OP_SUB_FLT) {
+        op_arithflt(L, luai_numsub, OP_SUB);
+        vmbreak;
+      }
+      vmcase(OP_MUL_FLT) {
+        op_arithflt(L, luai_nummul, OP_MUL);
+        vmbreak;
+      }
+      vmcase(OP_DIV_FLT) {
+        op_arithflt(L, luai_numdiv, OP_DIV);
+        vmbreak;
+      }
+      vmcase(OP_ADDK_FLT) {
+        op_arithfltK(L, luai_numadd, OP_ADDK);
+        vmbreak;
+      }
+      vmcase(OP_SUBK_FLT) {
+        op_arithfltK(L, luai_numsub, OP_SUBK);
+        vmbreak;
+      }
+      vmcase(OP_MULK_FLT) {
+        op_arithfltK(L, luai_nummul, OP_MULK);
+        vmbreak;
+      }
+      vmcase(OP_DIVK_FLT) {
+        savestate(L, ci);  /* in case of division by 0 */
+        op_arithfltK(L, luai_numdiv, OP_DIVK);
+        vmbreak;
+      }
+      vmcase(OP_EQ_INT) {
+        op_orderint(L, l_eqi, OP_EQ);
+        vmbreak;
+      }
+      vmcase(OP_LT_INT) {
+        op_orderint(L, l_lti, OP_LT);
+        vmbreak;
+      }
+      vmcase(OP_LE_INT) {
+        op_orderint(L, l_lei, OP_LE);
+        vmbreak;
+      }
+      vmcase(OP_LT_FLT) {
+        op_orderflt(L, luai_numlt, OP_LT);
+        vmbreak;
+      }
+      vmcase(OP_LE_FLT) {
+        op_orderflt(L, luai_numle, OP_LE);
+        vmbreak;
+      }
     }
     L->checkEtl();
   }
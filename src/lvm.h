@@ -12,6 +12,10 @@
 #include "lobject.h"
 #include "ltm.h"
 
+#ifdef PLUTO_VMSTATS
+#include "lstate.h"
+#endif
+
 
 #if !defined(LUA_NOCVTN2S)
 #define cvt2str(o)	ttisnumber(o)
@@ -115,6 +119,7 @@ typedef enum {
 LUAI_FUNC int luaV_equalobj (lua_State *L, const TValue *t1, const TValue *t2);
 LUAI_FUNC int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r);
 LUAI_FUNC int luaV_lessequal (lua_State *L, const TValue *l, const TValue *r);
+LUAI_FUNC int luaV_strcmp (const TString *ts1, const TString *ts2);
 LUAI_FUNC int luaV_tonumber_ (const TValue *obj, lua_Number *n);
 LUAI_FUNC int luaV_tointeger (const TValue *obj, lua_Integer *p, F2Imod mode);
 LUAI_FUNC int luaV_tointegerns (const TValue *obj, lua_Integer *p,
@@ -135,4 +140,8 @@ LUAI_FUNC lua_Integer luaV_shiftl (lua_Integer x, lua_Integer y);
 LUAI_FUNC void luaV_objlen (lua_State *L, StkId ra, const TValue *rb);
 #endif
 
+#ifdef PLUTO_VMSTATS
+LUAI_FUNC void luaV_statsregister (lua_State *L, Proto *p);
+#endif
+
 #endif
@@ -1,67 +1,108 @@
-#include <cstring> // strcmp
+#include <algorithm> // min
+#include <cstring> // memchr, strcmp
+#include <string>
+#include <string_view>
+#include <vector>
 
 #define LUA_LIB
 #include "lualib.h"
+#include "lobject.h" // luaO_utf8esc
 #include "lstate.h" // luaE_incCstack
 
 #include "vendor/Soup/soup/xml.hpp"
 
-static void check_xml (lua_State *L, int i, soup::UniquePtr<soup::XmlNode>& out) {
+/* Appends text with the characters that have a meaning in markup escaped. */
+static void appendxmltext (std::string& out, const char *str, size_t len) {
+  for (const char *const end = str + len; str != end; ++str) {
+    switch (*str) {
+      case '&': out.append("&amp;"); break;
+      case '<': out.append("&lt;"); break;
+      case '>': out.append("&gt;"); break;
+      default: out.push_back(*str);
+    }
+  }
+}
+
+/* Appends the attributes in the table at the top of the stack. */
+static void appendxmlattributes (lua_State *L, std::string& out) {
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    lua_pushvalue(L, -2);  /* checking a number key would convert it in place and confuse lua_next */
+    size_t namelen, valuelen;
+    const char *name = luaL_checklstring(L, -1, &namelen);
+    const char *value = luaL_checklstring(L, -2, &valuelen);
+    out.push_back(' ');
+    out.append(name, namelen);
+    out.push_back('=');
+    const char quote = memchr(value, '"', valuelen) ? '\'' : '"';
+    out.push_back(quote);
+    out.append(value, valuelen);
+    out.push_back(quote);
+    lua_pop(L, 2);
+  }
+}
+
+/*
+** Serialises the node at index i straight into 'out'. A negative depth means no pretty-printing.
+** Produces the same output as building a soup::XmlNode tree and encoding that.
+*/
+static void encode_xml (lua_State *L, int i, std::string& out, int depth) {
   const auto type = lua_type(L, i);
   if (type == LUA_TTABLE) {
-    lua_checkstack(L, 4);
+    lua_checkstack(L, 5);
     lua_pushvalue(L, i);
     lua_pushliteral(L, "tag");
     if (lua_rawget(L, -2) == LUA_TSTRING) {
       luaE_incCstack(L);
-      out = soup::make_unique<soup::XmlTag>();
-      auto& tag = static_cast<soup::XmlTag&>(*out);
-      tag.name = pluto_checkstring(L, -1);
-      lua_pop(L, 1);  /* pop result of lua_rawget */
+      size_t namelen;
+      const char *name = lua_tolstring(L, -1, &namelen);
+      out.push_back('<');
+      out.append(name, namelen);
       lua_pushliteral(L, "attributes");
-      if (lua_rawget(L, -2) != LUA_TNONE) {
-        if (lua_type(L, -1) == LUA_TTABLE) {
-          lua_pushnil(L);
-          while (lua_next(L, -2)) {
-            lua_pushvalue(L, -2);
-            tag.attributes.emplace_back(pluto_checkstring(L, -1), pluto_checkstring(L, -2));
-            lua_pop(L, 2);
-          }
-        }
-        lua_pop(L, 1);  /* pop result of lua_rawget */
-      }
+      if (lua_rawget(L, -3) == LUA_TTABLE)
+        appendxmlattributes(L, out);
+      lua_pop(L, 1);  /* pop result of lua_rawget */
+      out.push_back('>');
+      bool haschildren = false;
       lua_pushliteral(L, "children");
-      if (lua_rawget(L, -2) != LUA_TNONE) {
-        if (lua_type(L, -1) == LUA_TTABLE) {
-          lua_pushnil(L);
-          while (lua_next(L, -2)) {
-            check_xml(L, -1, tag.children.emplace_back());
-            lua_pop(L, 1);
+      if (lua_rawget(L, -3) == LUA_TTABLE) {
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+          if (depth >= 0) {
+            out.push_back('\n');
+            out.append((depth + 1) * 4, ' ');
           }
+          encode_xml(L, -1, out, depth >= 0 ? depth + 1 : -1);
+          haschildren = true;
+          lua_pop(L, 1);
         }
-        lua_pop(L, 1);  /* pop result of lua_rawget */
       }
-      lua_pop(L, 1);  /* pop table from lua_pushvalue */
+      lua_pop(L, 1);  /* pop result of lua_rawget */
+      if (depth >= 0 && haschildren) {
+        out.push_back('\n');
+        out.append(depth * 4, ' ');
+      }
+      out.append("</");
+      out.append(name, namelen);
+      out.push_back('>');
+      lua_pop(L, 2);  /* pop tag name and table from lua_pushvalue */
       L->nCcalls--;
       return;
     }
   }
   else if (type == LUA_TSTRING) {
-    out = soup::make_unique<soup::XmlText>(pluto_checkstring(L, i));
+    size_t len;
+    const char *str = lua_tolstring(L, i, &len);
+    appendxmltext(out, str, len);
     return;
   }
   luaL_typeerror(L, i, "XML-castable type");
 }
 
 static int xml_encode (lua_State *L) {
-  auto& root = *pluto_newclassinst(L, soup::UniquePtr<soup::XmlNode>);
-  check_xml(L, 1, root);
-  if (lua_istrue(L, 2)) {
-    pluto_pushstring(L, root->encodePretty());
-  }
-  else {
-    pluto_pushstring(L, root->encode());
-  }
+  std::string out;
+  encode_xml(L, 1, out, lua_istrue(L, 2) ? 0 : -1);
+  pluto_pushstring(L, std::move(out));
   return 1;
 }
 
@@ -124,17 +165,21 @@ static void pushxmltag (lua_State *L, const soup::XmlTag& tag) {
   lua_setmetatable(L, -2);
 }
 
+[[nodiscard]] static const soup::XmlMode *checkmode (lua_State *L, int i) {
+  if (lua_gettop(L) < i)
+    return &soup::xml::MODE_XML;
+  const char *modename = luaL_checkstring(L, i);
+  if (strcmp(modename, "html") == 0)
+    return &soup::xml::MODE_HTML;
+  if (strcmp(modename, "lax") == 0)
+    return &soup::xml::MODE_LAX_XML;
+  if (strcmp(modename, "xml") != 0)
+    luaL_error(L, "unknown parser mode '%s'", modename);
+  return &soup::xml::MODE_XML;
+}
+
 static int xml_decode (lua_State *L) {
-  const soup::XmlMode *mode = &soup::xml::MODE_XML;
-  if (lua_gettop(L) >= 2) {
-    const char *modename = luaL_checkstring(L, 2);
-    if (strcmp(modename, "html") == 0)
-      mode = &soup::xml::MODE_HTML;
-    else if (strcmp(modename, "lax") == 0)
-      mode = &soup::xml::MODE_LAX_XML;
-    else if (strcmp(modename, "xml") != 0)
-      luaL_error(L, "unknown parser mode '%s'", modename);
-  }
+  const soup::XmlMode *mode = checkmode(L, 2);
   size_t len;
   const char *data = luaL_checklstring(L, 1, &len);
   soup::UniquePtr<soup::XmlTag> root;
@@ -148,9 +193,676 @@ static int xml_decode (lua_State *L) {
   return 1;
 }
 
+
+/*
+** Event-based parsing. Input is fed in pieces and events are pulled one at a time, so only the current token
+** and the names of the open tags are held in memory, never the document or a tree of it. It follows the same
+** rules as xml.decode: metadata, comments and the DOCTYPE are skipped, leading whitespace of text is dropped,
+** and tags left open or closed out of order are closed as if the document were well-formed.
+*/
+struct XmlSaxParser {
+  enum Event { NEEDMORE, END, START, TEXT, FINISH };
+
+  const soup::XmlMode *mode;
+  std::string buf;
+  size_t pos = 0;
+  size_t scanned = 0;  /* bytes after 'pos' already searched for the end of what starts there */
+  size_t subset = 0;  /* offset from 'pos' of the '[' opening the internal subset of a declaration, once found */
+  char tagquote = 0;  /* quote 'findtagend' was within when it ran out of input */
+  bool eof = false;
+  std::vector<std::string> open;
+  size_t unwind = 0;  /* tags still to be finished because of a closing tag further down the stack */
+  bool selfclosed = false;  /* the tag just started has no content */
+
+  /* Event data. */
+  std::string name;
+  std::vector<std::pair<std::string, std::string>> attributes;
+  std::string text;
+
+  explicit XmlSaxParser (const soup::XmlMode *mode) : mode(mode) {}
+
+  void feed (const char *data, size_t len) {
+    if (pos != 0 && pos >= buf.size() / 2) {  /* drop what was consumed once that's the bigger part */
+      buf.erase(0, pos);
+      pos = 0;
+    }
+    buf.append(data, len);
+  }
+
+  [[nodiscard]] static bool isspace (char c) noexcept {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+  }
+
+  /* Decodes the predefined and numeric character references. */
+  static void appenddecoded (std::string& out, const char *p, const char *const end) {
+    while (p != end) {
+      const char *const amp = (const char*)memchr(p, '&', end - p);
+      if (!amp) {
+        out.append(p, end - p);
+        return;
+      }
+      out.append(p, amp - p);
+      const char *const semi = (const char*)memchr(amp, ';', std::min<size_t>(end - amp, 12));
+      p = amp + 1;
+      if (!semi) {
+        out.push_back('&');
+        continue;
+      }
+      const std::string_view ref(amp + 1, semi - (amp + 1));
+      if (ref == "amp") out.push_back('&');
+      else if (ref == "lt") out.push_back('<');
+      else if (ref == "gt") out.push_back('>');
+      else if (ref == "quot") out.push_back('"');
+      else if (ref == "apos") out.push_back('\'');
+      else if (ref.size() >= 2 && ref[0] == '#') {
+        const bool hex = (ref[1] == 'x' || ref[1] == 'X');
+        unsigned long cp = 0;
+        bool valid = ref.size() > (hex ? 2u : 1u);
+        for (size_t k = hex ? 2 : 1; k != ref.size() && valid; ++k) {
+          const char c = ref[k];
+          int digit;
+          if (c >= '0' && c <= '9') digit = c - '0';
+          else if (hex && c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+          else if (hex && c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+          else { valid = false; break; }
+          cp = cp * (hex ? 16 : 10) + digit;
+          valid = (cp <= 0x10FFFF);
+        }
+        if (!valid) {
+          out.push_back('&');
+          continue;
+        }
+        char utf8[UTF8BUFFSZ];
+        const int n = luaO_utf8esc(utf8, cp);
+        out.append(utf8 + UTF8BUFFSZ - n, n);
+      }
+      else {
+        out.push_back('&');
+        continue;
+      }
+      p = semi + 1;
+    }
+  }
+
+  /* Moves on to 'to', forgetting how far the searches for the end of the previous construct got. */
+  void advance (size_t to) noexcept {
+    pos = to;
+    scanned = 0;
+    subset = 0;
+    tagquote = 0;
+  }
+
+  /*
+  ** Finds 'what' at or after 'from', or returns npos. A search that runs out of input resumes where it stopped
+  ** once more is fed, so a construct arriving in many small pieces is not searched from the start every time.
+  */
+  [[nodiscard]] size_t find (const char *what, size_t from) noexcept {
+    const size_t e = buf.find(what, std::max(from, pos + scanned));
+    if (e == std::string::npos) {
+      const size_t keep = strlen(what) - 1;  /* the terminator may be cut off at the end */
+      if (buf.size() - pos > scanned + keep)
+        scanned = buf.size() - pos - keep;
+    }
+    return e;
+  }
+
+  /* Finds the '>' that ends the tag starting at pos, skipping over quoted attribute values. */
+  [[nodiscard]] size_t findtagend () noexcept {
+    char quote = tagquote;
+    for (size_t k = pos + std::max<size_t>(scanned, 1); k != buf.size(); ++k) {
+      const char c = buf[k];
+      if (quote) {
+        if (c == quote)
+          quote = 0;
+      }
+      else if (c == '"' || c == '\'')
+        quote = c;
+      else if (c == '>')
+        return k;
+    }
+    scanned = buf.size() - pos;
+    tagquote = quote;
+    return std::string::npos;
+  }
+
+  /* Checks if the input ends within what could still become 'lit'. */
+  [[nodiscard]] bool isprefixof (const char *lit) const noexcept {
+    const size_t n = buf.size() - pos;
+    return n < strlen(lit) && buf.compare(pos, n, lit, n) == 0;
+  }
+
+  void parsestarttag (const char *p, const char *const end) {
+    const char *n = p;
+    while (p != end && !isspace(*p) && *p != '/')
+      ++p;
+    name.assign(n, p - n);
+    attributes.clear();
+    selfclosed = false;
+    while (true) {
+      while (p != end && isspace(*p))
+        ++p;
+      if (p == end)
+        break;
+      if (*p == '/') {
+        if (p + 1 == end && !mode->hasSelfClosingTags())
+          selfclosed = true;
+        ++p;
+        continue;
+      }
+      n = p;
+      while (p != end && !isspace(*p) && *p != '=' && *p != '/')
+        ++p;
+      std::string attr(n, p - n);
+      while (p != end && isspace(*p))
+        ++p;
+      if (p == end || *p != '=') {
+        if (mode->empty_attribute_syntax)
+          attributes.emplace_back(std::move(attr), std::string());
+        continue;
+      }
+      ++p;
+      while (p != end && isspace(*p))
+        ++p;
+      std::string value;
+      if (p != end && (*p == '"' || *p == '\'')) {
+        const char quote = *p++;
+        const char *v = p;
+        while (p != end && *p != quote)
+          ++p;
+        appenddecoded(value, v, p);
+        if (p != end)
+          ++p;
+      }
+      else if (mode->unquoted_attributes) {
+        const char *v = p;
+        while (p != end && !isspace(*p) && *p != '/')
+          ++p;
+        appenddecoded(value, v, p);
+      }
+      else {
+        if (mode->empty_attribute_syntax)
+          attributes.emplace_back(std::move(attr), std::string());
+        continue;
+      }
+      attributes.emplace_back(std::move(attr), std::move(value));
+    }
+    if (mode->isSelfClosingTag(name))
+      selfclosed = true;
+  }
+
+  /* Produces the next event, or NEEDMORE if more input is needed to tell what it is. */
+  [[nodiscard]] Event next () {
+    if (selfclosed) {
+      selfclosed = false;
+      open.pop_back();
+      return FINISH;
+    }
+    if (unwind != 0) {
+      --unwind;
+      name = std::move(open.back());
+      open.pop_back();
+      return FINISH;
+    }
+    while (true) {
+      while (pos != buf.size() && isspace(buf[pos]))
+        ++pos;
+      if (pos == buf.size()) {
+        if (!eof)
+          return NEEDMORE;
+        if (open.empty())
+          return END;
+        name = std::move(open.back());
+        open.pop_back();
+        return FINISH;
+      }
+      if (buf[pos] != '<') {
+        size_t lt = find("<", pos);
+        if (lt == std::string::npos) {
+          if (!eof)
+            return NEEDMORE;
+          lt = buf.size();
+        }
+        text.clear();
+        appenddecoded(text, buf.data() + pos, buf.data() + lt);
+        advance(lt);
+        return TEXT;
+      }
+      if (!eof && (isprefixof("<!--") || isprefixof("<![CDATA[")))
+        return NEEDMORE;  /* can't tell what this is yet */
+      if (buf.compare(pos, 4, "<!--") == 0) {
+        const size_t e = find("-->", pos + 4);
+        if (!skip(e, 3))
+          return NEEDMORE;
+        continue;
+      }
+      if (buf.compare(pos, 9, "<![CDATA[") == 0) {
+        const size_t e = find("]]>", pos + 9);
+        if (e == std::string::npos) {
+          if (!eof)
+            return NEEDMORE;
+          text.assign(buf, pos + 9);
+          advance(buf.size());
+          return TEXT;
+        }
+        text.assign(buf, pos + 9, e - (pos + 9));
+        advance(e + 3);
+        if (text.empty())
+          continue;
+        return TEXT;
+      }
+      if (buf.size() - pos < 2) {
+        if (!eof)
+          return NEEDMORE;
+        advance(buf.size());
+        continue;
+      }
+      if (buf[pos + 1] == '?') {
+        if (!skip(find("?>", pos + 2), 2))
+          return NEEDMORE;
+        continue;
+      }
+      if (buf[pos + 1] == '!') {  /* DOCTYPE or another declaration, possibly with an internal subset */
+        if (subset == 0) {
+          const size_t e = buf.find_first_of("[>", pos + std::max<size_t>(scanned, 2));
+          if (e == std::string::npos || buf[e] == '>') {
+            scanned = buf.size() - pos;
+            if (!skip(e, 1))
+              return NEEDMORE;
+            continue;
+          }
+          subset = e - pos;
+        }
+        if (!skip(find("]>", pos + subset), 2))
+          return NEEDMORE;
+        continue;
+      }
+      const size_t e = findtagend();
+      if (e == std::string::npos) {
+        if (!eof)
+          return NEEDMORE;
+        advance(buf.size());
+        continue;
+      }
+      const char *const start = buf.data() + pos + 1;
+      advance(e + 1);
+      if (*start == '/') {
+        const char *n = start + 1;
+        const char *ne = buf.data() + e;
+        while (ne != n && isspace(ne[-1]))
+          --ne;
+        const std::string_view closing(n, ne - n);
+        for (size_t k = open.size(); k-- != 0; ) {
+          if (open[k] == closing) {
+            unwind = open.size() - k;
+            return next();
+          }
+        }
+        continue;  /* stray closing tag */
+      }
+      const char *end = buf.data() + e;
+      if (end != start && end[-1] == '/' && mode->hasSelfClosingTags())
+        --end;  /* only certain tags are self-closing in this mode, so ignore the slash */
+      parsestarttag(start, end);
+      open.emplace_back(name);
+      return START;
+    }
+  }
+
+  /* Skips to after the terminator at e, if it was found. */
+  [[nodiscard]] bool skip (size_t e, size_t len) noexcept {
+    if (e == std::string::npos) {
+      if (!eof)
+        return false;
+      advance(buf.size());
+      return true;
+    }
+    advance(e + len);
+    return true;
+  }
+};
+
+static XmlSaxParser *checkparser (lua_State *L, int i) {
+  return (XmlSaxParser*)luaL_checkudata(L, i, "pluto:xml-parser");
+}
+
+static int parser_feed (lua_State *L);
+static int parser_close (lua_State *L);
+
+static const luaL_Reg funcs_parser[] = {
+  {"feed", parser_feed},
+  {"close", parser_close},
+  {nullptr, nullptr}
+};
+
+/* Pushes a parser whose user value is the value at the top of the stack, which is popped. */
+static XmlSaxParser& pushparser (lua_State *L, const soup::XmlMode *mode) {
+  auto& p = *new (lua_newuserdatauv(L, sizeof(XmlSaxParser), 1)) XmlSaxParser(mode);
+  if (luaL_newmetatable(L, "pluto:xml-parser")) {
+    lua_pushliteral(L, "__index");
+    luaL_newlib(L, funcs_parser);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__gc");
+    lua_pushcfunction(L, [](lua_State *L) {
+      pluto_errorifnotgc(L);
+      std::destroy_at<>(checkparser(L, 1));
+      return 0;
+    });
+    lua_settable(L, -3);
+  }
+  lua_setmetatable(L, -2);
+  lua_insert(L, -2);
+  lua_setiuservalue(L, -2, 1);
+  return p;
+}
+
+/* Pushes the name of an event followed by its data, and returns how many values that is. */
+static int pushevent (lua_State *L, const XmlSaxParser& p, XmlSaxParser::Event e) {
+  lua_checkstack(L, 5);
+  switch (e) {
+    case XmlSaxParser::START:
+      lua_pushliteral(L, "start");
+      pluto_pushstring(L, p.name);
+      lua_createtable(L, 0, (int)p.attributes.size());
+      for (const auto& attr : p.attributes) {
+        pluto_pushstring(L, attr.first);
+        pluto_pushstring(L, attr.second);
+        lua_settable(L, -3);
+      }
+      return 3;
+    case XmlSaxParser::TEXT:
+      lua_pushliteral(L, "text");
+      pluto_pushstring(L, p.text);
+      return 2;
+    default:
+      lua_pushliteral(L, "finish");
+      pluto_pushstring(L, p.name);
+      return 2;
+  }
+}
+
+/* Calls the handlers in the table at index h for every event that can be produced from the input so far. */
+static XmlSaxParser::Event dispatch (lua_State *L, XmlSaxParser& p, int h) {
+  while (true) {
+    const auto e = p.next();
+    if (e == XmlSaxParser::NEEDMORE || e == XmlSaxParser::END)
+      return e;
+    const int n = pushevent(L, p, e);
+    lua_pushvalue(L, -n);
+    if (lua_gettable(L, h) == LUA_TNIL) {
+      lua_pop(L, n + 1);
+      continue;
+    }
+    lua_replace(L, -(n + 1));  /* handler replaces the event name */
+    lua_call(L, n - 1, 0);
+  }
+}
+
+/* Input is handed to the parser in pieces of this size, so a large string doesn't get copied as a whole. */
+static constexpr size_t XML_PIECE = 0x10000;
+
+/*
+** Gives the parser more input from the source at index src, which is a string (read from 'offset'), a function
+** returning pieces until it returns nil, or a file handle. Marks the end of input once the source is exhausted.
+*/
+static void refill (lua_State *L, XmlSaxParser& p, int src, size_t& offset) {
+  if (lua_type(L, src) == LUA_TSTRING) {
+    size_t len;
+    const char *str = lua_tolstring(L, src, &len);
+    const size_t n = std::min(len - offset, XML_PIECE);
+    p.feed(str + offset, n);
+    offset += n;
+    p.eof = (offset == len);
+  }
+  else if (const auto stream = (luaL_Stream*)luaL_testudata(L, src, LUA_FILEHANDLE)) {
+    if (l_unlikely(stream->closef == nullptr))
+      luaL_error(L, "attempt to use a closed file");
+    char buf[XML_PIECE];
+    const size_t n = fread(buf, 1, sizeof(buf), stream->f);
+    p.feed(buf, n);
+    p.eof = (n == 0);
+  }
+  else {
+    lua_pushvalue(L, src);
+    lua_call(L, 0, 1);
+    if (lua_isnil(L, -1))
+      p.eof = true;
+    else {
+      size_t len;
+      const char *str = luaL_checklstring(L, -1, &len);
+      p.feed(str, len);
+    }
+    lua_pop(L, 1);
+  }
+}
+
+static void checksource (lua_State *L, int i) {
+  if (lua_type(L, i) != LUA_TSTRING && lua_type(L, i) != LUA_TFUNCTION && !luaL_testudata(L, i, LUA_FILEHANDLE))
+    luaL_typeerror(L, i, "string, function or file");
+}
+
+/* xml.parser(handlers, [mode]): a parser to feed pieces of a document to. */
+static int xml_parser (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  const soup::XmlMode *mode = checkmode(L, 2);
+  lua_pushvalue(L, 1);
+  pushparser(L, mode);
+  return 1;
+}
+
+static int parser_feed (lua_State *L) {
+  XmlSaxParser& p = *checkparser(L, 1);
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  if (l_unlikely(p.eof))
+    luaL_error(L, "parser is closed");
+  lua_settop(L, 2);
+  lua_getiuservalue(L, 1, 1);
+  for (size_t offset = 0; offset != len; ) {  /* in pieces, so the buffered input stays small */
+    const size_t n = std::min(len - offset, XML_PIECE);
+    p.feed(data + offset, n);
+    offset += n;
+    (void)dispatch(L, p, 3);
+  }
+  return 0;
+}
+
+/* Marks the end of the document, finishing whatever is still open. */
+static int parser_close (lua_State *L) {
+  XmlSaxParser& p = *checkparser(L, 1);
+  if (!p.eof) {
+    p.eof = true;
+    lua_settop(L, 1);
+    lua_getiuservalue(L, 1, 1);
+    (void)dispatch(L, p, 2);
+  }
+  return 0;
+}
+
+/* xml.parse(source, handlers, [mode]): calls the start, text and finish handlers for the events of a document. */
+static int xml_parse (lua_State *L) {
+  checksource(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  const soup::XmlMode *mode = checkmode(L, 3);
+  lua_settop(L, 2);
+  lua_pushnil(L);
+  XmlSaxParser& p = pushparser(L, mode);  /* at index 3 */
+  size_t offset = 0;
+  while (dispatch(L, p, 2) != XmlSaxParser::END)
+    refill(L, p, 1, offset);
+  return 0;
+}
+
+static int events_next (lua_State *L) {
+  XmlSaxParser& p = *checkparser(L, lua_upvalueindex(1));
+  size_t offset = (size_t)lua_tointeger(L, lua_upvalueindex(3));
+  while (true) {
+    const auto e = p.next();
+    if (e == XmlSaxParser::END)
+      return 0;
+    if (e != XmlSaxParser::NEEDMORE)
+      return pushevent(L, p, e);
+    refill(L, p, lua_upvalueindex(2), offset);
+    lua_pushinteger(L, (lua_Integer)offset);
+    lua_replace(L, lua_upvalueindex(3));
+  }
+}
+
+/* xml.events(source, [mode]): an iterator over the events of a document, for use in a generic for loop. */
+static int xml_events (lua_State *L) {
+  checksource(L, 1);
+  const soup::XmlMode *mode = checkmode(L, 2);
+  lua_pushnil(L);
+  pushparser(L, mode);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  lua_pushcclosure(L, events_next, 3);
+  return 1;
+}
+
+/*
+** Writer: serialises a document from start, text and finish calls directly into an output buffer, which is
+** handed to a sink whenever it grows beyond a piece, so documents of any size can be produced in constant memory.
+*/
+struct XmlWriter {
+  std::string out;
+  std::vector<std::string> open;
+  bool closed = false;
+};
+
+static XmlWriter *checkwriter (lua_State *L, int i) {
+  return (XmlWriter*)luaL_checkudata(L, i, "pluto:xml-writer");
+}
+
+/* Hands the output to the sink, if the writer has one. */
+static void flushwriter (lua_State *L, XmlWriter& w) {
+  if (lua_getiuservalue(L, 1, 1) == LUA_TNIL) {
+    lua_pop(L, 1);
+    return;
+  }
+  if (const auto stream = (luaL_Stream*)luaL_testudata(L, -1, LUA_FILEHANDLE)) {
+    if (l_unlikely(stream->closef == nullptr))
+      luaL_error(L, "attempt to use a closed file");
+    if (l_unlikely(fwrite(w.out.data(), 1, w.out.size(), stream->f) != w.out.size()))
+      luaL_error(L, "failed to write to file");
+    lua_pop(L, 1);
+  }
+  else {
+    pluto_pushstring(L, w.out);
+    lua_call(L, 1, 0);
+  }
+  w.out.clear();
+}
+
+static void maybeflush (lua_State *L, XmlWriter& w) {
+  if (w.out.size() >= XML_PIECE)
+    flushwriter(L, w);
+}
+
+static XmlWriter& checkopenwriter (lua_State *L) {
+  XmlWriter& w = *checkwriter(L, 1);
+  if (l_unlikely(w.closed))
+    luaL_error(L, "writer is closed");
+  return w;
+}
+
+static int writer_start (lua_State *L) {
+  XmlWriter& w = checkopenwriter(L);
+  size_t len;
+  const char *name = luaL_checklstring(L, 2, &len);
+  w.out.push_back('<');
+  w.out.append(name, len);
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_settop(L, 3);
+    appendxmlattributes(L, w.out);
+  }
+  w.out.push_back('>');
+  w.open.emplace_back(name, len);
+  maybeflush(L, w);
+  return 0;
+}
+
+static int writer_text (lua_State *L) {
+  XmlWriter& w = checkopenwriter(L);
+  size_t len;
+  const char *str = luaL_checklstring(L, 2, &len);
+  appendxmltext(w.out, str, len);
+  maybeflush(L, w);
+  return 0;
+}
+
+/* Closes the innermost open tag. */
+static int writer_finish (lua_State *L) {
+  XmlWriter& w = checkopenwriter(L);
+  if (l_unlikely(w.open.empty()))
+    luaL_error(L, "no tag to finish");
+  w.out.append("</");
+  w.out.append(w.open.back());
+  w.out.push_back('>');
+  w.open.pop_back();
+  maybeflush(L, w);
+  return 0;
+}
+
+/* Closes all open tags and flushes the output. Without a sink, returns the document. */
+static int writer_close (lua_State *L) {
+  XmlWriter& w = checkopenwriter(L);
+  while (!w.open.empty()) {
+    w.out.append("</");
+    w.out.append(w.open.back());
+    w.out.push_back('>');
+    w.open.pop_back();
+  }
+  w.closed = true;
+  if (lua_getiuservalue(L, 1, 1) == LUA_TNIL) {
+    pluto_pushstring(L, std::move(w.out));
+    w.out.clear();
+    return 1;
+  }
+  lua_pop(L, 1);
+  flushwriter(L, w);
+  return 0;
+}
+
+static const luaL_Reg funcs_writer[] = {
+  {"start", writer_start},
+  {"text", writer_text},
+  {"finish", writer_finish},
+  {"close", writer_close},
+  {nullptr, nullptr}
+};
+
+/* xml.writer([sink]): the sink is a function called with each piece of output, or a file handle. */
+static int xml_writer (lua_State *L) {
+  if (!lua_isnoneornil(L, 1) && lua_type(L, 1) != LUA_TFUNCTION && !luaL_testudata(L, 1, LUA_FILEHANDLE))
+    luaL_typeerror(L, 1, "function or file");
+  lua_settop(L, 1);
+  new (lua_newuserdatauv(L, sizeof(XmlWriter), 1)) XmlWriter();
+  if (luaL_newmetatable(L, "pluto:xml-writer")) {
+    lua_pushliteral(L, "__index");
+    luaL_newlib(L, funcs_writer);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__gc");
+    lua_pushcfunction(L, [](lua_State *L) {
+      pluto_errorifnotgc(L);
+      std::destroy_at<>(checkwriter(L, 1));
+      return 0;
+    });
+    lua_settable(L, -3);
+  }
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, 1);
+  lua_setiuservalue(L, -2, 1);
+  return 1;
+}
+
 static const luaL_Reg funcs_xml[] = {
   {"encode", xml_encode},
   {"decode", xml_decode},
+  {"parse", xml_parse},
+  {"parser", xml_parser},
+  {"events", xml_events},
+  {"writer", xml_writer},
   {nullptr, nullptr}
 };
 